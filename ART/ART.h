@@ -0,0 +1,649 @@
+///////////////////////////////////////////////////////////////////////////////
+// ART.h
+//////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef ART_H
+#define ART_H
+
+#include "../BTree/BTree.h"
+#include "ARTNode.h"
+#include "ARTRangeIterator.h"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+
+// Forward declaration of the iterator
+template<class T> class ARTRangeIterator;
+
+// Class representing an Adaptive Radix Tree, an in-memory index over TIDs
+// with the interface of the BTree, for unsigned integer keys, which are
+// unique. Keys are split into their bytes, most significant first, and each
+// inner node (see ARTNode) maps the next byte to a child, so that a lookup
+// reads one node per byte instead of searching for the key. Inner nodes hold
+// the bytes shared by all keys below them as their prefix (path compression),
+// and a key is kept in a leaf right below the first node where it differs
+// from all other keys. Nodes are resized to the number of their children.
+//
+// Concurrent operations synchronize through optimistic lock coupling, as in
+// the BTree: readers validate the version of a node once its child has been
+// found, and restart otherwise. Writers only latch the node they modify, and
+// its parent iff the node is replaced. The root is never replaced. Nodes and
+// leaves removed from the tree are freed once no operation which started
+// before their removal is running anymore (see Guard).
+template<class T> class ART
+{
+	friend class ARTRangeIterator<T>;
+	FRIEND_TEST(ARTTest, nodeTypes);
+
+public:
+
+	// Constructor. Creates an empty tree.
+	ART();
+
+	// Destructor. Frees all nodes and leaves.
+	~ART();
+
+	// Inserts a new key/TID pair into the tree. The TID of a key which is
+	// already found is replaced.
+	void insert(T key, TID tid);
+
+	// Deletes a specified key. Returns false iff key was not found.
+	bool erase(T key);
+
+	// Returns a TID or indicates that the key was not found (via exception).
+	TID lookup(T key);
+
+	// Returns an iterator to the first element of the result set, or to the
+	// last one iff reverse. Iterator implements a next() method to retrieve
+	// new values, and nextBatch() to retrieve many at once.
+	ARTRangeIterator<T>* lookupRange(T start, T end, bool reverse = false);
+
+	// Returns the number of key/TID pairs in the tree
+	uint64_t size() { return entries; }
+
+
+private:
+
+	static_assert(std::is_unsigned<T>::value &&
+	              sizeof(T) <= ARTNode::maxPrefix,
+	              "ART keys must be unsigned integers of up to 8 bytes");
+
+	// Number of bytes of a key
+	static const uint64_t keyLength = sizeof(T);
+
+	// Returns the byte of the key at the given depth, most significant first
+	static uint8_t byteAt(const T& key, uint64_t depth)
+	{
+		return (uint64_t)key >> (8 * (keyLength - 1 - depth));
+	}
+
+	// Returns the given byte at the given depth of a key
+	static T atDepth(uint8_t byte, uint64_t depth)
+	{
+		return (T)((uint64_t)byte << (8 * (keyLength - 1 - depth)));
+	}
+
+	// Returns the number of bytes of the prefix of node which the key shares
+	// from the given depth on. The node is read optimistically.
+	static uint64_t matchPrefix(ARTNode* node, const T& key, uint64_t depth);
+
+	// Returns the leaf of the given key, nullptr iff it is not found. Sets
+	// restart iff a node has changed on the way.
+	ARTLeaf<T>* find(const T& key, bool& restart);
+
+	// Inserts the given leaf, replaces the leaf of its key iff there is one.
+	// Returns false iff a node has changed on the way, in which case nothing
+	// changes.
+	bool insert(ARTLeaf<T>* leaf);
+
+	// Deletes the given key, returns false iff it was not found. Sets restart
+	// iff a node has changed on the way, in which case nothing changes.
+	bool erase(const T& key, bool& restart);
+
+	// A range scan in progress (see scan), which collects the pairs of the
+	// keys in [low, high], in descending order iff reverse, until max of them
+	// are found. Sets end iff a key beyond the range is found.
+	struct Scan
+	{
+		T low, high;
+		bool reverse;
+		uint64_t max;
+		std::vector<T> keys;
+		std::vector<TID> tids;
+		bool end;
+
+		bool done() { return end || tids.size() >= max; }
+	};
+
+	// Continues the scan with the subtree of node, latched at the given
+	// version, whose keys start with the given bytes of path, up to depth.
+	// Returns false iff a node has changed on the way, in which case the
+	// pairs collected are not valid.
+	bool scan(ARTNode* node, uint64_t version, uint64_t depth, T path,
+	          Scan& s);
+
+	// Collects the pairs of the given scan, from the root
+	void scan(Scan& s);
+
+	// Counts an operation in the epoch it starts in, for as long as it runs
+	struct Guard
+	{
+		ART* tree;
+		uint64_t epoch;
+
+		Guard(ART* tree);
+		~Guard();
+	};
+
+	// Frees the given node or leaf, removed from the tree, once no operation
+	// which started before can see it anymore
+	void retire(ARTNode* child);
+
+	// Frees the given node or leaf, and all nodes and leaves below it iff
+	// recursive
+	void release(ARTNode* child, bool recursive);
+
+	// The root, a node with a child for every byte, which is never replaced
+	ARTNode* root;
+
+	// Number of entries in the tree
+	std::atomic<uint64_t> entries;
+
+	// Operations are counted in the epoch they start in, by its parity. Nodes
+	// and leaves removed in an epoch are retired until the epoch after it
+	// has ended. The epoch is only advanced by retire, under retireLock.
+	std::atomic<uint64_t> epoch;
+	std::atomic<uint64_t> active[2];
+	std::deque<std::pair<ARTNode*, uint64_t>> retired;
+	std::mutex retireLock;
+
+	// Stores pointers to instantiated range iterators.
+	std::vector<ARTRangeIterator<T>*> rangeIterators;
+	std::mutex iteratorLock;
+
+	// Exception instances
+	KeyNotFoundException keyNotFound;
+};
+
+
+// _____________________________________________________________________________
+template<class T> const uint64_t ART<T>::keyLength;
+
+
+// _____________________________________________________________________________
+template<class T> ART<T>::ART()
+{
+	root = ARTNode::create(ARTNode::N256, nullptr, 0);
+	entries = 0;
+	epoch = 2;
+	active[0] = 0;
+	active[1] = 0;
+}
+
+
+// _____________________________________________________________________________
+template<class T> ART<T>::~ART()
+{
+	release(root, true);
+	for (auto& node : retired) release(node.first, false);
+	for (auto& it : rangeIterators) delete it;
+}
+
+
+// _____________________________________________________________________________
+template<class T> ART<T>::Guard::Guard(ART* tree)
+{
+	// The epoch may advance before the operation is counted, in which case
+	// it is counted in the new one
+	this->tree = tree;
+	while (true)
+	{
+		epoch = tree->epoch;
+		tree->active[epoch & 1]++;
+		if (tree->epoch == epoch) return;
+		tree->active[epoch & 1]--;
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T> ART<T>::Guard::~Guard()
+{
+	tree->active[epoch & 1]--;
+}
+
+
+// _____________________________________________________________________________
+template<class T> void ART<T>::retire(ARTNode* child)
+{
+	// Operations of the epoch before the current one may still see nodes
+	// retired in it. Once they have ended, the epoch advances, and nodes
+	// retired two epochs before are unreachable.
+	std::lock_guard<std::mutex> guard(retireLock);
+	uint64_t current = epoch;
+	retired.push_back(std::make_pair(child, current));
+	if (active[(current - 1) & 1] == 0) epoch = ++current;
+	while (!retired.empty() && retired.front().second + 2 <= current)
+	{
+		release(retired.front().first, false);
+		retired.pop_front();
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T> void ART<T>::release(ARTNode* child, bool recursive)
+{
+	if (ARTNode::isLeaf(child))
+	{
+		delete ARTNode::leaf<T>(child);
+		return;
+	}
+	if (recursive)
+	{
+		uint8_t bytes[256];
+		ARTNode* children[256];
+		uint64_t count = child->children(bytes, children);
+		for (uint64_t i = 0; i < count; i++) release(children[i], true);
+	}
+	ARTNode::destroy(child);
+}
+
+
+// _____________________________________________________________________________
+template<class T>
+uint64_t ART<T>::matchPrefix(ARTNode* node, const T& key, uint64_t depth)
+{
+	uint64_t length = std::min<uint64_t>(node->prefixLength, keyLength);
+	uint64_t shared = 0;
+	while (shared < length && depth + shared < keyLength &&
+	       node->prefix[shared] == byteAt(key, depth + shared))
+		shared++;
+	return shared;
+}
+
+
+// _____________________________________________________________________________
+template<class T> ARTLeaf<T>* ART<T>::find(const T& key, bool& restart)
+{
+	// Leaves are never modified, so that a leaf is valid once its parent is
+	ARTNode* node = root;
+	uint64_t version = node->latch.readLock(restart);
+	uint64_t depth = 0;
+	while (!restart)
+	{
+		uint64_t length = node->prefixLength;
+		bool match = matchPrefix(node, key, depth) == length;
+		depth += length;
+		ARTNode* child = match && depth < keyLength ?
+			node->findChild(byteAt(key, depth)) : nullptr;
+		node->latch.validate(version, restart);
+		if (restart || child == nullptr) return nullptr;
+		if (ARTNode::isLeaf(child))
+		{
+			ARTLeaf<T>* leaf = ARTNode::leaf<T>(child);
+			return leaf->key == key ? leaf : nullptr;
+		}
+
+		uint64_t childVersion = child->latch.readLock(restart);
+		node->latch.validate(version, restart);
+		node = child;
+		version = childVersion;
+		depth++;
+	}
+	return nullptr;
+}
+
+
+// _____________________________________________________________________________
+template<class T> TID ART<T>::lookup(T key)
+{
+	Guard guard(this);
+	while (true)
+	{
+		bool restart = false;
+		ARTLeaf<T>* leaf = find(key, restart);
+		if (restart) continue;
+		if (leaf == nullptr) throw keyNotFound;
+		return leaf->tid;
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T> void ART<T>::insert(T key, TID tid)
+{
+	Guard guard(this);
+	ARTLeaf<T>* leaf = new ARTLeaf<T>();
+	leaf->key = key;
+	leaf->tid = tid;
+	while (!insert(leaf)) { }
+}
+
+
+// _____________________________________________________________________________
+template<class T> bool ART<T>::insert(ARTLeaf<T>* leaf)
+{
+	const T& key = leaf->key;
+	bool restart = false;
+	ARTNode* parent = nullptr;
+	uint64_t parentVersion = 0;
+	uint8_t parentByte = 0;
+	ARTNode* node = root;
+	uint64_t version = node->latch.readLock(restart);
+	uint64_t depth = 0;
+	while (!restart)
+	{
+		// A prefix which differs from the key is split: a new node takes the
+		// bytes shared, and holds both the node and the leaf. The root has no
+		// prefix, so that every node with one has a parent.
+		uint64_t length = std::min<uint64_t>(node->prefixLength, keyLength);
+		uint64_t shared = matchPrefix(node, key, depth);
+		if (shared < length)
+		{
+			parent->latch.upgrade(parentVersion, restart);
+			if (restart) return false;
+			node->latch.upgrade(version, restart);
+			if (restart) { parent->latch.writeUnlock(); return false; }
+			ARTNode* split = ARTNode::create(ARTNode::N4, node->prefix, shared);
+			split->insertChild(node->prefix[shared], node);
+			split->insertChild(byteAt(key, depth + shared), ARTNode::tag(leaf));
+			std::copy(node->prefix + shared + 1, node->prefix + length,
+			          node->prefix);
+			node->prefixLength = length - shared - 1;
+			parent->replaceChild(parentByte, split);
+			node->latch.writeUnlock();
+			parent->latch.writeUnlock();
+			entries++;
+			return true;
+		}
+		depth += length;
+		if (depth >= keyLength) return false;
+
+		uint8_t byte = byteAt(key, depth);
+		ARTNode* child = node->findChild(byte);
+		bool full = node->count >= node->capacity();
+		node->latch.validate(version, restart);
+		if (restart) return false;
+
+		// A full node is replaced by a larger one, which holds the leaf.
+		// The root is never full.
+		if (child == nullptr && full)
+		{
+			parent->latch.upgrade(parentVersion, restart);
+			if (restart) return false;
+			node->latch.upgrade(version, restart);
+			if (restart) { parent->latch.writeUnlock(); return false; }
+			ARTNode* larger = node->resize(true);
+			larger->insertChild(byte, ARTNode::tag(leaf));
+			parent->replaceChild(parentByte, larger);
+			node->latch.writeUnlockObsolete();
+			parent->latch.writeUnlock();
+			retire(node);
+			entries++;
+			return true;
+		}
+		if (child == nullptr)
+		{
+			node->latch.upgrade(version, restart);
+			if (restart) return false;
+			node->insertChild(byte, ARTNode::tag(leaf));
+			node->latch.writeUnlock();
+			entries++;
+			return true;
+		}
+
+		// The leaf of another key is moved below a new node, which holds the
+		// bytes both keys share after this node as its prefix
+		if (ARTNode::isLeaf(child))
+		{
+			node->latch.upgrade(version, restart);
+			if (restart) return false;
+			const T& other = ARTNode::leaf<T>(child)->key;
+			if (other == key)
+			{
+				node->replaceChild(byte, ARTNode::tag(leaf));
+				node->latch.writeUnlock();
+				retire(child);
+				return true;
+			}
+			uint8_t prefix[ARTNode::maxPrefix];
+			uint64_t shared = 0;
+			while (byteAt(other, depth + 1 + shared) ==
+			       byteAt(key, depth + 1 + shared))
+			{
+				prefix[shared] = byteAt(key, depth + 1 + shared);
+				shared++;
+			}
+			ARTNode* expanded = ARTNode::create(ARTNode::N4, prefix, shared);
+			expanded->insertChild(byteAt(other, depth + 1 + shared), child);
+			expanded->insertChild(byteAt(key, depth + 1 + shared),
+			                      ARTNode::tag(leaf));
+			node->replaceChild(byte, expanded);
+			node->latch.writeUnlock();
+			entries++;
+			return true;
+		}
+
+		uint64_t childVersion = child->latch.readLock(restart);
+		node->latch.validate(version, restart);
+		parent = node;
+		parentVersion = version;
+		parentByte = byte;
+		node = child;
+		version = childVersion;
+		depth++;
+	}
+	return false;
+}
+
+
+// _____________________________________________________________________________
+template<class T> bool ART<T>::erase(T key)
+{
+	Guard guard(this);
+	while (true)
+	{
+		bool restart = false;
+		bool erased = erase(key, restart);
+		if (!restart) return erased;
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T> bool ART<T>::erase(const T& key, bool& restart)
+{
+	ARTNode* parent = nullptr;
+	uint64_t parentVersion = 0;
+	uint8_t parentByte = 0;
+	ARTNode* node = root;
+	uint64_t version = node->latch.readLock(restart);
+	uint64_t depth = 0;
+	while (!restart)
+	{
+		uint64_t length = node->prefixLength;
+		bool match = matchPrefix(node, key, depth) == length;
+		depth += length;
+		ARTNode* child = match && depth < keyLength ?
+			node->findChild(byteAt(key, depth)) : nullptr;
+		bool found = child != nullptr && ARTNode::isLeaf(child) &&
+		             ARTNode::leaf<T>(child)->key == key;
+		bool underfull = node != root && node->underfull();
+		node->latch.validate(version, restart);
+		if (restart || child == nullptr) return false;
+		uint8_t byte = byteAt(key, depth);
+		if (!ARTNode::isLeaf(child))
+		{
+			uint64_t childVersion = child->latch.readLock(restart);
+			node->latch.validate(version, restart);
+			parent = node;
+			parentVersion = version;
+			parentByte = byte;
+			node = child;
+			version = childVersion;
+			depth++;
+			continue;
+		}
+		if (!found) return false;
+
+		if (!underfull)
+		{
+			node->latch.upgrade(version, restart);
+			if (restart) return false;
+			node->removeChild(byte);
+			node->latch.writeUnlock();
+		}
+		else if (node->type != ARTNode::N4)
+		{
+			// The node is replaced by a smaller one
+			parent->latch.upgrade(parentVersion, restart);
+			if (restart) return false;
+			node->latch.upgrade(version, restart);
+			if (restart) { parent->latch.writeUnlock(); return false; }
+			node->removeChild(byte);
+			parent->replaceChild(parentByte, node->resize(false));
+			node->latch.writeUnlockObsolete();
+			parent->latch.writeUnlock();
+			retire(node);
+		}
+		else
+		{
+			// The node is replaced by its other child, which takes over the
+			// node's prefix and the byte leading to it. That child is
+			// latched last, as writers latch top-down.
+			uint8_t bytes[4];
+			ARTNode* children[4];
+			uint64_t count = node->children(bytes, children);
+			uint64_t other = bytes[0] == byte ? 1 : 0;
+			ARTNode* remaining = children[other];
+			node->latch.validate(version, restart);
+			if (restart || count != 2) { restart = true; return false; }
+			uint64_t remainingVersion = 0;
+			if (!ARTNode::isLeaf(remaining))
+				remainingVersion = remaining->latch.readLock(restart);
+			parent->latch.upgrade(parentVersion, restart);
+			if (restart) return false;
+			node->latch.upgrade(version, restart);
+			if (restart) { parent->latch.writeUnlock(); return false; }
+			if (!ARTNode::isLeaf(remaining))
+			{
+				remaining->latch.upgrade(remainingVersion, restart);
+				if (restart)
+				{
+					node->latch.writeUnlock();
+					parent->latch.writeUnlock();
+					return false;
+				}
+				uint8_t prefix[ARTNode::maxPrefix];
+				uint64_t length = node->prefixLength;
+				std::copy(node->prefix, node->prefix + length, prefix);
+				prefix[length] = bytes[other];
+				std::copy(remaining->prefix,
+				          remaining->prefix + remaining->prefixLength,
+				          prefix + length + 1);
+				length += 1 + remaining->prefixLength;
+				std::copy(prefix, prefix + length, remaining->prefix);
+				remaining->prefixLength = length;
+				remaining->latch.writeUnlock();
+			}
+			parent->replaceChild(parentByte, remaining);
+			node->latch.writeUnlockObsolete();
+			parent->latch.writeUnlock();
+			retire(node);
+		}
+		retire(child);
+		entries--;
+		return true;
+	}
+	return false;
+}
+
+
+// _____________________________________________________________________________
+template<class T> bool ART<T>::scan(ARTNode* node, uint64_t version,
+	uint64_t depth, T path, Scan& s)
+{
+	// Children are read at once, and validated before any is visited. The
+	// bytes of a child bound the keys below it, so that subtrees outside the
+	// range are skipped.
+	uint64_t length = std::min<uint64_t>(node->prefixLength, keyLength);
+	for (uint64_t i = 0; i < length && depth + i < keyLength; i++)
+		path |= atDepth(node->prefix[i], depth + i);
+	depth += length;
+	uint8_t bytes[256];
+	ARTNode* children[256];
+	uint64_t count = node->children(bytes, children);
+	bool restart = false;
+	node->latch.validate(version, restart);
+	if (restart || depth >= keyLength) return false;
+
+	T below = depth + 1 < keyLength ?
+		(T)(((T)1 << (8 * (keyLength - 1 - depth))) - 1) : 0;
+	for (uint64_t k = 0; k < count && !s.done(); k++)
+	{
+		uint64_t i = s.reverse ? count - 1 - k : k;
+		T low = path | atDepth(bytes[i], depth), high = low | below;
+		if (high < s.low || low > s.high)
+		{
+			s.end = s.reverse ? high < s.low : low > s.high;
+			continue;
+		}
+		if (ARTNode::isLeaf(children[i]))
+		{
+			// Pairs of removed leaves are not collected
+			ARTLeaf<T>* leaf = ARTNode::leaf<T>(children[i]);
+			T key = leaf->key;
+			TID tid = leaf->tid;
+			node->latch.validate(version, restart);
+			if (restart) return false;
+			if (key < s.low || key > s.high)
+			{
+				s.end = s.reverse ? key < s.low : key > s.high;
+				continue;
+			}
+			s.keys.push_back(key);
+			s.tids.push_back(tid);
+			continue;
+		}
+		uint64_t childVersion = children[i]->latch.readLock(restart);
+		node->latch.validate(version, restart);
+		if (restart || !scan(children[i], childVersion, depth + 1, low, s))
+			return false;
+	}
+	return true;
+}
+
+
+// _____________________________________________________________________________
+template<class T> void ART<T>::scan(Scan& s)
+{
+	Guard guard(this);
+	while (true)
+	{
+		bool restart = false;
+		s.keys.clear();
+		s.tids.clear();
+		s.end = false;
+		uint64_t version = root->latch.readLock(restart);
+		if (!restart && scan(root, version, 0, 0, s)) return;
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T>
+ARTRangeIterator<T>* ART<T>::lookupRange(T start, T end, bool reverse)
+{
+	auto it = new ARTRangeIterator<T>(this, &start, &end, reverse);
+	std::lock_guard<std::mutex> guard(iteratorLock);
+	rangeIterators.push_back(it);
+	return it;
+}
+
+#endif  // ART_H
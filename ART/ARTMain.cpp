@@ -0,0 +1,90 @@
+///////////////////////////////////////////////////////////////////////////////
+// ARTMain.cpp
+///////////////////////////////////////////////////////////////////////////////
+
+
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+
+#include "ART.h"
+
+using namespace std;
+
+// Comparator functor for uint64_t
+struct UInt64Cmp
+{
+	bool operator()(uint64_t a, uint64_t b) const { return a < b; }
+};
+template<> struct NaturalOrder<uint64_t, UInt64Cmp> : std::true_type { };
+
+// Returns the milliseconds passed since start
+uint64_t elapsed(chrono::steady_clock::time_point start)
+{
+	return chrono::duration_cast<chrono::milliseconds>(
+		chrono::steady_clock::now() - start).count();
+}
+
+// Runs the operations of the BTree's external test on the given index, with
+// sparse keys, and reports how long they take
+template<class Index> void test(Index& index, const string& name, uint64_t n)
+{
+	auto start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; ++i)
+	{
+		TID tid;
+		tid.intRepresentation = i*i;
+		index.insert(i * 0x9E3779B97F4A7C15ul, tid);
+	}
+	assert(index.size() == n);
+	uint64_t insertTime = elapsed(start);
+
+	// Check if they can be retrieved
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; ++i)
+	{
+		TID tid = index.lookup(i * 0x9E3779B97F4A7C15ul);
+		assert(tid.intRepresentation == i*i);
+		(void)tid;
+	}
+	uint64_t lookupTime = elapsed(start);
+
+	// Delete some values, and check if the right ones have been deleted
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; ++i)
+		if ((i%7) == 0)
+			index.erase(i * 0x9E3779B97F4A7C15ul);
+	uint64_t eraseTime = elapsed(start);
+	for (uint64_t i = 0; i < n; ++i)
+	{
+		bool found = true;
+		try { index.lookup(i * 0x9E3779B97F4A7C15ul); }
+		catch (KeyNotFoundException& e) { found = false; }
+		assert(found == ((i%7) != 0));
+		(void)found;
+	}
+
+	// Delete everything
+	for (uint64_t i = 0; i < n; ++i)
+		index.erase(i * 0x9E3779B97F4A7C15ul);
+	assert(index.size() == 0);
+
+	cout << name << ": insert " << insertTime << " ms, lookup " << lookupTime
+	     << " ms, erase " << eraseTime << " ms" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+	// Get command line argument
+	const uint64_t n = (argc == 2) ? strtoul(argv[1], NULL, 10) : 1000*1000ul;
+
+	// Compare the in-memory ART with the BTree on 64bit unsigned integers
+	ART<uint64_t> art;
+	test(art, "ART", n);
+	SegmentManager sm("/tmp/db");
+	BTree<uint64_t, UInt64Cmp> bTree(&sm);
+	test(bTree, "BTree", n);
+	if (system("rm /tmp/db") < 0) cout << "Error removing database\n";
+	return 0;
+}
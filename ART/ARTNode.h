@@ -0,0 +1,441 @@
+///////////////////////////////////////////////////////////////////////////////
+// ARTNode.h
+//////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef ARTNODE_H
+#define ARTNODE_H
+
+#include "../BTree/BTreeNode.h"
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#ifdef __x86_64__
+#include <emmintrin.h>
+#endif
+
+
+// The nodes of an Adaptive Radix Tree (see ART). Inner nodes map the next
+// byte of a key to a child, and come in four sizes, which are replaced by
+// the next larger or smaller one as children are added or removed. Children
+// are inner nodes or leaves, which are told apart by the lowest bit of the
+// pointer. Nodes are read optimistically (see OptimisticLatch): readers may
+// see a node while it is modified, so that every read is bounded by the
+// node's capacity, and its result is only used once the node is validated.
+
+
+// A leaf, holding a key and its TID. Leaves are never modified, but replaced.
+template<class T> struct ARTLeaf
+{
+	T key;
+	TID tid;
+};
+
+
+// Header of an inner node -----------------------------------------------------
+struct ARTNode
+{
+	// The node types, named after their capacity
+	enum Type : uint8_t { N4, N16, N48, N256 };
+
+	// Maximum number of key bytes in a prefix, i.e. the longest key
+	static const uint64_t maxPrefix = 8;
+
+	// Guards the node
+	OptimisticLatch latch;
+
+	Type type;
+
+	// Number of bytes of the prefix, which all keys below the node share
+	// after the bytes which lead to the node (path compression)
+	uint8_t prefixLength;
+
+	// Number of children
+	uint16_t count;
+
+	uint8_t prefix[maxPrefix];
+
+	// Whether the given child is a leaf, and the leaf or its tagged pointer
+	static bool isLeaf(ARTNode* child)
+	{
+		return (reinterpret_cast<uintptr_t>(child) & 1) == 1;
+	}
+	template<class T> static ARTLeaf<T>* leaf(ARTNode* child)
+	{
+		return reinterpret_cast<ARTLeaf<T>*>(
+			reinterpret_cast<uintptr_t>(child) & ~(uintptr_t)1);
+	}
+	template<class T> static ARTNode* tag(ARTLeaf<T>* leaf)
+	{
+		return reinterpret_cast<ARTNode*>(
+			reinterpret_cast<uintptr_t>(leaf) | 1);
+	}
+
+	// Creates an empty node of the given type with the given prefix
+	static ARTNode* create(Type type, const uint8_t* prefix, uint64_t length);
+
+	// Frees the given node, but not its children
+	static void destroy(ARTNode* node);
+
+	// Returns the number of children the node can hold
+	uint64_t capacity();
+
+	// Returns the child found for the given byte, nullptr iff there is none
+	ARTNode* findChild(uint8_t byte);
+
+	// Writes the bytes of the children, and the children, in order of their
+	// bytes, up to 256 each. Returns their number.
+	uint64_t children(uint8_t* bytes, ARTNode** out);
+
+	// Adds the given child for the given byte, which must not be found yet.
+	// The node must not be full.
+	void insertChild(uint8_t byte, ARTNode* child);
+
+	// Replaces the child of the given byte, which must be found
+	void replaceChild(uint8_t byte, ARTNode* child);
+
+	// Removes the child of the given byte, which must be found
+	void removeChild(uint8_t byte);
+
+	// Returns a copy of this node, of the next larger type iff grow, or the
+	// next smaller one otherwise, which must hold all children
+	ARTNode* resize(bool grow);
+
+	// Whether the node has to be replaced once a child is removed: by a
+	// smaller one iff the other children then leave room in it, or, for the
+	// smallest type, by its only other child
+	bool underfull()
+	{
+		static const uint16_t shrink[] = { 1, 3, 12, 40 };
+		return count <= shrink[type] + 1;
+	}
+};
+
+
+// Node with up to 4 children, whose bytes are kept sorted --------------------
+struct ARTNode4 : public ARTNode
+{
+	uint8_t keys[4];
+	ARTNode* child[4];
+};
+
+
+// Node with up to 16 children. The bytes are kept sorted, with their top bit
+// flipped, so that they are compared as signed bytes with SIMD instructions.
+struct ARTNode16 : public ARTNode
+{
+	uint8_t keys[16];
+	ARTNode* child[16];
+
+	static uint8_t flip(uint8_t byte) { return byte ^ 0x80; }
+
+	// Returns the position of the given byte among the first count, or count
+	// iff it is not found
+	uint64_t find(uint8_t byte, uint64_t count)
+	{
+#ifdef __x86_64__
+		__m128i key = _mm_set1_epi8(flip(byte));
+		__m128i all = _mm_loadu_si128(reinterpret_cast<__m128i*>(keys));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(key, all)) &
+		           ((1 << count) - 1);
+		return mask == 0 ? count : __builtin_ctz(mask);
+#else
+		for (uint64_t i = 0; i < count; i++)
+			if (keys[i] == flip(byte)) return i;
+		return count;
+#endif
+	}
+
+	// Returns the position of the first of count bytes which is larger than
+	// the given one
+	uint64_t upperBound(uint8_t byte, uint64_t count)
+	{
+#ifdef __x86_64__
+		__m128i key = _mm_set1_epi8(flip(byte));
+		__m128i all = _mm_loadu_si128(reinterpret_cast<__m128i*>(keys));
+		int mask = _mm_movemask_epi8(_mm_cmplt_epi8(key, all)) &
+		           ((1 << count) - 1);
+		return mask == 0 ? count : __builtin_ctz(mask);
+#else
+		uint64_t i = 0;
+		while (i < count && (int8_t)keys[i] <= (int8_t)flip(byte)) i++;
+		return i;
+#endif
+	}
+};
+
+
+// Node with up to 48 children, indexed by byte. An index of 0 marks a missing
+// child, the others are positions in child plus one.
+struct ARTNode48 : public ARTNode
+{
+	uint8_t index[256];
+	ARTNode* child[48];
+};
+
+
+// Node with a child for every byte, nullptr iff it is missing ----------------
+struct ARTNode256 : public ARTNode
+{
+	ARTNode* child[256];
+};
+
+
+// _____________________________________________________________________________
+inline ARTNode* ARTNode::create(Type type, const uint8_t* prefix,
+                                uint64_t length)
+{
+	ARTNode* node;
+	switch (type)
+	{
+		case N4: node = new ARTNode4(); break;
+		case N16: node = new ARTNode16(); break;
+		case N48: node = new ARTNode48(); break;
+		default: node = new ARTNode256(); break;
+	}
+	node->latch.version = 0;
+	node->type = type;
+	node->prefixLength = length;
+	node->count = 0;
+	std::copy(prefix, prefix + length, node->prefix);
+	return node;
+}
+
+// _____________________________________________________________________________
+inline void ARTNode::destroy(ARTNode* node)
+{
+	switch (node->type)
+	{
+		case N4: delete static_cast<ARTNode4*>(node); break;
+		case N16: delete static_cast<ARTNode16*>(node); break;
+		case N48: delete static_cast<ARTNode48*>(node); break;
+		default: delete static_cast<ARTNode256*>(node); break;
+	}
+}
+
+// _____________________________________________________________________________
+inline uint64_t ARTNode::capacity()
+{
+	static const uint64_t capacities[] = { 4, 16, 48, 256 };
+	return capacities[type];
+}
+
+// _____________________________________________________________________________
+inline ARTNode* ARTNode::findChild(uint8_t byte)
+{
+	uint64_t n = std::min<uint64_t>(count, capacity());
+	switch (type)
+	{
+		case N4:
+		{
+			ARTNode4* node = static_cast<ARTNode4*>(this);
+			for (uint64_t i = 0; i < n; i++)
+				if (node->keys[i] == byte) return node->child[i];
+			return nullptr;
+		}
+		case N16:
+		{
+			ARTNode16* node = static_cast<ARTNode16*>(this);
+			uint64_t i = node->find(byte, n);
+			return i < n ? node->child[i] : nullptr;
+		}
+		case N48:
+		{
+			ARTNode48* node = static_cast<ARTNode48*>(this);
+			uint64_t i = node->index[byte];
+			return i > 0 && i <= 48 ? node->child[i-1] : nullptr;
+		}
+		default:
+			return static_cast<ARTNode256*>(this)->child[byte];
+	}
+}
+
+// _____________________________________________________________________________
+inline uint64_t ARTNode::children(uint8_t* bytes, ARTNode** out)
+{
+	uint64_t n = std::min<uint64_t>(count, capacity()), result = 0;
+	switch (type)
+	{
+		case N4:
+		{
+			ARTNode4* node = static_cast<ARTNode4*>(this);
+			for (; result < n; result++)
+			{
+				bytes[result] = node->keys[result];
+				out[result] = node->child[result];
+			}
+			break;
+		}
+		case N16:
+		{
+			ARTNode16* node = static_cast<ARTNode16*>(this);
+			for (; result < n; result++)
+			{
+				bytes[result] = ARTNode16::flip(node->keys[result]);
+				out[result] = node->child[result];
+			}
+			break;
+		}
+		case N48:
+		{
+			ARTNode48* node = static_cast<ARTNode48*>(this);
+			for (uint64_t b = 0; b < 256; b++)
+			{
+				uint64_t i = node->index[b];
+				if (i == 0 || i > 48) continue;
+				bytes[result] = b;
+				out[result++] = node->child[i-1];
+			}
+			break;
+		}
+		default:
+		{
+			ARTNode256* node = static_cast<ARTNode256*>(this);
+			for (uint64_t b = 0; b < 256; b++)
+			{
+				if (node->child[b] == nullptr) continue;
+				bytes[result] = b;
+				out[result++] = node->child[b];
+			}
+			break;
+		}
+	}
+	return result;
+}
+
+// _____________________________________________________________________________
+inline void ARTNode::insertChild(uint8_t byte, ARTNode* child)
+{
+	switch (type)
+	{
+		case N4:
+		{
+			ARTNode4* node = static_cast<ARTNode4*>(this);
+			uint64_t pos = 0;
+			while (pos < count && node->keys[pos] < byte) pos++;
+			std::copy_backward(node->keys + pos, node->keys + count,
+			                   node->keys + count + 1);
+			std::copy_backward(node->child + pos, node->child + count,
+			                   node->child + count + 1);
+			node->keys[pos] = byte;
+			node->child[pos] = child;
+			break;
+		}
+		case N16:
+		{
+			ARTNode16* node = static_cast<ARTNode16*>(this);
+			uint64_t pos = node->upperBound(byte, count);
+			std::copy_backward(node->keys + pos, node->keys + count,
+			                   node->keys + count + 1);
+			std::copy_backward(node->child + pos, node->child + count,
+			                   node->child + count + 1);
+			node->keys[pos] = ARTNode16::flip(byte);
+			node->child[pos] = child;
+			break;
+		}
+		case N48:
+		{
+			// The positions of removed children are reused
+			ARTNode48* node = static_cast<ARTNode48*>(this);
+			uint64_t pos = count;
+			if (node->child[pos] != nullptr)
+				for (pos = 0; node->child[pos] != nullptr; pos++) { }
+			node->child[pos] = child;
+			node->index[byte] = pos + 1;
+			break;
+		}
+		default:
+			static_cast<ARTNode256*>(this)->child[byte] = child;
+			break;
+	}
+	count++;
+}
+
+// _____________________________________________________________________________
+inline void ARTNode::replaceChild(uint8_t byte, ARTNode* child)
+{
+	switch (type)
+	{
+		case N4:
+		{
+			ARTNode4* node = static_cast<ARTNode4*>(this);
+			for (uint64_t i = 0; i < count; i++)
+				if (node->keys[i] == byte) node->child[i] = child;
+			break;
+		}
+		case N16:
+		{
+			ARTNode16* node = static_cast<ARTNode16*>(this);
+			node->child[node->find(byte, count)] = child;
+			break;
+		}
+		case N48:
+		{
+			ARTNode48* node = static_cast<ARTNode48*>(this);
+			node->child[node->index[byte] - 1] = child;
+			break;
+		}
+		default:
+			static_cast<ARTNode256*>(this)->child[byte] = child;
+			break;
+	}
+}
+
+// _____________________________________________________________________________
+inline void ARTNode::removeChild(uint8_t byte)
+{
+	switch (type)
+	{
+		case N4:
+		case N16:
+		{
+			// Both keep their bytes and children sorted, in arrays of
+			// different size
+			uint8_t* keys;
+			ARTNode** child;
+			uint64_t pos;
+			if (type == N4)
+			{
+				ARTNode4* node = static_cast<ARTNode4*>(this);
+				keys = node->keys;
+				child = node->child;
+				for (pos = 0; keys[pos] != byte; pos++) { }
+			}
+			else
+			{
+				ARTNode16* node = static_cast<ARTNode16*>(this);
+				keys = node->keys;
+				child = node->child;
+				pos = node->find(byte, count);
+			}
+			std::copy(keys + pos + 1, keys + count, keys + pos);
+			std::copy(child + pos + 1, child + count, child + pos);
+			break;
+		}
+		case N48:
+		{
+			ARTNode48* node = static_cast<ARTNode48*>(this);
+			node->child[node->index[byte] - 1] = nullptr;
+			node->index[byte] = 0;
+			break;
+		}
+		default:
+			static_cast<ARTNode256*>(this)->child[byte] = nullptr;
+			break;
+	}
+	count--;
+}
+
+// _____________________________________________________________________________
+inline ARTNode* ARTNode::resize(bool grow)
+{
+	uint8_t bytes[256];
+	ARTNode* out[256];
+	uint64_t n = children(bytes, out);
+	ARTNode* node = create(Type(grow ? type + 1 : type - 1), prefix,
+	                       prefixLength);
+	for (uint64_t i = 0; i < n; i++) node->insertChild(bytes[i], out[i]);
+	return node;
+}
+
+#endif  // ARTNODE_H
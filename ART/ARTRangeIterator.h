@@ -0,0 +1,159 @@
+///////////////////////////////////////////////////////////////////////////////
+// ARTRangeIterator.h
+//////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef ARTRANGEITERATOR_H
+#define ARTRANGEITERATOR_H
+
+#include "ART.h"
+#include "../BTree/BTreeRangeIterator.h"
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+
+// Forward declaration of the ART
+template<class T> class ART;
+
+// An iterator that iterates over a given key range on a given ART, in
+// ascending key order, or in descending order iff it is reversed, with the
+// interface of the BTreeRangeIterator. The pairs are collected in batches,
+// each from a consistent state of the tree, and every batch continues after
+// the last key collected. The iterator is therefore not isolated from
+// concurrent modifications of the tree, but never returns a key twice.
+template<class T> class ARTRangeIterator
+{
+public:
+
+	// Constructor, gets the key bounds of the range to be searched as well
+	// as a pointer to the tree. The bounds are interpreted as by the
+	// BTreeRangeIterator. Throws StartKeyOutOfBounds iff no key in the tree
+	// is as large as keyStart, or, iff reverse, as small as keyEnd.
+	ARTRangeIterator(ART<T>* tree, T* keyStart, T* keyEnd,
+	                 bool reverse = false);
+
+	~ARTRangeIterator() { }
+
+	// Returns the next TID in the range specified by [keyStart, keyEnd].
+	// Once the range is exhausted, the last TID is returned again.
+	TID next();
+
+	// Replaces the contents of tids by the next TIDs in the range, at most
+	// max of them, and those of keys, iff given, by their keys. Returns the
+	// number of TIDs, which is 0 iff the range is exhausted.
+	uint64_t nextBatch(std::vector<TID>& tids, uint64_t max,
+	                   std::vector<T>* keys = nullptr);
+
+private:
+
+	// Number of TIDs read ahead by next()
+	static const uint64_t batchSize = 64;
+
+	// Collects the next pairs after the last key collected, up to max
+	void fill(uint64_t max);
+
+	// The tree containing the keys
+	ART<T>* tree;
+
+	// The scan of the next batch, which holds the range, and the pairs
+	// collected but not returned yet, and the position of the next one
+	typename ART<T>::Scan batch;
+	uint64_t position;
+
+	// Whether the range is exhausted, and whether a key beyond it was found
+	bool exhausted;
+	bool pastEnd;
+
+	// Exception instances
+	StartKeyOutOfBounds keyOutOfBounds;
+	InvalidRange invalidRange;
+
+	// last TID returned
+	TID currentTID;
+};
+
+
+// _____________________________________________________________________________
+template<class T> ARTRangeIterator<T>::ARTRangeIterator(ART<T>* tree,
+	T* keyStart, T* keyEnd, bool reverse)
+{
+	// Set the bounds, switch if necessary
+	if (keyStart == nullptr && keyEnd == nullptr) throw invalidRange;
+	this->tree = tree;
+	batch.low = keyStart != nullptr ? *keyStart : 0;
+	batch.high = keyEnd != nullptr ? *keyEnd : std::numeric_limits<T>::max();
+	if (batch.high < batch.low) std::swap(batch.low, batch.high);
+	batch.reverse = reverse;
+	currentTID.intRepresentation = 0;
+	exhausted = false;
+	pastEnd = false;
+
+	// If nothing is collected, and no key beyond the range is found, then
+	// the start key is beyond all elements in the tree
+	fill(1);
+	if (batch.tids.empty() && !pastEnd) throw keyOutOfBounds;
+}
+
+
+// _____________________________________________________________________________
+template<class T> void ARTRangeIterator<T>::fill(uint64_t max)
+{
+	// The range of the next batch starts after the last key collected
+	position = 0;
+	if (exhausted) { batch.keys.clear(); batch.tids.clear(); return; }
+	if (!batch.keys.empty())
+	{
+		T last = batch.keys.back();
+		if (batch.reverse ? last == batch.low : last == batch.high)
+		{
+			batch.keys.clear();
+			batch.tids.clear();
+			exhausted = true;
+			return;
+		}
+		if (batch.reverse) batch.high = last - 1;
+		else batch.low = last + 1;
+	}
+	batch.max = max;
+	tree->scan(batch);
+	pastEnd = pastEnd || batch.end;
+	exhausted = batch.end || batch.tids.size() < max;
+}
+
+
+// _____________________________________________________________________________
+template<class T> TID ARTRangeIterator<T>::next()
+{
+	// Return the TIDs read ahead first
+	if (position == batch.tids.size()) fill(batchSize);
+	if (position == batch.tids.size()) return currentTID;
+	currentTID = batch.tids[position++];
+	return currentTID;
+}
+
+
+// _____________________________________________________________________________
+template<class T> uint64_t ARTRangeIterator<T>::nextBatch(
+	std::vector<TID>& tids, uint64_t max, std::vector<T>* keys)
+{
+	tids.clear();
+	if (keys != nullptr) keys->clear();
+	while (tids.size() < max)
+	{
+		if (position == batch.tids.size()) fill(max - tids.size());
+		if (position == batch.tids.size()) break;
+		uint64_t count = std::min<uint64_t>(max - tids.size(),
+		                                    batch.tids.size() - position);
+		tids.insert(tids.end(), batch.tids.begin() + position,
+		            batch.tids.begin() + position + count);
+		if (keys != nullptr)
+			keys->insert(keys->end(), batch.keys.begin() + position,
+			             batch.keys.begin() + position + count);
+		position += count;
+	}
+	if (!tids.empty()) currentTID = tids.back();
+	return tids.size();
+}
+
+#endif  // ARTRANGEITERATOR_H
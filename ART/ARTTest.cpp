@@ -0,0 +1,251 @@
+///////////////////////////////////////////////////////////////////////////////
+// ARTTest.cpp
+///////////////////////////////////////////////////////////////////////////////
+
+
+#include "ART.h"
+#include <algorithm>
+#include <random>
+#include <thread>
+
+using namespace std;
+
+// Returns a TID holding the given value
+TID toTID(uint64_t value)
+{
+	TID tid;
+	tid.intRepresentation = value;
+	return tid;
+}
+
+// Returns the keys [0, n) in random order
+vector<uint64_t> shuffledKeys(uint64_t n)
+{
+	vector<uint64_t> keys;
+	for (uint64_t i = 0; i < n; i++) keys.push_back(i);
+	shuffle(keys.begin(), keys.end(), mt19937(42));
+	return keys;
+}
+
+// _____________________________________________________________________________
+TEST(ARTTest, insertLookupErase)
+{
+	// Dense keys fill whole nodes, sparse keys are compressed into paths
+	ART<uint64_t>* tree = new ART<uint64_t>();
+	ASSERT_THROW(tree->lookup(1), KeyNotFoundException);
+	ASSERT_FALSE(tree->erase(1));
+	vector<uint64_t> keys = shuffledKeys(100000);
+	for (uint64_t key : keys)
+	{
+		tree->insert(key, toTID(key));
+		tree->insert(key * 0x9E3779B97F4A7C15ul, toTID(key + 1));
+	}
+	ASSERT_EQ(tree->size(), 2*keys.size() - 1);
+	for (uint64_t key : keys)
+	{
+		ASSERT_EQ(tree->lookup(key * 0x9E3779B97F4A7C15ul).intRepresentation,
+		          key + 1);
+		if (key == 0) continue;
+		ASSERT_EQ(tree->lookup(key).intRepresentation, key);
+	}
+	ASSERT_THROW(tree->lookup(keys.size()), KeyNotFoundException);
+
+	// Inserting a key again replaces its TID
+	tree->insert(42, toTID(7));
+	ASSERT_EQ(tree->lookup(42).intRepresentation, 7);
+	ASSERT_EQ(tree->size(), 2*keys.size() - 1);
+
+	// Delete some keys, then everything
+	for (uint64_t key : keys)
+	{
+		if (key % 7 != 0) continue;
+		ASSERT_TRUE(tree->erase(key));
+	}
+	ASSERT_FALSE(tree->erase(7));
+	for (uint64_t key : keys)
+	{
+		if (key % 7 == 0) ASSERT_THROW(tree->lookup(key), KeyNotFoundException);
+		else ASSERT_EQ(tree->lookup(key).intRepresentation, key);
+	}
+	for (uint64_t key : keys)
+	{
+		tree->erase(key);
+		tree->erase(key * 0x9E3779B97F4A7C15ul);
+	}
+	ASSERT_EQ(tree->size(), 0);
+	ASSERT_THROW(tree->lookup(1), KeyNotFoundException);
+
+	// Keys narrower than 8 bytes
+	ART<uint16_t>* small = new ART<uint16_t>();
+	for (uint64_t key : shuffledKeys(65536)) small->insert(key, toTID(key));
+	ASSERT_EQ(small->size(), 65536);
+	for (uint64_t key = 0; key < 65536; key += 3)
+		ASSERT_EQ(small->lookup(key).intRepresentation, key);
+
+	// Cleanup
+	delete tree;
+	delete small;
+}
+
+// _____________________________________________________________________________
+TEST(ARTTest, nodeTypes)
+{
+	// All keys share their first 7 bytes, so that they are held by one node
+	// with a prefix of 6 bytes below the root. The node grows and shrinks
+	// with the number of keys.
+	ART<uint64_t>* tree = new ART<uint64_t>();
+	const uint64_t base = 0x0102030405060700ul;
+	vector<uint64_t> order = shuffledKeys(256);
+	vector<ARTNode::Type> types;
+	for (uint64_t i = 0; i < order.size(); i++)
+	{
+		tree->insert(base + order[i], toTID(order[i]));
+		ARTNode* node = tree->root->findChild(0x01);
+		if (i == 0) { ASSERT_TRUE(ARTNode::isLeaf(node)); continue; }
+		ASSERT_FALSE(ARTNode::isLeaf(node));
+		ASSERT_EQ(node->count, i + 1);
+		ASSERT_EQ(node->prefixLength, 6);
+		types.push_back(node->type);
+	}
+	ASSERT_EQ(count(types.begin(), types.end(), ARTNode::N4), 3);
+	ASSERT_EQ(count(types.begin(), types.end(), ARTNode::N16), 12);
+	ASSERT_EQ(count(types.begin(), types.end(), ARTNode::N48), 32);
+	for (uint64_t key = 0; key < 256; key++)
+		ASSERT_EQ(tree->lookup(base + key).intRepresentation, key);
+
+	for (uint64_t i = 0; i < order.size(); i++)
+	{
+		ASSERT_TRUE(tree->erase(base + order[i]));
+		ARTNode* node = tree->root->findChild(0x01);
+		uint64_t count = order.size() - i - 1;
+		if (count == 0) ASSERT_EQ(node, nullptr);
+		else if (count == 1) ASSERT_TRUE(ARTNode::isLeaf(node));
+		else if (count <= 3) ASSERT_EQ(node->type, ARTNode::N4);
+		else if (count <= 12) ASSERT_EQ(node->type, ARTNode::N16);
+		else if (count <= 40) ASSERT_EQ(node->type, ARTNode::N48);
+		else ASSERT_EQ(node->type, ARTNode::N256);
+	}
+
+	// A key which differs within the prefix splits it. Once the key is
+	// erased, the node below takes over the rest of the prefix again.
+	tree->insert(base, toTID(0));
+	tree->insert(base + 1, toTID(1));
+	tree->insert(0x0102FF0000000000ul, toTID(2));
+	ARTNode* node = tree->root->findChild(0x01);
+	ASSERT_EQ(node->prefixLength, 1);
+	ASSERT_EQ(node->findChild(0x03)->prefixLength, 4);
+	ASSERT_TRUE(ARTNode::isLeaf(node->findChild(0xFF)));
+	ASSERT_TRUE(tree->erase(0x0102FF0000000000ul));
+	node = tree->root->findChild(0x01);
+	ASSERT_EQ(node->prefixLength, 6);
+	ASSERT_EQ(tree->lookup(base + 1).intRepresentation, 1);
+
+	// Cleanup
+	delete tree;
+}
+
+// _____________________________________________________________________________
+TEST(ARTTest, lookupRange)
+{
+	ART<uint64_t>* tree = new ART<uint64_t>();
+	for (uint64_t key : shuffledKeys(100000))
+		tree->insert(2*key + 2, toTID(key));
+
+	// Bounds need not be keys in the tree, and may be given in any order
+	auto it = tree->lookupRange(9001, 101);
+	for (uint64_t key = 102; key <= 9000; key += 2)
+		ASSERT_EQ(it->next().intRepresentation, key / 2 - 1);
+	ASSERT_EQ(it->next().intRepresentation, 4499);
+	ASSERT_THROW(tree->lookupRange(200001, 300000), StartKeyOutOfBounds);
+	ASSERT_THROW(tree->lookupRange(0, 1, true), StartKeyOutOfBounds);
+
+	// Batches hold the TIDs and keys in order, until the range is exhausted
+	vector<TID> tids;
+	vector<uint64_t> keys;
+	it = tree->lookupRange(0, ~0ul);
+	uint64_t expected = 2;
+	while (it->nextBatch(tids, 1000, &keys) > 0)
+		for (uint64_t i = 0; i < tids.size(); i++, expected += 2)
+		{
+			ASSERT_EQ(keys[i], expected);
+			ASSERT_EQ(tids[i].intRepresentation, expected / 2 - 1);
+		}
+	ASSERT_EQ(expected, 200002);
+	ASSERT_EQ(it->nextBatch(tids, 1000), 0);
+
+	// Reverse scans start at the end of the range
+	for (uint64_t key = 2; key <= 200000; key += 6) tree->erase(key);
+	it = tree->lookupRange(150000, 100, true);
+	expected = 150000;
+	while (it->nextBatch(tids, 777, &keys) > 0)
+		for (uint64_t key : keys)
+		{
+			if (expected % 6 == 2) expected -= 2;
+			ASSERT_EQ(key, expected);
+			expected -= 2;
+		}
+	ASSERT_EQ(expected, 98);
+
+	// Cleanup
+	delete tree;
+}
+
+// _____________________________________________________________________________
+TEST(ARTTest, concurrentAccess)
+{
+	// Writers insert and erase disjoint keys, while readers look up keys
+	// which are never erased and scan them
+	ART<uint64_t>* tree = new ART<uint64_t>();
+	const uint64_t n = 100000, threads = 4;
+	vector<uint64_t> keys = shuffledKeys(n);
+	for (uint64_t key : keys) if (key % 2 == 0) tree->insert(key, toTID(key));
+
+	vector<thread> workers;
+	vector<char> correct(threads, true);
+	for (uint64_t t = 0; t < threads; t++)
+	{
+		workers.push_back(thread([&, t]() {
+			for (uint64_t key : keys)
+				if (key % (2*threads) == 2*t+1) tree->insert(key, toTID(key));
+			for (uint64_t key : keys)
+				if (key % (4*threads) == 2*t+1) tree->erase(key);
+		}));
+		workers.push_back(thread([&, t]() {
+			for (uint64_t key : keys)
+			{
+				if (key % 2 != 0) continue;
+				if (tree->lookup(key).intRepresentation != key) correct[t] = false;
+			}
+			auto it = tree->lookupRange(0, n);
+			vector<TID> tids;
+			uint64_t expected = 0;
+			while (it->nextBatch(tids, 100) > 0)
+				for (TID tid : tids)
+				{
+					if (tid.intRepresentation % 2 != 0) continue;
+					if (tid.intRepresentation != expected) correct[t] = false;
+					expected += 2;
+				}
+			if (expected != n) correct[t] = false;
+		}));
+	}
+	for (thread& worker : workers) worker.join();
+	for (char c : correct) ASSERT_TRUE(c);
+	ASSERT_EQ(tree->size(), n - n / 4);
+	for (uint64_t key : keys)
+	{
+		if (key % 2 == 1 && key % 16 < 8)
+			ASSERT_THROW(tree->lookup(key), KeyNotFoundException);
+		else ASSERT_EQ(tree->lookup(key).intRepresentation, key);
+	}
+
+	// Cleanup
+	delete tree;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
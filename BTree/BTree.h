@@ -1,4 +1,3 @@
-
 ///////////////////////////////////////////////////////////////////////////////
 // BTree.h
 //////////////////////////////////////////////////////////////////////////////
@@ -9,7 +8,15 @@
 #include "../SegmentManager/SegmentManager.h"
 #include "BTreeNode.h"
 #include "BTreeRangeIterator.h"
+#include "BTreeSearch.h"
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <type_traits>
+#include <vector>
 
 
 // Exception thrown when searching for key that is not found
@@ -18,80 +25,1972 @@ class KeyNotFoundException: public std::exception
   virtual const char* what() const throw() { return "Key not found"; }
 };
 
+// Exception thrown when bulk loading into a tree which is not empty, or
+// input which is not sorted
+class BulkLoadException: public std::exception
+{
+  virtual const char* what() const throw()
+  	{ return "Bulk load requires an empty tree and sorted keys"; }
+};
+
 // Forward declaration of the iterator
-template<class T, class CMP> class BTreeRangeIterator;
+template<class T, class CMP, bool unique> class BTreeRangeIterator;
 
 // Class representing a B+ Tree. Parametrized to allow for generic element
-// storage and comparison. CMP is a class / struct implementing a binary 
-// operator() function
-template<class T, class CMP> class BTree
+// storage and comparison. CMP is a class / struct implementing a binary
+// operator() function. Iff unique == false, a key may be found with several
+// TIDs, which are kept as a compressed list per key (see
+// BTreePostingLeafNode).
+//
+// The nodes of the tree are the pages of a regular segment, accessed through
+// the buffer manager, so that the tree may be larger than main memory. The
+// first page of the segment holds the tree's metadata (see BTreeMetadata),
+// all other pages hold nodes, which link other nodes by page id. Every node
+// fills a page, so leaves overflow at BTreeLeafNode<T>::capacity keys, and
+// inner nodes at BTreeInnerNode<T>::capacity keys. If CMP orders keys by
+// their bytes (see BinaryOrder), the keys of inner nodes are compressed
+// instead (see BTreePrefixInnerNode), so that they hold more of them.
+//
+// Concurrent operations synchronize through optimistic lock coupling (see
+// OptimisticLatch): readers descend without writing to any node, and validate
+// the version of a node once its child has been found, restarting from the
+// root if it has changed. Writers only latch the nodes they modify, i.e. the
+// leaf, or a full node and its parent when splitting. Full nodes are split on
+// the way down, so splits never propagate. Nodes filled less than underflow
+// by erase are merged with a sibling, which is then marked obsolete in its
+// latch. Pages are only fixed in shared mode, to keep them buffered.
+//
+// Pages removed from the tree are reused for new nodes once no operation
+// which started before their removal is running anymore (see Guard), as in
+// the ART. Pages which are still free when the tree is closed are kept in a
+// list (see BTreeFreePage).
+template<class T, class CMP, bool unique = true> class BTree
 {
+	friend class BTreeRangeIterator<T, CMP, unique>;
+	FRIEND_TEST(BTreeTest, defragment);
+
 public:
 
-	// Constructor. Inner nodes underflow at k entries, and overflow at 2k
-	// entries. Leaves underflow at l entries, and overflow at 2l entries.
-	// The root has either max 2k entries, or it is a leaf with max 2l entries.
-	BTree(SegmentManager* sm, uint64_t k, uint64_t l);
-	
-	// Destructor
+	// Constructor. Creates an empty tree in a new segment.
+	BTree(SegmentManager* sm);
+
+	// Constructor. Opens the tree found in the segment with the given id,
+	// created by the constructor above.
+	BTree(SegmentManager* sm, uint64_t segId);
+
+	// Destructor. Writes the metadata of the tree to its first page.
 	~BTree();
-	
-	// Inserts a new key/TID pair into the tree. Does not support non-unique
-	// entries.
+
+	// Inserts a new key/TID pair into the tree. If keys are unique, the TID
+	// of a key which is already found is replaced, otherwise the TID is added
+	// to the TIDs of the key.
 	void insert(T key, TID tid);
-	
-	// Deletes a specified key. Underfull pages are accepted. Returns false
-	// iff key was not found.
+
+	// Deletes a specified key with all its TIDs. Underfull nodes are merged
+	// with a sibling iff they fit into one node (see rebalance). Returns
+	// false iff key was not found.
 	bool erase(T key);
-	
-	// Returns a TID or indicates that the key was not found (via exception)
+
+	// Deletes the given key/TID pair. Returns false iff it was not found.
+	bool erase(T key, TID tid);
+
+	// Returns a TID or indicates that the key was not found (via exception).
+	// Returns the smallest TID of a key which has several.
 	TID lookup(T key);
-	
-	// Returns an iterator to the first element of the result set.
-	// Iterator implements a next() method to retrieve new values.
-	BTreeRangeIterator<T, CMP>* lookupRange(T start, T end);
+
+	// Returns all TIDs of the given key, sorted, none iff it is not found
+	std::vector<TID> lookupAll(T key);
+
+	// Looks up all given keys. Sets found[i] iff keys[i] is found, and
+	// tids[i] to its TID (see lookup). The keys are probed in sorted order,
+	// in groups which descend the tree together, level by level: the nodes
+	// of a level are prefetched before any of them is searched, and nodes
+	// shared by several keys are only fixed once.
+	void lookupBatch(const std::vector<T>& keys, std::vector<TID>& tids,
+	                 std::vector<bool>& found);
+
+	// Returns an iterator to the first element of the result set, or to the
+	// last one iff reverse. Iterator implements a next() method to retrieve
+	// new values, and nextBatch() to retrieve many at once.
+	BTreeRangeIterator<T, CMP, unique>* lookupRange(T start, T end,
+	                                                bool reverse = false);
+
+	// Builds the tree from the key/TID pairs in [begin, end), which must be
+	// sorted by key, bottom-up. Leaves are filled up to the given fraction of
+	// their capacity, and inner nodes up to the given fraction of their
+	// space, the rest is kept for later inserts. Pages are allocated in the
+	// order they are filled, and each is written once. The tree must be
+	// empty and must not be accessed concurrently. Throws BulkLoadException
+	// otherwise, or once a key is smaller than its predecessor (or equal to
+	// it, if keys are unique), in which case the tree holds the pairs before
+	// that key.
+	template<class Iterator>
+	void bulkLoad(Iterator begin, Iterator end, double fill = 1.0);
+
+	// Rewrites the leaves onto new pages, which follow each other in key
+	// order, merging neighbours while they fit into a leaf filled up to the
+	// given fraction. Runs concurrently with other operations, one parent of
+	// leaves at a time. The new pages are taken from runs of free pages
+	// where possible, e.g. the ones left by the previous pass, and the old
+	// pages are freed, so that repeated passes do not grow the segment.
+	void defragment(double fill = 1.0);
+
+	// Returns the number of key/TID pairs in the tree
+	uint64_t size() { return entries; }
+
+	// Returns the id of the segment holding the tree
+	uint64_t getSegmentId() { return segId; }
+
+	// Returns the number of levels below the root
+	uint64_t height();
 
 
 private:
-	
-	// Starting at the given node, navigates down the tree to the leaf node
-	// where the given key should be inserted. Returns pointer to that leaf.
-	// Assumes that the keys are sorted with respect to comp, and that the keys
-	// and values match with respect to their indices (e.g. first key separates 
-	// the first pointer from the second pointer)
-	BTreeLeafNode<T>* navigateToLeaf(T key, BTreeNode<T>* start);
-
-	// Splits the given node and accomodates the entries along the split.
-	// Called recursively if necessary. Assumes given node has an overflow of 1
-	void splitNode(BTreeNode<T>* node);
-
-	// Materializes the b tree to file. Calculates space requirements and saves
-	// a node per page.
-	void writeToFile();
+
+	typedef BTreeNode<T> Node;
+	typedef typename std::conditional<unique,
+		BTreeLeafNode<T>, BTreePostingLeafNode<T>>::type Leaf;
+	typedef typename std::conditional<BinaryOrder<T, CMP>::value,
+		BTreePrefixInnerNode<T>, BTreeInnerNode<T>>::type Inner;
+
+	// Navigates down the tree to the leaf node where the given key should be
+	// found, or to the leftmost leaf iff key == nullptr, without latching any
+	// node. Stops at the node on the given level instead, or at the root iff
+	// the tree is lower. Returns the frame of the node, and the version of
+	// the node which its contents have to be validated against. Sets restart
+	// and returns nullptr iff a node has changed on the way. Assumes that the
+	// keys are sorted with respect to comp.
+	BufferFrame* descend(const T* key, uint64_t& version, bool& restart,
+	                     uint32_t level = 0);
+
+	// Navigates down the tree like descend, but to the rightmost node iff
+	// key == nullptr. Sets bounded iff the node is not the leftmost one on
+	// its level, and fence to the separator left of the path at the lowest
+	// level where there is one, so that no key left of the node is larger.
+	BufferFrame* descendLast(const T* key, uint64_t& version, bool& restart,
+	                         T& fence, bool& bounded, uint32_t level = 0);
+
+	// Replaces pages by the page ids of up to count leaves following the one
+	// where the given key is found (see descend), or preceding the one of
+	// descendLast iff reverse, in scan order, as found in their parent.
+	// Prefetches them through the buffer manager.
+	void prefetchLeaves(const T* key, bool reverse, uint64_t count,
+	                    std::vector<uint64_t>& pages);
+
+	// Splits the full node on frame, whose parent is found on parentFrame
+	// (the metadata page iff the node is the root). Sets restart iff either
+	// has changed since the given versions, in which case nothing changes.
+	// Only marks the parent to be split iff the separator does not fit.
+	void split(BufferFrame* parentFrame, uint64_t parentVersion,
+	           BufferFrame* frame, uint64_t version, bool& restart);
+
+	// Number of keys descended together by lookupBatch
+	static const uint64_t batchSize = 16;
+
+	// Looks up the keys[order[i]] for i < count, which must be sorted, as
+	// lookupBatch does. Returns false iff a node has changed in between, in
+	// which case the results are not valid.
+	bool lookupGroup(const std::vector<T>& keys, const uint64_t* order,
+	                 uint64_t count, std::vector<TID>& tids,
+	                 std::vector<bool>& found);
+
+	// Prefetches the cache lines of the given node which a search reads
+	// first, i.e. its header and the middle of its keys
+	static void prefetchNode(const void* node);
+
+	// Deletes the given key/TID pair, or the key with all its TIDs iff
+	// tid == nullptr. Returns false iff nothing was found.
+	bool erase(const T& key, const TID* tid);
+
+	// Nodes filled less than underflow are merged with a sibling, iff both
+	// fit into one node filled up to mergeFill. The gap keeps nodes from
+	// being merged and split again in turn.
+	static constexpr double underflow = 0.25;
+	static constexpr double mergeFill = 0.75;
+
+	// Merges the underfull leaf the given key is found on, and its
+	// ancestors as long as they become underfull in turn, then removes
+	// roots with a single child.
+	void rebalance(const T& key);
+
+	// Merges the underfull node on the given level the key is found below
+	// with its right sibling, or its left one iff it is the rightmost child
+	// of its parent. Returns true iff the parent has become underfull.
+	bool mergeAt(const T& key, uint32_t level);
+
+	// Replaces the root by its child as long as it has a single one
+	void collapseRoot();
+
+	// Rewrites the leaves below the parent of the leaf the given key is
+	// found on (the leftmost leaf iff from == nullptr), see defragment.
+	// previous is the leaf written last, along with the version it had
+	// then, and is set to the leaf written last by this call. Returns false
+	// iff no leaves follow, otherwise sets next to the first key after the
+	// leaves written.
+	bool defragmentParent(const T* from, T& next, uint64_t& previous,
+	                      uint64_t& previousVersion, double fill);
+
+	// Returns the frame of the leaf which links the leaf on the given page,
+	// found from the leaf on page start, and its version. start is only
+	// followed iff its version is still startVersion. Sets restart iff the
+	// leaf is not found.
+	BufferFrame* findPredecessor(uint64_t start, uint64_t startVersion,
+	                             uint64_t page, uint64_t& version,
+	                             bool& restart);
+
+	// Acquires the latches of all given pages iff none has changed since
+	// the given versions. Returns false otherwise, holding none of them.
+	bool upgradeAll(const std::vector<BufferFrame*>& frames,
+	                const std::vector<uint64_t>& versions);
+
+	// Adds the given separator and the page id of the node right of it to the
+	// rightmost nodes of the levels built by bulkLoad, starting at the given
+	// level. left is the page id of the node left of the separator.
+	void bulkAppend(std::vector<BufferFrame*>& levels, uint64_t level,
+	                const T& separator, uint64_t left, uint64_t child,
+	                double fill);
+
+	// Adds the given key and its TIDs to the rightmost leaf built by
+	// bulkLoad (levels[0]), or to a new leaf once it is full.
+	void bulkAppendKey(std::vector<BufferFrame*>& levels, const T& key,
+	                   std::vector<uint64_t>& tids, double fill);
+
+	// Operations on the leaves, for either kind of leaf. Only the ones on
+	// the tree's kind are instantiated.
+	//
+	// Returns whether the given pair can be inserted without splitting the
+	// leaf. The leaf is read optimistically.
+	bool leafHasRoom(BTreeLeafNode<T>* leaf, const T& key, TID tid);
+	bool leafHasRoom(BTreePostingLeafNode<T>* leaf, const T& key, TID tid);
+
+	// Inserts the given pair into the leaf, which must have room for it.
+	// Returns the number of pairs added (0 iff the pair was found, or a TID
+	// replaced).
+	uint64_t leafInsert(BTreeLeafNode<T>* leaf, const T& key, TID tid);
+	uint64_t leafInsert(BTreePostingLeafNode<T>* leaf, const T& key, TID tid);
+
+	// Deletes the given pair from the leaf, or the key with all its TIDs iff
+	// tid == nullptr. Returns the number of pairs deleted.
+	uint64_t leafErase(BTreeLeafNode<T>* leaf, const T& key, const TID* tid);
+	uint64_t leafErase(BTreePostingLeafNode<T>* leaf, const T& key,
+	                   const TID* tid);
+
+	// Returns the ith key of the leaf and all its TIDs. The leaf is read
+	// optimistically, posting pages are only read while the leaf still has
+	// the given version.
+	void leafRead(BTreeLeafNode<T>* leaf, uint64_t i, T& key,
+	              std::vector<TID>& tids, uint64_t version);
+	void leafRead(BTreePostingLeafNode<T>* leaf, uint64_t i, T& key,
+	              std::vector<TID>& tids, uint64_t version);
+
+	// Returns the smallest TID of the ith key of the leaf. The leaf is read
+	// as in leafRead.
+	TID leafFirst(BTreeLeafNode<T>* leaf, uint64_t i, uint64_t version);
+	TID leafFirst(BTreePostingLeafNode<T>* leaf, uint64_t i, 
+	              uint64_t version);
+
+	// Appends the given key and its sorted TIDs to the leaf, iff it is filled
+	// less than the given fraction (see bulkLoad). Returns false otherwise.
+	bool leafAppend(BTreeLeafNode<T>* leaf, const T& key,
+	                const std::vector<uint64_t>& tids, double fill);
+	bool leafAppend(BTreePostingLeafNode<T>* leaf, const T& key,
+	                const std::vector<uint64_t>& tids, double fill);
+
+	// Operations on the posting pages of lists too long for a leaf (see
+	// BTreePostingPage). They are guarded by the latch of the list's leaf.
+	//
+	// Appends at most count TIDs of the list starting on the given page to
+	// tids. The pages are read optimistically.
+	void readPostings(uint64_t page, uint64_t count,
+	                  std::vector<uint64_t>& tids);
+
+	// Writes the given sorted TIDs to new posting pages, returns the first
+	uint64_t writePostings(const uint64_t* tids, uint64_t count);
+
+	// Adds the given TID to the list starting on the given page. Returns false
+	// iff it is found already.
+	bool addPosting(uint64_t first, uint64_t tid);
+
+	// Removes the given TID from the list starting on the given page, which
+	// is updated iff the first page is removed. Returns false iff it is not
+	// found.
+	bool removePosting(uint64_t& first, uint64_t tid);
+
+	// Replaces the run on the given posting page by the given TIDs
+	void writeRun(BTreePostingPage* page, const uint64_t* tids, uint64_t count);
+
+	// Returns a page of the segment not used by the tree: the page after
+	// the given one iff it is free or has never been used, otherwise the
+	// first page of the first run of #run free pages, otherwise a page which
+	// has never been used. Grows the segment iff necessary.
+	uint64_t allocatePage(uint64_t after = 0, uint64_t run = 1);
+
+	// Counts an operation in the epoch it starts in, for as long as it runs
+	struct Guard
+	{
+		BTree* tree;
+		uint64_t epoch;
+
+		Guard(BTree* tree);
+		~Guard();
+	};
+
+	// Frees the given page, removed from the tree, once no operation which
+	// started before can reach it anymore
+	void retire(uint64_t page);
 
 	// Boolean comparison function, equivalent to comp
-	bool cmp(T key1, T key2);
-	
-	// Data structure to contain all nodes
-	std::vector<BTreeNode<T>*> nodes;
+	bool cmp(const T& key1, const T& key2);
+
+	// Returns the latch of the page (node or metadata) on the given frame
+	OptimisticLatch* latchOf(BufferFrame* frame);
 
 	// Stores pointers to instantiated range iterators.
-	std::vector<BTreeRangeIterator<T, CMP>* > rangeIterators;
+	std::vector<BTreeRangeIterator<T, CMP, unique>* > rangeIterators;
+	std::mutex iteratorLock;
 
 	// The segment manager on which this tree operates
 	SegmentManager* sm;
+	BufferManager* bm;
+
+	// The segment on which this tree operates, and its first page
+	uint64_t segId;
+	uint64_t metaPage;
 
-	// The segment on which this tree operates
-	uint64_t segId;	
-	
-	// The root of the tree
-	BTreeNode<T>* root;
+	// The next page of the segment not used yet, the end of its extent, and
+	// the pages which have been used and are free again. Guarded by
+	// allocationLock.
+	uint64_t nextPage, extentEnd;
+	std::set<uint64_t> freePages;
+	std::mutex allocationLock;
 
-	// Underflow / overflow parameters
-	uint64_t k, l;
+	// Operations are counted in the epoch they start in, by its parity. Pages
+	// removed in an epoch are retired until the epoch after it has ended
+	// (see ART). The epoch is only advanced by retire, under retireLock.
+	std::atomic<uint64_t> epoch;
+	std::atomic<uint64_t> active[2];
+	std::deque<std::pair<uint64_t, uint64_t>> retired;
+	std::mutex retireLock;
+
+	// Held by defragment
+	std::mutex defragmentLock;
+
+	// The number of key/TID pairs in the tree
+	std::atomic<uint64_t> entries;
 
 	// Comparison predicate
 	CMP comp;
 };
 
-#endif  // BTREE_H
\ No newline at end of file
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+const uint64_t BTree<T, CMP, unique>::batchSize;
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+BTree<T, CMP, unique>::BTree(SegmentManager* sm)
+{
+	static_assert(sizeof(Leaf) <= BM_CONS::pageSize, "Leaf exceeds page");
+	static_assert(sizeof(Inner) <= BM_CONS::pageSize, "Node exceeds page");
+	this->sm = sm;
+	bm = &sm->getBufferManager();
+	segId = sm->createSegment(RG_SGM, true);
+	Segment* seg = sm->retrieveSegmentById(segId);
+	metaPage = seg->firstPage();
+	nextPage = metaPage + 1;
+	extentEnd = metaPage + seg->getSize();
+	entries = 0;
+	epoch = 2;
+	active[0] = 0;
+	active[1] = 0;
+
+	// The root starts as an empty leaf
+	uint64_t rootPage = allocatePage();
+	BufferFrame& rootFrame = bm->fixPage(rootPage, true);
+	Leaf* root = reinterpret_cast<Leaf*>(rootFrame.getData());
+	root->latch.reset();
+	root->init();
+	bm->unfixPage(rootFrame, true);
+
+	BufferFrame& metaFrame = bm->fixPage(metaPage, true);
+	auto meta = reinterpret_cast<BTreeMetadata*>(metaFrame.getData());
+	meta->latch.version = 0;
+	meta->root = rootPage;
+	meta->height = 0;
+	meta->size = 0;
+	meta->nextPage = nextPage;
+	meta->extentEnd = extentEnd;
+	meta->freePage = 0;
+	bm->unfixPage(metaFrame, true);
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+BTree<T, CMP, unique>::BTree(SegmentManager* sm, uint64_t segId)
+{
+	this->sm = sm;
+	this->segId = segId;
+	bm = &sm->getBufferManager();
+	metaPage = sm->retrieveSegmentById(segId)->firstPage();
+
+	BufferFrame& metaFrame = bm->fixPage(metaPage, false);
+	auto meta = reinterpret_cast<BTreeMetadata*>(metaFrame.getData());
+	entries = meta->size;
+	nextPage = meta->nextPage;
+	extentEnd = meta->extentEnd;
+	uint64_t page = meta->freePage;
+	bm->unfixPage(metaFrame, false);
+	epoch = 2;
+	active[0] = 0;
+	active[1] = 0;
+
+	while (page != 0)
+	{
+		freePages.insert(page);
+		BufferFrame& frame = bm->fixPage(page, false);
+		page = reinterpret_cast<BTreeFreePage*>(frame.getData())->next;
+		bm->unfixPage(frame, false);
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique> BTree<T, CMP, unique>::~BTree()
+{
+	for (auto &it : rangeIterators) delete it;
+
+	// No operation runs anymore, so all retired pages are free. They are
+	// linked in descending order, so that the list starts with the first.
+	for (auto& page : retired) freePages.insert(page.first);
+	uint64_t next = 0;
+	for (auto it = freePages.rbegin(); it != freePages.rend(); ++it)
+	{
+		BufferFrame& frame = bm->fixPage(*it, false);
+		reinterpret_cast<BTreeFreePage*>(frame.getData())->next = next;
+		bm->unfixPage(frame, true);
+		next = *it;
+	}
+
+	BufferFrame& metaFrame = bm->fixPage(metaPage, true);
+	auto meta = reinterpret_cast<BTreeMetadata*>(metaFrame.getData());
+	meta->size = entries;
+	meta->nextPage = nextPage;
+	meta->extentEnd = extentEnd;
+	meta->freePage = next;
+	bm->unfixPage(metaFrame, true);
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::cmp(const T& key1, const T& key2)
+{
+	return comp(key1, key2);
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+uint64_t BTree<T, CMP, unique>::height()
+{
+	BufferFrame& metaFrame = bm->fixPage(metaPage, false);
+	auto meta = reinterpret_cast<BTreeMetadata*>(metaFrame.getData());
+	uint64_t height;
+	while (true)
+	{
+		bool restart = false;
+		uint64_t version = meta->latch.readLock(restart);
+		height = meta->height;
+		meta->latch.validate(version, restart);
+		if (!restart) break;
+	}
+	bm->unfixPage(metaFrame, false);
+	return height;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+OptimisticLatch* BTree<T, CMP, unique>::latchOf(BufferFrame* frame)
+{
+	// Every page of the tree starts with its latch
+	return reinterpret_cast<OptimisticLatch*>(frame->getData());
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique> BufferFrame* BTree<T, CMP, unique>::
+	descend(const T* key, uint64_t& version, bool& restart, uint32_t level)
+{
+	// The parent's version is validated once the child is latched, so that
+	// the child cannot have been split in between
+	BufferFrame* frame = &bm->fixPage(metaPage, false);
+	OptimisticLatch* latch = latchOf(frame);
+	version = latch->readLock(restart);
+	uint64_t page = reinterpret_cast<BTreeMetadata*>(frame->getData())->root;
+	latch->validate(version, restart);
+	while (!restart)
+	{
+		BufferFrame* child = &bm->fixPage(page, false);
+		Node* node = reinterpret_cast<Node*>(child->getData());
+		uint64_t childVersion = node->latch.readLock(restart);
+		latch->validate(version, restart);
+		bm->unfixPage(*frame, false);
+		frame = child;
+		latch = &node->latch;
+		version = childVersion;
+		if (restart || node->level <= level) break;
+
+		// Follow the pointer preceding the first key which is greater than
+		// or equal to the search key, or the last pointer if there is none.
+		// The page id is only used once the node is known to be unchanged.
+		Inner* inner = reinterpret_cast<Inner*>(node);
+		page = key == nullptr ? inner->firstChild() :
+		                        inner->childFor(*key, comp);
+		latch->validate(version, restart);
+	}
+
+	if (!restart) return frame;
+	bm->unfixPage(*frame, false);
+	return nullptr;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique> BufferFrame* BTree<T, CMP, unique>::
+	descendLast(const T* key, uint64_t& version, bool& restart, T& fence,
+	            bool& bounded, uint32_t level)
+{
+	// As descend, the fence is only used once its node is validated
+	bounded = false;
+	BufferFrame* frame = &bm->fixPage(metaPage, false);
+	OptimisticLatch* latch = latchOf(frame);
+	version = latch->readLock(restart);
+	uint64_t page = reinterpret_cast<BTreeMetadata*>(frame->getData())->root;
+	latch->validate(version, restart);
+	while (!restart)
+	{
+		BufferFrame* child = &bm->fixPage(page, false);
+		Node* node = reinterpret_cast<Node*>(child->getData());
+		uint64_t childVersion = node->latch.readLock(restart);
+		latch->validate(version, restart);
+		bm->unfixPage(*frame, false);
+		frame = child;
+		latch = &node->latch;
+		version = childVersion;
+		if (restart || node->level <= level) break;
+
+		Inner* inner = reinterpret_cast<Inner*>(node);
+		uint64_t pos = key == nullptr ? inner->childCount() - 1 :
+		                                inner->childIndex(*key, comp);
+		page = inner->childAt(pos);
+		if (pos > 0)
+		{
+			fence = inner->keyAt(pos - 1);
+			bounded = true;
+		}
+		latch->validate(version, restart);
+	}
+
+	if (!restart) return frame;
+	bm->unfixPage(*frame, false);
+	return nullptr;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::prefetchLeaves(const T* key, bool reverse,
+	uint64_t count, std::vector<uint64_t>& pages)
+{
+	// Read the siblings of the leaf from its parent, which is not there iff
+	// the root is a leaf
+	while (true)
+	{
+		bool restart = false, bounded;
+		uint64_t version;
+		T fence;
+		pages.clear();
+		BufferFrame* frame = reverse ?
+			descendLast(key, version, restart, fence, bounded, 1) :
+			descend(key, version, restart, 1);
+		if (restart) continue;
+		Node* node = reinterpret_cast<Node*>(frame->getData());
+		if (node->level == 1)
+		{
+			Inner* inner = reinterpret_cast<Inner*>(node);
+			uint64_t children = inner->childCount();
+			uint64_t pos = key != nullptr ? inner->childIndex(*key, comp) :
+			               reverse ? children - 1 : 0;
+			for (uint64_t i = 1; i <= count; i++)
+			{
+				if (reverse ? pos < i : pos + i >= children) break;
+				pages.push_back(inner->childAt(reverse ? pos - i : pos + i));
+			}
+		}
+		node->latch.validate(version, restart);
+		bm->unfixPage(*frame, false);
+		if (!restart) break;
+	}
+
+	// Pages of leaves which follow each other on file, in either direction,
+	// are hinted at once
+	for (uint64_t i = 0; i < pages.size(); )
+	{
+		uint64_t first = pages[i], last = first;
+		for (i++; i < pages.size(); i++)
+		{
+			if (pages[i] == last + 1) last++;
+			else if (pages[i] == first - 1) first--;
+			else break;
+		}
+		bm->prefetchPages(first, last - first + 1);
+	}
+}
+
+
+//______________________________________________________________________________
+template<class T, class CMP, bool unique>
+TID BTree<T, CMP, unique>::lookup(T key)
+{
+	// Get leaf and use binary search to locate the given key, start over iff
+	// the leaf changes in between
+	Guard guard(this);
+	while (true)
+	{
+		bool restart = false;
+		uint64_t version;
+		BufferFrame* frame = descend(&key, version, restart);
+		if (restart) continue;
+		Leaf* leaf = reinterpret_cast<Leaf*>(frame->getData());
+		uint64_t pos = leaf->position(key, comp);
+		bool found = pos < leaf->keyCount() && !cmp(key, leaf->keyAt(pos));
+		TID tid;
+		if (found) tid = leafFirst(leaf, pos, version);
+		leaf->latch.validate(version, restart);
+		bm->unfixPage(*frame, false);
+		if (restart) continue;
+
+		KeyNotFoundException keyNotFound;
+		if (!found) throw keyNotFound;
+		return tid;
+	}
+}
+
+
+//______________________________________________________________________________
+template<class T, class CMP, bool unique>
+std::vector<TID> BTree<T, CMP, unique>::lookupAll(T key)
+{
+	Guard guard(this);
+	std::vector<TID> tids;
+	while (true)
+	{
+		bool restart = false;
+		uint64_t version;
+		BufferFrame* frame = descend(&key, version, restart);
+		if (restart) continue;
+		Leaf* leaf = reinterpret_cast<Leaf*>(frame->getData());
+		uint64_t pos = leaf->position(key, comp);
+		tids.clear();
+		if (pos < leaf->keyCount() && !cmp(key, leaf->keyAt(pos)))
+		{
+			T found;
+			leafRead(leaf, pos, found, tids, version);
+		}
+		leaf->latch.validate(version, restart);
+		bm->unfixPage(*frame, false);
+		if (!restart) return tids;
+	}
+}
+
+
+//______________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::lookupBatch(const std::vector<T>& keys,
+	std::vector<TID>& tids, std::vector<bool>& found)
+{
+	// Keys on the same path are next to each other once sorted
+	tids.resize(keys.size());
+	found.assign(keys.size(), false);
+	std::vector<uint64_t> order(keys.size());
+	for (uint64_t i = 0; i < order.size(); i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b)
+		{ return comp(keys[a], keys[b]); });
+
+	// Groups are repeated iff a node has changed in between
+	Guard guard(this);
+	for (uint64_t i = 0; i < order.size(); i += batchSize)
+	{
+		uint64_t count = std::min<uint64_t>(batchSize, order.size() - i);
+		while (!lookupGroup(keys, order.data() + i, count, tids, found)) { }
+	}
+}
+
+
+//______________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::lookupGroup(const std::vector<T>& keys,
+	const uint64_t* order, uint64_t count, std::vector<TID>& tids,
+	std::vector<bool>& found)
+{
+	// The path of every key, as in descend. The ith key shares its node with
+	// the one before iff frames[i] == frames[i-1], as the keys are sorted.
+	bool restart = false;
+	BufferFrame* metaFrame = &bm->fixPage(metaPage, false);
+	uint64_t metaVersion = latchOf(metaFrame)->readLock(restart);
+	auto meta = reinterpret_cast<BTreeMetadata*>(metaFrame->getData());
+	std::vector<BufferFrame*> parents(count, metaFrame), frames(count);
+	std::vector<uint64_t> parentVersions(count, metaVersion), versions(count);
+	std::vector<uint64_t> pages(count, meta->root);
+	latchOf(metaFrame)->validate(metaVersion, restart);
+	while (true)
+	{
+		// Fix the nodes of the next level, and prefetch each of them before
+		// the first one is searched
+		bool fixed = !restart;
+		if (fixed)
+		{
+			for (uint64_t i = 0; i < count; i++)
+			{
+				if (i > 0 && pages[i] == pages[i-1])
+				{
+					frames[i] = frames[i-1];
+					versions[i] = versions[i-1];
+					continue;
+				}
+				frames[i] = &bm->fixPage(pages[i], false);
+				versions[i] = latchOf(frames[i])->readLock(restart);
+				prefetchNode(frames[i]->getData());
+			}
+		}
+
+		// The parents must not have changed before the nodes were latched
+		for (uint64_t i = 0; i < count; i++)
+		{
+			if (i > 0 && parents[i] == parents[i-1]) continue;
+			latchOf(parents[i])->validate(parentVersions[i], restart);
+			bm->unfixPage(*parents[i], false);
+		}
+		if (restart)
+		{
+			for (uint64_t i = 0; fixed && i < count; i++)
+				if (i == 0 || frames[i] != frames[i-1])
+					bm->unfixPage(*frames[i], false);
+			return false;
+		}
+		parents = frames;
+		parentVersions = versions;
+		if (reinterpret_cast<Node*>(frames[0]->getData())->isLeaf()) break;
+
+		// Continue with the children, once the nodes are known to be
+		// unchanged
+		for (uint64_t i = 0; i < count; i++)
+		{
+			Inner* inner = reinterpret_cast<Inner*>(frames[i]->getData());
+			pages[i] = inner->childFor(keys[order[i]], comp);
+			inner->latch.validate(versions[i], restart);
+		}
+	}
+
+	// Search the leaves, then validate them
+	for (uint64_t i = 0; i < count; i++)
+	{
+		Leaf* leaf = reinterpret_cast<Leaf*>(frames[i]->getData());
+		const T& key = keys[order[i]];
+		uint64_t pos = leaf->position(key, comp);
+		found[order[i]] = pos < leaf->keyCount() &&
+		                  !cmp(key, leaf->keyAt(pos));
+		if (found[order[i]]) 
+			tids[order[i]] = leafFirst(leaf, pos, versions[i]);
+	}
+	for (uint64_t i = 0; i < count; i++)
+	{
+		if (i > 0 && frames[i] == frames[i-1]) continue;
+		latchOf(frames[i])->validate(versions[i], restart);
+		bm->unfixPage(*frames[i], false);
+	}
+	return !restart;
+}
+
+
+//______________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::prefetchNode(const void* node)
+{
+	const char* data = reinterpret_cast<const char*>(node);
+	__builtin_prefetch(data);
+	__builtin_prefetch(data + BM_CONS::pageSize / 4);
+	__builtin_prefetch(data + BM_CONS::pageSize / 2);
+	__builtin_prefetch(data + 3 * BM_CONS::pageSize / 4);
+}
+
+
+
+//______________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::erase(T key)
+{
+	return erase(key, nullptr);
+}
+
+
+//______________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::erase(T key, TID tid)
+{
+	return erase(key, &tid);
+}
+
+
+//______________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::erase(const T& key, const TID* tid)
+{
+	// Get leaf and use binary search to locate the given key. Only the leaf
+	// is latched.
+	Guard guard(this);
+	while (true)
+	{
+		bool restart = false;
+		uint64_t version;
+		BufferFrame* frame = descend(&key, version, restart);
+		if (restart) continue;
+		Leaf* leaf = reinterpret_cast<Leaf*>(frame->getData());
+		leaf->latch.upgrade(version, restart);
+		if (restart) { bm->unfixPage(*frame, false); continue; }
+
+		uint64_t erased = leafErase(leaf, key, tid);
+		bool underfull = erased > 0 && leaf->load() < underflow;
+		entries -= erased;
+		leaf->latch.writeUnlock();
+		bm->unfixPage(*frame, erased > 0);
+		if (underfull) rebalance(key);
+		return erased > 0;
+	}
+}
+
+
+
+//______________________________________________________________________________
+template<class T, class CMP, bool unique>
+BTreeRangeIterator<T, CMP, unique>* BTree<T, CMP, unique>::
+	lookupRange(T start, T end, bool reverse)
+{
+	auto it = new BTreeRangeIterator<T, CMP, unique>(this, &start, &end,
+	                                                 reverse);
+	std::lock_guard<std::mutex> guard(iteratorLock);
+	rangeIterators.push_back(it);
+	return it;
+}
+
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::insert(T key, TID tid)
+{
+	// Descend optimistically. Full nodes on the way are split eagerly, so
+	// that the parent of a node always has room for another separator. Start
+	// over whenever a node has changed in between.
+	Guard guard(this);
+	top:
+	bool restart = false;
+	BufferFrame* parentFrame = &bm->fixPage(metaPage, false);
+	OptimisticLatch* parentLatch = latchOf(parentFrame);
+	uint64_t parentVersion = parentLatch->readLock(restart);
+	uint64_t page =
+		reinterpret_cast<BTreeMetadata*>(parentFrame->getData())->root;
+	parentLatch->validate(parentVersion, restart);
+	if (restart) { bm->unfixPage(*parentFrame, false); goto top; }
+
+	while (true)
+	{
+		BufferFrame* frame = &bm->fixPage(page, false);
+		Node* node = reinterpret_cast<Node*>(frame->getData());
+		uint64_t version = node->latch.readLock(restart);
+		parentLatch->validate(parentVersion, restart);
+		if (restart)
+		{
+			bm->unfixPage(*frame, false);
+			bm->unfixPage(*parentFrame, false);
+			goto top;
+		}
+
+		// Only the leaf changes unless it is full
+		if (node->isLeaf())
+		{
+			Leaf* leaf = reinterpret_cast<Leaf*>(node);
+			if (leafHasRoom(leaf, key, tid))
+			{
+				leaf->latch.upgrade(version, restart);
+				bm->unfixPage(*parentFrame, false);
+				if (restart) { bm->unfixPage(*frame, false); goto top; }
+				entries += leafInsert(leaf, key, tid);
+				leaf->latch.writeUnlock();
+				bm->unfixPage(*frame, true);
+				return;
+			}
+		}
+
+		// Continue with the child, the parent is not needed anymore
+		else if (reinterpret_cast<Inner*>(node)->hasRoom())
+		{
+			Inner* inner = reinterpret_cast<Inner*>(node);
+			page = inner->childFor(key, comp);
+			inner->latch.validate(version, restart);
+			bm->unfixPage(*parentFrame, false);
+			parentFrame = frame;
+			parentLatch = &inner->latch;
+			parentVersion = version;
+			if (restart) { bm->unfixPage(*frame, false); goto top; }
+			continue;
+		}
+
+		// Split the full node, then start over
+		split(parentFrame, parentVersion, frame, version, restart);
+		bm->unfixPage(*frame, !restart);
+		bm->unfixPage(*parentFrame, !restart);
+		goto top;
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique> void BTree<T, CMP, unique>::split(
+	BufferFrame* parentFrame, uint64_t parentVersion, BufferFrame* frame,
+	uint64_t version, bool& restart)
+{
+	// Latch the parent and the node
+	OptimisticLatch* parentLatch = latchOf(parentFrame);
+	parentLatch->upgrade(parentVersion, restart);
+	if (restart) return;
+	Node* node = reinterpret_cast<Node*>(frame->getData());
+	node->latch.upgrade(version, restart);
+	if (restart) { parentLatch->writeUnlock(); return; }
+
+	// If the separator does not fit into the parent, the parent is split
+	// first (by the next operation passing it)
+	Leaf* leaf = reinterpret_cast<Leaf*>(node);
+	Inner* inner = reinterpret_cast<Inner*>(node);
+	uint64_t med = node->isLeaf() ? leaf->splitPoint() : 0;
+	T separator = !node->isLeaf() ? inner->median() :
+		Inner::separator(leaf->keyAt(med - 1), leaf->keyAt(med));
+	Inner* parent = reinterpret_cast<Inner*>(parentFrame->getData());
+	if (parentFrame->pageId != metaPage && !parent->fits(separator))
+	{
+		parent->requestSplit();
+		node->latch.writeUnlock();
+		parentLatch->writeUnlock();
+		return;
+	}
+
+	// The sibling is not reachable before the parent is unlatched
+	uint64_t siblingPage = allocatePage();
+	BufferFrame& siblingFrame = bm->fixPage(siblingPage, false);
+	Node* sibling = reinterpret_cast<Node*>(siblingFrame.getData());
+	sibling->latch.reset();
+	if (node->isLeaf())
+		leaf->split(reinterpret_cast<Leaf*>(sibling), siblingPage);
+	else inner->split(reinterpret_cast<Inner*>(sibling));
+	bm->unfixPage(siblingFrame, true);
+
+	// The root has been split -> add a new root
+	if (parentFrame->pageId == metaPage)
+	{
+		auto meta = reinterpret_cast<BTreeMetadata*>(parentFrame->getData());
+		uint64_t rootPage = allocatePage();
+		BufferFrame& rootFrame = bm->fixPage(rootPage, false);
+		Inner* root = reinterpret_cast<Inner*>(rootFrame.getData());
+		root->latch.reset();
+		root->init(node->level + 1, nullptr, nullptr, frame->pageId);
+		root->insert(separator, siblingPage, comp);
+		bm->unfixPage(rootFrame, true);
+		meta->root = rootPage;
+		meta->height = root->level;
+	}
+	else parent->insert(separator, siblingPage, comp);
+	node->latch.writeUnlock();
+	parentLatch->writeUnlock();
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique> template<class Iterator>
+void BTree<T, CMP, unique>::bulkLoad(Iterator begin, Iterator end, double fill)
+{
+	// Start with the empty root leaf
+	BulkLoadException bulkLoadFailed;
+	if (entries != 0 || fill <= 0 || fill > 1) throw bulkLoadFailed;
+	BufferFrame& metaFrame = bm->fixPage(metaPage, false);
+	auto meta = reinterpret_cast<BTreeMetadata*>(metaFrame.getData());
+	if (meta->height != 0)
+	{
+		bm->unfixPage(metaFrame, false);
+		throw bulkLoadFailed;
+	}
+
+	// The rightmost node of each level is kept fixed until it is full,
+	// leaves first. The TIDs of a key are collected before it is added.
+	std::vector<BufferFrame*> levels(1, &bm->fixPage(meta->root, false));
+	std::vector<uint64_t> tids;
+	T key;
+	bool sorted = true;
+	for (; begin != end; ++begin)
+	{
+		if (!tids.empty() && !cmp(key, begin->first))
+		{
+			if (unique || cmp(begin->first, key))
+			{
+				sorted = false;
+				break;
+			}
+			tids.push_back(begin->second.intRepresentation);
+			continue;
+		}
+		if (!tids.empty()) bulkAppendKey(levels, key, tids, fill);
+		key = begin->first;
+		tids.assign(1, begin->second.intRepresentation);
+	}
+	if (!tids.empty()) bulkAppendKey(levels, key, tids, fill);
+
+	// The top level holds the root
+	meta->root = levels.back()->pageId;
+	meta->height = levels.size() - 1;
+	for (BufferFrame* frame : levels) bm->unfixPage(*frame, true);
+	bm->unfixPage(metaFrame, true);
+	if (!sorted) throw bulkLoadFailed;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::bulkAppendKey(std::vector<BufferFrame*>& levels,
+	const T& key, std::vector<uint64_t>& tids, double fill)
+{
+	std::sort(tids.begin(), tids.end());
+	tids.erase(std::unique(tids.begin(), tids.end()), tids.end());
+	Leaf* leaf = reinterpret_cast<Leaf*>(levels[0]->getData());
+	if (!leafAppend(leaf, key, tids, fill))
+	{
+		// Continue on a new leaf, which the parent level learns about
+		uint64_t page = allocatePage();
+		BufferFrame* frame = &bm->fixPage(page, false);
+		Leaf* next = reinterpret_cast<Leaf*>(frame->getData());
+		next->latch.reset();
+		next->init();
+		leaf->next = page;
+		T separator = Inner::separator(leaf->keyAt(leaf->count - 1), key);
+		uint64_t left = levels[0]->pageId;
+		bm->unfixPage(*levels[0], true);
+		levels[0] = frame;
+		leafAppend(next, key, tids, 1.0);
+		bulkAppend(levels, 1, separator, left, page, fill);
+	}
+	entries += tids.size();
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::bulkAppend(std::vector<BufferFrame*>& levels,
+	uint64_t level, const T& separator, uint64_t left, uint64_t child,
+	double fill)
+{
+	for (; level < levels.size(); level++)
+	{
+		Inner* node = reinterpret_cast<Inner*>(levels[level]->getData());
+		if (node->count == 0 ||
+		    (node->load() < fill && node->fits(separator)))
+		{
+			node->insert(separator, child, comp);
+			return;
+		}
+
+		// Continue on a new node, the separator moves up
+		uint64_t page = allocatePage();
+		BufferFrame* frame = &bm->fixPage(page, false);
+		Inner* next = reinterpret_cast<Inner*>(frame->getData());
+		next->latch.reset();
+		next->init(level, &separator, nullptr, child);
+		left = levels[level]->pageId;
+		bm->unfixPage(*levels[level], true);
+		levels[level] = frame;
+		child = page;
+	}
+
+	// Add a new root above the top level
+	uint64_t page = allocatePage();
+	levels.push_back(&bm->fixPage(page, false));
+	Inner* root = reinterpret_cast<Inner*>(levels.back()->getData());
+	root->latch.reset();
+	root->init(level, nullptr, nullptr, left);
+	root->insert(separator, child, comp);
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::leafHasRoom(BTreeLeafNode<T>* leaf, const T& key,
+	TID)
+{
+	uint64_t pos = leaf->position(key, comp);
+	uint64_t count = leaf->keyCount();
+	return (pos < count && !cmp(key, leaf->keyAt(pos))) ||
+	       count < BTreeLeafNode<T>::capacity;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::leafHasRoom(BTreePostingLeafNode<T>* leaf,
+	const T& key, TID tid)
+{
+	typedef BTreePostingLeafNode<T> PostingLeaf;
+	uint64_t pos = leaf->position(key, comp);
+	if (pos == leaf->keyCount() || cmp(key, leaf->keyAt(pos)))
+		return leaf->fits(sizeof(typename PostingLeaf::Slot) +
+		                  PostingList::length(tid.intRepresentation), 0);
+
+	// A list on posting pages does not grow in the leaf. Lists which grow
+	// beyond inlineLimit move to posting pages. The leaf is read 
+	// optimistically, so the list is decoded within inlineLimit bytes, each
+	// TID taking one byte at least.
+	uint64_t length;
+	const unsigned char* list = leaf->list(pos, length);
+	if (leaf->slots()[pos].length == PostingLeaf::overflow) return true;
+	std::vector<uint64_t> tids;
+	uint64_t limit = PostingLeaf::inlineLimit;
+	PostingList::decode(list, std::min(length, limit),
+	                    std::min<uint64_t>(leaf->slots()[pos].count, limit),
+	                    tids);
+	auto it = std::lower_bound(tids.begin(), tids.end(),
+	                           tid.intRepresentation);
+	if (it != tids.end() && *it == tid.intRepresentation) return true;
+	tids.insert(it, tid.intRepresentation);
+	uint64_t newLength = PostingList::length(tids.data(), tids.size());
+	if (newLength > limit) newLength = sizeof(uint64_t);
+	return leaf->fits(newLength, length);
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+uint64_t BTree<T, CMP, unique>::leafInsert(BTreeLeafNode<T>* leaf,
+	const T& key, TID tid)
+{
+	uint64_t pos = leaf->position(key, comp);
+	uint64_t count = leaf->count;
+	if (pos < count && !cmp(key, leaf->keys[pos]))
+	{
+		leaf->values[pos] = tid;
+		return 0;
+	}
+	std::copy_backward(leaf->keys + pos, leaf->keys + count,
+	                   leaf->keys + count + 1);
+	std::copy_backward(leaf->values + pos, leaf->values + count,
+	                   leaf->values + count + 1);
+	leaf->keys[pos] = key;
+	leaf->values[pos] = tid;
+	leaf->count++;
+	return 1;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+uint64_t BTree<T, CMP, unique>::leafInsert(BTreePostingLeafNode<T>* leaf,
+	const T& key, TID tid)
+{
+	typedef BTreePostingLeafNode<T> PostingLeaf;
+	std::vector<unsigned char> bytes;
+	std::vector<uint64_t> tids;
+	uint64_t pos = leaf->position(key, comp);
+	if (pos == leaf->count || cmp(key, leaf->keyAt(pos)))
+	{
+		tids.push_back(tid.intRepresentation);
+		PostingList::encode(tids.data(), 1, bytes);
+		leaf->insertSlot(pos, key);
+		leaf->setList(pos, bytes.data(), bytes.size(), 1);
+		return 1;
+	}
+
+	auto& slot = leaf->slots()[pos];
+	if (slot.length == PostingLeaf::overflow)
+	{
+		if (!addPosting(leaf->overflowPage(pos), tid.intRepresentation))
+			return 0;
+		slot.count++;
+		return 1;
+	}
+
+	// Decode the list, then replace it
+	uint64_t length;
+	const unsigned char* list = leaf->list(pos, length);
+	PostingList::decode(list, length, slot.count, tids);
+	auto it = std::lower_bound(tids.begin(), tids.end(),
+	                           tid.intRepresentation);
+	if (it != tids.end() && *it == tid.intRepresentation) return 0;
+	tids.insert(it, tid.intRepresentation);
+	PostingList::encode(tids.data(), tids.size(), bytes);
+	if (bytes.size() > PostingLeaf::inlineLimit)
+		leaf->setOverflow(pos, writePostings(tids.data(), tids.size()),
+		                  tids.size());
+	else leaf->setList(pos, bytes.data(), bytes.size(), tids.size());
+	return 1;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+uint64_t BTree<T, CMP, unique>::leafErase(BTreeLeafNode<T>* leaf,
+	const T& key, const TID* tid)
+{
+	uint64_t pos = leaf->position(key, comp);
+	uint64_t count = leaf->count;
+	if (pos == count || cmp(key, leaf->keys[pos])) return 0;
+	if (tid != nullptr &&
+	    leaf->values[pos].intRepresentation != tid->intRepresentation)
+		return 0;
+	std::copy(leaf->keys + pos + 1, leaf->keys + count, leaf->keys + pos);
+	std::copy(leaf->values + pos + 1, leaf->values + count,
+	          leaf->values + pos);
+	leaf->count--;
+	return 1;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+uint64_t BTree<T, CMP, unique>::leafErase(BTreePostingLeafNode<T>* leaf,
+	const T& key, const TID* tid)
+{
+	typedef BTreePostingLeafNode<T> PostingLeaf;
+	uint64_t pos = leaf->position(key, comp);
+	if (pos == leaf->count || cmp(key, leaf->keyAt(pos))) return 0;
+	auto& slot = leaf->slots()[pos];
+	uint64_t count = slot.count;
+	if (tid == nullptr)
+	{
+		// The pages of a list too long for the leaf are freed along with it
+		uint64_t page = slot.length == PostingLeaf::overflow ?
+			leaf->overflowPage(pos) : 0;
+		while (page != 0)
+		{
+			BufferFrame& frame = bm->fixPage(page, false);
+			uint64_t next = 
+				reinterpret_cast<BTreePostingPage*>(frame.getData())->next;
+			bm->unfixPage(frame, false);
+			retire(page);
+			page = next;
+		}
+		leaf->removeSlot(pos);
+		return count;
+	}
+
+	if (slot.length == PostingLeaf::overflow)
+	{
+		uint64_t first = leaf->overflowPage(pos);
+		if (!removePosting(first, tid->intRepresentation)) return 0;
+		if (count == 1) leaf->removeSlot(pos);
+		else leaf->setOverflow(pos, first, count - 1);
+		return 1;
+	}
+
+	uint64_t length;
+	std::vector<uint64_t> tids;
+	const unsigned char* list = leaf->list(pos, length);
+	PostingList::decode(list, length, count, tids);
+	auto it = std::lower_bound(tids.begin(), tids.end(),
+	                           tid->intRepresentation);
+	if (it == tids.end() || *it != tid->intRepresentation) return 0;
+	tids.erase(it);
+	if (tids.empty()) { leaf->removeSlot(pos); return 1; }
+	std::vector<unsigned char> bytes;
+	PostingList::encode(tids.data(), tids.size(), bytes);
+	leaf->setList(pos, bytes.data(), bytes.size(), tids.size());
+	return 1;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::leafRead(BTreeLeafNode<T>* leaf, uint64_t i,
+	T& key, std::vector<TID>& tids, uint64_t)
+{
+	key = leaf->keys[i];
+	tids.push_back(leaf->values[i]);
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::leafRead(BTreePostingLeafNode<T>* leaf,
+	uint64_t i, T& key, std::vector<TID>& tids, uint64_t version)
+{
+	// The slot may be inconsistent, so an inline list is decoded as in
+	// leafHasRoom, and a list on posting pages is only followed once the
+	// leaf is validated
+	typedef BTreePostingLeafNode<T> PostingLeaf;
+	key = leaf->keyAt(i);
+	uint64_t length, count = leaf->slots()[i].count;
+	uint64_t limit = PostingLeaf::inlineLimit;
+	const unsigned char* list = leaf->list(i, length);
+	std::vector<uint64_t> values;
+	if (leaf->slots()[i].length == PostingLeaf::overflow)
+	{
+		bool restart = false;
+		uint64_t page = leaf->overflowPage(i);
+		leaf->latch.validate(version, restart);
+		if (!restart) readPostings(page, count, values);
+	}
+	else PostingList::decode(list, std::min(length, limit), 
+	                         std::min(count, limit), values);
+	for (uint64_t value : values)
+	{
+		TID tid;
+		tid.intRepresentation = value;
+		tids.push_back(tid);
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+TID BTree<T, CMP, unique>::leafFirst(BTreeLeafNode<T>* leaf, uint64_t i,
+	uint64_t)
+{
+	return leaf->values[i];
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+TID BTree<T, CMP, unique>::leafFirst(BTreePostingLeafNode<T>* leaf,
+	uint64_t i, uint64_t version)
+{
+	typedef BTreePostingLeafNode<T> PostingLeaf;
+	uint64_t length, limit = PostingLeaf::inlineLimit;
+	const unsigned char* list = leaf->list(i, length);
+	std::vector<uint64_t> values;
+	if (leaf->slots()[i].length == PostingLeaf::overflow)
+	{
+		bool restart = false;
+		uint64_t page = leaf->overflowPage(i);
+		leaf->latch.validate(version, restart);
+		if (!restart) readPostings(page, 1, values);
+	}
+	else PostingList::decode(list, std::min(length, limit), 1, values);
+	TID tid;
+	tid.intRepresentation = values.empty() ? 0 : values[0];
+	return tid;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::leafAppend(BTreeLeafNode<T>* leaf, const T& key,
+	const std::vector<uint64_t>& tids, double fill)
+{
+	uint64_t capacity = BTreeLeafNode<T>::capacity;
+	if (leaf->count >= std::max<uint64_t>(1, fill * capacity)) return false;
+	leaf->keys[leaf->count] = key;
+	leaf->values[leaf->count].intRepresentation = tids[0];
+	leaf->count++;
+	return true;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::leafAppend(BTreePostingLeafNode<T>* leaf,
+	const T& key, const std::vector<uint64_t>& tids, double fill)
+{
+	// Every key has to fit, whatever the length of its list
+	typedef BTreePostingLeafNode<T> PostingLeaf;
+	uint64_t limit = PostingLeaf::inlineLimit;
+	if (leaf->count > 0 && (leaf->load() >= fill ||
+	    !leaf->fits(sizeof(typename PostingLeaf::Slot) + limit, 0)))
+		return false;
+
+	uint64_t pos = leaf->count;
+	leaf->insertSlot(pos, key);
+	std::vector<unsigned char> bytes;
+	PostingList::encode(tids.data(), tids.size(), bytes);
+	if (bytes.size() > limit)
+		leaf->setOverflow(pos, writePostings(tids.data(), tids.size()),
+		                  tids.size());
+	else leaf->setList(pos, bytes.data(), bytes.size(), tids.size());
+	return true;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::readPostings(uint64_t page, uint64_t count,
+	std::vector<uint64_t>& tids)
+{
+	// Every page holds at least one TID, which bounds the pages visited if
+	// they are modified in between
+	uint64_t size = BTreePostingPage::dataSize;
+	for (uint64_t pages = 0; page != 0 && pages < count; pages++)
+	{
+		if (tids.size() >= count) break;
+		BufferFrame& frame = bm->fixPage(page, false);
+		auto run = reinterpret_cast<BTreePostingPage*>(frame.getData());
+		uint64_t length = std::min<uint64_t>(run->length, size);
+		PostingList::decode(run->data, length,
+		                    std::min<uint64_t>(run->count, count - tids.size()),
+		                    tids);
+		page = run->next;
+		bm->unfixPage(frame, false);
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+uint64_t BTree<T, CMP, unique>::writePostings(const uint64_t* tids,
+	uint64_t count)
+{
+	// Fill the pages one after another, each run starts with a full TID
+	uint64_t first = 0;
+	BufferFrame* previous = nullptr;
+	for (uint64_t begin = 0; begin < count; )
+	{
+		uint64_t length = PostingList::length(tids[begin]), end = begin + 1;
+		while (end < count && length + PostingList::length(tids[end] -
+		       tids[end-1]) <= BTreePostingPage::dataSize)
+			length += PostingList::length(tids[end] - tids[end-1]), end++;
+
+		uint64_t page = allocatePage();
+		BufferFrame* frame = &bm->fixPage(page, false);
+		auto run = reinterpret_cast<BTreePostingPage*>(frame->getData());
+		run->latch.reset();
+		run->next = 0;
+		writeRun(run, tids + begin, end - begin);
+		if (previous == nullptr) first = page;
+		else
+		{
+			reinterpret_cast<BTreePostingPage*>(previous->getData())->next =
+				page;
+			bm->unfixPage(*previous, true);
+		}
+		previous = frame;
+		begin = end;
+	}
+	if (previous != nullptr) bm->unfixPage(*previous, true);
+	return first;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::addPosting(uint64_t first, uint64_t tid)
+{
+	// Find the last page whose run starts before tid
+	BufferFrame* frame = &bm->fixPage(first, false);
+	auto run = reinterpret_cast<BTreePostingPage*>(frame->getData());
+	std::vector<uint64_t> tids;
+	while (run->next != 0)
+	{
+		BufferFrame* nextFrame = &bm->fixPage(run->next, false);
+		auto next = reinterpret_cast<BTreePostingPage*>(nextFrame->getData());
+		tids.clear();
+		PostingList::decode(next->data, next->length, 1, tids);
+		if (tid < tids[0]) { bm->unfixPage(*nextFrame, false); break; }
+		bm->unfixPage(*frame, false);
+		frame = nextFrame;
+		run = next;
+	}
+
+	tids.clear();
+	PostingList::decode(run->data, run->length, run->count, tids);
+	auto it = std::lower_bound(tids.begin(), tids.end(), tid);
+	if (it != tids.end() && *it == tid)
+	{
+		bm->unfixPage(*frame, false);
+		return false;
+	}
+	tids.insert(it, tid);
+
+	// A full page moves the upper half of its run to a new page
+	uint64_t keep = tids.size();
+	if (PostingList::length(tids.data(), keep) > BTreePostingPage::dataSize)
+	{
+		keep /= 2;
+		uint64_t page = allocatePage();
+		BufferFrame& siblingFrame = bm->fixPage(page, false);
+		auto sibling =
+			reinterpret_cast<BTreePostingPage*>(siblingFrame.getData());
+		sibling->latch.reset();
+		sibling->next = run->next;
+		writeRun(sibling, tids.data() + keep, tids.size() - keep);
+		bm->unfixPage(siblingFrame, true);
+		run->next = page;
+	}
+	writeRun(run, tids.data(), keep);
+	bm->unfixPage(*frame, true);
+	return true;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::removePosting(uint64_t& first, uint64_t tid)
+{
+	// Find the last page whose run starts before tid, and its predecessor
+	BufferFrame* previous = nullptr;
+	BufferFrame* frame = &bm->fixPage(first, false);
+	auto run = reinterpret_cast<BTreePostingPage*>(frame->getData());
+	std::vector<uint64_t> tids;
+	while (run->next != 0)
+	{
+		BufferFrame* nextFrame = &bm->fixPage(run->next, false);
+		auto next = reinterpret_cast<BTreePostingPage*>(nextFrame->getData());
+		tids.clear();
+		PostingList::decode(next->data, next->length, 1, tids);
+		if (tid < tids[0]) { bm->unfixPage(*nextFrame, false); break; }
+		if (previous != nullptr) bm->unfixPage(*previous, false);
+		previous = frame;
+		frame = nextFrame;
+		run = next;
+	}
+
+	tids.clear();
+	PostingList::decode(run->data, run->length, run->count, tids);
+	auto it = std::lower_bound(tids.begin(), tids.end(), tid);
+	bool found = it != tids.end() && *it == tid;
+	bool unlinked = false;
+	if (found)
+	{
+		// An empty page is unlinked from the list, and freed
+		tids.erase(it);
+		unlinked = tids.empty();
+		if (!unlinked) writeRun(run, tids.data(), tids.size());
+		else if (previous == nullptr) first = run->next;
+		else
+		{
+			reinterpret_cast<BTreePostingPage*>(previous->getData())->next =
+				run->next;
+		}
+	}
+	uint64_t page = frame->pageId;
+	bm->unfixPage(*frame, found && !unlinked);
+	if (previous != nullptr) bm->unfixPage(*previous, unlinked);
+	if (unlinked) retire(page);
+	return found;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::writeRun(BTreePostingPage* page,
+	const uint64_t* tids, uint64_t count)
+{
+	std::vector<unsigned char> bytes;
+	PostingList::encode(tids, count, bytes);
+	std::copy(bytes.begin(), bytes.end(), page->data);
+	page->count = count;
+	page->length = bytes.size();
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::rebalance(const T& key)
+{
+	for (uint32_t level = 0; mergeAt(key, level); level++) { }
+	collapseRoot();
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::mergeAt(const T& key, uint32_t level)
+{
+	while (true)
+	{
+		// Find the parent, and the children to be merged
+		bool restart = false;
+		uint64_t version;
+		BufferFrame* parentFrame = descend(&key, version, restart, level + 1);
+		if (restart) continue;
+		Inner* parent = reinterpret_cast<Inner*>(parentFrame->getData());
+		uint64_t children = parent->childCount();
+		uint64_t pos = parent->childIndex(key, comp);
+		bool found = parent->level == level + 1 && children > 1;
+		uint64_t left = pos + 1 < children ? pos : pos - 1;
+		uint64_t leftPage = found ? parent->childAt(left) : 0;
+		uint64_t rightPage = found ? parent->childAt(left + 1) : 0;
+		parent->latch.validate(version, restart);
+		if (restart || !found)
+		{
+			bm->unfixPage(*parentFrame, false);
+			if (restart) continue;
+			return false;
+		}
+
+		// Latch the parent and both children
+		std::vector<BufferFrame*> frames(1, parentFrame);
+		std::vector<uint64_t> versions(1, version);
+		for (uint64_t page : { leftPage, rightPage })
+		{
+			frames.push_back(&bm->fixPage(page, false));
+			versions.push_back(latchOf(frames.back())->readLock(restart));
+		}
+		parent->latch.validate(version, restart);
+		if (restart || !upgradeAll(frames, versions))
+		{
+			for (BufferFrame* frame : frames) bm->unfixPage(*frame, false);
+			continue;
+		}
+
+		// Merge iff the node is still underfull, the right child is removed
+		bool merge;
+		void* node = frames[pos == left ? 1 : 2]->getData();
+		if (level == 0)
+		{
+			Leaf* leftNode = reinterpret_cast<Leaf*>(frames[1]->getData());
+			Leaf* rightNode = reinterpret_cast<Leaf*>(frames[2]->getData());
+			merge = reinterpret_cast<Leaf*>(node)->load() < underflow &&
+			        leftNode->canMerge(rightNode, mergeFill);
+			if (merge) leftNode->merge(rightNode);
+		}
+		else
+		{
+			Inner* leftNode = reinterpret_cast<Inner*>(frames[1]->getData());
+			Inner* rightNode = reinterpret_cast<Inner*>(frames[2]->getData());
+			T separator = parent->keyAt(left);
+			merge = reinterpret_cast<Inner*>(node)->load() < underflow &&
+			        leftNode->canMerge(separator, rightNode, mergeFill);
+			if (merge) leftNode->merge(separator, rightNode);
+		}
+		if (merge) parent->remove(left);
+		bool underfull = merge && parent->load() < underflow;
+
+		if (merge) latchOf(frames[2])->writeUnlockObsolete();
+		else latchOf(frames[2])->writeUnlock();
+		latchOf(frames[1])->writeUnlock();
+		parent->latch.writeUnlock();
+		for (BufferFrame* frame : frames) bm->unfixPage(*frame, merge);
+		if (merge) retire(rightPage);
+		return underfull;
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::collapseRoot()
+{
+	while (true)
+	{
+		bool restart = false;
+		BufferFrame* metaFrame = &bm->fixPage(metaPage, false);
+		auto meta = reinterpret_cast<BTreeMetadata*>(metaFrame->getData());
+		uint64_t metaVersion = meta->latch.readLock(restart);
+		uint64_t rootPage = meta->root;
+		meta->latch.validate(metaVersion, restart);
+		if (restart) { bm->unfixPage(*metaFrame, false); continue; }
+
+		BufferFrame* rootFrame = &bm->fixPage(rootPage, false);
+		Inner* root = reinterpret_cast<Inner*>(rootFrame->getData());
+		uint64_t rootVersion = root->latch.readLock(restart);
+		meta->latch.validate(metaVersion, restart);
+		bool single = !root->isLeaf() && root->childCount() == 1;
+		root->latch.validate(rootVersion, restart);
+		std::vector<BufferFrame*> frames = { metaFrame, rootFrame };
+		std::vector<uint64_t> versions = { metaVersion, rootVersion };
+		if (restart || !single || !upgradeAll(frames, versions))
+		{
+			bm->unfixPage(*rootFrame, false);
+			bm->unfixPage(*metaFrame, false);
+			if (restart || single) continue;
+			return;
+		}
+
+		meta->root = root->firstChild();
+		meta->height--;
+		root->latch.writeUnlockObsolete();
+		meta->latch.writeUnlock();
+		bm->unfixPage(*rootFrame, true);
+		bm->unfixPage(*metaFrame, true);
+		retire(rootPage);
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::upgradeAll(const std::vector<BufferFrame*>& frames,
+	const std::vector<uint64_t>& versions)
+{
+	for (uint64_t i = 0; i < frames.size(); i++)
+	{
+		bool restart = false;
+		latchOf(frames[i])->upgrade(versions[i], restart);
+		if (!restart) continue;
+		while (i > 0) latchOf(frames[--i])->writeUnlock();
+		return false;
+	}
+	return true;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::defragment(double fill)
+{
+	std::lock_guard<std::mutex> guard(defragmentLock);
+	T key;
+	uint64_t previous = 0, previousVersion = 0;
+	if (!defragmentParent(nullptr, key, previous, previousVersion, fill))
+		return;
+	while (defragmentParent(&key, key, previous, previousVersion, fill)) { }
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTree<T, CMP, unique>::defragmentParent(const T* from, T& next,
+	uint64_t& previous, uint64_t& previousVersion, double fill)
+{
+	// The leaf written last may have been removed and reused since, which its
+	// version tells
+	Guard epochGuard(this);
+	while (true)
+	{
+		// Find the parent and its children. A tree of a single leaf is left
+		// as it is.
+		bool restart = false;
+		uint64_t version;
+		BufferFrame* parentFrame = descend(from, version, restart, 1);
+		if (restart) continue;
+		Inner* parent = reinterpret_cast<Inner*>(parentFrame->getData());
+		bool leaf = parent->isLeaf();
+		std::vector<uint64_t> pages;
+		for (uint64_t i = 0; !leaf && i < parent->childCount(); i++)
+			pages.push_back(parent->childAt(i));
+		parent->latch.validate(version, restart);
+		if (restart || leaf)
+		{
+			bm->unfixPage(*parentFrame, false);
+			if (restart) continue;
+			return false;
+		}
+
+		// The leaf left of the first child links it, unless it is the
+		// leftmost leaf. It is searched from the leftmost leaf iff it is not
+		// found from the leaf written last.
+		std::vector<BufferFrame*> frames(1, parentFrame);
+		std::vector<uint64_t> versions(1, version);
+		BufferFrame* predecessor = nullptr;
+		if (previous != 0)
+		{
+			uint64_t predecessorVersion;
+			predecessor = findPredecessor(previous, previousVersion, pages[0],
+			                              predecessorVersion, restart);
+			if (restart)
+			{
+				bm->unfixPage(*parentFrame, false);
+				restart = false;
+				BufferFrame* leftmost = descend(nullptr, version, restart);
+				if (leftmost == nullptr) continue;
+				previous = leftmost->pageId == pages[0] ? 0 : leftmost->pageId;
+				bm->unfixPage(*leftmost, false);
+				continue;
+			}
+			frames.push_back(predecessor);
+			versions.push_back(predecessorVersion);
+		}
+
+		// Latch all of them
+		uint64_t firstChild = frames.size();
+		for (uint64_t page : pages)
+		{
+			frames.push_back(&bm->fixPage(page, false));
+			versions.push_back(latchOf(frames.back())->readLock(restart));
+		}
+		parent->latch.validate(version, restart);
+		if (restart || !upgradeAll(frames, versions))
+		{
+			for (BufferFrame* frame : frames) bm->unfixPage(*frame, false);
+			continue;
+		}
+
+		// Copy the children to new pages in order, merging them into the
+		// page before while they fit. The pages follow the leaf written last
+		// where possible.
+		std::vector<BufferFrame*> written;
+		std::vector<bool> merged(pages.size(), false);
+		for (uint64_t i = 0; i < pages.size(); i++)
+		{
+			Leaf* child =
+				reinterpret_cast<Leaf*>(frames[firstChild + i]->getData());
+			Leaf* last = written.empty() ? nullptr :
+				reinterpret_cast<Leaf*>(written.back()->getData());
+			if (last != nullptr && last->canMerge(child, fill))
+			{
+				last->merge(child);
+				merged[i] = true;
+				continue;
+			}
+			uint64_t page = allocatePage(written.empty() ? previous :
+			                             written.back()->pageId,
+			                             pages.size() - i);
+			BufferFrame* frame = &bm->fixPage(page, false);
+			uint64_t version = latchOf(frame)->version;
+			memcpy(frame->getData(), child, BM_CONS::pageSize);
+			latchOf(frame)->version = version;
+			latchOf(frame)->reset();
+			if (last != nullptr) last->next = page;
+			written.push_back(frame);
+		}
+
+		// Link the new leaves instead of the children
+		for (uint64_t i = pages.size() - 1; i > 0; i--)
+			if (merged[i]) parent->remove(i - 1);
+		for (uint64_t i = 0; i < written.size(); i++)
+			parent->setChild(i, written[i]->pageId);
+		if (predecessor != nullptr)
+		{
+			reinterpret_cast<Leaf*>(predecessor->getData())->next =
+				written[0]->pageId;
+		}
+
+		// The first key after the new leaves decides the next parent. The
+		// leaf following them cannot be merged away while they are latched.
+		Leaf* last = reinterpret_cast<Leaf*>(written.back()->getData());
+		uint64_t page = last->next;
+		bool more = false;
+		while (page != 0 && !more)
+		{
+			BufferFrame& frame = bm->fixPage(page, false);
+			Leaf* leaf = reinterpret_cast<Leaf*>(frame.getData());
+			bool changed = false;
+			uint64_t leafVersion = leaf->latch.readLock(changed);
+			more = leaf->keyCount() > 0;
+			if (more) next = leaf->keyAt(0);
+			uint64_t following = leaf->next;
+			leaf->latch.validate(leafVersion, changed);
+			bm->unfixPage(frame, false);
+			if (changed) { more = false; page = last->next; }
+			else page = following;
+		}
+		previous = written.back()->pageId;
+		previousVersion = latchOf(written.back())->version;
+
+		for (uint64_t i = firstChild; i < frames.size(); i++)
+			latchOf(frames[i])->writeUnlockObsolete();
+		for (uint64_t i = 0; i < firstChild; i++)
+			latchOf(frames[i])->writeUnlock();
+		for (BufferFrame* frame : written) bm->unfixPage(*frame, true);
+		for (BufferFrame* frame : frames) bm->unfixPage(*frame, true);
+		for (uint64_t page : pages) retire(page);
+		return more;
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+BufferFrame* BTree<T, CMP, unique>::findPredecessor(uint64_t start,
+	uint64_t startVersion, uint64_t page, uint64_t& version, bool& restart)
+{
+	for (uint64_t current = start; current != 0 && !restart; )
+	{
+		BufferFrame* frame = &bm->fixPage(current, false);
+		Leaf* leaf = reinterpret_cast<Leaf*>(frame->getData());
+		version = leaf->latch.readLock(restart);
+		if (current == start && version != startVersion) restart = true;
+		current = restart ? 0 : leaf->next;
+		leaf->latch.validate(version, restart);
+		if (!restart && current == page) return frame;
+		bm->unfixPage(*frame, false);
+	}
+	restart = true;
+	return nullptr;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+uint64_t BTree<T, CMP, unique>::allocatePage(uint64_t after, uint64_t run)
+{
+	std::lock_guard<std::mutex> guard(allocationLock);
+	if (after != 0 && freePages.erase(after + 1) > 0) return after + 1;
+	if (after == 0 || after + 1 != nextPage)
+	{
+		// Find the first run of free pages which is long enough
+		uint64_t start = 0, length = 0;
+		for (uint64_t page : freePages)
+		{
+			if (length > 0 && page == start + length) length++;
+			else { start = page; length = 1; }
+			if (length < run) continue;
+			freePages.erase(start);
+			return start;
+		}
+	}
+
+	if (nextPage == extentEnd)
+	{
+		// Continue on the extent added by the SM
+		Segment* seg = sm->retrieveSegmentById(segId);
+		uint64_t sizeBefore = seg->getSize();
+		nextPage = sm->growSegment(segId);
+		extentEnd = nextPage + seg->getSize() - sizeBefore;
+	}
+	return nextPage++;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+BTree<T, CMP, unique>::Guard::Guard(BTree* tree)
+{
+	// The epoch may advance before the operation is counted, in which case
+	// it is counted in the new one
+	this->tree = tree;
+	while (true)
+	{
+		epoch = tree->epoch;
+		tree->active[epoch & 1]++;
+		if (tree->epoch == epoch) return;
+		tree->active[epoch & 1]--;
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+BTree<T, CMP, unique>::Guard::~Guard()
+{
+	tree->active[epoch & 1]--;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTree<T, CMP, unique>::retire(uint64_t page)
+{
+	// Operations of the epoch before the current one may still reach pages
+	// retired in it. Once they have ended, the epoch advances, and pages
+	// retired two epochs before are unreachable.
+	std::lock_guard<std::mutex> guard(retireLock);
+	uint64_t current = epoch;
+	retired.push_back(std::make_pair(page, current));
+	if (active[(current - 1) & 1] == 0) epoch = ++current;
+	std::lock_guard<std::mutex> allocationGuard(allocationLock);
+	while (!retired.empty() && retired.front().second + 2 <= current)
+	{
+		freePages.insert(retired.front().first);
+		retired.pop_front();
+	}
+}
+
+#endif  // BTREE_H
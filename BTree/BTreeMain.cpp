@@ -1,5 +1,4 @@
 
-/*
 #include <string>
 #include <cstdint>
 #include <cassert>
@@ -8,7 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "MyDatabaseIncludes.hpp"
+#include "BTree.h"
 
 // Comparator functor for uint64_t
 struct MyCustomUInt64Cmp {
@@ -42,6 +41,14 @@ struct MyCustomIntPairCmp {
    }
 };
 
+// Char keys are compared like memcmp, so separators are compressed
+template <unsigned len>
+struct BinaryOrder<Char<len>, MyCustomCharCmp<len>> : std::true_type {};
+
+// Both comparators order by value, so nodes are searched with SIMD
+template <> struct NaturalOrder<uint64_t, MyCustomUInt64Cmp> : std::true_type {};
+template <> struct NaturalOrder<IntPair, MyCustomIntPairCmp> : std::true_type {};
+
 template <class T>
 const T& getKey(const uint64_t& i);
 
@@ -68,23 +75,22 @@ const IntPair& getKey(const uint64_t& i) {
 
 template <class T, class CMP>
 void test(uint64_t n) {
-   // Set up stuff, you probably have to change something here to match to your interfaces
-   BufferManager bm("/tmp/db", 10ul*1024ul*1024ul); // bogus arguments
-   SegmentManager sm(bm);
-   SegmentID spId = sm.createSegment(Segment::SegmentType::BTree);
-   BTreeSegment& seg = static_cast<BTreeSegment&>(sm.getSegment(spId));
-   BTree<T, CMP> bTree(seg);
+   // Set up stuff
+   SegmentManager sm("/tmp/db");
+   BTree<T, CMP> bTree(&sm);
 
    // Insert values
-   for (uint64_t i=0; i<n; ++i)
-      bTree.insert(getKey<T>(i),static_cast<TID>(i*i));
+   for (uint64_t i=0; i<n; ++i) {
+      TID tid;
+      tid.intRepresentation = i*i;
+      bTree.insert(getKey<T>(i),tid);
+   }
    assert(bTree.size()==n);
 
    // Check if they can be retrieved
    for (uint64_t i=0; i<n; ++i) {
-      TID tid;
-      assert(bTree.lookup(getKey<T>(i),tid));
-      assert(tid==i*i);
+      TID tid = bTree.lookup(getKey<T>(i));
+      assert(tid.intRepresentation==i*i);
    }
 
    // Delete some values
@@ -94,12 +100,14 @@ void test(uint64_t n) {
 
    // Check if the right ones have been deleted
    for (uint64_t i=0; i<n; ++i) {
-      TID tid;
       if ((i%7)==0) {
-         assert(!bTree.lookup(getKey<T>(i),tid));
+         bool found = true;
+         try { bTree.lookup(getKey<T>(i)); }
+         catch (KeyNotFoundException& e) { found = false; }
+         assert(!found);
       } else {
-         assert(bTree.lookup(getKey<T>(i),tid));
-         assert(tid==i*i);
+         TID tid = bTree.lookup(getKey<T>(i));
+         assert(tid.intRepresentation==i*i);
       }
    }
 
@@ -108,9 +116,9 @@ void test(uint64_t n) {
       bTree.erase(getKey<T>(i));
    assert(bTree.size()==0);
 }
-*/
+
 int main(int argc, char* argv[]) {
-   /*// Get command line argument
+   // Get command line argument
    const uint64_t n = (argc==2) ? strtoul(argv[1], NULL, 10) : 1000*1000ul;
 
    // Test index with 64bit unsigned integers
@@ -120,6 +128,7 @@ int main(int argc, char* argv[]) {
    test<Char<20>, MyCustomCharCmp<20>>(n);
 
    // Test index with compound key
-   test<IntPair, MyCustomIntPairCmp>(n);*/
+   test<IntPair, MyCustomIntPairCmp>(n);
+   if (system("rm /tmp/db") < 0) std::cout << "Error removing database\n";
    return 0;
 }
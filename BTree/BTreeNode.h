@@ -1,4 +1,3 @@
-
 ///////////////////////////////////////////////////////////////////////////////
 // BTreeNode.h
 //////////////////////////////////////////////////////////////////////////////
@@ -8,71 +7,1115 @@
 #define BTREENODE_H
 
 #include "../SegmentManager/TID.h"
+#include "../BufferManager/BMConst.h"
+#include "BTreeSearch.h"
 #include <gtest/gtest.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
 
+// The page layouts of a B+ Tree. Nodes are never constructed, they are laid
+// over the data of the pages of the tree's segment (see BTree). Links to other
+// nodes are page ids. Keys must therefore be trivially copyable.
 
-// Class representing a node in a B+ Tree. -------------------------------------
-template<class T> class BTreeNode
+
+// An optimistic latch, found on every page of a B+ Tree. The version counts
+// the modifications of the page. Its second bit is set while a writer holds
+// the latch, its first bit once the page has been removed from the tree.
+// Readers never write the latch, they validate that the version has not
+// changed after reading, and restart otherwise.
+struct OptimisticLatch
 {
-public:
+	std::atomic<uint64_t> version;
 
-	// Constructor. Underflow and overflow are controlled by the BTree itself.
-	BTreeNode(BTreeNode<T>* parent = NULL) : parent(parent) { }
-	~BTreeNode() { }
+	// Returns the current version once no writer holds the latch. Sets
+	// restart iff the page has been removed from the tree.
+	uint64_t readLock(bool& restart)
+	{
+		uint64_t v = version.load();
+		while ((v & 2) == 2)
+		{
+			std::this_thread::yield();
+			v = version.load();
+		}
+		if ((v & 1) == 1) restart = true;
+		return v;
+	}
 
-private:
+	// Sets restart iff the page has changed since the given version
+	void validate(uint64_t v, bool& restart)
+	{
+		if (version.load() != v) restart = true;
+	}
+
+	// Acquires the latch for writing iff the page has not changed since the
+	// given version, sets restart otherwise
+	void upgrade(uint64_t v, bool& restart)
+	{
+		if (!version.compare_exchange_strong(v, v + 2)) restart = true;
+	}
+
+	// Releases the latch, increments the version
+	void writeUnlock() { version.fetch_add(2); }
+
+	// Releases the latch, and marks the page as removed from the tree
+	void writeUnlockObsolete() { version.fetch_add(3); }
+
+	// Prepares the latch of a page which is (re)used for a new node. The
+	// version continues after the one of the page's previous use, so that
+	// readers who saw that never validate.
+	void reset() { version = (version.load() | 3) + 1; }
+};
+
+
+// The first page of the segment of a B+ Tree ---------------------------------
+struct BTreeMetadata
+{
+	// Guards the root
+	OptimisticLatch latch;
+
+	// Page id of the root node
+	uint64_t root;
+
+	// Number of levels below the root, 0 iff the root is a leaf
+	uint64_t height;
+
+	// Number of entries in the tree, only up to date once the tree has been
+	// closed
+	uint64_t size;
+
+	// The next page of the segment not used yet, and the end of its extent
+	uint64_t nextPage;
+	uint64_t extentEnd;
+
+	// The first of the pages which have been removed from the tree (see
+	// BTreeFreePage), 0 iff there are none. Only up to date once the tree
+	// has been closed.
+	uint64_t freePage;
+};
+
+
+// A page removed from a B+ Tree, to be reused for a new node ----------------
+struct BTreeFreePage
+{
+	// The latch of the node the page held last
+	OptimisticLatch latch;
+
+	// Page id of the next free page, 0 iff there is none
+	uint64_t next;
+};
+
+
+// Header of a node in a B+ Tree. -------------------------------------------
+template<class T> struct BTreeNode
+{
+	// Guards the node
+	OptimisticLatch latch;
+
+	// The level of the node, leaves are at level 0
+	uint32_t level;
+
+	// The number of keys
+	uint32_t count;
+
+	bool isLeaf() { return level == 0; }
+};
+
+
+
+// A leaf node in a B+ Tree -------------------------------------------------
+template<class T> struct BTreeLeafNode : public BTreeNode<T>
+{
+	// Number of entries fitting on a page (one pair of 8 bytes is kept for
+	// alignment)
+	static const uint64_t capacity = (BM_CONS::pageSize -
+		sizeof(BTreeNode<T>) - 2*sizeof(uint64_t)) / (sizeof(T) + sizeof(TID));
+
+	// Page id of the next leaf node, 0 iff there is none
+	uint64_t next;
+
+	// Keys held by this node, sorted
+	T keys[capacity];
+
+	// Values (TIDs) held by this node, matching the keys
+	TID values[capacity];
+
+	// Initializes an empty leaf
+	void init()
+	{
+		this->level = 0;
+		this->count = 0;
+		next = 0;
+	}
+
+	// Returns the number of keys. The node may be read while it is modified
+	// (see OptimisticLatch).
+	uint64_t keyCount()
+	{
+		uint64_t cap = capacity;
+		return this->count < cap ? this->count : cap;
+	}
+
+	// Returns the position of the first key which is not smaller than key
+	template<class CMP> uint64_t position(const T& key, const CMP& comp)
+	{
+		return BTreeSearch<T, CMP>::lowerBound(keys, keyCount(), key, comp);
+	}
+
+	// Returns the ith key
+	T keyAt(uint64_t i) { return keys[i]; }
+
+	// Returns the fraction of the node's space which is used
+	double load() { return (double)this->count / capacity; }
+
+	// Returns the position of the first entry which split moves
+	uint64_t splitPoint() { return this->count / 2; }
+
+	// Moves the entries from splitPoint() on to sibling, found on the given
+	// page
+	void split(BTreeLeafNode* sibling, uint64_t siblingPage)
+	{
+		uint64_t med = splitPoint();
+		sibling->init();
+		sibling->count = this->count - med;
+		std::copy(keys + med, keys + this->count, sibling->keys);
+		std::copy(values + med, values + this->count, sibling->values);
+		sibling->next = next;
+		next = siblingPage;
+		this->count = med;
+	}
+
+	// Whether the entries of right, the next leaf, fit into this leaf,
+	// filled up to the given fraction
+	bool canMerge(BTreeLeafNode* right, double fill)
+	{
+		return this->count + right->count <= fill * capacity;
+	}
+
+	// Appends the entries of right, the next leaf, which this leaf replaces
+	void merge(BTreeLeafNode* right)
+	{
+		std::copy(right->keys, right->keys + right->count, keys + this->count);
+		std::copy(right->values, right->values + right->count,
+		          values + this->count);
+		this->count += right->count;
+		next = right->next;
+	}
+};
 
-	// The number of entries
-	uint64_t count;
-		
-	// (Opaque) Keys held by this node
-	std::vector<T> keys;
-
-	// The parent of this node
-	BTreeNode<T>* parent;
-	
-	// Marks whether this node is a leaf or not
-	bool isLeaf;
+
+
+// Encoding of posting lists, i.e. sorted lists of TIDs. The first TID is
+// followed by the differences between neighbours, each as a variable length
+// integer of 7 bits per byte.
+struct PostingList
+{
+	// Returns the number of bytes of the given value
+	static uint64_t length(uint64_t value)
+	{
+		uint64_t length = 1;
+		while (value >= 0x80) { value >>= 7; length++; }
+		return length;
+	}
+
+	// Returns the number of bytes of the given TIDs, encoded
+	static uint64_t length(const uint64_t* tids, uint64_t count)
+	{
+		uint64_t length = 0;
+		for (uint64_t i = 0; i < count; i++)
+			length += PostingList::length(i == 0 ? tids[0] :
+			                                       tids[i] - tids[i-1]);
+		return length;
+	}
+
+	// Appends the given TIDs, encoded, to out
+	static void encode(const uint64_t* tids, uint64_t count,
+	                   std::vector<unsigned char>& out)
+	{
+		for (uint64_t i = 0; i < count; i++)
+		{
+			uint64_t value = i == 0 ? tids[0] : tids[i] - tids[i-1];
+			while (value >= 0x80)
+			{
+				out.push_back((value & 0x7F) | 0x80);
+				value >>= 7;
+			}
+			out.push_back(value);
+		}
+	}
+
+	// Appends at most count TIDs, decoded from the given bytes, to out. The
+	// bytes may be inconsistent if they are read optimistically.
+	static void decode(const unsigned char* in, uint64_t length,
+	                   uint64_t count, std::vector<uint64_t>& out)
+	{
+		uint64_t previous = 0, i = 0;
+		for (uint64_t n = 0; n < count && i < length; n++)
+		{
+			uint64_t value = 0;
+			for (unsigned shift = 0; i < length && shift < 64; shift += 7)
+			{
+				value |= (uint64_t)(in[i] & 0x7F) << shift;
+				if ((in[i++] & 0x80) == 0) break;
+			}
+			previous += value;
+			out.push_back(previous);
+		}
+	}
+};
+
+
+
+// A page holding a part of a posting list which is too long for a leaf ------
+// (see BTreePostingLeafNode). The pages of a list are chained, each one holds
+// a sorted run of the list, larger than the runs before.
+struct BTreePostingPage
+{
+	// Unused, pages of a list are guarded by the latch of their leaf
+	OptimisticLatch latch;
+
+	// Page id of the next page of the list, 0 iff there is none
+	uint64_t next;
+
+	// Number of TIDs and bytes of the encoded run
+	uint32_t count;
+	uint32_t length;
+
+	// Number of bytes available for the run
+	static const uint64_t dataSize = BM_CONS::pageSize - 3*sizeof(uint64_t);
+
+	unsigned char data[dataSize];
+};
+
+
+
+// Header of a leaf with posting lists (see BTreePostingLeafNode) -----------
+template<class T> struct BTreePostingLeafHeader : public BTreeNode<T>
+{
+	// Page id of the next leaf node, 0 iff there is none
+	uint64_t next;
+
+	// The offset of the heap in the node's data, and the number of bytes in
+	// the heap which are not used anymore
+	uint16_t heapStart;
+	uint16_t garbage;
 };
 
 
 
-// Class representing a leaf node in a B+ Tree ---------------------------------
-template<class T> class BTreeLeafNode : public BTreeNode<T>
+// A leaf node of a B+ Tree on non-unique keys -------------------------------
+// Every key is found in a slot once, together with the number of its TIDs.
+// The TIDs are kept as an encoded posting list in a heap at the end of the
+// node. Lists which would take more than inlineLimit bytes are moved to a
+// chain of posting pages, whose first page id is kept in the heap instead.
+template<class T> struct BTreePostingLeafNode : public BTreePostingLeafHeader<T>
 {
-public:	
+	typedef BTreePostingLeafHeader<T> Header;
+
+	// A key, and the position and size of its posting list in the heap
+	struct Slot
+	{
+		T key;
+		uint32_t count;
+		uint16_t offset;
+		uint16_t length;
+	};
+
+	// Marks the length of a list which is kept on posting pages
+	static const uint16_t overflow = 0xFFFF;
+
+	// Size of the space shared by slots and heap
+	static const uint64_t dataSize = BM_CONS::pageSize - sizeof(Header);
+
+	// Maximum number of bytes of a list kept in the node
+	static const uint64_t inlineLimit = dataSize / 16;
+
+	// Slots grow from the front, the heap from the back
+	unsigned char data[dataSize];
+
+	Slot* slots() { return reinterpret_cast<Slot*>(data); }
+
+	// Initializes an empty leaf
+	void init()
+	{
+		this->level = 0;
+		this->count = 0;
+		this->next = 0;
+		this->heapStart = dataSize;
+		this->garbage = 0;
+	}
+
+	// Returns the number of keys. The node may be read while it is modified
+	// (see OptimisticLatch).
+	uint64_t keyCount()
+	{
+		uint64_t count = this->count;
+		return std::min<uint64_t>(count, dataSize / sizeof(Slot));
+	}
+
+	// Returns the position of the first key which is not smaller than key
+	template<class CMP> uint64_t position(const T& key, const CMP& comp)
+	{
+		uint64_t low = 0, high = keyCount();
+		while (low < high)
+		{
+			uint64_t mid = (low + high) / 2;
+			if (comp(slots()[mid].key, key)) low = mid + 1;
+			else high = mid;
+		}
+		return low;
+	}
+
+	// Returns the ith key
+	T keyAt(uint64_t i) { return slots()[i].key; }
+
+	// Returns the fraction of the node's space which is used
+	double load() { return (double)used() / dataSize; }
+
+	// Returns the position of the first entry which split moves, so that
+	// both leaves keep about half of the space used
+	uint64_t splitPoint()
+	{
+		uint64_t half = used() / 2, bytes = 0, med = 0;
+		while (med + 1 < this->count && bytes < half)
+			bytes += sizeof(Slot) + listLength(slots()[med++]);
+		return std::max<uint64_t>(med, 1);
+	}
+
+	// Moves the entries from splitPoint() on to sibling, found on the given
+	// page
+	void split(BTreePostingLeafNode* sibling, uint64_t siblingPage)
+	{
+		uint64_t med = splitPoint();
+		sibling->init();
+		for (uint64_t i = med; i < this->count; i++)
+		{
+			Slot& slot = slots()[i];
+			sibling->insertSlot(i - med, slot.key);
+			sibling->setList(i - med, data + slot.offset, listLength(slot),
+			                 slot.count);
+			sibling->slots()[i - med].length = slot.length;
+			this->garbage += listLength(slot);
+		}
+		this->count = med;
+		compact();
+		sibling->next = this->next;
+		this->next = siblingPage;
+	}
+
+	// Whether the entries of right, the next leaf, fit into this leaf,
+	// filled up to the given fraction
+	bool canMerge(BTreePostingLeafNode* right, double fill)
+	{
+		return used() + right->used() <= fill * dataSize;
+	}
+
+	// Appends the entries of right, the next leaf, which this leaf replaces
+	void merge(BTreePostingLeafNode* right)
+	{
+		for (uint64_t i = 0; i < right->count; i++)
+		{
+			Slot& slot = right->slots()[i];
+			uint64_t pos = this->count;
+			insertSlot(pos, slot.key);
+			setList(pos, right->data + slot.offset, listLength(slot),
+			        slot.count);
+			slots()[pos].length = slot.length;
+		}
+		this->next = right->next;
+	}
+
+	// Returns the number of bytes of the given slot's list in the heap
+	static uint64_t listLength(const Slot& slot)
+	{
+		return slot.length == overflow ? sizeof(uint64_t) : slot.length;
+	}
+
+	// Whether the given number of bytes fits into the node, once the given
+	// number of bytes in the heap is not used anymore
+	bool fits(uint64_t bytes, uint64_t freed)
+	{
+		return used() + bytes <= dataSize + freed;
+	}
+
+	// Returns the ith list, and its length. Offset and length may be
+	// inconsistent, but are kept within the node.
+	const unsigned char* list(uint64_t i, uint64_t& length)
+	{
+		Slot& slot = slots()[i];
+		uint64_t size = dataSize;
+		uint64_t offset = std::min<uint64_t>(slot.offset, size);
+		length = std::min<uint64_t>(listLength(slot), size - offset);
+		return data + offset;
+	}
+
+	// Returns the first posting page of the ith list, which is kept on
+	// posting pages
+	uint64_t overflowPage(uint64_t i)
+	{
+		uint64_t length, page = 0;
+		const unsigned char* in = list(i, length);
+		memcpy(&page, in, std::min<uint64_t>(length, sizeof(page)));
+		return page;
+	}
+
+	// Inserts the given key with an empty list at position pos. The slot has
+	// to fit (see fits).
+	void insertSlot(uint64_t pos, const T& key)
+	{
+		if ((this->count + 1) * sizeof(Slot) > this->heapStart) compact();
+		Slot* slot = slots();
+		std::copy_backward(slot + pos, slot + this->count,
+		                   slot + this->count + 1);
+		slot[pos].key = key;
+		slot[pos].count = 0;
+		slot[pos].offset = this->heapStart;
+		slot[pos].length = 0;
+		this->count++;
+	}
+
+	// Removes the key at position pos, and its list
+	void removeSlot(uint64_t pos)
+	{
+		Slot* slot = slots();
+		this->garbage += listLength(slot[pos]);
+		std::copy(slot + pos + 1, slot + this->count, slot + pos);
+		this->count--;
+	}
 
-	// Constructor
-	BTreeLeafNode(BTreeLeafNode<T>* next = NULL) : BTreeNode<T>() 
-	{ this->next = next; this->isLeaf = true; }
+	// Replaces the ith list by the given bytes, holding count TIDs. The
+	// bytes have to fit (see fits).
+	void setList(uint64_t i, const unsigned char* bytes, uint64_t length,
+	             uint32_t count)
+	{
+		Slot& slot = slots()[i];
+		this->garbage += listLength(slot);
+		slot.length = 0;
+		if (this->count * sizeof(Slot) + length > this->heapStart) compact();
+		this->heapStart -= length;
+		std::copy(bytes, bytes + length, data + this->heapStart);
+		slot.count = count;
+		slot.offset = this->heapStart;
+		slot.length = length;
+	}
+
+	// Replaces the ith list by the posting pages starting at the given page
+	void setOverflow(uint64_t i, uint64_t page, uint32_t count)
+	{
+		setList(i, reinterpret_cast<unsigned char*>(&page), sizeof(page),
+		        count);
+		slots()[i].length = overflow;
+	}
 
 private:
 
-	// Pointer to the next leaf node
-	BTreeLeafNode<T>* next;
-	
-	// Values (TIDs) held by this node
-	std::vector<TID> values;
+	// Returns the number of bytes used by slots and lists
+	uint64_t used()
+	{
+		return this->count * sizeof(Slot) + dataSize - this->heapStart -
+		       this->garbage;
+	}
+
+	// Moves all lists to the end of the heap
+	void compact()
+	{
+		std::vector<unsigned char> heap(data + this->heapStart,
+		                                data + dataSize);
+		uint64_t base = this->heapStart;
+		this->heapStart = dataSize;
+		for (uint64_t i = 0; i < this->count; i++)
+		{
+			Slot& slot = slots()[i];
+			uint64_t length = listLength(slot);
+			this->heapStart -= length;
+			std::copy(heap.begin() + (slot.offset - base),
+			          heap.begin() + (slot.offset - base + length),
+			          data + this->heapStart);
+			slot.offset = this->heapStart;
+		}
+		this->garbage = 0;
+	}
+};
+
+
+
+// An inner node in a B+ Tree -----------------------------------------------
+// The ith key is the largest key found below the ith child.
+template<class T> struct BTreeInnerNode : public BTreeNode<T>
+{
+	// Number of keys fitting on a page, next to one more child
+	static const uint64_t capacity = (BM_CONS::pageSize -
+		sizeof(BTreeNode<T>) - 2*sizeof(uint64_t)) / (sizeof(T) +
+		sizeof(uint64_t));
+
+	// Keys held by this node, sorted
+	T keys[capacity];
+
+	// Page ids of the children, one more than keys
+	uint64_t children[capacity+1];
+
+	// Initializes an empty node with the given child, whose keys are found
+	// in (lower, upper]. The bounds are ignored.
+	void init(uint32_t level, const T*, const T*, uint64_t child)
+	{
+		this->level = level;
+		this->count = 0;
+		children[0] = child;
+	}
+
+	// Returns the key separating the given keys of two adjacent leaves
+	static T separator(const T& left, const T&) { return left; }
+
+	// Whether another key fits into the node
+	bool hasRoom() { return this->count < capacity; }
+
+	// Whether the given key fits into the node, which is the case iff any
+	// key fits. Thus the node never has to be split beforehand.
+	bool fits(const T&) { return hasRoom(); }
+	void requestSplit() { }
+
+	// Returns the fraction of the node's space which is used
+	double load() { return (double)this->count / capacity; }
+
+	// Returns the page id of the leftmost child
+	uint64_t firstChild() { return children[0]; }
+
+	// Returns the number of children, and the page id of the ith one. The
+	// node may be read while it is modified (see OptimisticLatch).
+	uint64_t childCount()
+	{
+		uint64_t cap = capacity;
+		return (this->count < cap ? this->count : cap) + 1;
+	}
+	uint64_t childAt(uint64_t i) { return children[i]; }
+	void setChild(uint64_t i, uint64_t child) { children[i] = child; }
+
+	// Returns the position of the child the given key is found below. The
+	// node may be read while it is modified (see OptimisticLatch).
+	template<class CMP> uint64_t childIndex(const T& key, const CMP& comp)
+	{
+		uint64_t cap = capacity;
+		uint64_t count = this->count < cap ? this->count : cap;
+		return BTreeSearch<T, CMP>::lowerBound(keys, count, key, comp);
+	}
+
+	// Returns the page id of the child the given key is found below
+	template<class CMP> uint64_t childFor(const T& key, const CMP& comp)
+	{
+		return children[childIndex(key, comp)];
+	}
+
+	// Returns the ith key
+	T keyAt(uint64_t i) { return keys[i]; }
+
+	// Inserts the given key and the page id of the child right of it. The
+	// child left of the key has been split, so that its old key now belongs
+	// to the new child.
+	template<class CMP> void insert(const T& key, uint64_t child,
+	                                const CMP& comp)
+	{
+		uint64_t count = this->count;
+		uint64_t pos = BTreeSearch<T, CMP>::lowerBound(keys, count, key, comp);
+		std::copy_backward(keys + pos, keys + count, keys + count + 1);
+		std::copy_backward(children + pos + 1, children + count + 1,
+		                   children + count + 2);
+		keys[pos] = key;
+		children[pos+1] = child;
+		this->count++;
+	}
+
+	// Returns the key which split moves up
+	T median() { return keys[this->count / 2]; }
+
+	// Moves the keys right of the median to sibling, the median is held by
+	// neither
+	void split(BTreeInnerNode* sibling)
+	{
+		uint64_t med = this->count / 2;
+		sibling->level = this->level;
+		sibling->count = this->count - med - 1;
+		std::copy(keys + med + 1, keys + this->count, sibling->keys);
+		std::copy(children + med + 1, children + this->count + 1,
+		          sibling->children);
+		this->count = med;
+	}
+
+	// Removes the ith key and the child right of it, whose keys have moved
+	// to the child left of it
+	void remove(uint64_t i)
+	{
+		std::copy(keys + i + 1, keys + this->count, keys + i);
+		std::copy(children + i + 2, children + this->count + 1,
+		          children + i + 1);
+		this->count--;
+	}
+
+	// Whether the given key, which separates this node from right, the next
+	// node on its level, and the keys of right fit into this node, filled up
+	// to the given fraction
+	bool canMerge(const T&, BTreeInnerNode* right, double fill)
+	{
+		return this->count + 1 + right->count <= fill * capacity;
+	}
+
+	// Appends the given key, which separates this node from right, and the
+	// keys of right, which this node replaces
+	void merge(const T& key, BTreeInnerNode* right)
+	{
+		keys[this->count] = key;
+		std::copy(right->keys, right->keys + right->count,
+		          keys + this->count + 1);
+		std::copy(right->children, right->children + right->count + 1,
+		          children + this->count + 1);
+		this->count += right->count + 1;
+	}
+};
+
+
+
+// Header of an inner node with compressed keys (see BTreePrefixInnerNode) --
+template<class T> struct BTreePrefixInnerHeader : public BTreeNode<T>
+{
+	// Number of bytes shared by the fences and all separators, and the offset
+	// of the key heap in the node's data
+	uint16_t prefixLength;
+	uint16_t heapStart;
+
+	// Whether the fences are set, and whether the node has to be split before
+	// another separator is inserted (see fits)
+	uint8_t hasLower, hasUpper, mustSplit;
+
+	// The fences, all keys below the node are found in (lower, upper]
+	T lower, upper;
+
+	// Holds the shared bytes
+	T prefix;
+
+	// Page id of the rightmost child
+	uint64_t last;
 };
 
 
 
-// Class representing an inner node in a B+ Tree -------------------------------
-template<class T> class BTreeInnerNode : public BTreeNode<T>
+// An inner node of a B+ Tree on keys ordered by their bytes (BinaryOrder) ----
+// Keys are compressed in three ways: the bytes shared by all separators and
+// the node's fences are kept once, separators end after the first byte which
+// tells the adjacent leaves apart, and the remaining bytes of a separator are
+// implicitly filled up with 0xFF. Each separator is found in a slot next to
+// the child left of it, together with the first 4 of its remaining bytes as
+// an integer, which decides most comparisons. The rest of its bytes are kept
+// in a heap at the end of the node. The ith separator is not smaller than any
+// key below the ith child, and smaller than all keys below the next child.
+template<class T> struct BTreePrefixInnerNode : public BTreePrefixInnerHeader<T>
 {
-public:	
+	typedef BTreePrefixInnerHeader<T> Header;
+
+	// A separator and the child left of it. The first bytes of the separator
+	// after the prefix are kept as a big endian integer, the other bytes at
+	// offset in the node's data.
+	struct Slot
+	{
+		uint64_t child;
+		uint32_t head;
+		uint16_t offset;
+		uint16_t length;
+	};
+
+	// Number of bytes of a separator kept in its slot
+	static const uint64_t headLength = sizeof(uint32_t);
+
+	// Size of the space shared by slots and key heap
+	static const uint64_t dataSize = BM_CONS::pageSize - sizeof(Header);
+
+	// Slots grow from the front, the key heap from the back
+	unsigned char data[dataSize];
+
+	Slot* slots() { return reinterpret_cast<Slot*>(data); }
+
+	// Returns the bytes of the given key
+	static const unsigned char* bytes(const T& key)
+	{
+		return reinterpret_cast<const unsigned char*>(&key);
+	}
+
+	// Initializes an empty node with the given child, whose keys are found
+	// in (lower, upper], where nullptr stands for an open bound
+	void init(uint32_t level, const T* lower, const T* upper, uint64_t child)
+	{
+		build(level, lower, upper, std::vector<T>(),
+		      std::vector<uint64_t>(1, child), 0, 0);
+	}
+
+	// Returns the shortest key which is not smaller than left and smaller than
+	// right, filled up with 0xFF
+	static T separator(const T& left, const T& right)
+	{
+		T result = left;
+		unsigned char* out = reinterpret_cast<unsigned char*>(&result);
+		uint64_t length = common(left, right, sizeof(T));
+		if (length < sizeof(T))
+			std::fill(out + length + 1, out + sizeof(T), 0xFF);
+		return result;
+	}
+
+	// Whether another separator sharing the prefix fits into the node
+	bool hasRoom()
+	{
+		uint64_t used = (this->count + 1) * sizeof(Slot);
+		return !this->mustSplit &&
+		       used + restLength(sizeof(T), this->prefixLength) <=
+		       this->heapStart;
+	}
+
+	// Whether the given separator fits into the node. Separators which do
+	// not share the prefix may not, as all separators are compressed anew.
+	bool fits(const T& key)
+	{
+		uint64_t prefix = this->prefixLength;
+		uint64_t shared = common(key, this->prefix, prefix);
+		uint64_t used = (this->count + 1) * sizeof(Slot);
+		if (shared == prefix)
+			return used + restLength(length(key), prefix) <= this->heapStart;
+		used += restLength(length(key), shared);
+		for (uint64_t i = 0; i < this->count; i++)
+			used += restLength(prefix + headLength + slots()[i].length, shared);
+		return used <= dataSize;
+	}
+
+	// Makes sure that the node is split before another separator is inserted
+	void requestSplit() { this->mustSplit = 1; }
+
+	// Returns the fraction of the node's space which is used
+	double load()
+	{
+		uint64_t used = this->count * sizeof(Slot) + dataSize - this->heapStart;
+		return (double)used / dataSize;
+	}
+
+	// Returns the page id of the leftmost child
+	uint64_t firstChild()
+	{
+		return this->count == 0 ? this->last : slots()[0].child;
+	}
+
+	// Returns the number of children, and the page id of the ith one. The
+	// node may be read while it is modified (see OptimisticLatch).
+	uint64_t childCount()
+	{
+		uint64_t count = this->count;
+		return std::min<uint64_t>(count, dataSize / sizeof(Slot)) + 1;
+	}
+	uint64_t childAt(uint64_t i)
+	{
+		return i < this->count ? slots()[i].child : this->last;
+	}
+	void setChild(uint64_t i, uint64_t child)
+	{
+		if (i < this->count) slots()[i].child = child;
+		else this->last = child;
+	}
+
+	// Returns the position of the child the given key is found below. The
+	// node may be read while it is modified (see OptimisticLatch).
+	template<class CMP> uint64_t childIndex(const T& key, const CMP&)
+	{
+		uint64_t count = this->count;
+		if (count > dataSize / sizeof(Slot)) count = dataSize / sizeof(Slot);
+		return position(key, count);
+	}
+
+	// Returns the page id of the child the given key is found below
+	template<class CMP> uint64_t childFor(const T& key, const CMP& comp)
+	{
+		uint64_t count = this->count;
+		if (count > dataSize / sizeof(Slot)) count = dataSize / sizeof(Slot);
+		uint64_t pos = childIndex(key, comp);
+		return pos < count ? slots()[pos].child : this->last;
+	}
+
+	// Inserts the given separator, which must fit, and the page id of the
+	// child right of it. The child left of the separator has been split, so
+	// that its old separator now belongs to the new child.
+	template<class CMP> void insert(const T& key, uint64_t child, const CMP&)
+	{
+		// The prefix of a node without separators is only known once the
+		// first one is inserted
+		uint64_t count = this->count;
+		uint64_t pos = position(key, count);
+		if (count == 0 ||
+		    common(key, this->prefix, this->prefixLength) < this->prefixLength)
+		{
+			std::vector<T> keys;
+			std::vector<uint64_t> children;
+			expand(keys, children);
+			keys.insert(keys.begin() + pos, key);
+			children.insert(children.begin() + pos + 1, child);
+			T lower = this->lower, upper = this->upper;
+			build(this->level, this->hasLower ? &lower : nullptr,
+			      this->hasUpper ? &upper : nullptr, keys, children, 0,
+			      count + 1);
+			return;
+		}
+
+		Slot* slot = slots();
+		uint64_t left = pos < count ? slot[pos].child : this->last;
+		std::copy_backward(slot + pos, slot + count, slot + count + 1);
+		append(pos, key, left);
+		if (pos < count) slot[pos+1].child = child;
+		else this->last = child;
+		this->count++;
+	}
+
+	// Returns the separator which split moves up
+	T median() { return keyAt(this->count / 2); }
+
+	// Moves the separators right of the median to sibling, the median is
+	// held by neither. Both nodes are compressed anew, within their new
+	// fences.
+	void split(BTreePrefixInnerNode* sibling)
+	{
+		std::vector<T> keys;
+		std::vector<uint64_t> children;
+		expand(keys, children);
+		uint64_t count = this->count, med = count / 2;
+		T lower = this->lower, upper = this->upper;
+		sibling->build(this->level, &keys[med],
+		               this->hasUpper ? &upper : nullptr, keys, children,
+		               med + 1, count);
+		build(this->level, this->hasLower ? &lower : nullptr, &keys[med],
+		      keys, children, 0, med);
+	}
 
-	// Constructor
-	BTreeInnerNode() : BTreeNode<T>() 
-	{ 
-		this->isLeaf = false;
-		values.push_back(nullptr);
+	// Removes the ith separator and the child right of it, whose keys have
+	// moved to the child left of it. The node is compressed anew.
+	void remove(uint64_t i)
+	{
+		std::vector<T> keys;
+		std::vector<uint64_t> children;
+		expand(keys, children);
+		keys.erase(keys.begin() + i);
+		children.erase(children.begin() + i + 1);
+		T lower = this->lower, upper = this->upper;
+		build(this->level, this->hasLower ? &lower : nullptr,
+		      this->hasUpper ? &upper : nullptr, keys, children, 0,
+		      keys.size());
+	}
+
+	// Whether the given separator of this node and right, the next node on
+	// its level, and the separators of right fit into this node, filled up
+	// to the given fraction, once they are compressed together
+	bool canMerge(const T& key, BTreePrefixInnerNode* right, double fill)
+	{
+		std::vector<T> keys;
+		std::vector<uint64_t> children;
+		expand(keys, children);
+		keys.push_back(key);
+		right->expand(keys, children);
+		T lower = this->lower, upper = right->upper;
+		uint64_t prefix = shared(this->hasLower ? &lower : nullptr,
+		                         right->hasUpper ? &upper : nullptr, keys);
+		uint64_t used = keys.size() * sizeof(Slot);
+		for (const T& k : keys)
+			used += restLength(std::max<uint64_t>(length(k), prefix), prefix);
+		return used <= fill * dataSize;
+	}
+
+	// Appends the given separator of this node and right, and the
+	// separators of right, which this node replaces. The node is compressed
+	// anew.
+	void merge(const T& key, BTreePrefixInnerNode* right)
+	{
+		std::vector<T> keys;
+		std::vector<uint64_t> children;
+		expand(keys, children);
+		keys.push_back(key);
+		right->expand(keys, children);
+		T lower = this->lower, upper = right->upper;
+		build(this->level, this->hasLower ? &lower : nullptr,
+		      right->hasUpper ? &upper : nullptr, keys, children, 0,
+		      keys.size());
+	}
+
+	// Returns the ith separator, expanded to a full key. The node may be
+	// read while it is modified (see OptimisticLatch), bytes of an
+	// inconsistent node are not read beyond it.
+	T keyAt(uint64_t i)
+	{
+		T key;
+		unsigned char* out = reinterpret_cast<unsigned char*>(&key);
+		Slot& slot = slots()[i];
+		uint64_t prefix = std::min<uint64_t>(this->prefixLength, sizeof(T));
+		std::copy(bytes(this->prefix), bytes(this->prefix) + prefix, out);
+		for (uint64_t k = 0; k < headLength && prefix + k < sizeof(T); k++)
+			out[prefix + k] = slot.head >> (8 * (headLength - 1 - k));
+		uint64_t restStart = std::min<uint64_t>(prefix + headLength, sizeof(T));
+		uint64_t size = dataSize;
+		uint64_t offset = std::min<uint64_t>(slot.offset, size);
+		uint64_t length = std::min<uint64_t>(std::min<uint64_t>(slot.length,
+			sizeof(T) - restStart), size - offset);
+		std::copy(data + offset, data + offset + length, out + restStart);
+		std::fill(out + restStart + length, out + sizeof(T), 0xFF);
+		return key;
 	}
 
 private:
 
-	// Values (pointers to other nodes) held by this node
-	std::vector<BTreeNode<T>*> values;
+	// Returns the number of leading bytes, up to max, shared by two keys
+	static uint64_t common(const T& key1, const T& key2, uint64_t max)
+	{
+		uint64_t length = 0;
+		while (length < max && bytes(key1)[length] == bytes(key2)[length])
+			length++;
+		return length;
+	}
+
+	// Returns the length of the given key without trailing 0xFF bytes
+	static uint64_t length(const T& key)
+	{
+		uint64_t length = sizeof(T);
+		while (length > 0 && bytes(key)[length-1] == 0xFF) length--;
+		return length;
+	}
+
+	// Returns the number of bytes of a separator of the given length, which
+	// are neither found in the given prefix nor fit into its slot
+	static uint64_t restLength(uint64_t length, uint64_t prefix)
+	{
+		return length > prefix + headLength ? length - prefix - headLength : 0;
+	}
+
+	// Returns the bytes of the given key after the prefix, which fit into a
+	// slot, as an integer. The key ends after length bytes, and is filled up
+	// with 0xFF. Bytes beyond the end of a full key count as 0.
+	uint32_t head(const unsigned char* key, uint64_t length)
+	{
+		uint32_t result = 0;
+		for (uint64_t k = 0; k < headLength; k++)
+		{
+			uint64_t i = this->prefixLength + k;
+			result = result << 8 | (i < length ? key[i] :
+			                        i < sizeof(T) ? 0xFF : 0);
+		}
+		return result;
+	}
+
+	// Compares the given key, which shares the prefix, with the ith
+	// separator: -1 iff the key is smaller, 0 iff it is equal, 1 iff it is
+	// larger
+	int compare(const T& key, uint32_t keyHead, uint64_t i)
+	{
+		Slot& slot = slots()[i];
+		if (keyHead != slot.head) return keyHead < slot.head ? -1 : 1;
+
+		// Compare the remaining bytes, of which the separator lacks the last
+		// ones (0xFF). Bytes of an inconsistent node are not read beyond it.
+		uint64_t restStart = std::min<uint64_t>(this->prefixLength + headLength,
+		                                        sizeof(T));
+		const unsigned char* rest = bytes(key) + restStart;
+		uint64_t restLength = sizeof(T) - restStart;
+		uint64_t size = dataSize;
+		uint64_t offset = std::min<uint64_t>(slot.offset, size);
+		uint64_t length = std::min<uint64_t>(
+			std::min<uint64_t>(slot.length, restLength), size - offset);
+		int c = memcmp(rest, data + offset, length);
+		if (c != 0) return c < 0 ? -1 : 1;
+		for (uint64_t k = length; k < restLength; k++)
+			if (rest[k] != 0xFF) return -1;
+		return 0;
+	}
+
+	// Returns the position of the first of count separators which is not
+	// smaller than the given key
+	uint64_t position(const T& key, uint64_t count)
+	{
+		// Keys not sharing the prefix are smaller or larger than all
+		// separators
+		uint64_t prefix = std::min<uint64_t>(this->prefixLength, sizeof(T));
+		int c = memcmp(bytes(key), bytes(this->prefix), prefix);
+		if (c != 0) return c < 0 ? 0 : count;
+
+		uint32_t keyHead = head(bytes(key), sizeof(T));
+		uint64_t low = 0, high = count;
+		while (low < high)
+		{
+			uint64_t mid = (low + high) / 2;
+			if (compare(key, keyHead, mid) > 0) low = mid + 1;
+			else high = mid;
+		}
+		return low;
+	}
+
+	// Writes the given separator, which shares the prefix, and the child left
+	// of it into the ith slot
+	void append(uint64_t i, const T& key, uint64_t child)
+	{
+		// Trailing 0xFF bytes are implicit
+		const unsigned char* in = bytes(key);
+		uint64_t end = std::max<uint64_t>(length(key), this->prefixLength);
+		uint64_t rest = restLength(end, this->prefixLength);
+		this->heapStart -= rest;
+		std::copy(in + end - rest, in + end, data + this->heapStart);
+		Slot& slot = slots()[i];
+		slot.child = child;
+		slot.head = head(in, end);
+		slot.offset = this->heapStart;
+		slot.length = rest;
+	}
+
+	// Appends all separators and children to the given vectors
+	void expand(std::vector<T>& keys, std::vector<uint64_t>& children)
+	{
+		for (uint64_t i = 0; i < this->count; i++)
+		{
+			keys.push_back(keyAt(i));
+			children.push_back(slots()[i].child);
+		}
+		children.push_back(this->last);
+	}
+
+	// Initializes the node with the given fences, the separators [from, to)
+	// of keys, and the children right of from - 1
+	void build(uint32_t level, const T* lower, const T* upper,
+		const std::vector<T>& keys, const std::vector<uint64_t>& children,
+		uint64_t from, uint64_t to)
+	{
+		this->level = level;
+		this->count = to - from;
+		this->heapStart = dataSize;
+		this->mustSplit = 0;
+		this->hasLower = lower != nullptr;
+		this->hasUpper = upper != nullptr;
+		if (lower != nullptr) this->lower = *lower;
+		if (upper != nullptr) this->upper = *upper;
+		this->last = children[to];
+
+		// The prefix is shared by the fences and all separators
+		std::vector<T> separators(keys.begin() + from, keys.begin() + to);
+		this->prefixLength = shared(lower, upper, separators);
+		if (lower != nullptr) this->prefix = *lower;
+		else if (upper != nullptr) this->prefix = *upper;
+		else if (from < to) this->prefix = keys[from];
+		for (uint64_t i = from; i < to; i++)
+			append(i - from, keys[i], children[i]);
+	}
+
+	// Returns the number of leading bytes shared by the given fences, where
+	// nullptr stands for an open bound, and separators
+	static uint64_t shared(const T* lower, const T* upper,
+	                       const std::vector<T>& keys)
+	{
+		std::vector<const T*> all;
+		if (lower != nullptr) all.push_back(lower);
+		if (upper != nullptr) all.push_back(upper);
+		for (const T& key : keys) all.push_back(&key);
+		uint64_t prefix = all.empty() ? 0 : sizeof(T);
+		for (const T* key : all) prefix = common(*all[0], *key, prefix);
+		return prefix;
+	}
 };
 
-#endif  // BTREENODE_H
\ No newline at end of file
+#endif  // BTREENODE_H
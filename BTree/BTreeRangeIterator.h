@@ -1,4 +1,3 @@
-
 ///////////////////////////////////////////////////////////////////////////////
 // BTreeRangeIterator.h
 //////////////////////////////////////////////////////////////////////////////
@@ -8,77 +7,357 @@
 #define BTREERANGEITERATOR_H
 
 #include "BTree.h"
+#include "BTreeNode.h"
+#include <algorithm>
 #include <gtest/gtest.h>
+#include <type_traits>
+#include <vector>
 
 
 // Exception thrown when searching for key that is not found
 class StartKeyOutOfBounds: public std::exception
 {
-  virtual const char* what() const throw() 
+  virtual const char* what() const throw()
   	{ return "Start key is larger than largest element in tree"; }
 };
 
 // Exception thrown when searching for key that is not found
 class InvalidRange: public std::exception
 {
-  virtual const char* what() const throw() 
+  virtual const char* what() const throw()
   	{ return "Given lookup range is invalid"; }
 };
 
 
 // Forward declaration of the BTree
-template<class T, class CMP> class BTree;
+template<class T, class CMP, bool unique> class BTree;
 
-// An iterator that iterates over a given key range on a given BTree.
-template<class T, class CMP> class BTreeRangeIterator
+// An iterator that iterates over a given key range on a given BTree, in
+// ascending key order, or in descending order iff it is reversed. The
+// iterator reads leaves optimistically, and continues after the last key it
+// has read whenever the current leaf has changed in between. It is therefore
+// not isolated from concurrent modifications of the tree, but never returns
+// a key twice. All TIDs of a key are read at once, and returned in ascending
+// order. The leaves ahead of the current one are prefetched through the
+// buffer manager, a window at a time, as found in their parent.
+template<class T, class CMP, bool unique> class BTreeRangeIterator
 {
 public:
 
 	// Constructor, gets the key bounds of the range to be searched as well
 	// as a pointer to the btree.
-	// Search semantics: 
+	// Search semantics:
 	// 		keyStart = nullptr, keyEnd != nullptr : (-inf, keyEnd]
 	//      keyStart != nullptr, keyEnd = nullptr : [keyStart, inf)
 	//      keyStart != nullptr, keyEnd != nullptr : [keyStart, keyEnd]
 	//		keyStart == nullptr, keyEnd == nullptr: not defined
-	// TODO: one side unbounded
-	BTreeRangeIterator(BTree<T, CMP>* btree, T* keyStart, T* keyEnd); 
+	// Throws StartKeyOutOfBounds iff no key in the tree is as large as
+	// keyStart, or, iff reverse, as small as keyEnd.
+	BTreeRangeIterator(BTree<T, CMP, unique>* btree, T* keyStart, T* keyEnd,
+	                   bool reverse = false);
 
 	~BTreeRangeIterator() { }
 
-	// Returns the next TID in the range specified by [keyStart, keyEnd]
+	// Returns the next TID in the range specified by [keyStart, keyEnd].
+	// Once the range is exhausted, the last TID is returned again.
 	TID next();
 
+	// Replaces the contents of tids by the next TIDs in the range, at most
+	// max of them, and those of keys, iff given, by their keys. Returns the
+	// number of TIDs, which is 0 iff the range is exhausted.
+	uint64_t nextBatch(std::vector<TID>& tids, uint64_t max,
+	                   std::vector<T>* keys = nullptr);
+
 private:
 
+	typedef typename std::conditional<unique,
+		BTreeLeafNode<T>, BTreePostingLeafNode<T>>::type Leaf;
+
+	// Number of TIDs read ahead by next()
+	static const uint64_t batchSize = 64;
+
+	// Number of leaves prefetched ahead of the current one
+	static const uint64_t readAhead = 32;
+
 	// Comparison equivalent to comp;
-	bool cmp(T key1, T key2);
+	bool cmp(const T& key1, const T& key2);
+
+	// Finds the leaf and position of the next entry by descending the tree
+	// to the given key, which is included in the range iff inclusive. Starts
+	// after the last key read, or at the start of the range, iff key ==
+	// nullptr.
+	void reposition(const T* key = nullptr, bool inclusive = false);
+
+	// Buffers the entries following the last one read, until at least max
+	// TIDs are buffered, or the range is exhausted
+	void fill(uint64_t max);
+
+	// Prefetches the leaves ahead of the current one, unless enough of them
+	// have been prefetched already
+	void prefetch();
 
 	// The tree containing the keys
-	BTree<T, CMP>* btree;
+	BTree<T, CMP, unique>* btree;
+
+	// Page id of the leaf holding the next entry, 0 iff the range is
+	// exhausted, and the position of the next entry on that leaf, counted
+	// from the end of the range, i.e. plus one iff reverse
+	uint64_t currentLeaf;
+	uint64_t index;
+
+	// The version of the current leaf the position is valid for
+	uint64_t leafVersion;
 
-	// The next leaf to be examined by the iterator
-	BTreeLeafNode<T>* currentLeaf, lastSafeLeaf;
+	// Iff reverse, the separator left of the current leaf, valid iff bounded
+	T fence;
+	bool bounded;
+
+	// The TIDs read but not returned yet, their keys, and the position of
+	// the next one to be returned
+	std::vector<TID> postings;
+	std::vector<T> postingKeys;
+	uint64_t postingIndex;
+
+	// The leaves prefetched, in scan order
+	std::vector<uint64_t> upcoming;
+
+	// The last key read, valid iff started == true
+	T lastKey;
+	bool started;
+
+	// Whether a key beyond the range has been read
+	bool pastEnd;
 
 	// Exception instances
 	StartKeyOutOfBounds keyOutOfBounds;
 	InvalidRange invalidRange;
 
-	// The specified range
+	// The specified range, and the scan direction
 	T keyStart, keyEnd;
+	bool reverse;
 
-	// last TID compared
+	// last TID returned
 	TID currentTID;
 
 	// Comparison predicate
 	CMP comp;
 
-	// The under in the currentLeaf current which the next TID to be returned 
-	// by the iterator is found.
-	int index;
-
 	// Tell wether search interval is unbounded
 	bool leftBound, rightBound;
 };
 
-#endif  // BTREERANGEITERATOR_H
\ No newline at end of file
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+bool BTreeRangeIterator<T, CMP, unique>::cmp(const T& key1, const T& key2)
+{
+	return comp(key1, key2);
+}
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+BTreeRangeIterator<T, CMP, unique>::BTreeRangeIterator(
+	BTree<T, CMP, unique>* btree, T* keyStart, T* keyEnd, bool reverse)
+{
+	// Set keyStart, keyEnd, switch if necessary
+	if (keyStart == nullptr && keyEnd == nullptr) throw invalidRange;
+	this->btree = btree;
+	this->reverse = reverse;
+	leftBound = keyStart != nullptr;
+	rightBound = keyEnd != nullptr;
+	if (leftBound) this->keyStart = *keyStart;
+	if (rightBound) this->keyEnd = *keyEnd;
+	if (leftBound && rightBound && cmp(this->keyEnd, this->keyStart))
+		std::swap(this->keyStart, this->keyEnd);
+	currentTID.intRepresentation = 0;
+	started = false;
+	pastEnd = false;
+	postingIndex = 0;
+
+	// If no key is read before the last leaf is left, then the start key is
+	// beyond all elements in the btree
+	reposition();
+	fill(1);
+	if (postings.empty() && !pastEnd) throw keyOutOfBounds;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTreeRangeIterator<T, CMP, unique>::reposition(const T* key,
+                                                    bool inclusive)
+{
+	// Travel to the first leaf that could possibly contain the next entry, and
+	// get the first key after the last one read (or the first key which is
+	// within the range)
+	if (key == nullptr && started) key = &lastKey;
+	else if (key == nullptr)
+	{
+		key = reverse ? (rightBound ? &keyEnd : nullptr) :
+		                (leftBound ? &keyStart : nullptr);
+		inclusive = true;
+	}
+	typename BTree<T, CMP, unique>::Guard guard(btree);
+	while (true)
+	{
+		bool restart = false;
+		BufferFrame* frame = reverse ?
+			btree->descendLast(key, leafVersion, restart, fence, bounded) :
+			btree->descend(key, leafVersion, restart);
+		if (restart) continue;
+		auto leaf = reinterpret_cast<Leaf*>(frame->getData());
+		uint64_t count = leaf->keyCount();
+		index = key == nullptr ? (reverse ? count : 0) :
+		                         leaf->position(*key, comp);
+		if (key != nullptr && index < count &&
+		    !cmp(*key, leaf->keyAt(index)) && inclusive == reverse)
+			index++;
+
+		// Keys left of the fence may have moved to the leaf in between
+		if (reverse && started)
+			index = std::min(index, leaf->position(lastKey, comp));
+		leaf->latch.validate(leafVersion, restart);
+		currentLeaf = frame->pageId;
+		btree->bm->unfixPage(*frame, false);
+		if (!restart) return;
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTreeRangeIterator<T, CMP, unique>::fill(uint64_t max)
+{
+	// Read the current leaf in scan direction, and keep what has been read
+	// only once the leaf is validated. Start over from the last key read
+	// whenever the current leaf changes. The leaf may have been removed from
+	// the tree and reused since the last call, so it is only read iff it has
+	// not changed.
+	typename BTree<T, CMP, unique>::Guard guard(btree);
+	postings.clear();
+	postingKeys.clear();
+	postingIndex = 0;
+	while (currentLeaf != 0 && postings.size() < max)
+	{
+		prefetch();
+		bool restart = false;
+		BufferFrame& frame = btree->bm->fixPage(currentLeaf, false);
+		auto leaf = reinterpret_cast<Leaf*>(frame.getData());
+		if (leaf->latch.version != leafVersion)
+		{
+			btree->bm->unfixPage(frame, false);
+			reposition();
+			continue;
+		}
+		uint64_t read = postings.size(), count = leaf->keyCount();
+		uint64_t position = std::min(index, count);
+		bool end = false;
+		T key;
+		while (postings.size() < max && (reverse ? position > 0 :
+		                                           position < count))
+		{
+			uint64_t size = postings.size();
+			btree->leafRead(leaf, reverse ? position - 1 : position, key,
+			                postings, leafVersion);
+			end = reverse ? leftBound && cmp(key, keyStart) :
+			                rightBound && cmp(keyEnd, key);
+			if (end) { postings.resize(size); break; }
+			postingKeys.resize(postings.size(), key);
+			position = reverse ? position - 1 : position + 1;
+		}
+		bool left = !end && position == (reverse ? 0 : count);
+		uint64_t next = leaf->next;
+		leaf->latch.validate(leafVersion, restart);
+		uint64_t nextVersion = 0;
+		if (left && !reverse && !restart && next != 0)
+		{
+			// Latch the sibling before the current leaf is validated again,
+			// so that it cannot have been split in between
+			BufferFrame& nextFrame = btree->bm->fixPage(next, false);
+			auto nextLeaf = reinterpret_cast<Leaf*>(nextFrame.getData());
+			nextVersion = nextLeaf->latch.readLock(restart);
+			leaf->latch.validate(leafVersion, restart);
+			btree->bm->unfixPage(nextFrame, false);
+		}
+		btree->bm->unfixPage(frame, false);
+
+		if (restart)
+		{
+			postings.resize(read);
+			postingKeys.resize(read);
+			reposition();
+			continue;
+		}
+		if (postings.size() > read)
+		{
+			lastKey = postingKeys.back();
+			started = true;
+		}
+		index = position;
+		if (end) { currentLeaf = 0; pastEnd = true; }
+		else if (left && !reverse)
+		{
+			currentLeaf = next;
+			leafVersion = nextVersion;
+			index = 0;
+		}
+		else if (left && !bounded) currentLeaf = 0;
+		else if (left) { T key = fence; reposition(&key, true); }
+	}
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+void BTreeRangeIterator<T, CMP, unique>::prefetch()
+{
+	// The window is moved on once half of it has been passed, unless it ends
+	// with the parent of its leaves
+	auto it = std::find(upcoming.begin(), upcoming.end(), currentLeaf);
+	if (it != upcoming.end() && (upcoming.size() < readAhead ||
+	    (uint64_t)(upcoming.end() - it) > readAhead / 2))
+		return;
+	const T* key = started ? &lastKey : reverse ?
+		(rightBound ? &keyEnd : nullptr) : (leftBound ? &keyStart : nullptr);
+	btree->prefetchLeaves(key, reverse, readAhead, upcoming);
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+TID BTreeRangeIterator<T, CMP, unique>::next()
+{
+	// Return the TIDs read ahead first. If the next key is "larger" than
+	// the keyEnd, the range is exhausted.
+	if (postingIndex == postings.size()) fill(batchSize);
+	if (postingIndex == postings.size()) return currentTID;
+	currentTID = postings[postingIndex++];
+	return currentTID;
+}
+
+
+// _____________________________________________________________________________
+template<class T, class CMP, bool unique>
+uint64_t BTreeRangeIterator<T, CMP, unique>::nextBatch(
+	std::vector<TID>& tids, uint64_t max, std::vector<T>* keys)
+{
+	tids.clear();
+	if (keys != nullptr) keys->clear();
+	while (tids.size() < max)
+	{
+		if (postingIndex == postings.size()) fill(max - tids.size());
+		if (postingIndex == postings.size()) break;
+		uint64_t count = std::min<uint64_t>(max - tids.size(),
+		                                    postings.size() - postingIndex);
+		tids.insert(tids.end(), postings.begin() + postingIndex,
+		            postings.begin() + postingIndex + count);
+		if (keys != nullptr)
+			keys->insert(keys->end(), postingKeys.begin() + postingIndex,
+			             postingKeys.begin() + postingIndex + count);
+		postingIndex += count;
+	}
+	if (!tids.empty()) currentTID = tids.back();
+	return tids.size();
+}
+
+#endif  // BTREERANGEITERATOR_H
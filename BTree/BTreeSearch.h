@@ -0,0 +1,159 @@
+///////////////////////////////////////////////////////////////////////////////
+// BTreeSearch.h
+//////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BTREESEARCH_H
+#define BTREESEARCH_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <type_traits>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+
+// Declares whether CMP orders keys of type T by their natural order, i.e. by
+// value for unsigned integers and lexicographically for pairs of them. Only
+// then the keys of a node are searched with SIMD instructions. Specialize it
+// for custom comparators (see BTreeMain.cpp).
+template<class T, class CMP> struct NaturalOrder : std::false_type { };
+template<class T> struct NaturalOrder<T, std::less<T>> : std::true_type { };
+
+// Declares whether CMP orders keys of type T like memcmp on their bytes. Only
+// then the keys of inner nodes are compressed (see BTreePrefixInnerNode).
+// Specialize it for custom comparators (see BTreeMain.cpp).
+template<class T, class CMP> struct BinaryOrder : std::false_type { };
+
+
+// Searches the sorted keys of a node for the position of the first key which
+// is not less than the given key. The generic version uses binary search.
+template<class T, class CMP, bool natural = NaturalOrder<T, CMP>::value>
+struct BTreeSearch
+{
+	static uint64_t lowerBound(const T* keys, uint64_t count, const T& key,
+	                           const CMP& comp)
+	{
+		return std::lower_bound(keys, keys + count, key, comp) - keys;
+	}
+};
+
+
+// Search on 64 bit values, compared as unsigned integers after the 32 bit
+// halves of each value have been swapped iff swapHalves == true. Narrows the
+// keys down to a window without branching, then counts the keys less than
+// the given key in the window.
+namespace BTreeSIMD
+{
+	// Number of keys counted at once at the end of the search
+	static const uint64_t window = 16;
+
+	// A key read as a 64 bit value, which may alias the key type
+	typedef uint64_t __attribute__((__may_alias__)) Word;
+
+	// Whether the CPU supports AVX2, checked once
+	inline bool hasAVX2()
+	{
+#ifdef __x86_64__
+		static const bool avx2 = __builtin_cpu_supports("avx2");
+		return avx2;
+#else
+		return false;
+#endif
+	}
+
+	// The value a key is compared by
+	template<bool swapHalves> inline uint64_t ordered(uint64_t value)
+	{
+		return swapHalves ? (value << 32) | (value >> 32) : value;
+	}
+
+	// Counts the keys less than key among the given keys (count <= window)
+	template<bool swapHalves> inline uint64_t countScalar(const Word* keys,
+		uint64_t count, uint64_t key)
+	{
+		uint64_t less = 0;
+		for (uint64_t i = 0; i < count; i++)
+			less += ordered<swapHalves>(keys[i]) < key;
+		return less;
+	}
+
+#ifdef __x86_64__
+	// Same as countScalar, four keys at a time. AVX2 only compares signed
+	// integers, so the sign bits are flipped beforehand.
+	template<bool swapHalves> __attribute__((target("avx2")))
+	inline uint64_t countAVX2(const Word* keys, uint64_t count,
+		uint64_t key)
+	{
+		const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+		const __m256i needle = _mm256_set1_epi64x(key ^ INT64_MIN);
+		uint64_t less = 0, i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			__m256i v = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i*>(keys + i));
+			if (swapHalves) v = _mm256_shuffle_epi32(v, 0xB1);
+			__m256i gt = _mm256_cmpgt_epi64(needle, _mm256_xor_si256(v, sign));
+			less += __builtin_popcount(
+				_mm256_movemask_pd(_mm256_castsi256_pd(gt)));
+		}
+		return less + countScalar<swapHalves>(keys + i, count - i, key);
+	}
+#endif
+
+	// Returns the position of the first key not less than key
+	template<bool swapHalves> inline uint64_t lowerBound(const Word* keys,
+		uint64_t count, uint64_t key)
+	{
+		// The position is found in [base, base + count] after each step
+		key = ordered<swapHalves>(key);
+		const Word* base = keys;
+		while (count > window)
+		{
+			uint64_t half = count / 2;
+			base = ordered<swapHalves>(base[half - 1]) < key ? base + half : base;
+			count -= half;
+		}
+		uint64_t offset = base - keys;
+#ifdef __x86_64__
+		if (hasAVX2()) return offset + countAVX2<swapHalves>(base, count, key);
+#endif
+		return offset + countScalar<swapHalves>(base, count, key);
+	}
+}
+
+
+// Search on unsigned 64 bit keys
+template<class CMP> struct BTreeSearch<uint64_t, CMP, true>
+{
+	static uint64_t lowerBound(const uint64_t* keys, uint64_t count,
+	                           const uint64_t& key, const CMP&)
+	{
+		return BTreeSIMD::lowerBound<false>(keys, count, key);
+	}
+};
+
+
+// Search on pairs of unsigned 32 bit keys. A pair is laid out like a 64 bit
+// value holding the first key in its lower half, so the halves are swapped to
+// compare lexicographically.
+template<class CMP> struct BTreeSearch<std::pair<uint32_t, uint32_t>, CMP,
+	true>
+{
+	typedef std::pair<uint32_t, uint32_t> IntPair;
+	static_assert(sizeof(IntPair) == sizeof(uint64_t),
+	              "pairs of 32 bit keys must be packed");
+
+	static uint64_t lowerBound(const IntPair* keys, uint64_t count,
+	                           const IntPair& key, const CMP&)
+	{
+		uint64_t value = (uint64_t)key.second << 32 | key.first;
+		return BTreeSIMD::lowerBound<true>(
+			reinterpret_cast<const BTreeSIMD::Word*>(keys), count, value);
+	}
+};
+
+#endif  // BTREESEARCH_H
@@ -1,41 +1,690 @@
-
 ///////////////////////////////////////////////////////////////////////////////
 // BTreeTest.cpp
 ///////////////////////////////////////////////////////////////////////////////
 
 
 #include "BTree.h"
+#include <algorithm>
+#include <random>
+#include <thread>
 
 using namespace std;
 
+// Comparator functor for uint64_t
+struct UInt64Cmp
+{
+	bool operator()(uint64_t a, uint64_t b) const { return a < b; }
+};
+template<> struct NaturalOrder<uint64_t, UInt64Cmp> : std::true_type { };
+
+// A key of 20 characters, and comparators for it. Both compare like memcmp,
+// but only the first is declared to, so that inner nodes are compressed.
+struct Key20 { char data[20]; };
+struct Key20Cmp
+{
+	bool operator()(const Key20& a, const Key20& b) const
+	{
+		return memcmp(a.data, b.data, 20) < 0;
+	}
+};
+struct PlainKey20Cmp : public Key20Cmp { };
+template<> struct BinaryOrder<Key20, Key20Cmp> : std::true_type { };
+
+// Returns the given number as a key, padded with leading zeros
+Key20 toKey20(uint64_t value)
+{
+	Key20 key;
+	char digits[22];
+	snprintf(digits, sizeof(digits), "%019lux", value);
+	memcpy(key.data, digits, sizeof(key.data));
+	return key;
+}
+
+// Returns a TID holding the given value
+TID toTID(uint64_t value)
+{
+	TID tid;
+	tid.intRepresentation = value;
+	return tid;
+}
+
+// Returns the keys [0, n) in random order
+vector<uint64_t> shuffledKeys(uint64_t n)
+{
+	vector<uint64_t> keys;
+	for (uint64_t i = 0; i < n; i++) keys.push_back(i);
+	shuffle(keys.begin(), keys.end(), mt19937(42));
+	return keys;
+}
+
 // _____________________________________________________________________________
 TEST(BTreeTest, constructor)
 {
+	SegmentManager* sm = new SegmentManager("database");
+	BTree<uint64_t, UInt64Cmp>* tree = new BTree<uint64_t, UInt64Cmp>(sm);
+	ASSERT_EQ(tree->size(), 0);
+	ASSERT_NE(sm->retrieveSegmentById(tree->getSegmentId()), nullptr);
+	ASSERT_THROW(tree->lookup(1), KeyNotFoundException);
+	ASSERT_FALSE(tree->erase(1));
 
+	// Cleanup
+	delete tree;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
 }
 
 // _____________________________________________________________________________
 TEST(BTreeTest, insert)
 {
+	// Enough keys for a tree with two levels of inner nodes
+	SegmentManager* sm = new SegmentManager("database");
+	BTree<uint64_t, UInt64Cmp>* tree = new BTree<uint64_t, UInt64Cmp>(sm);
+	vector<uint64_t> keys = shuffledKeys(100000);
+	for (uint64_t key : keys) tree->insert(key, toTID(key*key));
+	ASSERT_EQ(tree->size(), keys.size());
+	for (uint64_t key : keys)
+		ASSERT_EQ(tree->lookup(key).intRepresentation, key*key);
+	ASSERT_THROW(tree->lookup(keys.size()), KeyNotFoundException);
 
+	// Cleanup
+	delete tree;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
 }
 
 // _____________________________________________________________________________
 TEST(BTreeTest, erase)
 {
+	SegmentManager* sm = new SegmentManager("database");
+	BTree<uint64_t, UInt64Cmp>* tree = new BTree<uint64_t, UInt64Cmp>(sm);
+	vector<uint64_t> keys = shuffledKeys(20000);
+	for (uint64_t key : keys) tree->insert(key, toTID(key));
+	for (uint64_t key : keys)
+	{
+		if (key % 7 != 0) continue;
+		ASSERT_TRUE(tree->erase(key));
+	}
+	ASSERT_FALSE(tree->erase(7));
+	for (uint64_t key : keys)
+	{
+		if (key % 7 == 0) ASSERT_THROW(tree->lookup(key), KeyNotFoundException);
+		else ASSERT_EQ(tree->lookup(key).intRepresentation, key);
+	}
+
+	// Delete everything
+	for (uint64_t key : keys) tree->erase(key);
+	ASSERT_EQ(tree->size(), 0);
 
+	// Cleanup
+	delete tree;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
 }
 
 // _____________________________________________________________________________
 TEST(BTreeTest, lookup)
 {
+	// Keys are unique, inserting a key again replaces its TID. The tree
+	// survives the database being closed.
+	SegmentManager* sm = new SegmentManager("database");
+	BTree<uint64_t, UInt64Cmp>* tree = new BTree<uint64_t, UInt64Cmp>(sm);
+	vector<uint64_t> keys = shuffledKeys(50000);
+	for (uint64_t key : keys) tree->insert(key, toTID(key));
+	for (uint64_t key : keys) if (key % 2 == 0) tree->insert(key, toTID(0));
+	ASSERT_EQ(tree->size(), keys.size());
+	uint64_t segId = tree->getSegmentId();
+	delete tree;
+	delete sm;
 
+	sm = new SegmentManager("database");
+	tree = new BTree<uint64_t, UInt64Cmp>(sm, segId);
+	ASSERT_EQ(tree->size(), keys.size());
+	for (uint64_t key : keys)
+		ASSERT_EQ(tree->lookup(key).intRepresentation, key % 2 ? key : 0);
+	tree->insert(keys.size(), toTID(1));
+	ASSERT_EQ(tree->lookup(keys.size()).intRepresentation, 1);
+
+	// Cleanup
+	delete tree;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
 }
 
 // _____________________________________________________________________________
 TEST(BTreeTest, lookupRange)
 {
+	SegmentManager* sm = new SegmentManager("database");
+	BTree<uint64_t, UInt64Cmp>* tree = new BTree<uint64_t, UInt64Cmp>(sm);
+	vector<uint64_t> keys = shuffledKeys(20000);
+	for (uint64_t key : keys) tree->insert(2*key, toTID(2*key));
+
+	// Bounds need not be keys in the tree, and may be given in any order
+	auto it = tree->lookupRange(9001, 101);
+	for (uint64_t key = 102; key <= 9000; key += 2)
+		ASSERT_EQ(it->next().intRepresentation, key);
+	ASSERT_EQ(it->next().intRepresentation, 9000);
+	it = tree->lookupRange(39990, 50000);
+	ASSERT_EQ(it->next().intRepresentation, 39990);
+	ASSERT_EQ(it->next().intRepresentation, 39992);
+	ASSERT_EQ(it->next().intRepresentation, 39994);
+	ASSERT_EQ(it->next().intRepresentation, 39996);
+	ASSERT_EQ(it->next().intRepresentation, 39998);
+	ASSERT_EQ(it->next().intRepresentation, 39998);
+	ASSERT_THROW(tree->lookupRange(40000, 50000), StartKeyOutOfBounds);
+
+	// Cleanup
+	delete tree;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(BTreeTest, rangeBatches)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	BTree<uint64_t, UInt64Cmp>* tree = new BTree<uint64_t, UInt64Cmp>(sm);
+	for (uint64_t key : shuffledKeys(100000))
+		tree->insert(2*key + 2, toTID(key));
+
+	// Batches hold the TIDs and keys in order, until the range is exhausted
+	vector<TID> tids;
+	vector<uint64_t> keys;
+	auto it = tree->lookupRange(101, 150001);
+	uint64_t expected = 102;
+	while (it->nextBatch(tids, 1000, &keys) > 0)
+	{
+		ASSERT_EQ(keys.size(), tids.size());
+		ASSERT_LE(tids.size(), 1000);
+		for (uint64_t i = 0; i < tids.size(); i++, expected += 2)
+		{
+			ASSERT_EQ(keys[i], expected);
+			ASSERT_EQ(tids[i].intRepresentation, expected / 2 - 1);
+		}
+	}
+	ASSERT_EQ(expected, 150002);
+	ASSERT_EQ(it->nextBatch(tids, 1000), 0);
+	ASSERT_TRUE(tids.empty());
+
+	// Reverse scans start at the end of the range, also after merges
+	for (uint64_t key = 2; key <= 200000; key += 6) tree->erase(key);
+	it = tree->lookupRange(0, 200000, true);
+	expected = 200000;
+	while (it->nextBatch(tids, 777, &keys) > 0)
+		for (uint64_t key : keys)
+		{
+			if (expected % 6 == 2) expected -= 2;
+			ASSERT_EQ(key, expected);
+			expected -= 2;
+		}
+	ASSERT_EQ(expected, 2);
+	it = tree->lookupRange(9001, 101, true);
+	for (uint64_t key = 9000; key >= 102; key -= 2)
+	{
+		if (key % 6 == 2) continue;
+		ASSERT_EQ(it->next().intRepresentation, key / 2 - 1);
+	}
+	ASSERT_EQ(it->next().intRepresentation, 50);
+	ASSERT_THROW(tree->lookupRange(0, 1, true), StartKeyOutOfBounds);
+
+	// The TIDs of a key are split among batches, but stay in order
+	auto duplicates = new BTree<uint64_t, UInt64Cmp, false>(sm);
+	for (uint64_t i : shuffledKeys(20000)) duplicates->insert(i / 10, toTID(i));
+	auto reverse = duplicates->lookupRange(100, 200, true);
+	vector<uint64_t> values;
+	while (reverse->nextBatch(tids, 7, &keys) > 0)
+		for (uint64_t i = 0; i < tids.size(); i++)
+		{
+			ASSERT_EQ(keys[i], tids[i].intRepresentation / 10);
+			values.push_back(tids[i].intRepresentation);
+		}
+	ASSERT_EQ(values.size(), 1010);
+	for (uint64_t i = 0; i < values.size(); i++)
+		ASSERT_EQ(values[i], 10 * (200 - i / 10) + i % 10);
+
+	// Cleanup
+	delete tree;
+	delete duplicates;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(BTreeTest, concurrentAccess)
+{
+	// Writers insert disjoint keys, while readers look up keys inserted
+	// beforehand and scan them
+	SegmentManager* sm = new SegmentManager("database");
+	BTree<uint64_t, UInt64Cmp>* tree = new BTree<uint64_t, UInt64Cmp>(sm);
+	const uint64_t n = 20000, threads = 4;
+	vector<uint64_t> keys = shuffledKeys(n);
+	for (uint64_t key : keys) if (key % 2 == 0) tree->insert(key, toTID(key));
+
+	vector<thread> workers;
+	vector<char> correct(threads, true);
+	for (uint64_t t = 0; t < threads; t++)
+	{
+		workers.push_back(thread([&, t]() {
+			for (uint64_t key : keys)
+				if (key % (2*threads) == 2*t+1) tree->insert(key, toTID(key));
+		}));
+		workers.push_back(thread([&, t]() {
+			for (uint64_t key : keys)
+			{
+				if (key % 2 != 0) continue;
+				if (tree->lookup(key).intRepresentation != key) correct[t] = false;
+			}
+			auto it = tree->lookupRange(0, n);
+			for (uint64_t key = 0; key < n; key += 2)
+			{
+				uint64_t next = it->next().intRepresentation;
+				while (next % 2 != 0) next = it->next().intRepresentation;
+				if (next != key) correct[t] = false;
+			}
+		}));
+	}
+	for (thread& worker : workers) worker.join();
+	for (char c : correct) ASSERT_TRUE(c);
+	ASSERT_EQ(tree->size(), n);
+	for (uint64_t key : keys) ASSERT_EQ(tree->lookup(key).intRepresentation, key);
+
+	// Cleanup
+	delete tree;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(BTreeTest, nodeSearch)
+{
+	// The SIMD searches match binary search, for all node sizes and for keys
+	// which are not in the node. Halves of pairs and the sign bit matter.
+	typedef pair<uint32_t, uint32_t> IntPair;
+	mt19937 gen(42);
+	for (uint64_t count = 0; count <= 300; count++)
+	{
+		vector<uint64_t> keys;
+		vector<IntPair> pairs;
+		for (uint64_t i = 0; i < count; i++)
+		{
+			keys.push_back(gen() % 4 ? gen() % 1000 : gen() | 1ull << 63);
+			pairs.push_back(IntPair(gen() % 100, gen() % 10));
+		}
+		sort(keys.begin(), keys.end());
+		sort(pairs.begin(), pairs.end());
+		for (uint64_t i = 0; i < 100; i++)
+		{
+			uint64_t key = i % 4 ? gen() % 1000 : gen() | 1ull << 63;
+			ASSERT_EQ((BTreeSearch<uint64_t, UInt64Cmp>::lowerBound(
+				keys.data(), count, key, UInt64Cmp())),
+				lower_bound(keys.begin(), keys.end(), key) - keys.begin());
+			IntPair pair(gen() % 101, gen() % 11);
+			ASSERT_EQ((BTreeSearch<IntPair, less<IntPair>>::lowerBound(
+				pairs.data(), count, pair, less<IntPair>())),
+				lower_bound(pairs.begin(), pairs.end(), pair) - pairs.begin());
+		}
+	}
+}
+
+// _____________________________________________________________________________
+TEST(BTreeTest, compressedKeys)
+{
+	// Separators of character keys are compressed, so that inner nodes hold
+	// more of them, and the tree has fewer levels
+	SegmentManager* sm = new SegmentManager("database");
+	auto tree = new BTree<Key20, Key20Cmp>(sm);
+	auto plainTree = new BTree<Key20, PlainKey20Cmp>(sm);
+	vector<uint64_t> keys = shuffledKeys(20000);
+	for (uint64_t key : keys)
+	{
+		tree->insert(toKey20(3*key), toTID(key));
+		plainTree->insert(toKey20(3*key), toTID(key));
+	}
+	ASSERT_LT(tree->height(), plainTree->height());
+	for (uint64_t key : keys)
+	{
+		ASSERT_EQ(tree->lookup(toKey20(3*key)).intRepresentation, key);
+		ASSERT_THROW(tree->lookup(toKey20(3*key+1)), KeyNotFoundException);
+	}
+
+	// Ranges and erase work on the separators as well
+	auto it = tree->lookupRange(toKey20(29999), toKey20(3001));
+	for (uint64_t key = 1001; key < 10000; key++)
+		ASSERT_EQ(it->next().intRepresentation, key);
+	it = tree->lookupRange(toKey20(0), toKey20(59997), true);
+	for (uint64_t key = 20000; key-- > 0; )
+		ASSERT_EQ(it->next().intRepresentation, key);
+	for (uint64_t key : keys)
+	{
+		if (key % 3 != 0) continue;
+		ASSERT_TRUE(tree->erase(toKey20(3*key)));
+	}
+	for (uint64_t key : keys)
+	{
+		if (key % 3 == 0) continue;
+		ASSERT_EQ(tree->lookup(toKey20(3*key)).intRepresentation, key);
+	}
+
+	// Cleanup
+	delete tree;
+	delete plainTree;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(BTreeTest, bulkLoad)
+{
+	// Build trees from sorted input, which still accept inserts afterwards
+	SegmentManager* sm = new SegmentManager("database");
+	auto tree = new BTree<uint64_t, UInt64Cmp>(sm);
+	vector<pair<uint64_t, TID>> entries;
+	for (uint64_t key = 0; key < 100000; key++)
+		entries.push_back(make_pair(2*key, toTID(key)));
+	tree->bulkLoad(entries.begin(), entries.end(), 0.8);
+	ASSERT_EQ(tree->size(), entries.size());
+	ASSERT_THROW(tree->bulkLoad(entries.begin(), entries.end()),
+	             BulkLoadException);
+	for (uint64_t key : shuffledKeys(20000)) tree->insert(2*key+1, toTID(key));
+	for (uint64_t key = 0; key < 100000; key++)
+		ASSERT_EQ(tree->lookup(2*key).intRepresentation, key);
+	auto it = tree->lookupRange(0, 39999);
+	for (uint64_t key = 0; key < 40000; key++)
+		ASSERT_EQ(it->next().intRepresentation, key / 2);
+
+	auto stringTree = new BTree<Key20, Key20Cmp>(sm);
+	vector<pair<Key20, TID>> strings;
+	for (uint64_t key = 0; key < 50000; key++)
+		strings.push_back(make_pair(toKey20(key), toTID(key)));
+	stringTree->bulkLoad(strings.begin(), strings.end());
+	for (uint64_t key = 0; key < 50000; key++)
+		ASSERT_EQ(stringTree->lookup(toKey20(key)).intRepresentation, key);
+
+	// Unsorted input is rejected, the pairs before are kept
+	auto unsortedTree = new BTree<uint64_t, UInt64Cmp>(sm);
+	entries[500].first = 0;
+	ASSERT_THROW(unsortedTree->bulkLoad(entries.begin(), entries.end()),
+	             BulkLoadException);
+	ASSERT_EQ(unsortedTree->size(), 500);
+
+	// Cleanup
+	delete tree;
+	delete stringTree;
+	delete unsortedTree;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(BTreeTest, duplicates)
+{
+	// Every key is inserted with ten TIDs, in random order
+	SegmentManager* sm = new SegmentManager("database");
+	auto tree = new BTree<uint64_t, UInt64Cmp, false>(sm);
+	auto uniqueTree = new BTree<uint64_t, UInt64Cmp>(sm);
+	for (uint64_t i : shuffledKeys(100000))
+	{
+		tree->insert(i / 10, toTID(i));
+		uniqueTree->insert(i, toTID(i));
+	}
+	tree->insert(42, toTID(420));
+	ASSERT_EQ(tree->size(), 100000);
+	for (uint64_t key = 0; key < 10000; key++)
+	{
+		vector<TID> tids = tree->lookupAll(key);
+		ASSERT_EQ(tids.size(), 10);
+		for (uint64_t i = 0; i < 10; i++)
+			ASSERT_EQ(tids[i].intRepresentation, 10*key + i);
+		ASSERT_EQ(tree->lookup(key).intRepresentation, 10*key);
+	}
+	ASSERT_TRUE(tree->lookupAll(10000).empty());
+
+	// The TIDs of a key share one compressed list
+	ASSERT_LT(tree->height(), uniqueTree->height());
+
+	// A frequent key keeps its list on posting pages
+	for (uint64_t i : shuffledKeys(20000))
+		tree->insert(5000, toTID(200000 + i));
+	ASSERT_EQ(tree->size(), 120000);
+	vector<TID> tids = tree->lookupAll(5000);
+	ASSERT_EQ(tids.size(), 20010);
+	for (uint64_t i = 0; i < 20000; i++)
+		ASSERT_EQ(tids[10 + i].intRepresentation, 200000 + i);
+	auto it = tree->lookupRange(5000, 5001);
+	for (uint64_t i = 0; i < tids.size(); i++)
+		ASSERT_EQ(it->next().intRepresentation, tids[i].intRepresentation);
+	ASSERT_EQ(it->next().intRepresentation, 50010);
+	for (uint64_t i = 0; i < 20000; i += 2)
+		ASSERT_TRUE(tree->erase(5000, toTID(200000 + i)));
+	ASSERT_FALSE(tree->erase(5000, toTID(200000)));
+	ASSERT_EQ(tree->lookupAll(5000).size(), 10010);
+
+	// Pairs are erased one by one, or with their key
+	ASSERT_TRUE(tree->erase(7, toTID(73)));
+	ASSERT_EQ(tree->lookupAll(7).size(), 9);
+	ASSERT_TRUE(tree->erase(5000));
+	ASSERT_TRUE(tree->erase(8));
+	ASSERT_FALSE(tree->erase(8));
+	ASSERT_EQ(tree->size(), 100000 - 21);
+	ASSERT_THROW(tree->lookup(5000), KeyNotFoundException);
+
+	// Bulk loading groups the TIDs of a key
+	auto loadedTree = new BTree<uint64_t, UInt64Cmp, false>(sm);
+	vector<pair<uint64_t, TID>> entries;
+	for (uint64_t i = 0; i < 100000; i++)
+		entries.push_back(make_pair(i / 100, toTID(100000 - i)));
+	loadedTree->bulkLoad(entries.begin(), entries.end());
+	ASSERT_EQ(loadedTree->size(), entries.size());
+	ASSERT_EQ(loadedTree->lookupAll(123).size(), 100);
+	ASSERT_EQ(loadedTree->lookup(123).intRepresentation, 100000 - 12399);
+
+	// Cleanup
+	delete tree;
+	delete uniqueTree;
+	delete loadedTree;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(BTreeTest, lookupBatch)
+{
+	// Probe the even keys which are in the tree, the odd ones which are not,
+	// and some keys repeatedly, in random order
+	SegmentManager* sm = new SegmentManager("database");
+	auto tree = new BTree<uint64_t, UInt64Cmp>(sm);
+	for (uint64_t key : shuffledKeys(50000)) tree->insert(2*key, toTID(key));
+	vector<uint64_t> keys = shuffledKeys(100000);
+	for (uint64_t key = 0; key < 1000; key++) keys.push_back(key);
+	vector<TID> tids;
+	vector<bool> found;
+	tree->lookupBatch(keys, tids, found);
+	ASSERT_EQ(tids.size(), keys.size());
+	ASSERT_EQ(found.size(), keys.size());
+	for (uint64_t i = 0; i < keys.size(); i++)
+	{
+		ASSERT_EQ(found[i], keys[i] % 2 == 0);
+		if (!found[i]) continue;
+		ASSERT_EQ(tids[i].intRepresentation, keys[i] / 2);
+	}
+
+	// An empty batch, and one on a tree of a single leaf
+	tree->lookupBatch(vector<uint64_t>(), tids, found);
+	ASSERT_TRUE(tids.empty());
+	auto small = new BTree<uint64_t, UInt64Cmp, false>(sm);
+	small->insert(7, toTID(3));
+	small->insert(7, toTID(1));
+	small->lookupBatch(vector<uint64_t>({ 8, 7 }), tids, found);
+	ASSERT_FALSE(found[0]);
+	ASSERT_TRUE(found[1]);
+	ASSERT_EQ(tids[1].intRepresentation, 1);
+
+	// Cleanup
+	delete tree;
+	delete small;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(BTreeTest, merge)
+{
+	// Erasing most keys merges the nodes, until the tree is as low as before
+	SegmentManager* sm = new SegmentManager("database");
+	auto tree = new BTree<uint64_t, UInt64Cmp>(sm);
+	auto stringTree = new BTree<Key20, Key20Cmp>(sm);
+	for (uint64_t key : shuffledKeys(100000))
+	{
+		tree->insert(key, toTID(key));
+		stringTree->insert(toKey20(key), toTID(key));
+	}
+	uint64_t height = tree->height(), stringHeight = stringTree->height();
+	for (uint64_t key : shuffledKeys(100000))
+	{
+		if (key % 100 == 0) continue;
+		ASSERT_TRUE(tree->erase(key));
+		ASSERT_TRUE(stringTree->erase(toKey20(key)));
+	}
+	ASSERT_LT(tree->height(), height);
+	ASSERT_LT(stringTree->height(), stringHeight);
+	auto it = tree->lookupRange(0, 100000);
+	for (uint64_t key = 0; key < 100000; key += 100)
+	{
+		ASSERT_EQ(tree->lookup(key).intRepresentation, key);
+		ASSERT_EQ(stringTree->lookup(toKey20(key)).intRepresentation, key);
+		ASSERT_EQ(it->next().intRepresentation, key);
+	}
+
+	// An empty tree is a single leaf, which still accepts inserts
+	for (uint64_t key = 0; key < 100000; key += 100)
+		ASSERT_TRUE(tree->erase(key));
+	ASSERT_EQ(tree->height(), 0);
+	ASSERT_EQ(tree->size(), 0);
+	for (uint64_t key : shuffledKeys(10000)) tree->insert(key, toTID(key));
+	for (uint64_t key = 0; key < 10000; key++)
+		ASSERT_EQ(tree->lookup(key).intRepresentation, key);
+
+	// Cleanup
+	delete tree;
+	delete stringTree;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(BTreeTest, defragment)
+{
+	// Counts the leaves of a tree, and the ones followed by the next page
+	auto countLeaves = [](BTree<uint64_t, UInt64Cmp, false>* tree,
+	                      uint64_t& sequential)
+	{
+		uint64_t version, leaves = 0;
+		bool restart = false;
+		BufferFrame* frame = tree->descend(nullptr, version, restart);
+		sequential = 0;
+		while (true)
+		{
+			leaves++;
+			uint64_t page = frame->pageId;
+			uint64_t next = reinterpret_cast<BTreePostingLeafNode<uint64_t>*>(
+				frame->getData())->next;
+			tree->bm->unfixPage(*frame, false);
+			if (next == 0) return leaves;
+			if (next == page + 1) sequential++;
+			frame = &tree->bm->fixPage(next, false);
+		}
+	};
+
+	// Leaves split in random order, and are emptied by erase
+	SegmentManager* sm = new SegmentManager("database");
+	auto tree = new BTree<uint64_t, UInt64Cmp, false>(sm);
+	for (uint64_t i : shuffledKeys(200000)) tree->insert(i / 2, toTID(i));
+	for (uint64_t key = 0; key < 100000; key++)
+		if (key % 8 != 0) tree->erase(key);
+	uint64_t sequential, leaves = countLeaves(tree, sequential);
+	ASSERT_LT(sequential, leaves / 2);
+
+	// Afterwards, the leaves are dense and follow each other
+	tree->defragment();
+	uint64_t denseSequential, denseLeaves = countLeaves(tree, denseSequential);
+	ASSERT_LT(denseLeaves, leaves / 2);
+	ASSERT_GE(denseSequential, denseLeaves * 9 / 10);
+	ASSERT_EQ(tree->size(), 25000);
+
+	// Repeated passes reuse the pages freed by the passes before, rather
+	// than pages which have never been used, and the leaves still follow
+	// each other
+	for (uint64_t pass = 0; pass < 2; pass++) tree->defragment();
+	uint64_t nextPage = tree->nextPage;
+	for (uint64_t pass = 0; pass < 4; pass++) tree->defragment();
+	ASSERT_EQ(tree->nextPage, nextPage);
+
+	// The free pages are kept when the tree is reopened
+	uint64_t freePages = tree->freePages.size() + tree->retired.size();
+	uint64_t segId = tree->getSegmentId();
+	delete tree;
+	tree = new BTree<uint64_t, UInt64Cmp, false>(sm, segId);
+	ASSERT_GT(freePages, 0u);
+	ASSERT_EQ(tree->freePages.size(), freePages);
+	ASSERT_EQ(tree->nextPage, nextPage);
+	ASSERT_EQ(countLeaves(tree, denseSequential), denseLeaves);
+	ASSERT_GE(denseSequential, denseLeaves * 9 / 10);
+	auto it = tree->lookupRange(0, 100000);
+	for (uint64_t key = 0; key < 100000; key += 8)
+	{
+		ASSERT_EQ(tree->lookup(key).intRepresentation, 2*key);
+		ASSERT_EQ(it->next().intRepresentation, 2*key);
+		ASSERT_EQ(it->next().intRepresentation, 2*key + 1);
+	}
+	for (uint64_t key = 100000; key < 110000; key++)
+		tree->insert(key, toTID(key));
+	ASSERT_EQ(tree->lookup(109999).intRepresentation, 109999);
+
+	// Leaves are merged and rewritten while readers look up the keys which
+	// are kept
+	auto concurrentTree = new BTree<uint64_t, UInt64Cmp>(sm);
+	for (uint64_t key : shuffledKeys(40000))
+		concurrentTree->insert(key, toTID(key));
+	vector<thread> workers;
+	vector<char> correct(3, true);
+	for (uint64_t t = 0; t < 2; t++)
+	{
+		workers.push_back(thread([&, t]() {
+			for (uint64_t key = 2*t + 1; key < 40000; key += 4)
+				if (!concurrentTree->erase(key)) correct[t] = false;
+		}));
+	}
+	workers.push_back(thread([&]() {
+		for (uint64_t round = 0; round < 3; round++)
+			for (uint64_t key = 0; key < 40000; key += 2)
+				if (concurrentTree->lookup(key).intRepresentation != key)
+					correct[2] = false;
+	}));
+	for (uint64_t round = 0; round < 3; round++) concurrentTree->defragment();
+	for (thread& worker : workers) worker.join();
+	for (char c : correct) ASSERT_TRUE(c);
+	ASSERT_EQ(concurrentTree->size(), 20000);
+	concurrentTree->defragment();
+	for (uint64_t key = 0; key < 40000; key++)
+		ASSERT_EQ(concurrentTree->lookupAll(key).size(), 1 - key % 2);
 
+	// Cleanup
+	delete tree;
+	delete concurrentTree;
+	delete sm;
+	if (system("rm database") < 0)
+  		cout << "Error removing database" << endl;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -26,6 +26,7 @@ void BufferFrame::lockFrame(bool write)
 {
 	if (write) pthread_rwlock_wrlock(&lock);
 	else  	   pthread_rwlock_rdlock(&lock);
+	lock_guard<mutex> guard(clientLock);
 	clients.insert(this_thread::get_id());
 }
 
@@ -35,17 +36,16 @@ bool BufferFrame::tryLockFrame(bool write)
 {
 	if (write) 
 	{
-		if (pthread_rwlock_trywrlock(&lock) == 0)
-			{ clients.insert(this_thread::get_id()); return true; } 
-		else return false;
+		if (pthread_rwlock_trywrlock(&lock) != 0) return false;
 	}
 
 	else
 	{
-		if (pthread_rwlock_tryrdlock(&lock) == 0)
-			{ clients.insert(this_thread::get_id()); return true; } 
-		else return false;
+		if (pthread_rwlock_tryrdlock(&lock) != 0) return false;
 	}
+	lock_guard<mutex> guard(clientLock);
+	clients.insert(this_thread::get_id());
+	return true;
 }
 /*
 //______________________________________________________________________________
@@ -91,12 +91,16 @@ pair<bool,bool> BufferFrame::tryLockFrame(bool write)
 //______________________________________________________________________________
 void BufferFrame::unlockFrame()
 {
-	clients.erase(this_thread::get_id());
+	{
+		lock_guard<mutex> guard(clientLock);
+		clients.erase(this_thread::get_id());
+	}
 	pthread_rwlock_unlock(&lock);
 }
 
 //______________________________________________________________________________
 bool BufferFrame::isClient()
 {
+	lock_guard<mutex> guard(clientLock);
 	return clients.find(this_thread::get_id()) != clients.end() ? true : false;
 }
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include <unordered_set>
 #include <unordered_map>
 #include <gtest/gtest.h>
+#include <mutex>
 #include <thread>
 
 
@@ -63,8 +64,10 @@ public:
 
 private:
 
-	// Threads that currenty refer to this frame
+	// Threads that currenty refer to this frame. Guarded by clientLock, since
+	// several threads may hold the frame in shared mode.
 	std::unordered_set<std::thread::id> clients;
+	std::mutex clientLock;
 	
 	// Handle concurrent access
 	pthread_rwlock_t lock;
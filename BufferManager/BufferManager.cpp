@@ -90,6 +90,9 @@ int BufferManager::initializeDatabase(const char* filename)
 
 		} else {
 
+			// The file may have been grown before (see growDB)
+			numPages = fileBytes / BM_CONS::pageSize;
+
 			if (lseek(fileno(dbFile), 0, SEEK_SET) < 0)
 		    {
 				cout << "Error seeking to start of file: " << errno << endl;
@@ -115,20 +118,17 @@ int BufferManager::initializeDatabase(const char* filename)
 //______________________________________________________________________________
 std::pair<uint64_t, uint64_t> BufferManager::growDB(uint64_t pages)
 {
+	// Write at an explicit offset, so that the file offset used by concurrent
+	// page flushes is left alone
+	lock_guard<mutex> guard(growLock);
 	uint64_t sizeBefore = numPages;
 
-	// seek to end of file
-	if (lseek(fileDescriptor, 0, SEEK_END) < 0)
-	{
-		cout << "Error seeking to end of file: " << errno << endl;
-		exit(1);
-	}
-
 	// write page
 	vector<uint64_t> pageData;
 	uint64_t totalBytes = pages*BM_CONS::pageSize;
 	pageData.resize(totalBytes/sizeof(uint64_t), 0);
-	if (write(fileDescriptor, pageData.data(), totalBytes) < 0)
+	if (pwrite(fileDescriptor, pageData.data(), totalBytes, 
+	           sizeBefore*BM_CONS::pageSize) < 0)
 	{
 		cout << "Error appending pages to file: " << errno << endl;
 		exit(1);
@@ -140,6 +140,24 @@ std::pair<uint64_t, uint64_t> BufferManager::growDB(uint64_t pages)
 }
 
 
+//______________________________________________________________________________
+uint64_t BufferManager::getNumPages()
+{
+	lock_guard<mutex> guard(growLock);
+	return numPages;
+}
+
+
+//______________________________________________________________________________
+void BufferManager::prefetchPages(uint64_t pageId, uint64_t count)
+{
+	// Pages are mapped from file once fixed, so reading them into the page
+	// cache ahead avoids blocking on the page faults
+	posix_fadvise(fileDescriptor, pageId * BM_CONS::pageSize,
+	              count * BM_CONS::pageSize, POSIX_FADV_WILLNEED);
+}
+
+
 //______________________________________________________________________________
 void BufferManager::readPageIntoFrame(uint64_t pageId, BufferFrame* frame)
 {
@@ -226,13 +244,10 @@ BufferFrame& BufferManager::fixPage(uint64_t pageId, bool exclusive)
 	bool allPagesFixed = true;
 	for (uint64_t i = 0; i < numFrames; i++)
 	{
+		// Frames held by other threads are fixed, and therefore skipped
 		BufferFrame* frame = hasher->nextFrame();
 		if (frame->isClient()) continue;
-		if(!frame->tryLockFrame(true))
-		{
-			bmlock.unlock();
-            goto top;
-        }
+		if(!frame->tryLockFrame(true)) continue;
        
 		if (frame->getData() == nullptr)
 		{
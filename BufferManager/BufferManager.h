@@ -50,10 +50,18 @@ public:
 
 	// Appends #numPages worth of space to the end of the database file.
 	// Returns the page delimiters of the group of pages just created,
-	// in the form [start, end)
+	// in the form [start, end). May run concurrently with all other methods.
 	FRIEND_TEST(SegmentManagerTest, createGrowDropSegment);
 	std::pair<uint64_t, uint64_t> growDB(uint64_t numPages);
 
+	// Returns the number of pages on file.
+	uint64_t getNumPages();
+
+	// Hints that the #count pages starting at pageId will be fixed soon, so
+	// that they are read from file in the background. Does not block on IO,
+	// and does not fix any page. May run concurrently with all other methods.
+	void prefetchPages(uint64_t pageId, uint64_t count);
+
 
 private:
 	// Reads page with pageID into frame, updates hash table. The page becomes
@@ -93,6 +101,9 @@ private:
 
 	// Handle concurrent access to the BM's data structures and procedures
 	 std::mutex bmlock;
+
+	// Serializes growing the file, guards numPages
+	std::mutex growLock;
 };
 
 #endif  // BUFFERMANAGER_H
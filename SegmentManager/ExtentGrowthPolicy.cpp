@@ -0,0 +1,70 @@
+
+///////////////////////////////////////////////////////////////////////////////
+// ExtentGrowthPolicy.cpp
+///////////////////////////////////////////////////////////////////////////////
+
+#include "ExtentGrowthPolicy.h"
+#include <algorithm>
+#include <limits>
+#include <math.h>
+
+using namespace std;
+
+// _____________________________________________________________________________
+uint64_t DynamicGrowthPolicy::extentSize(uint64_t segId, uint64_t numExtents,
+                                         uint64_t numPages)
+{
+	// The size leaves the range of uint64_t after a few extents, so it is
+	// clamped before the conversion
+	double size = ceil(pow(base, pow(increase, (float)numExtents)));
+	return min<double>(size, numeric_limits<uint64_t>::max() / 2);
+}
+
+// _____________________________________________________________________________
+uint64_t GeometricGrowthPolicy::extentSize(uint64_t segId, uint64_t numExtents,
+                                           uint64_t numPages)
+{
+	return max(base, (uint64_t)ceil(numPages * (factor - 1)));
+}
+
+// _____________________________________________________________________________
+uint64_t CappedGrowthPolicy::extentSize(uint64_t segId, uint64_t numExtents,
+                                        uint64_t numPages)
+{
+	return min(maxPages, policy->extentSize(segId, numExtents, numPages));
+}
+
+// _____________________________________________________________________________
+uint64_t AdaptiveGrowthPolicy::extentSize(uint64_t segId, uint64_t numExtents,
+                                          uint64_t numPages)
+{
+	lock_guard<mutex> guard(lock);
+	auto it = states.find(segId);
+	if (it == states.end()) return base;
+
+	// Segments which have not been grown for long shrink back
+	auto idle = chrono::steady_clock::now() - it->second.lastGrowth;
+	if (idle > 4 * interval) return max(base, it->second.size / 2);
+	return it->second.size;
+}
+
+// _____________________________________________________________________________
+void AdaptiveGrowthPolicy::notifyGrowth(uint64_t segId)
+{
+	lock_guard<mutex> guard(lock);
+	auto now = chrono::steady_clock::now();
+	auto it = states.find(segId);
+	if (it == states.end())
+	{
+		GrowthState state = { base, now };
+		states[segId] = state;
+		return;
+	}
+
+	GrowthState& state = it->second;
+	if (now - state.lastGrowth < interval)
+		state.size = min(maxPages, 2 * state.size);
+	else if (now - state.lastGrowth > 4 * interval)
+		state.size = max(base, state.size / 2);
+	state.lastGrowth = now;
+}
@@ -0,0 +1,141 @@
+
+///////////////////////////////////////////////////////////////////////////////
+// ExtentGrowthPolicy.h
+//////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef EXTENTGROWTHPOLICY_H
+#define EXTENTGROWTHPOLICY_H
+
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+
+
+// Determines the size of the extents added to a segment whenever it is grown
+// (see SegmentManager::growSegment).
+class ExtentGrowthPolicy
+{
+public:
+
+	virtual ~ExtentGrowthPolicy() { }
+
+	// Returns the number of pages of the next extent of the segment with the
+	// given id, which currently consists of #numExtents extents holding
+	// #numPages pages in total. Does not change the state of the policy.
+	virtual uint64_t extentSize(uint64_t segId, uint64_t numExtents,
+	                            uint64_t numPages) = 0;
+
+	// Called whenever the segment with the given id has been grown.
+	virtual void notifyGrowth(uint64_t segId) { }
+};
+
+
+// The original dynamic extent mapping: the ith extent of a segment has size
+// b^(k^(i-1)), where b is the base extent size and k the exponential growth
+// constant. Grows super-exponentially, so usually wrapped in a
+// CappedGrowthPolicy.
+class DynamicGrowthPolicy : public ExtentGrowthPolicy
+{
+public:
+
+	DynamicGrowthPolicy(uint64_t base, float increase)
+		: base(base), increase(increase) { }
+
+	uint64_t extentSize(uint64_t segId, uint64_t numExtents, uint64_t numPages);
+
+private:
+
+	uint64_t base;
+	float increase;
+};
+
+
+// Every extent multiplies the size of the segment by factor (> 1), but is at
+// least base pages large.
+class GeometricGrowthPolicy : public ExtentGrowthPolicy
+{
+public:
+
+	GeometricGrowthPolicy(uint64_t base, float factor)
+		: base(base), factor(factor) { }
+
+	uint64_t extentSize(uint64_t segId, uint64_t numExtents, uint64_t numPages);
+
+private:
+
+	uint64_t base;
+	float factor;
+};
+
+
+// Every extent has the same size.
+class LinearGrowthPolicy : public ExtentGrowthPolicy
+{
+public:
+
+	LinearGrowthPolicy(uint64_t size) : size(size) { }
+
+	uint64_t extentSize(uint64_t, uint64_t, uint64_t) { return size; }
+
+private:
+
+	uint64_t size;
+};
+
+
+// Limits the extents of another policy to maxPages pages. Takes ownership of
+// the given policy.
+class CappedGrowthPolicy : public ExtentGrowthPolicy
+{
+public:
+
+	CappedGrowthPolicy(ExtentGrowthPolicy* policy, uint64_t maxPages)
+		: policy(policy), maxPages(maxPages) { }
+	~CappedGrowthPolicy() { delete policy; }
+
+	uint64_t extentSize(uint64_t segId, uint64_t numExtents, uint64_t numPages);
+	void notifyGrowth(uint64_t segId) { policy->notifyGrowth(segId); }
+
+private:
+
+	ExtentGrowthPolicy* policy;
+	uint64_t maxPages;
+};
+
+
+// Adapts the extent size of every segment to its rate of growth: a segment
+// which is grown again within interval gets an extent twice as large next
+// time (up to maxPages), a segment which has not been grown for four
+// intervals one half as large (down to base).
+class AdaptiveGrowthPolicy : public ExtentGrowthPolicy
+{
+public:
+
+	AdaptiveGrowthPolicy(uint64_t base, uint64_t maxPages,
+	                     std::chrono::milliseconds interval)
+		: base(base), maxPages(maxPages), interval(interval) { }
+
+	uint64_t extentSize(uint64_t segId, uint64_t numExtents, uint64_t numPages);
+	void notifyGrowth(uint64_t segId);
+
+private:
+
+	// The next extent size of a segment, and when it was grown last
+	struct GrowthState
+	{
+		uint64_t size;
+		std::chrono::steady_clock::time_point lastGrowth;
+	};
+
+	uint64_t base;
+	uint64_t maxPages;
+	std::chrono::milliseconds interval;
+
+	// Guards states
+	std::mutex lock;
+	std::unordered_map<uint64_t, GrowthState> states;
+};
+
+#endif  // EXTENTGROWTHPOLICY_H
@@ -35,50 +35,64 @@ void FreeSpaceInventory::registerExtent(Extent e)
 	// The FSI contains a set of extents describing free pages.
 	// At all times, these extents do not overlap and describe maximal
 	// continuous regions (i.e. [1, 4) instead of [1, 3), [3, 4))
-	// Therefore, when marking a new extent as free, check three cases:
+	// Therefore, when marking a new extent as free, check two cases:
 	//
 	// 1. The extent starts where another free extent ends -> extend previous
 	// 2. The extent ends where another free extent begins -> extend into next
-	// 3. Otherwise just add this extent to the set of extents.
-	
-	auto endIt = reverseMap.find(e.start);
-	auto startIt = forwardMap.find(e.end);
+	//
+	// Both neighbours are unregistered and registered again as part of the
+	// merged extent.
 	uint64_t begin = e.start;
-	bool merge = false;
+	uint64_t end = e.end;
 	
+	auto endIt = reverseMap.find(e.start);
 	if (endIt != reverseMap.end())
 	{
-		merge = true;
 		begin = endIt->second;
-		forwardMap.find(begin)->second = e.end;
-		reverseMap.insert(pair<uint64_t, uint64_t>(e.end, begin));
-		reverseMap.erase(endIt);
+		removeFree(begin);
 	}
 	
+	auto startIt = forwardMap.find(e.end);
 	if (startIt != forwardMap.end())
 	{
-		uint64_t end = forwardMap.find(e.end)->second;
-		
-		if (merge) forwardMap.find(begin)->second = end;
-		else	   forwardMap.insert(pair<uint64_t, uint64_t>(begin, end)); 	   
-			
-		reverseMap.find(end)->second = begin;
-		forwardMap.erase(e.end);
-						
-		merge = true;
+		end = startIt->second;
+		removeFree(e.end);
 	}
 	
-	// No merge with any other extent took place -> add new extent entry.
-	// Note: this is the only instance where numEntries is increased in the FSI
-	if (!merge)
-	{
-		numEntries++;
-		forwardMap.insert(pair<uint64_t, uint64_t>(e.start, e.end));
-		reverseMap.insert(pair<uint64_t, uint64_t>(e.end, e.start));
-		
-		// grow segment if necessary
-		if (maxEntries * getSize() <= numEntries) grow();
-	}
+	addFree(begin, end);
+	
+	// grow segment if necessary
+	if (maxEntries * getSize() <= numEntries) grow();
+}
+
+// _____________________________________________________________________________
+void FreeSpaceInventory::addFree(uint64_t start, uint64_t end)
+{
+	forwardMap.insert(pair<uint64_t, uint64_t>(start, end));
+	reverseMap.insert(pair<uint64_t, uint64_t>(end, start));
+	sizeIndex.insert(pair<uint64_t, uint64_t>(end - start, start));
+	numEntries = forwardMap.size();
+	si->logChange(LOG_ADD_FREE, 1, start, end);
+}
+
+// _____________________________________________________________________________
+void FreeSpaceInventory::removeFree(uint64_t start)
+{
+	auto it = forwardMap.find(start);
+	sizeIndex.erase(pair<uint64_t, uint64_t>(it->second - start, start));
+	reverseMap.erase(it->second);
+	uint64_t end = it->second;
+	forwardMap.erase(it);
+	numEntries = forwardMap.size();
+	si->logChange(LOG_REMOVE_FREE, 1, start, end);
+}
+
+// _____________________________________________________________________________
+void FreeSpaceInventory::replayChange(const LogRecord& r)
+{
+	if (r.type != LOG_ADD_FREE && r.type != LOG_REMOVE_FREE) return;
+	if (forwardMap.find(r.start) != forwardMap.end()) removeFree(r.start);
+	if (r.type == LOG_ADD_FREE) addFree(r.start, r.end);
 }
 
 // _____________________________________________________________________________
@@ -87,8 +101,8 @@ void FreeSpaceInventory::grow()
 	// Grow segment according to dynamic extent mapping.
 	// See SegmentManager::growSegment
 	float numExtents = extents.size();
-	uint64_t newExtentSize = ceil(pow(2, 
-	                         	  pow(params.extentIncrease, numExtents)));
+	uint64_t newExtentSize = min<double>(params.maxExtentSize,
+		ceil(pow(2, pow(params.extentIncrease, numExtents))));
 	
 	// Get an extent that is known to be clean -> allocate new set of pages	
 	pair<uint64_t, uint64_t> growth = bm->growDB(newExtentSize);
@@ -98,39 +112,37 @@ void FreeSpaceInventory::grow()
 }
 
 // _____________________________________________________________________________
-Extent FreeSpaceInventory::getExtent(uint64_t numPages)
+Extent FreeSpaceInventory::getExtent(uint64_t numPages, uint64_t after)
 {	
-	for (auto it = forwardMap.begin(); it != forwardMap.end(); ++it)
+	// Prefer the free extent right behind the segment's last extent,
+	// otherwise take the smallest one which is large enough
+	uint64_t first = 0;
+	auto adjacent = forwardMap.find(after);
+	if (after != 0 && adjacent != forwardMap.end() &&
+	    adjacent->second - adjacent->first >= numPages)
+		first = adjacent->first;
+	else
 	{
-		uint64_t first = it->first;
-		uint64_t second = it->second;
-		
-		if ((second - first) >= numPages)
-		{
-			Extent e(first, first+numPages);
-			
-			// Space required fills up an entire extent -> remove entire entry
-			if (e.end == second)
-			{
-				numEntries--;
-				reverseMap.erase(it->second);
-				forwardMap.erase(it);
-				return e;
-			}
-			
-			// Otherwise space required fills up only a portion of an available
-			// extent -> update data structures approriately and return extent
-			forwardMap.insert(pair<uint64_t, uint64_t>(e.end, second));
-			reverseMap.find(second)->second = e.end;
-			forwardMap.erase(it);
-			return e;
-		}
+		auto fit = sizeIndex.lower_bound(pair<uint64_t, uint64_t>(numPages, 0));
+		if (fit == sizeIndex.end()) return Extent(0, 0);
+		first = fit->second;
 	}
-
-	Extent e(0, 0);
+	
+	// The remainder of the free extent, if any, stays registered
+	uint64_t second = forwardMap.find(first)->second;
+	Extent e(first, first + numPages);
+	removeFree(first);
+	if (e.end != second) addFree(e.end, second);
 	return e;
 }
 
+// _____________________________________________________________________________
+bool FreeSpaceInventory::hasExtent(uint64_t numPages)
+{
+	return sizeIndex.lower_bound(pair<uint64_t, uint64_t>(numPages, 0)) !=
+	       sizeIndex.end();
+}
+
 // _____________________________________________________________________________
 void FreeSpaceInventory::parseFSIExtents(uint64_t frame, uint64_t& counter)
 {
@@ -145,8 +157,7 @@ void FreeSpaceInventory::parseFSIExtents(uint64_t frame, uint64_t& counter)
 		uint64_t end = data[i+1];
 		
 		// Fill mapping
-		forwardMap.insert(pair<uint64_t, uint64_t>(start, end));
-		reverseMap.insert(pair<uint64_t, uint64_t>(end, start));
+		addFree(start, end);
 	}
 	
 	bm->unfixPage(bf, false);
@@ -171,9 +182,7 @@ void FreeSpaceInventory::initializeFromFile()
 		extents.push_back(ext);
 		
 		// pages [2, BM_Const::defaultNumPages) is free
-		numEntries = 1;
-		forwardMap.insert(pair<uint64_t,uint64_t>(2, BM_CONS::defaultNumPages));
-		reverseMap.insert(pair<uint64_t,uint64_t>(BM_CONS::defaultNumPages, 2));
+		addFree(2, BM_CONS::defaultNumPages);
 		return;
 	}
 	
@@ -200,6 +209,7 @@ void FreeSpaceInventory::initializeFromFile()
 		uint64_t entryCounter = numEntries;
 		for (size_t i = 0; i < frames.size(); i++) 
 			parseFSIExtents(frames[i], entryCounter);
+		numEntries = forwardMap.size();
 		return;
 	} 
 }
@@ -11,13 +11,16 @@
 #include "SegmentInventory.h"
 #include "SMConst.h"
 #include <map>
+#include <set>
 
 // The FreeSpaceInventory is a special segment in the DBMS. It manages and
 // stores the free extents in the database. As with the SegmentInventory, it
 // also has the ability to materialize its state and initialize its state
-// from the database.
+// from the database. Its changes are logged by the SI (see SegmentInventory),
+// which also decides when to write a new snapshot.
 class FreeSpaceInventory : public Segment
 {
+	friend class SegmentInventory;
 
 public:
 
@@ -27,7 +30,7 @@ public:
 	FreeSpaceInventory(SegmentInventory* si, BufferManager* bm,
 	                   bool visible, uint64_t id, Extent* ex = NULL);
 	                   
-	~FreeSpaceInventory() { writeToFile(); }
+	~FreeSpaceInventory() { }
 	
 	// Give an extent to the FSI, which then incorporates its pages
 	// to the inventory of total free pages
@@ -39,8 +42,17 @@ public:
 	// start = end is returned. Otherwise, this method unregisters the extent
 	// from the FSI.
 	//
+	// If a free extent starts at #after (the end of the last extent of the
+	// segment being grown) and is large enough, its first pages are taken,
+	// so that the segment stays contiguous on disk. Otherwise the smallest
+	// free extent which is large enough is split (best fit), the one with
+	// the lowest start among equally large ones. O(log n) either way.
+	//
 	// FRIEND_TEST(SegmentManagerTest, createGrowDropSegment);
-	Extent getExtent(uint64_t numPages);
+	Extent getExtent(uint64_t numPages, uint64_t after = 0);
+
+	// Returns true iff getExtent would find a free extent with #numPages.
+	bool hasExtent(uint64_t numPages);
 
 	
 private:
@@ -67,11 +79,26 @@ private:
 	// Adds an additional extent to the FSI. Whereas regular segments are grown 
 	// on demand (see SegmentManager::growSegment), the FSI grows automatically.    
 	void grow();
+
+	// Adds the free extent [start, end) to all mappings. Does not merge it
+	// with its neighbours.
+	void addFree(uint64_t start, uint64_t end);
+
+	// Removes the free extent starting at start from all mappings.
+	void removeFree(uint64_t start);
+
+	// Applies the given change record from the metadata log, if it concerns
+	// the FSI. Idempotent, as SegmentInventory::replayLog.
+	void replayChange(const LogRecord& r);
 	
 	// Mapping of start of extent to end of extent, marking free space
 	// Free space is given on interval [start, end)
 	std::map<uint64_t, uint64_t> forwardMap;
 	std::map<uint64_t, uint64_t> reverseMap;
+
+	// The free extents as (length, start) pairs, ordered by length, then by
+	// start. Used for best fit allocation.
+	std::set<std::pair<uint64_t, uint64_t>> sizeIndex;
 	
 	// Handler to the segment inventory
 	SegmentInventory* si;
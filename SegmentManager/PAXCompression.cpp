@@ -0,0 +1,342 @@
+
+///////////////////////////////////////////////////////////////////////////////
+// PAXCompression.cpp
+///////////////////////////////////////////////////////////////////////////////
+
+#include "PAXCompression.h"
+#include <algorithm>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+// _____________________________________________________________________________
+void ColumnCodec::encode(const Attribute& a, const char* values, uint16_t count,
+                         ColumnHeader& header, vector<char>& out)
+{
+	out.clear();
+	header.bitWidth = 0;
+	header.entries = 0;
+	header.base = 0;
+	uint32_t rawSize = count * a.length;
+
+	if (a.type == INTEGER && count > 0)
+	{
+		auto v = reinterpret_cast<const int64_t*>(values);
+		int64_t min = v[0], max = v[0];
+		uint16_t runs = 1;
+		for (uint16_t i = 1; i < count; i++)
+		{
+			min = std::min(min, v[i]);
+			max = std::max(max, v[i]);
+			runs += v[i] != v[i-1];
+		}
+		uint64_t range = (uint64_t)max - (uint64_t)min;
+		uint8_t width = range == 0 ? 0 : 64 - __builtin_clzll(range);
+		uint32_t forSize = packedSize(count, width);
+		uint32_t rleSize = runs * (sizeof(int64_t) + sizeof(uint16_t));
+
+		// Run length encoding: run values, then run ends
+		if (rleSize < forSize && rleSize < rawSize)
+		{
+			vector<int64_t> runValues;
+			vector<uint16_t> runEnds;
+			for (uint16_t i = 0; i < count; i++)
+			{
+				if (i == 0 || v[i] != v[i-1]) runValues.push_back(v[i]);
+				else runEnds.pop_back();
+				runEnds.push_back(i + 1);
+			}
+			header.encoding = PAX_RLE;
+			header.entries = runs;
+			out.insert(out.end(), (char*)runValues.data(),
+			           (char*)(runValues.data() + runs));
+			out.insert(out.end(), (char*)runEnds.data(),
+			           (char*)(runEnds.data() + runs));
+		}
+
+		// Frame of reference with bit-packing
+		else if (forSize < rawSize)
+		{
+			vector<uint64_t> codes(count);
+			for (uint16_t i = 0; i < count; i++)
+				codes[i] = (uint64_t)v[i] - (uint64_t)min;
+			header.encoding = PAX_FOR;
+			header.bitWidth = width;
+			header.base = min;
+			pack(codes.data(), count, width, out);
+		}
+	}
+
+	else if (a.type == CHAR && count > 0)
+	{
+		// Dictionary in order of first occurrence, padded to 8 bytes
+		unordered_map<string, uint64_t> codeOf;
+		vector<uint64_t> codes(count);
+		vector<char> dictionary;
+		for (uint16_t i = 0; i < count; i++)
+		{
+			string value(values + i * a.length, a.length);
+			auto it = codeOf.insert(make_pair(value, codeOf.size())).first;
+			if (it->second == dictionary.size() / a.length)
+				dictionary.insert(dictionary.end(), value.begin(), value.end());
+			codes[i] = it->second;
+		}
+		dictionary.resize((dictionary.size() + 7) / 8 * 8);
+		uint8_t width = codeOf.size() <= 1 ? 0 :
+		                64 - __builtin_clzll(codeOf.size() - 1);
+		if (dictionary.size() + packedSize(count, width) < rawSize)
+		{
+			header.encoding = PAX_DICT;
+			header.bitWidth = width;
+			header.entries = codeOf.size();
+			out = dictionary;
+			pack(codes.data(), count, width, out);
+		}
+	}
+
+	if (out.empty())
+	{
+		header.encoding = PAX_RAW;
+		out.assign(values, values + rawSize);
+	}
+	header.size = out.size();
+}
+
+// _____________________________________________________________________________
+void ColumnCodec::decode(const Attribute& a, const ColumnHeader& header,
+                         const char* data, uint16_t count, char* out)
+{
+	auto v = reinterpret_cast<int64_t*>(out);
+	switch (header.encoding)
+	{
+		case PAX_FOR:
+			for (uint16_t i = 0; i < count; i++)
+				v[i] = header.base + unpack(data, header.bitWidth, i);
+			break;
+
+		case PAX_RLE:
+		{
+			auto runValues = reinterpret_cast<const int64_t*>(data);
+			auto runEnds = reinterpret_cast<const uint16_t*>(
+			               data + header.entries * sizeof(int64_t));
+			uint16_t row = 0;
+			for (uint16_t r = 0; r < header.entries; r++)
+				for (; row < runEnds[r] && row < count; row++)
+					v[row] = runValues[r];
+			break;
+		}
+
+		case PAX_DICT:
+		{
+			auto codes = data + (header.entries * a.length + 7) / 8 * 8;
+			for (uint16_t i = 0; i < count; i++)
+				memcpy(out + i * a.length,
+				       data + unpack(codes, header.bitWidth, i) * a.length,
+				       a.length);
+			break;
+		}
+
+		default:
+			memcpy(out, data, count * a.length);
+	}
+}
+
+// _____________________________________________________________________________
+void ColumnCodec::decodeValue(const Attribute& a, const ColumnHeader& header,
+                              const char* data, uint16_t row, char* out)
+{
+	int64_t value;
+	switch (header.encoding)
+	{
+		case PAX_FOR:
+			value = header.base + unpack(data, header.bitWidth, row);
+			memcpy(out, &value, sizeof(int64_t));
+			break;
+
+		case PAX_RLE:
+		{
+			auto runValues = reinterpret_cast<const int64_t*>(data);
+			auto runEnds = reinterpret_cast<const uint16_t*>(
+			               data + header.entries * sizeof(int64_t));
+			auto run = upper_bound(runEnds, runEnds + header.entries, row);
+			memcpy(out, runValues + (run - runEnds), sizeof(int64_t));
+			break;
+		}
+
+		case PAX_DICT:
+		{
+			auto codes = data + (header.entries * a.length + 7) / 8 * 8;
+			memcpy(out, data + unpack(codes, header.bitWidth, row) * a.length,
+			       a.length);
+			break;
+		}
+
+		default:
+			memcpy(out, data + row * a.length, a.length);
+	}
+}
+
+// _____________________________________________________________________________
+void ColumnCodec::selectRange(const ColumnHeader& header, const char* data,
+                              uint16_t count, int64_t lo, int64_t hi,
+                              uint8_t* matches)
+{
+	switch (header.encoding)
+	{
+		case PAX_FOR:
+		{
+			// Translate the predicate into the code domain
+			if (hi < header.base || lo > hi)
+				{ memset(matches, 0, count); break; }
+			uint64_t loCode = lo <= header.base ? 0 :
+			                  (uint64_t)lo - (uint64_t)header.base;
+			uint64_t hiCode = (uint64_t)hi - (uint64_t)header.base;
+			for (uint16_t i = 0; i < count; i++)
+			{
+				uint64_t code = unpack(data, header.bitWidth, i);
+				matches[i] = (code >= loCode) & (code <= hiCode);
+			}
+			break;
+		}
+
+		case PAX_RLE:
+		{
+			// Evaluate once per run
+			auto runValues = reinterpret_cast<const int64_t*>(data);
+			auto runEnds = reinterpret_cast<const uint16_t*>(
+			               data + header.entries * sizeof(int64_t));
+			uint16_t row = 0;
+			for (uint16_t r = 0; r < header.entries && row < count; r++)
+			{
+				uint8_t match = runValues[r] >= lo && runValues[r] <= hi;
+				uint16_t end = min(runEnds[r], count);
+				memset(matches + row, match, end - row);
+				row = end;
+			}
+			break;
+		}
+
+		default:
+		{
+			auto v = reinterpret_cast<const int64_t*>(data);
+			for (uint16_t i = 0; i < count; i++)
+				matches[i] = (v[i] >= lo) & (v[i] <= hi);
+		}
+	}
+}
+
+// _____________________________________________________________________________
+void ColumnCodec::pack(const uint64_t* codes, uint16_t count, uint8_t width,
+                       vector<char>& out)
+{
+	vector<uint64_t> words(packedSize(count, width) / sizeof(uint64_t), 0);
+	for (uint16_t i = 0; width > 0 && i < count; i++)
+	{
+		uint64_t bit = (uint64_t)i * width;
+		uint64_t offset = bit % 64;
+		words[bit/64] |= codes[i] << offset;
+		if (offset + width > 64) words[bit/64 + 1] |= codes[i] >> (64 - offset);
+	}
+	out.insert(out.end(), (char*)words.data(),
+	           (char*)(words.data() + words.size()));
+}
+
+// _____________________________________________________________________________
+uint64_t ColumnCodec::unpack(const char* data, uint8_t width, uint16_t row)
+{
+	// Always combine two words, (hi << 1) << (63 - offset) is 0 for offset 0.
+	// Codes of width 0 are packed into the padding word only.
+	if (width == 0) return 0;
+	auto words = reinterpret_cast<const uint64_t*>(data);
+	uint64_t bit = (uint64_t)row * width;
+	uint64_t offset = bit % 64;
+	uint64_t value = (words[bit/64] >> offset) |
+	                 ((words[bit/64 + 1] << 1) << (63 - offset));
+	uint64_t mask = width == 64 ? ~0ull : (1ull << width) - 1;
+	return value & mask;
+}
+
+// _____________________________________________________________________________
+uint32_t ColumnCodec::packedSize(uint16_t count, uint8_t width)
+{
+	return ((count * width + 63) / 64 + 1) * sizeof(uint64_t);
+}
+
+// _____________________________________________________________________________
+void ColumnStats::clear()
+{
+	count = 0;
+	min = max = last = 0;
+	runs = 0;
+	distinct.clear();
+}
+
+// _____________________________________________________________________________
+void ColumnStats::add(const char* value)
+{
+	if (type == INTEGER)
+	{
+		int64_t v;
+		memcpy(&v, value, sizeof(int64_t));
+		if (count == 0) { min = max = v; runs = 1; }
+		else
+		{
+			min = std::min(min, v);
+			max = std::max(max, v);
+			runs += v != last;
+		}
+		last = v;
+	}
+	else
+	{
+		key.assign(value, length);
+		distinct.insert(key);
+	}
+	count++;
+}
+
+// _____________________________________________________________________________
+uint32_t ColumnStats::encodedSize(const char* next)
+{
+	// Mirrors the choice of the encoding in ColumnCodec::encode
+	uint16_t n = count + (next != nullptr);
+	uint32_t rawSize = n * length;
+	if (n == 0) return 0;
+
+	if (type == INTEGER)
+	{
+		int64_t lo = min, hi = max;
+		uint16_t r = runs;
+		if (next != nullptr)
+		{
+			int64_t v;
+			memcpy(&v, next, sizeof(int64_t));
+			if (count == 0) { lo = hi = v; r = 1; }
+			else
+			{
+				lo = std::min(lo, v);
+				hi = std::max(hi, v);
+				r += v != last;
+			}
+		}
+		uint64_t range = (uint64_t)hi - (uint64_t)lo;
+		uint8_t width = range == 0 ? 0 : 64 - __builtin_clzll(range);
+		uint32_t forSize = ColumnCodec::packedSize(n, width);
+		uint32_t rleSize = r * (sizeof(int64_t) + sizeof(uint16_t));
+		if (rleSize < forSize && rleSize < rawSize) return rleSize;
+		return forSize < rawSize ? forSize : rawSize;
+	}
+
+	uint64_t entries = distinct.size();
+	if (next != nullptr)
+	{
+		key.assign(next, length);
+		entries += distinct.count(key) == 0;
+	}
+	uint32_t dictSize = (entries * length + 7) / 8 * 8;
+	uint8_t width = entries <= 1 ? 0 : 64 - __builtin_clzll(entries - 1);
+	uint32_t size = dictSize + ColumnCodec::packedSize(n, width);
+	return size < rawSize ? size : rawSize;
+}
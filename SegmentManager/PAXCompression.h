@@ -0,0 +1,133 @@
+
+///////////////////////////////////////////////////////////////////////////////
+// PAXCompression.h
+//////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef PAXCOMPRESSION_H
+#define PAXCOMPRESSION_H
+
+#include "Schema.h"
+#include <stdint.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+
+// Encodings of a column chunk (the values of one attribute on one page)
+//
+// PAX_RAW: the plain values.
+// PAX_FOR: frame of reference, INTEGER only. The differences to the minimum
+// value (base) are bit-packed using bitWidth bits each.
+// PAX_RLE: run length encoding, INTEGER only. entries runs, stored as the
+// array of the run values followed by the array of the (exclusive) row ids
+// at which the runs end (uint16_t each).
+// PAX_DICT: dictionary, CHAR only. The entries distinct values, followed by
+// the bit-packed dictionary codes using bitWidth bits each.
+enum paxEncodings { PAX_RAW, PAX_FOR, PAX_RLE, PAX_DICT };
+
+
+// Describes the location and encoding of a column chunk on a compressed PAX
+// page. offset is relative to the start of the page.
+struct ColumnHeader
+{
+	uint32_t offset;
+	uint32_t size;
+	uint8_t encoding;
+	uint8_t bitWidth;
+	uint16_t entries;
+	int64_t base;
+};
+
+
+// Lightweight compression of PAX column chunks (see PAXSegment). Picks the
+// smallest encoding per chunk. All decoding loops work on fixed width codes
+// without branches, so that the compiler can vectorize them, and INTEGER
+// predicates are evaluated on the codes directly.
+class ColumnCodec
+{
+	friend class ColumnStats;
+
+public:
+
+	// Encodes the first count values of the given attribute found in values
+	// (a.length bytes each) into out. Fills in all fields of header except
+	// offset.
+	static void encode(const Attribute& a, const char* values, uint16_t count,
+	                   ColumnHeader& header, std::vector<char>& out);
+
+	// Decodes the first count values of the given column chunk to out
+	// (a.length bytes each).
+	static void decode(const Attribute& a, const ColumnHeader& header,
+	                   const char* data, uint16_t count, char* out);
+
+	// Decodes the value of the given row of the column chunk to out.
+	static void decodeValue(const Attribute& a, const ColumnHeader& header,
+	                        const char* data, uint16_t row, char* out);
+
+	// Sets matches[i] to 1 iff the value of row i of the given INTEGER column
+	// chunk lies in [lo, hi], and to 0 otherwise, for the first count rows.
+	static void selectRange(const ColumnHeader& header, const char* data,
+	                        uint16_t count, int64_t lo, int64_t hi,
+	                        uint8_t* matches);
+
+private:
+
+	// Bit-packs the first count codes using width bits each. Appends one
+	// extra word of padding, so that unpacking may always read two words.
+	// Codes of width 0 take no bits, only the padding word is written.
+	static void pack(const uint64_t* codes, uint16_t count, uint8_t width,
+	                 std::vector<char>& out);
+
+	// Returns the packed code of the given row, 0 without reading data iff
+	// width is 0.
+	static uint64_t unpack(const char* data, uint8_t width, uint16_t row);
+
+	// Returns the size of count codes bit-packed with width bits each.
+	static uint32_t packedSize(uint16_t count, uint8_t width);
+};
+
+
+// The statistics of a column chunk which values are appended to, from which
+// the size of its encoding (see ColumnCodec::encode) follows in constant
+// time, so that the chunk need not be encoded to find out whether it fits.
+class ColumnStats
+{
+public:
+
+	// Constructor, for an empty chunk of the given attribute
+	ColumnStats(const Attribute& a) : type(a.type), length(a.length)
+		{ clear(); }
+
+	// Removes all values from the chunk
+	void clear();
+
+	// Appends the given value (length bytes) to the chunk
+	void add(const char* value);
+
+	// Returns the size of the encoded chunk, including the given value iff
+	// it is not nullptr.
+	uint32_t encodedSize(const char* next = nullptr);
+
+private:
+
+	// The attribute's type and length
+	attrTypes type;
+	unsigned length;
+
+	// Number of values
+	uint16_t count;
+
+	// INTEGER chunks: the smallest, largest and last value, and the number
+	// of runs
+	int64_t min;
+	int64_t max;
+	int64_t last;
+	uint16_t runs;
+
+	// CHAR chunks: the distinct values, and a buffer to look values up
+	std::unordered_set<std::string> distinct;
+	std::string key;
+};
+
+#endif  // PAXCOMPRESSION_H
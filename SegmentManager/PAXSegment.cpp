@@ -0,0 +1,582 @@
+
+///////////////////////////////////////////////////////////////////////////////
+// PAXSegment.cpp
+///////////////////////////////////////////////////////////////////////////////
+
+#include "PAXSegment.h"
+#include "SMConst.h"
+#include <iostream>
+#include <stdlib.h>
+
+using namespace std;
+
+// Rounds n up to the next multiple of PAX_ALIGNMENT
+static unsigned align(unsigned n)
+{ return (n + PAX_ALIGNMENT - 1) / PAX_ALIGNMENT * PAX_ALIGNMENT; }
+
+// _____________________________________________________________________________
+PAXSegment::PAXSegment(BufferManager* bm, bool visible, uint64_t id,
+                       Extent* base, const Schema& schema, bool compressed)
+               : RegularSegment(visible, id, base), schema(schema)
+{
+	this->bm = bm;
+	this->compressed = compressed;
+	this->insertPage = 0;
+	this->stagedPage = 0;
+	this->stagedDirty = false;
+	computeLayout();
+	writeMetadata();
+}
+
+// _____________________________________________________________________________
+PAXSegment::PAXSegment(BufferManager* bm, bool visible, uint64_t id,
+                       Extent* base)
+               : RegularSegment(visible, id, base, true)
+{
+	this->bm = bm;
+	this->stagedPage = 0;
+	this->stagedDirty = false;
+	readMetadata();
+	computeLayout();
+}
+
+// _____________________________________________________________________________
+void PAXSegment::computeLayout()
+{
+	auto& attributes = schema.getAttributes();
+	if (compressed)
+	{
+		// Any number of rows may fit, at least a single raw row must
+		capacity = 1 << TID_CONS::slotBits;
+		validOffset = align(sizeof(PAXPageHeader));
+		directoryOffset = validOffset + align((capacity + 7) / 8);
+		chunkOffset = directoryOffset +
+		              align(attributes.size() * sizeof(ColumnHeader));
+		unsigned size = chunkOffset;
+		for (const Attribute& a : attributes)
+			size += (a.length + 7) / 8 * 8;
+		if (size > (unsigned)BM_CONS::pageSize)
+			{ SM_EXC::RecordLengthException e; throw e; }
+		for (const Attribute& a : attributes)
+		{
+			staged.push_back(vector<char>(capacity * a.length));
+			stagedStats.push_back(ColumnStats(a));
+		}
+		return;
+	}
+
+	// Find the largest number of rows for which header, bitmap and all
+	// minipages fit on a page. Row numbers must be addressable by a TID.
+	unsigned rows = 1 << TID_CONS::slotBits;
+	for (; rows > 0; rows--)
+	{
+		unsigned size = align(sizeof(PAXPageHeader)) + align((rows + 7) / 8);
+		for (const Attribute& a : schema.getAttributes())
+			size += align(rows * a.length);
+		if (size <= (unsigned)BM_CONS::pageSize) break;
+	}
+	if (rows == 0) { SM_EXC::RecordLengthException e; throw e; }
+
+	capacity = rows;
+	validOffset = align(sizeof(PAXPageHeader));
+	unsigned offset = validOffset + align((rows + 7) / 8);
+	for (const Attribute& a : schema.getAttributes())
+	{
+		minipageOffsets.push_back(offset);
+		offset += align(rows * a.length);
+	}
+}
+
+// _____________________________________________________________________________
+void PAXSegment::writeMetadata()
+{
+	// | insertPage | numAttributes | compressed | type | length | nameLength
+	// | name | ...
+	vector<char> bytes;
+	auto append = [&bytes](const void* data, size_t length)
+		{ bytes.insert(bytes.end(), (char*)data, (char*)data + length); };
+
+	uint64_t numAttributes = schema.getAttributes().size();
+	uint64_t isCompressed = compressed;
+	append(&insertPage, sizeof(uint64_t));
+	append(&numAttributes, sizeof(uint64_t));
+	append(&isCompressed, sizeof(uint64_t));
+	for (const Attribute& a : schema.getAttributes())
+	{
+		uint32_t fields[3] = { a.type, a.length, (uint32_t)a.name.size() };
+		append(fields, sizeof(fields));
+		append(a.name.data(), a.name.size());
+	}
+	if (bytes.size() > (size_t)BM_CONS::pageSize)
+		{ SM_EXC::InputLengthException e; throw e; }
+
+	BufferFrame& bf = bm->fixPage(this->firstPage(), true);
+	memcpy(bf.getData(), bytes.data(), bytes.size());
+	bm->unfixPage(bf, true);
+}
+
+// _____________________________________________________________________________
+void PAXSegment::readMetadata()
+{
+	// See writeMetadata
+	BufferFrame& bf = bm->fixPage(this->firstPage(), false);
+	auto data = reinterpret_cast<const char*>(bf.getData());
+	uint64_t numAttributes, isCompressed;
+	memcpy(&insertPage, data, sizeof(uint64_t));
+	memcpy(&numAttributes, data + sizeof(uint64_t), sizeof(uint64_t));
+	memcpy(&isCompressed, data + 2*sizeof(uint64_t), sizeof(uint64_t));
+	compressed = isCompressed;
+	size_t offset = 3*sizeof(uint64_t);
+	for (uint64_t i = 0; i < numAttributes; i++)
+	{
+		uint32_t fields[3];
+		memcpy(fields, data + offset, sizeof(fields));
+		offset += sizeof(fields);
+		string name(data + offset, fields[2]);
+		offset += fields[2];
+		schema.addAttribute(name, (attrTypes)fields[0], fields[1]);
+	}
+	bm->unfixPage(bf, false);
+}
+
+// _____________________________________________________________________________
+vector<uint64_t> PAXSegment::dataPages()
+{
+	// Pages are filled in extent order, skipping the metadata page
+	vector<uint64_t> pages;
+	if (insertPage == 0) return pages;
+	for (Extent& e : extents)
+	{
+		for (uint64_t page = e.start; page < e.end; page++)
+		{
+			if (page == this->firstPage()) continue;
+			pages.push_back(page);
+			if (page == insertPage) return pages;
+		}
+	}
+	return pages;
+}
+
+// _____________________________________________________________________________
+bool PAXSegment::isDataPage(uint64_t pageId)
+{
+	if (insertPage == 0 || pageId == this->firstPage()) return false;
+	for (Extent& e : extents)
+	{
+		// pageId comes first in extent order iff it is found before the
+		// insert page
+		bool hasPage = e.start <= pageId && pageId < e.end;
+		bool hasInsertPage = e.start <= insertPage && insertPage < e.end;
+		if (hasPage && hasInsertPage) return pageId <= insertPage;
+		if (hasPage) return true;
+		if (hasInsertPage) return false;
+	}
+	return false;
+}
+
+// _____________________________________________________________________________
+uint64_t PAXSegment::nextDataPage()
+{
+	bool passed = insertPage == 0;
+	for (Extent& e : extents)
+	{
+		for (uint64_t page = e.start; page < e.end; page++)
+		{
+			if (page == this->firstPage()) continue;
+			if (passed) return page;
+			passed = page == insertPage;
+		}
+	}
+	SM_EXC::PAXSegmentFullException e;
+	throw e;
+}
+
+// _____________________________________________________________________________
+TID PAXSegment::insert(const Record& r)
+{
+	if (r.getLen() != schema.getRecordLength())
+		{ SM_EXC::SchemaMismatchException e; throw e; }
+	if (compressed) return insertCompressed(r);
+
+	// Move on to the next page in extent order once the current one is full
+	BufferFrame* bf = nullptr;
+	PAXPageHeader* header = nullptr;
+	if (insertPage != 0)
+	{
+		bf = &bm->fixPage(insertPage, true);
+		header = reinterpret_cast<PAXPageHeader*>(bf->getData());
+		if (header->count == capacity) { bm->unfixPage(*bf, false); bf = 0; }
+	}
+	bool newPage = bf == nullptr;
+	if (newPage)
+	{
+		uint64_t next = nextDataPage();
+		bf = &bm->fixPage(next, true);
+		memset(bf->getData(), 0, BM_CONS::pageSize);
+		header = reinterpret_cast<PAXPageHeader*>(bf->getData());
+		insertPage = next;
+	}
+
+	// Scatter the attribute values into the minipages
+	auto data = reinterpret_cast<char*>(bf->getData());
+	uint16_t row = header->count++;
+	header->live++;
+	data[validOffset + row/8] |= 1 << (row%8);
+	auto& attributes = schema.getAttributes();
+	for (size_t i = 0; i < attributes.size(); i++)
+		memcpy(data + minipageOffsets[i] + row * attributes[i].length,
+		       r.getData() + attributes[i].offset, attributes[i].length);
+	bm->unfixPage(*bf, true);
+	if (newPage) writeMetadata();
+
+	TID tid;
+	tid.pageId = insertPage;
+	tid.slotId = row;
+	return tid;
+}
+
+// _____________________________________________________________________________
+TID PAXSegment::insertCompressed(const Record& r)
+{
+	// Move on to the next page once the current one is full, and encode the
+	// rows staged for it
+	BufferFrame* bf = nullptr;
+	PAXPageHeader* header = nullptr;
+	if (insertPage != 0)
+	{
+		bf = &bm->fixPage(insertPage, true);
+		auto data = reinterpret_cast<char*>(bf->getData());
+		header = reinterpret_cast<PAXPageHeader*>(data);
+		if (stagedPage != insertPage)
+		{
+			decodePage(data, staged);
+			stage(header->count);
+			stagedPage = insertPage;
+		}
+		if (header->count == capacity ||
+		    stagedSize(&r) > (unsigned)BM_CONS::pageSize)
+		{
+			if (stagedDirty) encodePage(staged, header->count, data);
+			stagedDirty = false;
+			bm->unfixPage(*bf, true);
+			bf = nullptr;
+		}
+	}
+	bool newPage = bf == nullptr;
+	if (newPage)
+	{
+		uint64_t next = nextDataPage();
+		bf = &bm->fixPage(next, true);
+		memset(bf->getData(), 0, BM_CONS::pageSize);
+		header = reinterpret_cast<PAXPageHeader*>(bf->getData());
+		insertPage = stagedPage = next;
+		stage(0);
+	}
+
+	// Append r to the staged columns
+	auto& attributes = schema.getAttributes();
+	auto data = reinterpret_cast<char*>(bf->getData());
+	uint16_t row = header->count++;
+	for (size_t i = 0; i < attributes.size(); i++)
+	{
+		char* value = staged[i].data() + row * attributes[i].length;
+		memcpy(value, r.getData() + attributes[i].offset, attributes[i].length);
+		stagedStats[i].add(value);
+	}
+	stagedDirty = true;
+	header->live++;
+	data[validOffset + row/8] |= 1 << (row%8);
+	bm->unfixPage(*bf, true);
+	if (newPage) writeMetadata();
+
+	TID tid;
+	tid.pageId = insertPage;
+	tid.slotId = row;
+	return tid;
+}
+
+// _____________________________________________________________________________
+void PAXSegment::stage(uint16_t count)
+{
+	auto& attributes = schema.getAttributes();
+	for (size_t i = 0; i < attributes.size(); i++)
+	{
+		stagedStats[i].clear();
+		for (uint16_t row = 0; row < count; row++)
+			stagedStats[i].add(staged[i].data() + row * attributes[i].length);
+	}
+	stagedDirty = false;
+}
+
+// _____________________________________________________________________________
+unsigned PAXSegment::stagedSize(const Record* r)
+{
+	// See encodePage
+	auto& attributes = schema.getAttributes();
+	unsigned size = chunkOffset;
+	for (size_t i = 0; i < attributes.size(); i++)
+	{
+		const char* next = r ? r->getData() + attributes[i].offset : nullptr;
+		size += (stagedStats[i].encodedSize(next) + 7) / 8 * 8;
+	}
+	return size;
+}
+
+// _____________________________________________________________________________
+void PAXSegment::flushStaged()
+{
+	if (!stagedDirty) return;
+	BufferFrame& bf = bm->fixPage(stagedPage, true);
+	auto data = reinterpret_cast<char*>(bf.getData());
+	encodePage(staged, reinterpret_cast<PAXPageHeader*>(data)->count, data);
+	stagedDirty = false;
+	bm->unfixPage(bf, true);
+}
+
+// _____________________________________________________________________________
+void PAXSegment::flush()
+{
+	if (compressed) flushStaged();
+}
+
+// _____________________________________________________________________________
+void PAXSegment::decodePage(const char* data, vector<vector<char>>& columns)
+{
+	auto& attributes = schema.getAttributes();
+	uint16_t count = reinterpret_cast<const PAXPageHeader*>(data)->count;
+	const ColumnHeader* headers = directory(data);
+	columns.resize(attributes.size());
+	for (size_t i = 0; i < attributes.size(); i++)
+	{
+		columns[i].resize(capacity * attributes[i].length);
+		ColumnCodec::decode(attributes[i], headers[i], data + headers[i].offset,
+		                    count, columns[i].data());
+	}
+}
+
+// _____________________________________________________________________________
+bool PAXSegment::encodePage(const vector<vector<char>>& columns,
+                            uint16_t count, char* data)
+{
+	auto& attributes = schema.getAttributes();
+	vector<ColumnHeader> headers(attributes.size());
+	vector<vector<char>> chunks(attributes.size());
+	unsigned offset = chunkOffset;
+	for (size_t i = 0; i < attributes.size(); i++)
+	{
+		ColumnCodec::encode(attributes[i], columns[i].data(), count, headers[i],
+		                    chunks[i]);
+		headers[i].offset = offset;
+		offset += (headers[i].size + 7) / 8 * 8;
+	}
+	if (offset > (unsigned)BM_CONS::pageSize) return false;
+
+	memcpy(data + directoryOffset, headers.data(),
+	       headers.size() * sizeof(ColumnHeader));
+	for (size_t i = 0; i < attributes.size(); i++)
+		memcpy(data + headers[i].offset, chunks[i].data(), chunks[i].size());
+	return true;
+}
+
+// _____________________________________________________________________________
+bool PAXSegment::remove(TID tid)
+{
+	if (!isDataPage(tid.pageId)) return false;
+
+	BufferFrame& bf = bm->fixPage(tid.pageId, true);
+	auto data = reinterpret_cast<char*>(bf.getData());
+	auto header = reinterpret_cast<PAXPageHeader*>(data);
+	auto& valid = reinterpret_cast<uint8_t&>(data[validOffset+tid.slotId/8]);
+	bool found = tid.slotId < header->count && valid & (1 << tid.slotId%8);
+	if (found)
+	{
+		valid &= ~(1 << tid.slotId%8);
+		header->live--;
+	}
+	bm->unfixPage(bf, found);
+	return found;
+}
+
+// _____________________________________________________________________________
+shared_ptr<Record> PAXSegment::lookup(TID tid)
+{
+	if (!isDataPage(tid.pageId)) return nullptr;
+
+	BufferFrame& bf = bm->fixPage(tid.pageId, false);
+	auto data = reinterpret_cast<const char*>(bf.getData());
+	auto header = reinterpret_cast<const PAXPageHeader*>(data);
+	shared_ptr<Record> record = nullptr;
+	if (tid.slotId < header->count &&
+	    data[validOffset + tid.slotId/8] & (1 << tid.slotId%8))
+	{
+		// Gather the attribute values from the minipages, or from the staged
+		// columns of the insert page
+		vector<char> bytes(schema.getRecordLength());
+		auto& attributes = schema.getAttributes();
+		for (size_t i = 0; i < attributes.size(); i++)
+		{
+			if (compressed && tid.pageId == stagedPage)
+				memcpy(bytes.data() + attributes[i].offset,
+				       staged[i].data() + tid.slotId * attributes[i].length,
+				       attributes[i].length);
+			else if (compressed)
+			{
+				const ColumnHeader& header = directory(data)[i];
+				ColumnCodec::decodeValue(attributes[i], header,
+				                         data + header.offset, tid.slotId,
+				                         bytes.data() + attributes[i].offset);
+			}
+			else
+				memcpy(bytes.data() + attributes[i].offset,
+				       data + minipageOffsets[i]+tid.slotId*attributes[i].length,
+				       attributes[i].length);
+		}
+		record = shared_ptr<Record>(new Record(bytes.size(), bytes.data()));
+	}
+	bm->unfixPage(bf, false);
+	return record;
+}
+
+// _____________________________________________________________________________
+bool PAXSegment::update(TID tid, const Record& r)
+{
+	if (r.getLen() != schema.getRecordLength())
+		{ SM_EXC::SchemaMismatchException e; throw e; }
+	if (!isDataPage(tid.pageId)) return false;
+
+	BufferFrame& bf = bm->fixPage(tid.pageId, true);
+	auto data = reinterpret_cast<char*>(bf.getData());
+	auto header = reinterpret_cast<PAXPageHeader*>(data);
+	bool found = tid.slotId < header->count &&
+	             data[validOffset + tid.slotId/8] & (1 << tid.slotId%8);
+	auto& attributes = schema.getAttributes();
+	bool overflow = false;
+	if (found && compressed && tid.pageId == stagedPage)
+	{
+		// Update the staged row, and restore it iff the page would overflow
+		vector<char> old(schema.getRecordLength());
+		for (size_t i = 0; i < attributes.size(); i++)
+		{
+			char* value = staged[i].data() + tid.slotId * attributes[i].length;
+			memcpy(old.data() + attributes[i].offset, value,
+			       attributes[i].length);
+			memcpy(value, r.getData() + attributes[i].offset,
+			       attributes[i].length);
+		}
+		stage(header->count);
+		overflow = stagedSize(nullptr) > (unsigned)BM_CONS::pageSize;
+		for (size_t i = 0; i < attributes.size() && overflow; i++)
+			memcpy(staged[i].data() + tid.slotId * attributes[i].length,
+			       old.data() + attributes[i].offset, attributes[i].length);
+		if (overflow) stage(header->count);
+		stagedDirty = true;
+	}
+	else if (found && compressed)
+	{
+		// Re-encode the page with the new values
+		vector<vector<char>> columns;
+		decodePage(data, columns);
+		for (size_t i = 0; i < attributes.size(); i++)
+			memcpy(columns[i].data() + tid.slotId * attributes[i].length,
+			       r.getData() + attributes[i].offset, attributes[i].length);
+		overflow = !encodePage(columns, header->count, data);
+	}
+	else if (found)
+	{
+		for (size_t i = 0; i < attributes.size(); i++)
+			memcpy(data + minipageOffsets[i] + tid.slotId*attributes[i].length,
+			       r.getData() + attributes[i].offset, attributes[i].length);
+	}
+	bm->unfixPage(bf, found && !overflow);
+	if (overflow) { SM_EXC::PAXPageOverflowException e; throw e; }
+	return found;
+}
+
+// _____________________________________________________________________________
+void PAXSegment::scan(const vector<unsigned>& attrs,
+                      const function<void(const ColumnBatch&)>& consumer)
+{
+	// Aligned buffers for the decoded column chunks
+	if (compressed) flushStaged();
+	auto& attributes = schema.getAttributes();
+	vector<char*> buffers;
+	for (size_t i = 0; i < attrs.size() && compressed; i++)
+	{
+		void* buffer = nullptr;
+		if (posix_memalign(&buffer, PAX_ALIGNMENT,
+		                   capacity * attributes[attrs[i]].length) != 0)
+			{ cout << "Error allocating scan buffer" << endl; exit(1); }
+		buffers.push_back(reinterpret_cast<char*>(buffer));
+	}
+
+	for (uint64_t page : dataPages())
+	{
+		BufferFrame& bf = bm->fixPage(page, false);
+		auto data = reinterpret_cast<const char*>(bf.getData());
+		ColumnBatch batch;
+		batch.pageId = page;
+		batch.count = reinterpret_cast<const PAXPageHeader*>(data)->count;
+		batch.valid = reinterpret_cast<const uint8_t*>(data + validOffset);
+		for (size_t i = 0; i < attrs.size(); i++)
+		{
+			if (!compressed)
+			{
+				batch.columns.push_back(data + minipageOffsets[attrs[i]]);
+				continue;
+			}
+			const ColumnHeader& header = directory(data)[attrs[i]];
+			ColumnCodec::decode(attributes[attrs[i]], header,
+			                    data + header.offset, batch.count, buffers[i]);
+			batch.columns.push_back(buffers[i]);
+		}
+		consumer(batch);
+		bm->unfixPage(bf, false);
+	}
+
+	for (char* buffer : buffers)
+		free(buffer);
+}
+
+// _____________________________________________________________________________
+vector<TID> PAXSegment::selectRange(unsigned attr, int64_t lo, int64_t hi)
+{
+	auto& attributes = schema.getAttributes();
+	if (attr >= attributes.size() || attributes[attr].type != INTEGER)
+		{ SM_EXC::SchemaMismatchException e; throw e; }
+	if (compressed) flushStaged();
+	vector<TID> result;
+	vector<uint8_t> matches(capacity);
+	for (uint64_t page : dataPages())
+	{
+		// Evaluate the predicate for all rows without branches, then collect
+		// the matching rows
+		BufferFrame& bf = bm->fixPage(page, false);
+		auto data = reinterpret_cast<const char*>(bf.getData());
+		uint16_t count = reinterpret_cast<const PAXPageHeader*>(data)->count;
+		auto valid = reinterpret_cast<const uint8_t*>(data + validOffset);
+		if (compressed)
+		{
+			const ColumnHeader& header = directory(data)[attr];
+			ColumnCodec::selectRange(header, data + header.offset, count, lo, hi,
+			                         matches.data());
+		}
+		else
+		{
+			auto values = reinterpret_cast<const int64_t*>(
+				__builtin_assume_aligned(data + minipageOffsets[attr],
+				                         PAX_ALIGNMENT));
+			for (uint16_t i = 0; i < count; i++)
+				matches[i] = (values[i] >= lo) & (values[i] <= hi);
+		}
+		for (uint16_t i = 0; i < count; i++)
+		{
+			if (!(matches[i] & (valid[i/8] >> (i%8)))) continue;
+			TID tid;
+			tid.pageId = page;
+			tid.slotId = i;
+			result.push_back(tid);
+		}
+		bm->unfixPage(bf, false);
+	}
+	return result;
+}
@@ -0,0 +1,207 @@
+
+///////////////////////////////////////////////////////////////////////////////
+// PAXSegment.h
+//////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef PAXSEGMENT_H
+#define PAXSEGMENT_H
+
+#include "../BufferManager/BufferManager.h"
+#include "RegularSegment.h"
+#include "Schema.h"
+#include "Record.h"
+#include "PAXCompression.h"
+#include "TID.h"
+#include <functional>
+#include <memory>
+
+
+// The header of a PAX page, padded to PAX_ALIGNMENT bytes. count is the
+// number of rows ever inserted into the page, live the number of rows not
+// removed since.
+struct PAXPageHeader
+{
+	uint16_t count;
+	uint16_t live;
+};
+
+// The alignment of minipages, chosen so that fixed width columns can be
+// processed with (aligned) vector instructions.
+const unsigned PAX_ALIGNMENT = 64;
+
+// The rows [0, count) of a PAX page, as seen by a column scan. columns holds
+// the start of the minipage of every requested attribute, valid a bitmap
+// marking the rows which have not been removed.
+struct ColumnBatch
+{
+	uint64_t pageId;
+	uint16_t count;
+	const uint8_t* valid;
+	std::vector<const char*> columns;
+};
+
+
+// A segment based on PAX (partition attributes across) pages. Records follow
+// a fixed schema. Every page holds up to getCapacity() records, and stores
+// the values of each attribute contiguously in a minipage of its own, so
+// that a scan only touches the bytes of the attributes it needs.
+//
+// The first page of the segment holds its metadata (schema and current
+// insert page). The data pages are filled in order, rows are never moved,
+// and the rows of removed records are not reused.
+//
+// Page layout:
+// | header | valid bitmap | minipage attribute 0 | minipage attribute 1 | ...
+// where every part starts at a multiple of PAX_ALIGNMENT.
+//
+// Compressed segments (CPAX_SGM) store each minipage as a column chunk
+// encoded by ColumnCodec, so that a page holds up to 2^slotBits rows:
+// | header | valid bitmap | column directory | chunk 0 | chunk 1 | ...
+// The directory holds a ColumnHeader per attribute, chunks are 8 byte
+// aligned. The rows of the insert page are staged uncompressed in memory,
+// while ColumnStats track the size of their encoding, so that a new page is
+// started once they would not fit anymore. They are only encoded to the page
+// when it is sealed, flushed, or scanned.
+class PAXSegment : public RegularSegment
+{
+public:
+
+	// Constructor. Creates a new segment with the given schema, and writes
+	// its metadata to the first page of the segment.
+	PAXSegment(BufferManager* bm, bool visible, uint64_t id, Extent* base,
+	           const Schema& schema, bool compressed = false);
+
+	// Constructor. Recovers a segment from file, whose first extent is base,
+	// from the metadata on its first page.
+	PAXSegment(BufferManager* bm, bool visible, uint64_t id, Extent* base);
+	~PAXSegment() { }
+
+	// Inserts r, which must be laid out according to the schema. Throws
+	// SchemaMismatchException iff the length of r does not match the schema,
+	// and PAXSegmentFullException iff the segment must be grown.
+	TID insert(const Record& r);
+
+	// Marks the record pointed to by tid as removed. Returns true iff remove
+	// was successful.
+	bool remove(TID tid);
+
+	// Reassembles the record associated with tid from the minipages. Returns
+	// nullptr iff tid is invalid.
+	std::shared_ptr<Record> lookup(TID tid);
+
+	// Updates the record associated with tid in place. Returns false iff tid
+	// is invalid. Throws SchemaMismatchException as insert. Rows are never
+	// moved, so iff the re-encoded values of a compressed page do not fit on
+	// the page anymore, PAXPageOverflowException is thrown and the record is
+	// left unchanged; it may be removed and inserted again instead.
+	bool update(TID tid, const Record& r);
+
+	// Passes the given attributes (schema indices) of every page's rows to
+	// consumer, page by page. The page is fixed in shared mode while consumer
+	// runs, other minipages are never read. Compressed column chunks are
+	// decoded to aligned buffers first.
+	void scan(const std::vector<unsigned>& attrs,
+	          const std::function<void(const ColumnBatch&)>& consumer);
+
+	// Returns the TIDs of all records whose INTEGER attribute attr lies in
+	// [lo, hi]. Evaluates the predicate branch free over the aligned
+	// minipage, so that the compiler can vectorize it. Compressed column
+	// chunks are filtered without decoding them. Throws 
+	// SchemaMismatchException iff attr is not an INTEGER attribute.
+	std::vector<TID> selectRange(unsigned attr, int64_t lo, int64_t hi);
+
+	// Getter methods
+	const Schema& getSchema() { return schema; }
+	uint16_t getCapacity() { return capacity; }
+	bool isCompressed() { return compressed; }
+	segTypes getType() { return compressed ? CPAX_SGM : PAX_SGM; }
+
+	// Override, encodes the staged rows of a compressed segment
+	void flush();
+
+private:
+
+	// Computes the capacity of a page and the offsets of its minipages.
+	void computeLayout();
+
+	// Writes the schema and the current insert page to the first page.
+	void writeMetadata();
+
+	// Reads the schema and the current insert page from the first page.
+	void readMetadata();
+
+	// Returns the data pages of this segment up to and including the current
+	// insert page, in insert order.
+	std::vector<uint64_t> dataPages();
+
+	// Returns true iff the given page is a data page of this segment which
+	// has already been initialized.
+	bool isDataPage(uint64_t pageId);
+
+	// Returns the page following the insert page in extent order. Throws
+	// PAXSegmentFullException iff there is none.
+	uint64_t nextDataPage();
+
+	// Inserts r into a compressed segment.
+	TID insertCompressed(const Record& r);
+
+	// Stages the first count rows of the decoded columns of the insert page.
+	void stage(uint16_t count);
+
+	// Returns the size of the compressed insert page holding the staged rows,
+	// and r iff it is not nullptr.
+	unsigned stagedSize(const Record* r);
+
+	// Encodes the staged rows to the insert page iff they have changed since
+	// they have been encoded last.
+	void flushStaged();
+
+	// Returns the column directory of a compressed page.
+	const ColumnHeader* directory(const char* data)
+		{ return reinterpret_cast<const ColumnHeader*>(data+directoryOffset); }
+
+	// Decodes all column chunks of a compressed page to columns.
+	void decodePage(const char* data, std::vector<std::vector<char>>& columns);
+
+	// Encodes the first count rows of columns to the compressed page data.
+	// Returns false, leaving the page unchanged, iff they do not fit.
+	bool encodePage(const std::vector<std::vector<char>>& columns,
+	                uint16_t count, char* data);
+
+	// The schema of the records in this segment
+	Schema schema;
+
+	// True iff pages are compressed
+	bool compressed;
+
+	// Max number of rows per page
+	uint16_t capacity;
+
+	// Offset of the valid bitmap, and of the minipage of each attribute
+	unsigned validOffset;
+	std::vector<unsigned> minipageOffsets;
+
+	// Offsets of the column directory and of the first column chunk of a
+	// compressed page
+	unsigned directoryOffset;
+	unsigned chunkOffset;
+
+	// The decoded columns of the insert page of a compressed segment, the
+	// page they belong to (0 iff none), the statistics of their first rows,
+	// and whether they have changed since they have been encoded last
+	std::vector<std::vector<char>> staged;
+	uint64_t stagedPage;
+	std::vector<ColumnStats> stagedStats;
+	bool stagedDirty;
+
+	// The page records are currently appended to, 0 iff there is none yet
+	uint64_t insertPage;
+
+	// Reference to the Buffer Manager. This class does not take responsibility
+	// for the destruction of this pointer.
+	BufferManager* bm;
+};
+
+
+#endif  // PAXSEGMENT_H
@@ -31,6 +31,18 @@ public:
 	// need to make memory management arrangements based on the free
 	// space in the segment.
 	virtual void notifySegGrowth(Extent e) {  }
+
+	// Returns true iff none of the pages of extent e is in use, so that the
+	// SM may remove e from this segment again (see 
+	// SegmentManager::shrinkSegment). Formatless segments cannot tell.
+	virtual bool canRelease(const Extent& e) { return false; }
+
+	// Notifies this RegularSegment that the SM has removed the extent e.
+	virtual void notifySegShrink(Extent e) {  }
+
+	// Writes the state this RegularSegment keeps in main memory to its 
+	// pages. Called by the SI when the database is closed.
+	virtual void flush() {  }
 	
 protected:
 
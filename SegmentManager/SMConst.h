@@ -31,6 +31,30 @@ namespace SM_EXC
   		virtual const char* what() const throw()
   		{ return "SPSegment is full -> grow segment using SM"; }
 	};
+
+	struct PAXSegmentFullException: public std::exception
+	{
+  		virtual const char* what() const throw()
+  		{ return "PAXSegment is full -> grow segment using SM"; }
+	};
+
+	struct PAXPageOverflowException: public std::exception
+	{
+  		virtual const char* what() const throw()
+  		{ return "Updated values do not fit on their compressed PAX page"; }
+	};
+
+	struct SchemaMismatchException: public std::exception
+	{
+  		virtual const char* what() const throw()
+  		{ return "Record does not match the schema of the segment"; }
+	};
+
+	struct SchemaMissingException: public std::exception
+	{
+  		virtual const char* what() const throw()
+  		{ return "Segment has no schema"; }
+	};
 }
 
 struct SMConst
@@ -47,6 +71,39 @@ struct SMConst
 	
 	// The size of a base extent
 	static const uint64_t baseExtentSize = 30;
+
+	// The max size of an extent added to a segment by the default extent
+	// growth policy (see SegmentManager::growSegment)
+	static const uint64_t maxExtentSize = 4096;
+
+	// Whether the next extent of a segment is allocated in the background
+	// whenever the segment is grown (see SegmentManager::preallocate)
+	static const bool preallocate = true;
+
+	// Number of pages of the metadata log of the SI and FSI (see 
+	// SegmentInventory). The inventories are compacted into snapshots
+	// whenever the log is half full.
+	static const uint64_t logPages = 8;
+
+	// Max number of extents of the FSI of an SP segment (see SegmentFSI)
+	static const uint64_t maxFSIExtents = 64;
+
+	// Number of pages per block of the summary an SP segment's FSI keeps in
+	// main memory (see SegmentFSI)
+	static const uint64_t fsiBlockPages = 1024;
+
+	// Number of milliseconds after which the target page of a thread which
+	// has not inserted into an SP segment meanwhile may be taken over by
+	// other threads (see SegmentFSI::getPage)
+	static const uint64_t claimTimeout = 500;
+
+	// Number of consecutive pages handed out to a worker thread as one unit
+	// of work (morsel) during a parallel segment scan.
+	static const uint64_t morselSize = 8;
+
+	// Moved records are only evacuated by SPSegment::compact from pages with
+	// at least this many free bytes.
+	static const uint64_t compactionFreeSpace = 2048;
 };
 
 
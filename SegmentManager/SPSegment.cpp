@@ -5,48 +5,127 @@
 
 #include "SPSegment.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
 
 using namespace std;
 
+// Returns true iff lhs starts before rhs
+bool extentStartComp(const Extent& lhs, const Extent& rhs)
+{ return lhs.start < rhs.start; }
+
 // _____________________________________________________________________________
-SPSegment::SPSegment(BufferManager* bm, bool visible, uint64_t id, Extent* base) 
-               : RegularSegment(visible, id, base)
+SPSegment::SPSegment(BufferManager* bm, bool visible, uint64_t id, Extent* base,
+                     const Schema* schema, bool recovered) 
+               : RegularSegment(visible, id, base, recovered)
 { 
 	this->bm = bm;
+
+	// The FSI and the zone maps of a recovered segment are read from file on
+	// first use (see getFSI and getZones), when the SI has added all of the
+	// segment's extents.
+	fsi = nullptr;
+	zones = nullptr;
+	if (this->recovered) return;
+
+	// If segment is being created for the first time, create a new FSI,
+	// which materializes itself on the first page.
 	fsi = new SegmentFSI(bm, this->getSize(), this->firstPage());
+	if (schema == nullptr) return;
+
+	// The schema is kept for recovery
+	zones = new ZoneMap(*schema, this->getSize());
+	vector<char> bytes;
+	ZoneMap::writeSchema(*schema, bytes);
+	fsi->schemaPage = insertLargeRecord(Record(bytes.size(), bytes.data()));
+	fsi->writeHeader();
+}
+
+// _____________________________________________________________________________
+SPSegment::~SPSegment()
+{
+	delete fsi;
+	delete zones;
+}
 
-	// Initialize this segment's internal FSI directly from file.
-	if (this->recovered)
+// _____________________________________________________________________________
+SegmentFSI* SPSegment::getFSI()
+{
+	call_once(fsiLoaded, [this]()
 	{
-		// Read FSI size and extents. Assumption: size field and extents
-		// all fit / can be found on the first page of the segment.
-		BufferFrame& bf = bm->fixPage(this->firstPage(), false);
-		auto header = reinterpret_cast<unsigned char*>(bf.getData());
-		fsi->deserialize(header);
-		bm->unfixPage(bf, false);
-	}
+		if (fsi == nullptr) fsi = new SegmentFSI(bm, this->firstPage());
+	});
+	return fsi;
+}
 
-	// If segment is being created for the first time, create a new FSI
-	// and materialize it to file. It is assumed that the FSI will fit on the
-	// first page in this case.
-	else
+// _____________________________________________________________________________
+ZoneMap* SPSegment::getZones()
+{
+	call_once(zonesLoaded, [this]()
 	{
-		auto serialized = fsi->serialize();
-		BufferFrame& bf = bm->fixPage(this->firstPage(), true);
-		memcpy(bf.getData(), serialized.first, serialized.second);
-		bm->unfixPage(bf, true);
-		delete[] serialized.first;
-	}
+		if (!this->recovered || getFSI()->schemaPage == 0) return;
+		shared_ptr<Record> schema = lookupLargeRecord(getFSI()->schemaPage);
+		zones = new ZoneMap(ZoneMap::readSchema(schema->getData()), 
+		                    this->getSize());
+		zones->forget();
+
+		// Persisted zones are only valid until the segment is modified, so
+		// they are dropped as soon as they have been read
+		uint64_t zonesPage = getFSI()->zonesPage;
+		if (zonesPage == 0) return;
+		zones->readZones(lookupLargeRecord(zonesPage)->getData());
+		{
+			SegmentFSI::LayoutGuard guard(getFSI(), true);
+			getFSI()->zonesPage = 0;
+			getFSI()->writeHeader();
+		}
+		removeLargeRecord(zonesPage);
+	});
+	return zones;
 }
 
 // _____________________________________________________________________________
-SPSegment::~SPSegment()
+void SPSegment::flush()
 {
-	delete fsi;
+	if (getZones() == nullptr) return;
+	vector<char> bytes;
+	zones->writeZones(bytes);
+
+	// Without empty pages left, the zones are lost, and recomputed by the
+	// predicate scans after recovery
+	try 
+	{ 
+		uint64_t zonesPage = insertLargeRecord(Record(bytes.size(), 
+		                                              bytes.data()));
+		SegmentFSI::LayoutGuard guard(getFSI(), true);
+		getFSI()->zonesPage = zonesPage;
+		getFSI()->writeHeader();
+	}
+	catch (SM_EXC::SPSegmentFullException& e) { }
 }
 
 // _____________________________________________________________________________
 TID SPSegment::insert(const Record& r)
+{
+	TID tid;
+	if (!isLarge(r.getLen())) tid = insertItem(r, SP_RECORD);
+
+	// Write the payload first, then reference its header page from a slot
+	else
+	{
+		uint64_t headerPage = insertLargeRecord(r);
+		try { tid = insertItem(Record(sizeof(uint64_t), (char*)&headerPage), 
+		                       SP_BLOB); }
+		catch (...) { removeLargeRecord(headerPage); throw; }
+	}
+	updateZones(tid.pageId, r);
+	return tid;
+}
+
+// _____________________________________________________________________________
+TID SPSegment::insertItem(const Record& r, unsigned type)
 {
 	// Query this segment's FSI for the index of a page in this segment
 	// (assume pages are numbered from 0 to n) which can accomodate r.
@@ -58,13 +137,15 @@ TID SPSegment::insert(const Record& r)
 	// page. If this is not possible, check if the page has enough space for
 	// the record and a new slot. If this is again not possible, then begin
 	// a new search, this time for r.getLen() + sizeof(slot) bytes.
+	// Note: r occupies at least sizeof(TID) bytes (see SlottedPage::footprint)
 	auto lastValid =  this->getSize() % 2 == 0 ? true : false;
 	auto slotSize = sizeof(SlottedPageSlot);
+	auto rSpace = SlottedPage::footprint(r.getLen());
 	bool secondRun = false;
 	while (true)
 	{
-		auto insertPage = secondRun? fsi->getPage(r.getLen()+slotSize,lastValid) 
-									 : fsi->getPage(r.getLen(), lastValid);                         
+		auto insertPage = 
+			getFSI()->getPage(secondRun ? rSpace+slotSize : rSpace, lastValid);
 		bool pageEmpty = insertPage.second;
 		auto pageToUpdate = insertPage.first;
 
@@ -77,8 +158,11 @@ TID SPSegment::insert(const Record& r)
 		// no free slots -> check that record + 1x slot fit in 
 		// pageSize-sizeof(header)
 		auto dataSize = BM_CONS::pageSize-sizeof(SlottedPageHeader);
-		if (pageEmpty && (r.getLen()+slotSize > dataSize))
-			{ SM_EXC::RecordLengthException e; throw e;}
+		if (pageEmpty && (rSpace+slotSize > dataSize))
+		{
+			getFSI()->releaseClaim();
+			SM_EXC::RecordLengthException e; throw e;
+		}
 		
 		// Otherwise, page has been initialized and was chosen now already
 		// considering the space taken up by the header. Therefore, proceed 
@@ -86,19 +170,28 @@ TID SPSegment::insert(const Record& r)
 		uint64_t fixedPage = this->nextPage(insertPage.first);
 		BufferFrame& bf = bm->fixPage(fixedPage, true);
 		SlottedPage* slottedPage = reinterpret_cast<SlottedPage*>(bf.getData());
-		auto insertResult = slottedPage->insert(r, !pageEmpty);
+		auto insertResult = slottedPage->insert(r, !pageEmpty, type);
 
 		if (insertResult == nullptr)
 		{
+			// A page without any slot left cannot take further records, so
+			// make sure it is not chosen again
+			auto& header = slottedPage->getHeader();
+			if (header.slotCount >= TID_CONS::maxSlots && 
+			    header.firstFreeSlot == SP_NO_FREE_SLOT)
+				getFSI()->update(pageToUpdate, 0);
+			bm->unfixPage(bf, false);
 			if (secondRun) { SM_EXC::SPSegmentFullException e; throw e; }
 			else secondRun = true;
 		}
 		else 
 		{ 
+			// Update the page in the FSI in which the record was inserted,
+			// while the page is still fixed, so that concurrent updates of 
+			// its FSI entry are applied in the same order as to the page.
+			getFSI()->update(pageToUpdate, insertResult->second);
 			bm->unfixPage(bf, true);
-	
-			// Update the page in the FSI in which the record was inserted.
-			fsi->update(pageToUpdate, insertResult->second);
+
 			TID returnTID;
 			returnTID.pageId = fixedPage;
 			returnTID.slotId = insertResult->first;
@@ -113,12 +206,28 @@ bool SPSegment::remove(TID tid)
 	// Check that the page actually belongs to this segment
 	if (!this->inSegment(tid.pageId)) return false;
 	
-	// Load page, look for and update slot
+	// Load page, look for and update slot. Moved records may only be
+	// removed through their home slot.
 	BufferFrame& bf = bm->fixPage(tid.pageId, true);
 	SlottedPage* slottedPage = reinterpret_cast<SlottedPage*>(bf.getData());
-	bool removeSuccess = slottedPage->remove(tid.slotId);
+	SlottedPageSlot* slot = slottedPage->getSlot(tid.slotId);
+	if (slot == nullptr || slot->type == SP_MOVED)
+	{
+		bm->unfixPage(bf, false);
+		return false;
+	}
+
+	unsigned type = slot->type;
+	uint64_t reference = 0;
+	if (type != SP_RECORD)
+		memcpy(&reference, slottedPage->getData()+slot->offset, sizeof(TID));
+
+	slottedPage->remove(tid.slotId);
+	updateFSI(tid.pageId, slottedPage);
 	bm->unfixPage(bf, true);
-	return removeSuccess;
+
+	releaseReference(type, reference, tid);
+	return true;
 }
 
 // _____________________________________________________________________________
@@ -127,12 +236,97 @@ shared_ptr<Record> SPSegment::lookup(TID tid)
 	// Check that the page actually belongs to this segment
 	if (!this->inSegment(tid.pageId)) return nullptr;
 
-	// Load page, query slotted page
+	// The record may have been moved on meanwhile (see compact), which 
+	// redirects its home slot before the old copy is removed. The home slot 
+	// is read once more then.
+	for (unsigned attempt = 0; attempt < 2; attempt++)
+	{
+		// Load page, query slotted page
+		BufferFrame& bf = bm->fixPage(tid.pageId, false);
+		SlottedPage* slottedPage = reinterpret_cast<SlottedPage*>(bf.getData());
+		SlottedPageSlot* slot = slottedPage->getSlot(tid.slotId);
+		shared_ptr<Record> record = nullptr;
+		unsigned type = slot == nullptr ? SP_MOVED : slot->type;
+		uint64_t reference = 0;
+		if (type == SP_RECORD) record = slottedPage->lookup(tid.slotId);
+		if (type == SP_REDIRECT || type == SP_BLOB)
+			memcpy(&reference, slottedPage->getData()+slot->offset, 
+			       sizeof(TID));
+
+		// The pages of a large record may be reused as soon as its slot 
+		// changes, so they are read while the home page is still fixed. A 
+		// moved record is checked against its home TID instead (see 
+		// lookupMoved).
+		if (type == SP_BLOB) record = lookupLargeRecord(reference);
+		bm->unfixPage(bf, false);
+		if (type != SP_REDIRECT) return record;
+
+		TID target;
+		target.intRepresentation = reference;
+		record = lookupMoved(target, tid);
+		if (record != nullptr) return record;
+	}
+	return nullptr;
+}
+
+// _____________________________________________________________________________
+uint64_t SPSegment::getLength(TID tid)
+{
+	if (!this->inSegment(tid.pageId)) return 0;
+
+	// Moved records are looked up at most twice, as in lookup
+	for (unsigned attempt = 0; attempt < 2; attempt++)
+	{
+		BufferFrame& bf = bm->fixPage(tid.pageId, false);
+		SlottedPage* slottedPage = reinterpret_cast<SlottedPage*>(bf.getData());
+		SlottedPageSlot* slot = slottedPage->getSlot(tid.slotId);
+		unsigned type = slot == nullptr ? SP_MOVED : slot->type;
+		uint64_t length = 0, reference = 0;
+		if (type == SP_RECORD) length = slot->length;
+		if (type == SP_REDIRECT || type == SP_BLOB)
+			memcpy(&reference, slottedPage->getData()+slot->offset, 
+			       sizeof(TID));
+		if (type == SP_BLOB)
+		{
+			vector<Extent> runs;
+			length = readLargeRecordHeader(reference, runs).length;
+		}
+		bm->unfixPage(bf, false);
+		if (type != SP_REDIRECT) return length;
+
+		TID target;
+		target.intRepresentation = reference;
+		auto record = lookupMoved(target, tid);
+		if (record != nullptr) return record->getLen();
+	}
+	return 0;
+}
+
+// _____________________________________________________________________________
+uint64_t SPSegment::read(TID tid, uint64_t offset, uint64_t len, char* out)
+{
+	// Large records are read directly from their pages, everything else
+	// fits into memory anyway.
+	if (!this->inSegment(tid.pageId)) return 0;
+
 	BufferFrame& bf = bm->fixPage(tid.pageId, false);
 	SlottedPage* slottedPage = reinterpret_cast<SlottedPage*>(bf.getData());
-	auto record = slottedPage->lookup(tid.slotId);
+	SlottedPageSlot* slot = slottedPage->getSlot(tid.slotId);
+	if (slot != nullptr && slot->type == SP_BLOB)
+	{
+		uint64_t reference;
+		memcpy(&reference, slottedPage->getData()+slot->offset, sizeof(TID));
+		uint64_t copied = readLargeRecord(reference, offset, len, out);
+		bm->unfixPage(bf, false);
+		return copied;
+	}
 	bm->unfixPage(bf, false);
-	return record;
+
+	auto record = lookup(tid);
+	if (record == nullptr || offset >= record->getLen()) return 0;
+	len = min(len, record->getLen() - offset);
+	memcpy(out, record->getData() + offset, len);
+	return len;
 }
 
 // _____________________________________________________________________________
@@ -141,68 +335,741 @@ bool SPSegment::update(TID tid, const Record& r)
 	// Check that the page actually belongs to this segment
 	if (!this->inSegment(tid.pageId)) return false;
 
+	// The update starts over if the record is relocated concurrently (see
+	// compact) while its home page is released
+	bool updated;
+	while (!tryUpdate(tid, r, updated)) {}
+	return updated;
+}
+
+// _____________________________________________________________________________
+bool SPSegment::tryUpdate(TID tid, const Record& r, bool& updated)
+{
 	// Load page, query slotted page
+	updated = false;
 	BufferFrame& bf = bm->fixPage(tid.pageId, true);
 	SlottedPage* slottedPage = reinterpret_cast<SlottedPage*>(bf.getData());
-	bool updateSuccess = slottedPage->update(tid.slotId, r);
+	SlottedPageSlot* slot = slottedPage->getSlot(tid.slotId);
+	if (slot == nullptr || slot->type == SP_MOVED)
+	{
+		bm->unfixPage(bf, false);
+		return true;
+	}
+
+	// Remember where the record has been moved to, if it has been moved, or
+	// where it is stored, if it is a large record
+	unsigned type = slot->type;
+	uint64_t reference = 0;
+	if (type != SP_RECORD)
+		memcpy(&reference, slottedPage->getData()+slot->offset, sizeof(TID));
+	TID target;
+	target.intRepresentation = reference;
+
+	// Case 1: r fits on the home page. This also moves the record back home
+	// if it has been moved before.
+	if (!isLarge(r.getLen()) && slottedPage->update(tid.slotId, r))
+	{
+		updateFSI(tid.pageId, slottedPage);
+		bm->unfixPage(bf, true);
+		updateZones(tid.pageId, r);
+		releaseReference(type, reference, tid);
+		updated = true;
+		return true;
+	}
+
+	// Case 2: the record has been moved before, and r fits where it is now.
+	// The home page stays fixed meanwhile, so that the record cannot be 
+	// relocated concurrently (see collapseRedirects and evacuate). Both pages
+	// are fixed in ascending page order, so the redirect is checked again.
+	bool homeFixed = true;
+	if (type == SP_REDIRECT && !isLarge(r.getLen() + sizeof(TID)))
+	{
+		bm->unfixPage(bf, false);
+		homeFixed = false;
+		BufferFrame *homeFrame, *targetFrame;
+		fixPages(tid.pageId, target.pageId, homeFrame, targetFrame);
+		slottedPage = reinterpret_cast<SlottedPage*>(homeFrame->getData());
+		if (!redirectsTo(slottedPage, tid.slotId, target))
+		{
+			unfixPages(homeFrame, targetFrame, false);
+			return false;
+		}
+		slottedPage = reinterpret_cast<SlottedPage*>(targetFrame->getData());
+		updated = updateMoved(slottedPage, target, tid, r);
+		if (updated) updateFSI(target.pageId, slottedPage);
+		unfixPages(homeFrame, targetFrame, updated);
+		if (updated)
+		{
+			updateZones(target.pageId, r);
+			return true;
+		}
+	}
+
+	// Case 3: r (prefixed by its home TID) does not fit on any page, store it
+	// as a large record. Its reference always fits into the slot, since every
+	// data item occupies at least sizeof(TID) bytes. Its pages are reserved
+	// for this thread, so they may be fixed while holding the home page.
+	if (homeFixed && isLarge(r.getLen() + sizeof(TID)))
+	{
+		uint64_t headerPage;
+		try { headerPage = insertLargeRecord(r); }
+		catch (...) { bm->unfixPage(bf, false); throw; }
+		slottedPage->update(tid.slotId, Record(sizeof(uint64_t), 
+		                    (char*)&headerPage), SP_BLOB);
+		updateFSI(tid.pageId, slottedPage);
+		bm->unfixPage(bf, true);
+		updateZones(tid.pageId, r);
+		releaseReference(type, reference, tid);
+		updated = true;
+		return true;
+	}
+
+	// Case 4: move the record to another page, prefixed by its home TID, and
+	// point the home slot there. The home page is released meanwhile, so that
+	// it is never fixed twice. The redirect always fits into the home slot,
+	// since every data item occupies at least sizeof(TID) bytes. If the home
+	// slot has changed in between, the copy is removed again, and the update
+	// starts over, unless the record has been removed.
+	if (homeFixed) bm->unfixPage(bf, false);
+	vector<char> moved(sizeof(TID) + r.getLen());
+	memcpy(moved.data(), &tid, sizeof(TID));
+	memcpy(moved.data() + sizeof(TID), r.getData(), r.getLen());
+	TID newTarget = insertItem(Record(moved.size(), moved.data()), SP_MOVED);
+	updateZones(newTarget.pageId, r);
+
+	BufferFrame& home = bm->fixPage(tid.pageId, true);
+	slottedPage = reinterpret_cast<SlottedPage*>(home.getData());
+	slot = slottedPage->getSlot(tid.slotId);
+	bool unchanged = slot != nullptr && slot->type == type &&
+	                 (type == SP_RECORD || 
+	                  memcmp(slottedPage->getData()+slot->offset, &reference,
+	                         sizeof(TID)) == 0);
+	if (unchanged)
+	{
+		slottedPage->update(tid.slotId, 
+		                    Record(sizeof(TID), (char*)&newTarget), 
+		                    SP_REDIRECT);
+		updateFSI(tid.pageId, slottedPage);
+	}
+	bool removed = slot == nullptr || slot->type == SP_MOVED;
+	bm->unfixPage(home, unchanged);
+	if (!unchanged)
+	{
+		removeMoved(newTarget, tid);
+		return removed;
+	}
+
+	releaseReference(type, reference, tid);
+	updated = true;
+	return true;
+}
+
+// _____________________________________________________________________________
+void SPSegment::fixPages(uint64_t first, uint64_t second, 
+                         BufferFrame*& firstFrame, BufferFrame*& secondFrame)
+{
+	if (first > second)
+		{ fixPages(second, first, secondFrame, firstFrame); return; }
+	firstFrame = &bm->fixPage(first, true);
+	secondFrame = first == second ? firstFrame : &bm->fixPage(second, true);
+}
+
+// _____________________________________________________________________________
+void SPSegment::unfixPages(BufferFrame* first, BufferFrame* second, 
+                           bool isDirty)
+{
+	if (second != first) bm->unfixPage(*second, isDirty);
+	bm->unfixPage(*first, isDirty);
+}
+
+// _____________________________________________________________________________
+shared_ptr<Record> SPSegment::lookupMoved(TID target, TID home)
+{
+	if (!this->inSegment(target.pageId)) return nullptr;
+
+	BufferFrame& bf = bm->fixPage(target.pageId, false);
+	SlottedPage* slottedPage = reinterpret_cast<SlottedPage*>(bf.getData());
+	auto record = readMoved(slottedPage, target.slotId, home);
+	bm->unfixPage(bf, false);
+	return record;
+}
+
+// _____________________________________________________________________________
+shared_ptr<Record> SPSegment::readMoved(SlottedPage* slottedPage, 
+                                        uint16_t slotId, TID home)
+{
+	SlottedPageSlot* slot = slottedPage->getSlot(slotId);
+	if (slot == nullptr || slot->type != SP_MOVED) return nullptr;
+	auto data = (const char*)slottedPage->getData() + slot->offset;
+	TID movedFrom;
+	memcpy(&movedFrom, data, sizeof(TID));
+	if (movedFrom.intRepresentation != home.intRepresentation) return nullptr;
+	return shared_ptr<Record>(new Record(slot->length-sizeof(TID), 
+	                                     data+sizeof(TID)));
+}
+
+// _____________________________________________________________________________
+bool SPSegment::updateMoved(SlottedPage* slottedPage, TID target, TID home, 
+                            const Record& r)
+{
+	vector<char> moved(sizeof(TID) + r.getLen());
+	memcpy(moved.data(), &home, sizeof(TID));
+	memcpy(moved.data() + sizeof(TID), r.getData(), r.getLen());
+	return slottedPage->update(target.slotId, 
+	                           Record(moved.size(), moved.data()), SP_MOVED);
+}
+
+// _____________________________________________________________________________
+bool SPSegment::removeMoved(TID target, TID home)
+{
+	if (!this->inSegment(target.pageId)) return false;
+
+	BufferFrame& bf = bm->fixPage(target.pageId, true);
+	SlottedPage* slottedPage = reinterpret_cast<SlottedPage*>(bf.getData());
+	bool removed = readMoved(slottedPage, target.slotId, home) != nullptr;
+	if (removed)
+	{
+		slottedPage->remove(target.slotId);
+		updateFSI(target.pageId, slottedPage);
+	}
+	bm->unfixPage(bf, removed);
+	return removed;
+}
+
+// _____________________________________________________________________________
+bool SPSegment::redirectsTo(SlottedPage* slottedPage, uint16_t slotId, 
+                            TID target)
+{
+	SlottedPageSlot* slot = slottedPage->getSlot(slotId);
+	if (slot == nullptr || slot->type != SP_REDIRECT) return false;
+	TID reference;
+	memcpy(&reference, slottedPage->getData()+slot->offset, sizeof(TID));
+	return reference.intRepresentation == target.intRepresentation;
+}
+
+// _____________________________________________________________________________
+void SPSegment::releaseReference(unsigned type, uint64_t reference, TID home)
+{
+	if (type == SP_REDIRECT)
+	{
+		TID target;
+		target.intRepresentation = reference;
+		removeMoved(target, home);
+	}
+	if (type == SP_BLOB) removeLargeRecord(reference);
+}
+
+// _____________________________________________________________________________
+bool SPSegment::isLarge(uint64_t length)
+{
+	auto dataSize = BM_CONS::pageSize-sizeof(SlottedPageHeader);
+	return SlottedPage::footprint(length)+sizeof(SlottedPageSlot) > dataSize;
+}
+
+// _____________________________________________________________________________
+uint64_t SPSegment::insertLargeRecord(const Record& r)
+{
+	// One header page, followed by the payload pages
+	uint64_t dataPages = (r.getLen() + BM_CONS::pageSize - 1)/BM_CONS::pageSize;
+	vector<Extent> runs = allocateLargeRecordPages(dataPages + 1);
+	uint64_t headerPage = runs[0].start++;
+	if (runs[0].start == runs[0].end) runs.erase(runs.begin());
+
+	// Write the payload sequentially, in ascending page order
+	uint64_t written = 0;
+	for (Extent& run : runs)
+	{
+		for (uint64_t page = run.start; page < run.end; page++)
+		{
+			uint64_t chunk = min((uint64_t)BM_CONS::pageSize, 
+			                     r.getLen() - written);
+			BufferFrame& bf = bm->fixPage(page, true);
+			memcpy(bf.getData(), r.getData() + written, chunk);
+			bm->unfixPage(bf, true);
+			written += chunk;
+		}
+	}
+
+	LargeRecordHeader header = { r.getLen(), runs.size() };
+	BufferFrame& bf = bm->fixPage(headerPage, true);
+	auto data = reinterpret_cast<unsigned char*>(bf.getData());
+	memcpy(data, &header, sizeof(LargeRecordHeader));
+	memcpy(data + sizeof(LargeRecordHeader), runs.data(), 
+	       runs.size() * sizeof(Extent));
 	bm->unfixPage(bf, true);
-	return updateSuccess;
+	return headerPage;
+}
+
+// _____________________________________________________________________________
+vector<Extent> SPSegment::allocateLargeRecordPages(uint64_t numPages)
+{
+	// Search and reserve the pages in one go, so that no other thread can
+	// claim them in between.
+	lock_guard<recursive_mutex> guard(getFSI()->claimLock);
+
+	// Collect the maximal runs of consecutive empty pages, in page order
+	vector<Extent> empty;
+	for (Morsel& m : getMorsels())
+	{
+		for (uint64_t page = m.start; page < m.end; page++)
+		{
+			if (!getFSI()->isEmpty(m.relStart + page - m.start)) continue;
+			if (!empty.empty() && empty.back().end == page) empty.back().end++;
+			else empty.push_back(Extent(page, page+1));
+		}
+	}
+
+	// Prefer the first run which can hold all pages, otherwise take the 
+	// runs in page order.
+	vector<Extent> runs;
+	for (Extent& e : empty)
+	{
+		if (e.end - e.start < numPages) continue;
+		runs.push_back(Extent(e.start, e.start + numPages));
+		break;
+	}
+	uint64_t remaining = runs.empty() ? numPages : 0;
+	for (size_t i = 0; i < empty.size() && remaining > 0; i++)
+	{
+		uint64_t take = min(remaining, empty[i].end - empty[i].start);
+		runs.push_back(Extent(empty[i].start, empty[i].start + take));
+		remaining -= take;
+	}
+
+	// The header page must be able to list all runs
+	auto maxRuns = (BM_CONS::pageSize - sizeof(LargeRecordHeader)) / 
+	               sizeof(Extent);
+	if (remaining > 0 || runs.size() > maxRuns)
+		{ SM_EXC::SPSegmentFullException e; throw e; }
 
+	for (Extent& run : runs)
+		for (uint64_t page = run.start; page < run.end; page++)
+			getFSI()->markLargeRecordPage(this->pageIndex(page), true);
+	return runs;
 }
 
 // _____________________________________________________________________________
-void SPSegment::notifySegGrowth(Extent e)
+LargeRecordHeader SPSegment::readLargeRecordHeader(uint64_t headerPage, 
+                                                   vector<Extent>& runs)
 {
-	// Add entries to the FSI for as many pages as exist in the given extent,
-	// and materialize the changes.
-	bool useLast = (this->getSize() - (e.end - e.start)) % 2 == 0? false : true;
-	fsi->grow(e, useLast);
+	LargeRecordHeader header;
+	BufferFrame& bf = bm->fixPage(headerPage, false);
+	auto data = reinterpret_cast<unsigned char*>(bf.getData());
+	memcpy(&header, data, sizeof(LargeRecordHeader));
+	auto first = reinterpret_cast<Extent*>(data + sizeof(LargeRecordHeader));
+	runs.assign(first, first + header.runCount);
+	bm->unfixPage(bf, false);
+	return header;
+}
 
-	// Materialize changes
-	//
-	// Calculate available space given in extents. If this is not enough,
-	// look for an empty page, mark it as being used by the FSI, and add
-	// it to the FSI's extents. Then, materialize FSI across its extents.
-	vector<uint64_t> pages;
-	for (Extent& e : fsi->extents) 
-		for (unsigned int i = e.start; i < e.end; i++) pages.push_back(i);
-	sort(pages.begin(), pages.end());
-	uint64_t availableSpace = pages.size() * BM_CONS::pageSize;
-	uint64_t requiredSpace = fsi->getRuntimeSize();
+// _____________________________________________________________________________
+uint64_t SPSegment::readLargeRecord(uint64_t headerPage, uint64_t offset,
+                                   uint64_t len, char* out)
+{
+	vector<Extent> runs;
+	LargeRecordHeader header = readLargeRecordHeader(headerPage, runs);
+	if (offset >= header.length) return 0;
+	len = min(len, header.length - offset);
 
-	
-	// Must look through the FSI for an empty page to add to the FSI's extents
-	while (requiredSpace > availableSpace)
+	// Only visit the pages which overlap [offset, offset+len)
+	uint64_t copied = 0;
+	uint64_t pageOffset = 0;
+	for (Extent& run : runs)
 	{
-		bool surplus = this->getSize() % 2 != 0 ? true : false;
-		fsi->absorbPage(surplus);
+		uint64_t runLength = (run.end - run.start) * BM_CONS::pageSize;
+		if (pageOffset + runLength <= offset) 
+			{ pageOffset += runLength; continue; }
 
-		// Update loop condition
-		pages.clear();
-		for (Extent& e : fsi->extents) 
-			for (unsigned int i = e.start; i < e.end; i++) pages.push_back(i);
-		sort(pages.begin(), pages.end());
-		availableSpace = pages.size() * BM_CONS::pageSize;
-		requiredSpace = fsi->getRuntimeSize();
+		for (uint64_t page = run.start; page < run.end && copied < len; page++)
+		{
+			if (pageOffset + BM_CONS::pageSize > offset + copied)
+			{
+				uint64_t from = offset + copied - pageOffset;
+				uint64_t chunk = min(BM_CONS::pageSize - from, len - copied);
+				BufferFrame& bf = bm->fixPage(page, false);
+				memcpy(out + copied, (char*)bf.getData() + from, chunk);
+				bm->unfixPage(bf, false);
+				copied += chunk;
+			}
+			pageOffset += BM_CONS::pageSize;
+		}
+		if (copied == len) break;
 	}
+	return copied;
+}
 
+// _____________________________________________________________________________
+shared_ptr<Record> SPSegment::lookupLargeRecord(uint64_t headerPage)
+{
+	vector<Extent> runs;
+	uint64_t length = readLargeRecordHeader(headerPage, runs).length;
+	vector<char> data(length);
+	readLargeRecord(headerPage, 0, length, data.data());
+	return shared_ptr<Record>(new Record(length, data.data()));
+}
 
-	// Extents now have enough space to hold the serialized FSI,
-	// pages vector is sorted.
-	auto serialized = fsi->serialize();
-	auto it = serialized.first;
-	uint64_t remainingBytes = serialized.second;
-	for (size_t i = 0; i < pages.size(); i++)
+// _____________________________________________________________________________
+void SPSegment::removeLargeRecord(uint64_t headerPage)
+{
+	vector<Extent> runs;
+	readLargeRecordHeader(headerPage, runs);
+	getFSI()->markLargeRecordPage(this->pageIndex(headerPage), false);
+	for (Extent& run : runs)
+		for (uint64_t page = run.start; page < run.end; page++)
+			getFSI()->markLargeRecordPage(this->pageIndex(page), false);
+}
+
+// _____________________________________________________________________________
+void SPSegment::updateFSI(uint64_t pageId, SlottedPage* slottedPage)
+{
+	getFSI()->update(this->pageIndex(pageId), 
+	                 slottedPage->getHeader().freeSpace);
+}
+
+// _____________________________________________________________________________
+void SPSegment::updateZones(uint64_t pageId, const Record& r)
+{
+	if (getZones() != nullptr) zones->add(this->pageIndex(pageId), r);
+}
+
+// _____________________________________________________________________________
+uint64_t SPSegment::collapseRedirects()
+{
+	uint64_t collapsed = 0;
+	for (Morsel& m : getMorsels())
 	{
-		uint64_t bytesToWrite = min(remainingBytes,(uint64_t)BM_CONS::pageSize);
-		BufferFrame& bf = bm->fixPage(pages[i], true);
-		memcpy(bf.getData(), it, bytesToWrite);
-		bm->unfixPage(bf, true);
+		for (uint64_t page = m.start; page < m.end; page++)
+		{
+			if (!getFSI()->holdsRecords(m.relStart + page - m.start)) continue;
+
+			// Collect the redirects of the page, along with their targets
+			vector<pair<uint16_t, TID>> redirects;
+			BufferFrame& bf = bm->fixPage(page, false);
+			SlottedPage* slottedPage = 
+				reinterpret_cast<SlottedPage*>(bf.getData());
+			for (uint16_t i = 0; i < slottedPage->getHeader().slotCount; i++)
+			{
+				SlottedPageSlot* slot = slottedPage->getSlot(i);
+				if (slot == nullptr || slot->type != SP_REDIRECT) continue;
+				TID target;
+				memcpy(&target, slottedPage->getData()+slot->offset, 
+				       sizeof(TID));
+				if (target.pageId != page) 
+					redirects.push_back(make_pair(i, target));
+			}
+			bm->unfixPage(bf, false);
+
+			// Move every record back home if it fits there by now. Both pages
+			// are fixed meanwhile, in ascending page order, so the redirect 
+			// is checked again, since it may have changed in between.
+			for (auto& redirect : redirects)
+			{
+				TID home, target = redirect.second;
+				home.pageId = page;
+				home.slotId = redirect.first;
+				BufferFrame *homeFrame, *targetFrame;
+				fixPages(page, target.pageId, homeFrame, targetFrame);
+				slottedPage = 
+					reinterpret_cast<SlottedPage*>(homeFrame->getData());
+				SlottedPage* targetPage = 
+					reinterpret_cast<SlottedPage*>(targetFrame->getData());
+				shared_ptr<Record> record = nullptr;
+				if (redirectsTo(slottedPage, home.slotId, target))
+					record = readMoved(targetPage, target.slotId, home);
+				bool moved = record != nullptr && 
+				             slottedPage->update(home.slotId, *record);
+				if (moved)
+				{
+					targetPage->remove(target.slotId);
+					updateFSI(page, slottedPage);
+					updateFSI(target.pageId, targetPage);
+				}
+				unfixPages(homeFrame, targetFrame, moved);
+				if (!moved) continue;
+
+				updateZones(page, *record);
+				collapsed++;
+			}
+		}
+	}
+	return collapsed;
+}
 
-		it += bytesToWrite; 
-		remainingBytes -= bytesToWrite;
-		if (remainingBytes == 0) break;
+// _____________________________________________________________________________
+uint64_t SPSegment::compact(unsigned pagesPerSecond)
+{
+	// Start at the end of the segment, so that its last extents are emptied
+	// first and the records evacuated end up in front
+	vector<Morsel> morsels = getMorsels();
+	uint64_t emptied = 0;
+	for (auto m = morsels.rbegin(); m != morsels.rend(); ++m)
+	{
+		for (uint64_t page = m->end; page-- > m->start; )
+		{
+			uint64_t relPage = m->relStart + page - m->start;
+			if (!getFSI()->holdsRecords(relPage)) continue;
+			if (evacuate(page)) emptied++;
+			if (pagesPerSecond > 0) 
+				this_thread::sleep_for(chrono::microseconds(1000000 / 
+				                                            pagesPerSecond));
+		}
+	}
+	return emptied;
+}
+
+// _____________________________________________________________________________
+bool SPSegment::evacuate(uint64_t page)
+{
+	// Collect the moved records on the page, along with their home slots.
+	// They are only evacuated if the page is sparse, or would be empty 
+	// afterwards.
+	uint64_t relPage = this->pageIndex(page);
+	vector<pair<uint16_t, TID>> moved;
+	bool pinned = false;
+	BufferFrame& bf = bm->fixPage(page, false);
+	SlottedPage* slottedPage = reinterpret_cast<SlottedPage*>(bf.getData());
+	for (uint16_t i = 0; i < slottedPage->getHeader().slotCount; i++)
+	{
+		SlottedPageSlot* slot = slottedPage->getSlot(i);
+		if (slot == nullptr) continue;
+		TID home;
+		memcpy(&home, slottedPage->getData()+slot->offset, sizeof(TID));
+		if (slot->type == SP_MOVED && home.pageId != page) 
+			moved.push_back(make_pair(i, home));
+		else pinned = true;
+	}
+	if (pinned && 
+	    slottedPage->getHeader().freeSpace < SMConst::compactionFreeSpace)
+		moved.clear();
+	bm->unfixPage(bf, false);
+
+	// Move every record to a fuller page and redirect its home slot there.
+	// The page itself and the home page are hidden from insertItem 
+	// meanwhile. No page is held while the copy is inserted, so the home 
+	// slot and the record are checked again once both pages are fixed (in
+	// ascending page order). The record is copied again if it has been 
+	// updated meanwhile, and skipped if it has been removed or moved.
+	bool full = false;
+	for (auto& item : moved)
+	{
+		TID target, home = item.second;
+		target.pageId = page;
+		target.slotId = item.first;
+		auto record = lookupMoved(target, home);
+		while (record != nullptr && !full)
+		{
+			getFSI()->update(relPage, 0);
+			getFSI()->update(this->pageIndex(home.pageId), 0);
+			vector<char> data(sizeof(TID) + record->getLen());
+			memcpy(data.data(), &home, sizeof(TID));
+			memcpy(data.data() + sizeof(TID), record->getData(), 
+			       record->getLen());
+			TID newTarget;
+			try 
+			{
+				newTarget = insertItem(Record(data.size(), data.data()), 
+				                       SP_MOVED);
+				updateZones(newTarget.pageId, *record);
+			}
+			catch (SM_EXC::SPSegmentFullException& e) { full = true; }
+
+			BufferFrame *homeFrame, *targetFrame;
+			fixPages(home.pageId, page, homeFrame, targetFrame);
+			SlottedPage* homePage = 
+				reinterpret_cast<SlottedPage*>(homeFrame->getData());
+			slottedPage = 
+				reinterpret_cast<SlottedPage*>(targetFrame->getData());
+			shared_ptr<Record> current = nullptr;
+			if (redirectsTo(homePage, home.slotId, target))
+				current = readMoved(slottedPage, target.slotId, home);
+			bool redirected = !full && current != nullptr && 
+			                  current->getLen() == record->getLen() &&
+			                  memcmp(current->getData(), record->getData(), 
+			                         record->getLen()) == 0;
+			if (redirected)
+			{
+				homePage->update(home.slotId, 
+				                 Record(sizeof(TID), (char*)&newTarget), 
+				                 SP_REDIRECT);
+				slottedPage->remove(target.slotId);
+				updateFSI(page, slottedPage);
+			}
+			updateFSI(home.pageId, homePage);
+			unfixPages(homeFrame, targetFrame, redirected);
+			if (redirected) break;
+			if (!full) removeMoved(newTarget, home);
+			record = current;
+		}
+		if (full) break;
 	}
-	delete[] serialized.first;
+
+	// A page without records is handed out as an empty page again, so that
+	// it may take large records, or be released by the SM
+	BufferFrame& frame = bm->fixPage(page, true);
+	slottedPage = reinterpret_cast<SlottedPage*>(frame.getData());
+	bool empty = true;
+	for (uint16_t i = 0; i < slottedPage->getHeader().slotCount && empty; i++)
+		empty = slottedPage->getSlot(i) == nullptr;
+	if (empty) getFSI()->markLargeRecordPage(relPage, false);
+	else updateFSI(page, slottedPage);
+	bm->unfixPage(frame, false);
+	return empty;
+}
+
+// _____________________________________________________________________________
+void SPSegment::notifySegGrowth(Extent e)
+{
+	// Add entries to the FSI for as many pages as exist in the given extent
+	getFSI()->grow(e);
+	if (zones != nullptr) zones->grow(e.end - e.start);
+}
+
+// _____________________________________________________________________________
+bool SPSegment::canRelease(const Extent& e)
+{
+	// Only the pages at the end of the segment can be dropped from the FSI
+	uint64_t last = 0;
+	for (Extent& x : extents) last = max(last, x.end);
+	if (e.end != last || e.start == this->firstPage()) return false;
+
+	// Large records, the FSI and other records occupy non empty pages
+	SegmentFSI::LayoutGuard guard(getFSI(), false);
+	unsigned int emptyMarker = getFSI()->freeBytes.size()-1;
+	for (uint64_t page = e.start; page < e.end; page++)
+		if (getFSI()->value(this->pageIndex(page)) != emptyMarker) return false;
+	return true;
 }
 
+// _____________________________________________________________________________
+void SPSegment::notifySegShrink(Extent e)
+{
+	// The extent has already been removed, and held the last pages
+	getFSI()->shrink(this->getSize());
+	if (zones != nullptr) zones->shrink(e.end - e.start);
+}
+
+// _____________________________________________________________________________
+vector<Morsel> SPSegment::getMorsels()
+{
+	// Relative page indices follow the order of the page ids (see
+	// Segment::nextPage), so visit the extents in that order.
+	vector<Extent> sortedExtents(extents);
+	sort(sortedExtents.begin(), sortedExtents.end(), extentStartComp);
+
+	vector<Morsel> morsels;
+	uint64_t relStart = 0;
+	for (Extent& e : sortedExtents)
+	{
+		for (uint64_t page = e.start; page < e.end; page += SMConst::morselSize)
+		{
+			Morsel m = { page, min(page + SMConst::morselSize, e.end),
+			             relStart + page - e.start };
+			morsels.push_back(m);
+		}
+		relStart += e.end - e.start;
+	}
+	return morsels;
+}
+
+// _____________________________________________________________________________
+uint64_t SPSegment::scanMorsel(const Morsel& m, RecordBatch& batch,
+                               const RangePredicate* p)
+{
+	uint64_t skipped = 0;
+	for (uint64_t page = m.start; page < m.end; page++)
+	{
+		uint64_t relPage = m.relStart + page - m.start;
+		if (!getFSI()->holdsRecords(relPage)) continue;
+		if (p != nullptr && !zones->mayMatch(relPage, *p)) 
+			{ skipped++; continue; }
+
+		// Records are only kept if they match, while the page's zones are
+		// computed from all of them
+		BufferFrame& bf = bm->fixPage(page, false);
+		SlottedPage* slottedPage = reinterpret_cast<SlottedPage*>(bf.getData());
+		vector<Zone> pageZones;
+		if (p != nullptr) pageZones = zones->emptyZones();
+		auto append = [&](TID tid, shared_ptr<Record> record)
+		{
+			if (p == nullptr) 
+				{ batch.push_back(make_pair(tid, record)); return; }
+			zones->widen(pageZones, *record);
+			if (zones->matches(*record, *p)) 
+				batch.push_back(make_pair(tid, record));
+		};
+		for (uint16_t i = 0; i < slottedPage->getHeader().slotCount; i++)
+		{
+			// Records which have been moved are reported where they are
+			// stored now, under the TID of their home slot.
+			SlottedPageSlot* slot = slottedPage->getSlot(i);
+			if (slot == nullptr || slot->type == SP_REDIRECT) continue;
+
+			TID tid;
+			tid.pageId = page;
+			tid.slotId = i;
+			auto data = (const char*)slottedPage->getData() + slot->offset;
+			unsigned length = slot->length;
+			if (slot->type == SP_BLOB)
+			{
+				uint64_t headerPage;
+				memcpy(&headerPage, data, sizeof(uint64_t));
+				append(tid, lookupLargeRecord(headerPage));
+				continue;
+			}
+			if (slot->type == SP_MOVED)
+			{
+				memcpy(&tid, data, sizeof(TID));
+				data += sizeof(TID);
+				length -= sizeof(TID);
+			}
+			append(tid, shared_ptr<Record>(new Record(length, data)));
+		}
+		if (p != nullptr) zones->set(relPage, pageZones);
+		bm->unfixPage(bf, false);
+	}
+	return skipped;
+}
+
+// _____________________________________________________________________________
+void SPSegment::parallelScan(const function<void(RecordBatch&)>& consumer,
+                             unsigned numThreads)
+{
+	scan(consumer, numThreads, nullptr);
+}
+
+// _____________________________________________________________________________
+uint64_t SPSegment::parallelScan(
+	const function<void(RecordBatch&)>& consumer, unsigned numThreads,
+	const RangePredicate& p)
+{
+	if (getZones() == nullptr) { SM_EXC::SchemaMissingException e; throw e; }
+	return scan(consumer, numThreads, &p);
+}
+
+// _____________________________________________________________________________
+uint64_t SPSegment::scan(const function<void(RecordBatch&)>& consumer,
+                         unsigned numThreads, const RangePredicate* p)
+{
+	// Morsels are handed out through a shared counter. Every worker keeps 
+	// its own output batch, which is passed to the consumer per morsel.
+	vector<Morsel> morsels = getMorsels();
+	atomic<uint64_t> nextMorsel(0);
+	atomic<uint64_t> skipped(0);
+	auto worker = [&]()
+	{
+		RecordBatch batch;
+		for (uint64_t i = nextMorsel++; i < morsels.size(); i = nextMorsel++)
+		{
+			batch.clear();
+			skipped += scanMorsel(morsels[i], batch, p);
+			if (!batch.empty()) consumer(batch);
+		}
+	};
+
+	// The calling thread takes part in the scan as well
+	vector<thread> workers;
+	for (unsigned i = 1; i < numThreads; i++) workers.push_back(thread(worker));
+	worker();
+	for (thread& t : workers) t.join();
+	return skipped;
+}
@@ -11,12 +11,41 @@
 #include "RegularSegment.h"
 #include "SlottedPage.h"
 #include "SegmentFSI.h"
+#include "ZoneMap.h"
 #include "Record.h"
 #include "TID.h"
+#include <functional>
+#include <mutex>
+
+
+// A batch of records produced by a segment scan, each along with its TID
+typedef std::vector<std::pair<TID, std::shared_ptr<Record>>> RecordBatch;
+
+// A unit of work of a parallel segment scan: the consecutive pages 
+// [start, end) of a segment, where start is the page with the (relative) 
+// index relStart inside the segment.
+struct Morsel
+{
+	uint64_t start;
+	uint64_t end;
+	uint64_t relStart;
+};
+
+// The header page of a large record (see SPSegment::insert). Followed on the
+// page by #runCount extents, the runs of consecutive pages which hold the 
+// record's payload, in payload order.
+struct LargeRecordHeader
+{
+	uint64_t length;
+	uint64_t runCount;
+};
 
 // A segment based on slotted pages.
 class SPSegment : public RegularSegment
 {
+	FRIEND_TEST(SegmentManagerTest, recordForwarding);
+	FRIEND_TEST(SegmentManagerTest, targetPageClaims);
+
 public:
 
 	// Constructor. Initializes the segment's FSI.
@@ -26,16 +55,34 @@ public:
 	// to signal that all of the segment's pages are empty. Otherwise, the
 	// segment has been recovered from file (see SegmentInventory::
 	// initializeFromFile). In this case the FSI must be recovered from file,
-	// starting from the first page of the segment.
-	SPSegment(BufferManager* bm, bool visible, uint64_t id, Extent* base =NULL);
+	// starting from the first page of the segment, which is deferred until
+	// the FSI is used first, so that opening the database does not read it.
+	//
+	// If the records follow a schema, zone maps are kept for its INTEGER
+	// attributes (see ZoneMap), so that predicate scans can skip pages.
+	// The schema is stored as a large record referenced by the FSI, and the
+	// zone maps are stored alongside by flush, so that both are recovered
+	// with the segment.
+	SPSegment(BufferManager* bm, bool visible, uint64_t id, Extent* base =NULL,
+	          const Schema* schema = nullptr, bool recovered = false);
 	~SPSegment();
 
 	// Searches through the segment's pages looking for a page with enough 
 	// space to store r. Throws SPSegmentFullException iff there is no space,
 	// i.e. segment must be grown. Otherwise returns the TID identifying the 
 	// location where r was stored. This is implemented effciently using the 
-	// segments's FSI. Throws RecordLengthException iff record too large to fit
-	// on any page.
+	// segments's FSI.
+	//
+	// Records which do not fit on an empty slotted page are stored out of
+	// line: their payload is written page by page in ascending page order to
+	// empty pages of the segment, preferably a single run of consecutive 
+	// pages, and the slot only references a header page listing these runs.
+	//
+	// insert, remove, lookup, update, read and parallelScan may be called
+	// concurrently, while growing the segment requires exclusive access. 
+	// Every inserting thread fills its own target page (see 
+	// SegmentFSI::getPage), so concurrent inserts do not serialize on one 
+	// page.
 	TID insert(const Record& r);
 
 	// Deletes the record pointed to by tid and updates the 
@@ -44,20 +91,215 @@ public:
 
 	// Returns a pointer or reference to the read-only record 
 	// associated with TID tid. Returns nullptr iff page / slot invalid.
+	// If the record has been moved to another page (see update), the 
+	// redirect on its home page is followed (never more than one hop).
 	std::shared_ptr<Record> lookup(TID tid);
 
 	// Updates the record pointed to by tid with the content of record r.
-	// Constraint: r must be at most as large as the record it replaces.
-	// Return true iff update successful.
+	// If r does not fit on the record's home page, it is moved to another 
+	// page of the segment, and a redirect to its new location is left in the
+	// home slot, so tid stays valid. A record that has been moved before is
+	// moved back home as soon as it fits there again. Throws 
+	// SPSegmentFullException iff the record must be moved but no page can 
+	// hold it, i.e. segment must be grown. Returns false iff tid is invalid.
 	bool update(TID tid, const Record& r);
 
+	// Returns the length of the record associated with tid, 0 iff page /
+	// slot invalid.
+	uint64_t getLength(TID tid);
+
+	// Copies up to len bytes of the record associated with tid, starting at
+	// the given offset, to out, without materializing the entire record. 
+	// Returns the number of bytes copied, 0 iff page / slot invalid or offset
+	// beyond the end of the record. Large records can thus be streamed 
+	// chunk by chunk.
+	uint64_t read(TID tid, uint64_t offset, uint64_t len, char* out);
+
+	// Moves records which have been moved away from their home page back
+	// home wherever they fit by now, and removes their redirects. Returns the
+	// number of redirects removed. Meant to be run periodically in the
+	// background, since every redirect costs an additional page access.
+	// Holds at most a record's home page and the page it has been moved to
+	// at a time, like update. Must not run concurrently with itself.
+	uint64_t collapseRedirects();
+
+	// Reclaims the space of removed and moved records, so that pages become
+	// empty again, and trailing extents can be handed back to the database
+	// (see SegmentManager::shrinkSegment). Visits the pages from the back of
+	// the segment, at most pagesPerSecond per second (0 for no limit), moves
+	// the moved records (see update) onto fuller pages, off pages which hold
+	// nothing else or have at least SMConst::compactionFreeSpace free bytes,
+	// and marks pages without records as empty. Records on their home page
+	// stay in place, since their TIDs must remain valid. Returns the number
+	// of pages emptied. Meant to be run in the background, like 
+	// collapseRedirects, and must not run concurrently with itself or 
+	// collapseRedirects.
+	uint64_t compact(unsigned pagesPerSecond = 0);
+
 	// Override
 	void notifySegGrowth(Extent e);
+
+	// Override
+	bool canRelease(const Extent& e);
+
+	// Returns the segment type
+	segTypes getType() { return SP_SGM; }
+
+	// Override
+	void notifySegShrink(Extent e);
+
+	// Scans all records of this segment using #numThreads worker threads
+	// (including the calling thread). The segment's extents are cut into 
+	// morsels of SMConst::morselSize pages, which the workers claim one at a
+	// time through a shared atomic counter, so that a worker which is done 
+	// early keeps taking over the remaining morsels, regardless of how large
+	// the extent they belong to is. Each worker fixes the pages of its morsel
+	// in shared mode and passes the records found to consumer, one batch per
+	// morsel. consumer is called concurrently and must be thread safe.
+	void parallelScan(const std::function<void(RecordBatch&)>& consumer,
+	                  unsigned numThreads);
+
+	// Scans the records matching p as parallelScan above. Pages whose zone
+	// cannot match p are skipped, the zones of all other pages are
+	// recomputed exactly while they are read. Returns the number of pages
+	// skipped. Throws SchemaMissingException iff the segment has no schema.
+	uint64_t parallelScan(const std::function<void(RecordBatch&)>& consumer,
+	                      unsigned numThreads, const RangePredicate& p);
+
+	// Returns the zone maps of this segment, nullptr iff it has no schema.
+	ZoneMap* getZoneMap() { return getZones(); }
+
+	// Writes the zone maps to empty pages of this segment, referenced by the
+	// FSI. Recovered zone maps are read once and dropped from file, so that
+	// they never miss changes made afterwards. If they have not been written,
+	// all zones of the recovered segment cover any value, until predicate
+	// scans recompute them.
+	void flush();
 		
 private:
 
-	// The free space inventory for this segment.
+	// Inserts r as a data item of the given type (see slotTypes), as 
+	// described in insert.
+	TID insertItem(const Record& r, unsigned type);
+
+	// Updates the record pointed to by tid as described in update, and sets
+	// updated to its result. Returns false iff the record has been relocated
+	// concurrently, and the update must start over.
+	bool tryUpdate(TID tid, const Record& r, bool& updated);
+
+	// Fixes the two given pages exclusively, the one with the smaller id 
+	// first, so that threads which hold two pages never wait for each other.
+	// Fixes a page only once if both are the same.
+	void fixPages(uint64_t first, uint64_t second, BufferFrame*& firstFrame,
+	              BufferFrame*& secondFrame);
+
+	// Unfixes the two pages fixed by fixPages.
+	void unfixPages(BufferFrame* first, BufferFrame* second, bool isDirty);
+
+	// Returns the record which has been moved to target from the home slot
+	// given by home, nullptr iff there is no such record at target.
+	std::shared_ptr<Record> lookupMoved(TID target, TID home);
+
+	// As lookupMoved, for the given slot of the given (fixed) page.
+	static std::shared_ptr<Record> readMoved(SlottedPage* slottedPage, 
+	                                         uint16_t slotId, TID home);
+
+	// Replaces the record which has been moved to target from the home slot
+	// given by home with r, on the given (fixed) page target. Returns false
+	// iff r does not fit on that page.
+	static bool updateMoved(SlottedPage* slottedPage, TID target, TID home, 
+	                        const Record& r);
+
+	// Removes the record which has been moved to target from the home slot
+	// given by home. Returns false iff there is no such record at target.
+	bool removeMoved(TID target, TID home);
+
+	// Returns true iff the given slot of the given (fixed) page redirects to
+	// target.
+	static bool redirectsTo(SlottedPage* slottedPage, uint16_t slotId, 
+	                        TID target);
+
+	// Releases the record referenced by a data item of the given type, i.e.
+	// the moved record (SP_REDIRECT) or the pages of the large record 
+	// (SP_BLOB) with the given reference, which is stored in the home slot
+	// given by home. No-op for other types.
+	void releaseReference(unsigned type, uint64_t reference, TID home);
+
+	// Returns true iff a record of the given length does not fit on an empty
+	// slotted page, i.e. must be stored as a large record.
+	static bool isLarge(uint64_t length);
+
+	// Writes r to pages of its own, returns the id of its header page. Throws
+	// SPSegmentFullException iff there are not enough empty pages.
+	uint64_t insertLargeRecord(const Record& r);
+
+	// Reserves #numPages empty pages for a large record and returns them as
+	// runs of consecutive pages. Prefers a single run. Throws 
+	// SPSegmentFullException iff there are not enough empty pages.
+	std::vector<Extent> allocateLargeRecordPages(uint64_t numPages);
+
+	// Returns the header and the payload runs of the given large record. The
+	// page referencing it must be fixed meanwhile, unless the reference has
+	// been removed by the caller, since its pages may be reused otherwise.
+	LargeRecordHeader readLargeRecordHeader(uint64_t headerPage, 
+	                                        std::vector<Extent>& runs);
+
+	// Copies up to len bytes of the given large record, starting at offset,
+	// to out. Returns the number of bytes copied.
+	uint64_t readLargeRecord(uint64_t headerPage, uint64_t offset, 
+	                         uint64_t len, char* out);
+
+	// Materializes the given large record.
+	std::shared_ptr<Record> lookupLargeRecord(uint64_t headerPage);
+
+	// Marks the pages of the given large record as empty again.
+	void removeLargeRecord(uint64_t headerPage);
+
+	// Evacuates the moved records from the given page of this segment, and
+	// marks it as empty if no records are left (see compact). Returns true
+	// iff the page is empty.
+	bool evacuate(uint64_t page);
+
+	// Returns the FSI, reads it from file first iff this segment has been
+	// recovered and the FSI has not been used yet.
+	SegmentFSI* getFSI();
+
+	// Returns the zone maps, reads them from file first iff this segment has
+	// been recovered and they have not been used yet. nullptr iff this 
+	// segment has no schema.
+	ZoneMap* getZones();
+
+	// Updates the FSI entry of the given (fixed) page of this segment.
+	void updateFSI(uint64_t pageId, SlottedPage* slottedPage);
+
+	// Widens the zones of the given page of this segment to cover r, the 
+	// (logical) record now stored on that page. No-op without a schema.
+	void updateZones(uint64_t pageId, const Record& r);
+
+	// Cuts this segment's extents into morsels, ordered by page id.
+	std::vector<Morsel> getMorsels();
+
+	// Appends all records found on the pages of the given morsel to batch.
+	// Skips pages which are empty or used by the FSI. If a predicate is
+	// given, only appends matching records, skips pages whose zone cannot 
+	// match, and recomputes the zones of the pages read. Returns the number 
+	// of pages skipped because of their zone.
+	uint64_t scanMorsel(const Morsel& m, RecordBatch& batch, 
+	                    const RangePredicate* p);
+
+	// Implements both parallelScan methods, p may be nullptr.
+	uint64_t scan(const std::function<void(RecordBatch&)>& consumer,
+	              unsigned numThreads, const RangePredicate* p);
+
+	// The free space inventory for this segment, nullptr until it has been
+	// read from file iff the segment has been recovered.
 	SegmentFSI* fsi;
+	std::once_flag fsiLoaded;
+
+	// The zone maps of this segment, nullptr iff it has no schema, or until
+	// they have been read from file iff the segment has been recovered.
+	ZoneMap* zones;
+	std::once_flag zonesLoaded;
 
 	// Reference to the Buffer Manager. This class does not take responsibility
 	// for the destruction of this pointer.
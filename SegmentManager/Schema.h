@@ -0,0 +1,62 @@
+
+///////////////////////////////////////////////////////////////////////////////
+// Schema.h
+//////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// Attribute types. INTEGER attributes are 8 byte signed integers, CHAR
+// attributes are fixed length character arrays.
+enum attrTypes { INTEGER, CHAR };
+
+
+// The metadata of an attribute of a relation: the attribute's value is found
+// at [offset, offset+length) of a record's data.
+struct Attribute
+{
+	std::string name;
+	unsigned offset;
+	unsigned length;
+	attrTypes type;
+};
+
+
+// The schema of a relation, i.e. the layout of its records (see
+// Operators/Design.txt). Attributes are laid out in the order in which they
+// are added, without padding.
+class Schema
+{
+public:
+
+	// Appends an attribute to the schema. The length of INTEGER attributes
+	// is always sizeof(int64_t).
+	void addAttribute(const std::string& name, attrTypes type,
+	                  unsigned length = sizeof(int64_t))
+	{
+		if (type == INTEGER) length = sizeof(int64_t);
+		Attribute a = { name, recordLength, length, type };
+		attributes.push_back(a);
+		recordLength += length;
+	}
+
+	// Getter methods
+	const std::vector<Attribute>& getAttributes() const { return attributes; }
+	unsigned getRecordLength() const { return recordLength; }
+
+private:
+
+	// The attributes of the relation, in record order
+	std::vector<Attribute> attributes;
+
+	// The length of a record in bytes
+	unsigned recordLength = 0;
+};
+
+#endif  // SCHEMA_H
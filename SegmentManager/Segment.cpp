@@ -66,6 +66,19 @@ uint64_t Segment::nextPage(uint64_t& nextPageCounter)
 	return pages[nextPageCounter++];
 }
 
+// _____________________________________________________________________________
+uint64_t Segment::pageIndex(uint64_t pageId)
+{
+	// Count the pages of this segment with a smaller page id
+	uint64_t index = 0;
+	for (Extent& e : extents)
+	{
+		if (e.end <= pageId) index += e.end - e.start;
+		else if (e.start <= pageId) index += pageId - e.start;
+	}
+	return index;
+}
+
 // _____________________________________________________________________________
 uint64_t Segment::firstPage()
 {
@@ -20,7 +20,8 @@ public:
 };
 
 // Specialized segment types
-enum segTypes { segTypes_begin, RG_SGM = segTypes_begin, SP_SGM, segTypes_end };
+enum segTypes { segTypes_begin, RG_SGM = segTypes_begin, SP_SGM, PAX_SGM, 
+                CPAX_SGM, segTypes_end };
 
 
 // Abstract class, represents a segment in the DBMS
@@ -47,6 +48,10 @@ public:
 	
 	// Returns the id of this segment
 	uint64_t getId() { return id; }
+
+	// Returns the type of this segment, which is recorded by the SI. The SI
+	// and FSI count as regular segments.
+	virtual segTypes getType() { return RG_SGM; }
 	
 	// Returns the size of this segment in frames
 	//
@@ -71,6 +76,10 @@ public:
 	// FRIEND_TEST(SegmentManagerTest, initializeWithFile);
 	uint64_t nextPage(uint64_t& nextPageCounter);
 
+	// Returns the (relative) index of the given page inside this segment, 
+	// i.e. the inverse of nextPage. The page must belong to this segment.
+	uint64_t pageIndex(uint64_t pageId);
+
 	
 protected:
 
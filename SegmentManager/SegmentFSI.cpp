@@ -1,47 +1,78 @@
-
 ///////////////////////////////////////////////////////////////////////////////
 // SegmentFSI.cpp
 ///////////////////////////////////////////////////////////////////////////////
 
 
 #include "SegmentFSI.h"
-#include <assert.h> 
+#include <assert.h>
 #include <algorithm>
-#include <math.h> 
+#include <math.h>
 #include <memory>
 
 using namespace std;
 
+// The offset of the inventory in the FSI (see SegmentFSI.h)
+static const uint64_t invOffset = 5*sizeof(uint64_t) +
+                                  SMConst::maxFSIExtents*sizeof(Extent);
+
 // _____________________________________________________________________________
-SegmentFSI::SegmentFSI(BufferManager* bm, uint64_t numPages, uint64_t pageStart)
-{ 
-	
+SegmentFSI::SegmentFSI(BufferManager* bm, uint64_t pages, uint64_t pageStart)
+{
+	this->bm = bm;
+	pthread_rwlock_init(&layoutLock, nullptr);
+
 	// Initialize free space mapping
 	freeBytes = {0,8,16,32,64,128,256,512,1024,2048,3072,4096};
 
-	// Initialize inv (marking empty pages). Mark first page as belonging
-	// to the FSI (value = 15)
-	unsigned size = (unsigned)freeBytes.size();
-	for (int i = 0; i < ceil(numPages/2); i++)
+	// The initial FSI is assumed to fit on the first page
+	entries = (pages + 1) / 2;
+	counted = 0;
+	schemaPage = 0;
+	zonesPage = 0;
+	extents.push_back(Extent(pageStart, pageStart+1));
+	if (invOffset + entries > (uint64_t)BM_CONS::pageSize)
 	{
-		FreeSpaceEntry e;
-		if (i == 0) e = {15,     size-1};
-		else 	    e = {size-1, size-1};
-		inv.push_back(e);
+		SM_EXC::FsiOverflowException e; throw e;
 	}
 
-	// Initialize extents
-	Extent e = {pageStart, pageStart+1};
-	extents.push_back(e);
-	this->bm = bm;
+	// Mark empty pages. Mark first page as belonging to the FSI (value = 15)
+	vector<unsigned char> values(pages, freeBytes.size()-1);
+	values[0] = 15;
+	writeValues(0, values);
+	writeHeader();
 }
 
 
 // _____________________________________________________________________________
-uint64_t SegmentFSI::getRuntimeSize()
-{ 
-	return 3*sizeof(uint64_t)+ extents.size()*sizeof(Extent) + 
-	       inv.size()*sizeof(FreeSpaceEntry);
+SegmentFSI::SegmentFSI(BufferManager* bm, uint64_t pageStart)
+{
+	this->bm = bm;
+	pthread_rwlock_init(&layoutLock, nullptr);
+	freeBytes = {0,8,16,32,64,128,256,512,1024,2048,3072,4096};
+
+	// Size markers and extents are always found on the first page
+	BufferFrame& bf = bm->fixPage(pageStart, false);
+	auto header = reinterpret_cast<uint64_t*>(bf.getData());
+	uint64_t pages = header[0];
+	uint64_t extentsSize = header[1];
+	entries = header[2];
+	schemaPage = header[3];
+	zonesPage = header[4];
+	auto storedExtents = reinterpret_cast<Extent*>(header + 5);
+	for (uint64_t i = 0; i < extentsSize; i++)
+		extents.push_back(storedExtents[i]);
+	bm->unfixPage(bf, false);
+
+	// Count the page markers block by block
+	counted = pages;
+	uint64_t blockPages = SMConst::fsiBlockPages;
+	summary.resize((pages + blockPages - 1) / blockPages);
+	vector<unsigned char> values;
+	for (uint64_t b = 0; b < summary.size(); b++)
+	{
+		readValues(b*blockPages, min(pages, (b+1)*blockPages), values);
+		for (unsigned char v : values) summary[b][v]++;
+	}
 }
 
 
@@ -49,9 +80,9 @@ uint64_t SegmentFSI::getRuntimeSize()
 void SegmentFSI::update(uint64_t page, uint32_t value)
 {
 	auto it = upper_bound(freeBytes.begin(), freeBytes.end(), value);
-	unsigned int discretizedValue = it - freeBytes.begin() - 1;
-	if (page % 2 == 0) inv[page/2].page1 = discretizedValue;
-	else inv[page/2].page2 = discretizedValue;
+	unsigned char discretizedValue = it - freeBytes.begin() - 1;
+	LayoutGuard guard(this, false);
+	setValue(page, discretizedValue);
 }
 
 
@@ -62,7 +93,6 @@ pair<uint64_t, bool> SegmentFSI::getPage(unsigned requiredSize, bool lastValid)
 	// mapping, so that its mapped value (guaranteed free space) is the smallest
 	// mapped value that is still greater than or equal to the required space.
 	// Prefers fuller pages, and non empty pages to empty pages.
-	bool empty = false;
 	int spaceIndex = -1;
 	for (size_t i = 0; i < freeBytes.size(); i++)
 		if (freeBytes[i] >= (int)requiredSize) { spaceIndex = i; break; }
@@ -70,181 +100,317 @@ pair<uint64_t, bool> SegmentFSI::getPage(unsigned requiredSize, bool lastValid)
 	// If requiredSize is larger than any empty space -> throw exception
 	if (spaceIndex == -1) { SM_EXC::InputLengthException e; throw e; }
 
-	// Find a valid page with the closest fullness degree to the above value.
-	uint64_t page = 0;
-	while (true)
+	// Stick to this thread's target page as long as r fits
+	lock_guard<recursive_mutex> guard(claimLock);
+	LayoutGuard layout(this, false);
+	unsigned int emptyMarker = freeBytes.size()-1;
+	auto self = this_thread::get_id();
+	auto now = chrono::steady_clock::now();
+	auto claim = claims.find(self);
+	if (claim != claims.end())
+	{
+		unsigned int v = value(claim->second.page);
+		claim->second.lastUse = now;
+		if ((int)v >= spaceIndex && v <= emptyMarker)
+			return pair<uint64_t, bool>(claim->second.page, v == emptyMarker);
+		claims.erase(claim);
+	}
+
+	// Find a valid page with the closest fullness degree to the above value,
+	// skipping other threads' target pages. Only if there is no such page,
+	// share a non empty target page with another thread. Second entry of the
+	// last inventory entry is invalid unless lastValid == true. Only blocks
+	// which hold a page with the given value are read.
+	uint64_t pages = lastValid ? 2*entries : 2*entries-1;
+	uint64_t blockPages = SMConst::fsiBlockPages;
+	vector<unsigned char> values;
+	for (int pass = 0; pass < 2; pass++)
 	{
-		for (size_t i = 0; i < inv.size(); i++)
+		for (unsigned int i = spaceIndex; i <= emptyMarker; i++)
 		{
-			if (inv[i].page1 == spaceIndex) 
-			{ 
-				page = 2*i;
-				if (spaceIndex == (int)freeBytes.size()-1) empty = true;
-				goto afterloop;
-			}
-			if (lastValid && inv[i].page2 == spaceIndex) 
-			{ 
-				page = 2*i+1;
-				if (spaceIndex == (int)freeBytes.size()-1) empty = true; 
-				goto afterloop;
+			for (uint64_t b = 0; b < summary.size(); b++)
+			{
+				if (__atomic_load_n(&summary[b][i], __ATOMIC_RELAXED) == 0) 
+					continue;
+				uint64_t first = b*blockPages;
+				readValues(first, min(pages, first+blockPages), values);
+				for (uint64_t k = 0; k < values.size(); k++)
+				{
+					uint64_t page = first + k;
+					if (page == 0 || values[k] != i) continue;
+					bool empty = i == emptyMarker;
+					if (claimedByOther(page, self, empty) &&
+					    (pass == 0 || empty)) continue;
+					dropClaims(page);
+					Claim c = { page, now };
+					claims[self] = c;
+					return pair<uint64_t, bool>(page, i == emptyMarker);
+				}
 			}
 		}
-
-		// If no page with exactly the required free space is available,
-		// search for a page with the next order of available free space
-		if (++spaceIndex >= (int)freeBytes.size()) break;
 	}
+	SM_EXC::SPSegmentFullException e; throw e;
+}
+
 
-	afterloop:
-	if (page == 0) { SM_EXC::SPSegmentFullException e; throw e; }
-	return pair<uint64_t, bool>(page, empty);
+// _____________________________________________________________________________
+void SegmentFSI::releaseClaim()
+{
+	lock_guard<recursive_mutex> guard(claimLock);
+	claims.erase(this_thread::get_id());
 }
 
 
 // _____________________________________________________________________________
-void SegmentFSI::grow(Extent e, bool useLast)
+unsigned int SegmentFSI::value(uint64_t page)
 {
-	// The inventory has a surplus marker iff useLast == true
-	uint64_t newEntryStart = e.start;
-	unsigned int size = freeBytes.size()-1;
-	if (useLast)
-	{
-		inv.back().page2 = size;
-		newEntryStart++;
-	}
+	vector<unsigned char> values;
+	readValues(page, page+1, values);
+	return values[0];
+}
 
-	for (uint64_t i = newEntryStart; i < e.end; i=i+2)
+
+// _____________________________________________________________________________
+pair<uint64_t, uint64_t> SegmentFSI::locate(uint64_t entry)
+{
+	uint64_t offset = invOffset + entry;
+	uint64_t index = offset / BM_CONS::pageSize;
+	for (Extent& e : extents)
 	{
-		FreeSpaceEntry f = { size, size };
-		inv.push_back(f);
+		if (index < e.end - e.start)
+			return pair<uint64_t, uint64_t>(e.start + index,
+			                                offset % BM_CONS::pageSize);
+		index -= e.end - e.start;
 	}
+	SM_EXC::FsiOverflowException e; throw e;
 }
 
+
 // _____________________________________________________________________________
-void SegmentFSI::absorbPage(bool surplus)
+void SegmentFSI::readValues(uint64_t first, uint64_t last,
+                            vector<unsigned char>& values)
 {
-	uint64_t newFSIPageIndex = 0;
-	auto freeMarker = freeBytes.size()-1;
-	for (size_t i = 0; i < inv.size(); i++)
+	values.clear();
+	uint64_t page = first;
+	while (page < last)
 	{
-		// First page of entry, must not be the first page of the segment.
-		if (i != 0 && inv[i].page1 == freeMarker)
-		{
-			newFSIPageIndex = 2*i;
-			inv[i].page1 = 15;
-			break;
-		}
-		// Second page of entry, if last entry in inventory, only valid
-		// if the segment has an even number of pages. Otherwise
-		// the last entry of the inventory has a surplus page marker.
-		else if ((i != inv.size()-1 || !surplus) && inv[i].page2 == freeMarker)
+		// Read all requested entries found on the same FSI page at once
+		uint64_t firstEntry = page / 2;
+		auto location = locate(firstEntry);
+		uint64_t end = min(last, 2*(firstEntry + BM_CONS::pageSize -
+		                            location.second));
+		BufferFrame& bf = bm->fixPage(location.first, false);
+		auto data = reinterpret_cast<unsigned char*>(bf.getData());
+		for (; page < end; page++)
 		{
-			newFSIPageIndex = 2*i + 1;
-			inv[i].page2 = 15;
-			break;
+			unsigned char entry = __atomic_load_n(&data[location.second + 
+			                                      page/2 - firstEntry],
+			                                      __ATOMIC_RELAXED);
+			values.push_back(page % 2 == 0 ? entry & 0xF : entry >> 4);
 		}
+		bm->unfixPage(bf, false);
 	}
+}
 
-	// Add empty page found to FSI's extents.
-	if (newFSIPageIndex == 0) { SM_EXC::FsiOverflowException e; throw e; }
-	bool pageAbsorbed = false;
 
-	// Check if page can be integrated into an existing extent, otherwise
-	// create new extent
-	for (Extent& e : this->extents)
+// _____________________________________________________________________________
+void SegmentFSI::writeValues(uint64_t first,
+                             const vector<unsigned char>& values)
+{
+	uint64_t last = first + values.size();
+	uint64_t blockPages = SMConst::fsiBlockPages;
+	if (summary.size() < (last + blockPages - 1) / blockPages)
+		summary.resize((last + blockPages - 1) / blockPages);
+
+	uint64_t page = first;
+	while (page < last)
 	{
-		if (e.start == newFSIPageIndex+1) 
-		{
-			e.start = newFSIPageIndex;
-			pageAbsorbed = true;
-			break;
-		}
-		else if (e.end == newFSIPageIndex) 
+		uint64_t firstEntry = page / 2;
+		auto location = locate(firstEntry);
+		uint64_t end = min(last, 2*(firstEntry + BM_CONS::pageSize -
+		                            location.second));
+		BufferFrame& bf = bm->fixPage(location.first, true);
+		auto data = reinterpret_cast<unsigned char*>(bf.getData());
+		bool dirty = false;
+		for (; page < end; page++)
 		{
-			e.end = newFSIPageIndex+1;
-			pageAbsorbed = true;
-			break;
+			unsigned char& entry = data[location.second + page/2 - firstEntry];
+			unsigned int shift = page % 2 == 0 ? 0 : 4;
+			unsigned char old = (entry >> shift) & 0xF;
+			unsigned char value = values[page - first];
+			auto& counts = summary[page / blockPages];
+			if (page < counted) counts[old]--;
+			counts[value]++;
+			if (old == value) continue;
+			entry = (entry & ~(0xF << shift)) | (value << shift);
+			dirty = true;
 		}
+		bm->unfixPage(bf, dirty);
+	}
+	counted = max(counted, last);
+}
+
+
+// _____________________________________________________________________________
+void SegmentFSI::setValue(uint64_t page, unsigned char value)
+{
+	if (page >= counted) return;
+	auto location = locate(page / 2);
+	BufferFrame& bf = bm->fixPage(location.first, false);
+	auto entry = reinterpret_cast<unsigned char*>(bf.getData()) + 
+	             location.second;
+
+	// The other page of the entry may be updated concurrently
+	unsigned int shift = page % 2 == 0 ? 0 : 4;
+	unsigned char expected = __atomic_load_n(entry, __ATOMIC_RELAXED);
+	unsigned char old, desired;
+	do
+	{
+		old = (expected >> shift) & 0xF;
+		desired = (expected & ~(0xF << shift)) | (value << shift);
 	}
-	if (!pageAbsorbed)
+	while (old != value && 
+	       !__atomic_compare_exchange_n(entry, &expected, desired, false,
+	                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	if (old != value)
 	{
-		Extent e = { newFSIPageIndex, newFSIPageIndex+1};
-		this->extents.push_back(e);
+		auto& counts = summary[page / SMConst::fsiBlockPages];
+		__atomic_fetch_sub(&counts[old], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&counts[value], 1, __ATOMIC_RELAXED);
 	}
+	bm->unfixPage(bf, old != value);
 }
 
-	
-// _____________________________________________________________________________
-pair<unsigned char*, uint64_t> SegmentFSI::serialize()
-{ 
-	// FSI format:
-	// | FSI size | Extents size | Inventory Size | Extents | Inventory |
-	uint64_t fsiSize = getRuntimeSize();
-	uint64_t extentsSize = extents.size();
-	uint64_t inventorySize = inv.size();
 
-	unsigned char* fsibytes = new unsigned char[fsiSize];
+// _____________________________________________________________________________
+void SegmentFSI::addPage(uint64_t pageId)
+{
+	if (extents.back().end == pageId) { extents.back().end++; return; }
+	if (extents.size() == SMConst::maxFSIExtents)
+	{
+		SM_EXC::FsiOverflowException e; throw e;
+	}
+	extents.push_back(Extent(pageId, pageId+1));
+}
 
-	// serialize components
-	auto exArray = reinterpret_cast<unsigned char*>(extents.data());
-	auto inArray = reinterpret_cast<unsigned char*>(inv.data());
-	
-	// write to output array
-	fsibytes[0] = fsiSize;
-	fsibytes[1] = extentsSize;
-	fsibytes[2] = inventorySize;
-	auto it = fsibytes + 3;
-	memcpy(it, exArray, extentsSize * sizeof(Extent));
-	it += extentsSize * sizeof(Extent);
-	memcpy(it, inArray, inventorySize * sizeof(FreeSpaceEntry));
 
-	return pair<unsigned char*, uint64_t>(fsibytes, fsiSize);
+// _____________________________________________________________________________
+void SegmentFSI::writeHeader()
+{
+	BufferFrame& bf = bm->fixPage(extents[0].start, true);
+	auto header = reinterpret_cast<uint64_t*>(bf.getData());
+	header[0] = counted;
+	header[1] = extents.size();
+	header[2] = entries;
+	header[3] = schemaPage;
+	header[4] = zonesPage;
+	memcpy(header + 5, extents.data(), extents.size()*sizeof(Extent));
+	bm->unfixPage(bf, true);
 }
 
+
 // _____________________________________________________________________________
-void SegmentFSI::deserialize(unsigned char* bytes)
-{ 
-	// Reset data structures
-	extents.clear();
-	inv.clear();
+bool SegmentFSI::claimedByOther(uint64_t page, thread::id self, bool empty)
+{
+	for (auto& claim : claims)
+	{
+		if (claim.second.page != page || claim.first == self) continue;
+		auto idle = chrono::steady_clock::now() - claim.second.lastUse;
+		return empty || idle <= chrono::milliseconds(SMConst::claimTimeout);
+	}
+	return false;
+}
 
-	// Get the extents / pages on which the FSI is found. Assumed to always
-	// be found exclusively on the first page of the segment.
-	auto header = reinterpret_cast<uint64_t*>(bytes);
-	uint64_t fsiSize = header[0];
-	uint64_t extentsSize = header[1];
-	uint64_t inventorySize = header[2];
-
-	vector<unsigned char> extentBytes(bytes+3*sizeof(uint64_t), 
-		                              bytes+3*sizeof(uint64_t) + 
-		                              extentsSize * sizeof(Extent));
-	auto deserializedExtents = reinterpret_cast<Extent*>(extentBytes.data());
-	vector<uint64_t> pages;
-	for (unsigned int i = 0; i < extentsSize; i++)
+
+// _____________________________________________________________________________
+void SegmentFSI::dropClaims(uint64_t page)
+{
+	for (auto it = claims.begin(); it != claims.end(); )
 	{
-		Extent e = deserializedExtents[i];
-		this->extents.push_back(e);
-		for (auto j = e.start; j < e.end; j++) pages.push_back(j);
+		if (it->second.page == page) it = claims.erase(it);
+		else ++it;
 	}
+}
 
-	// Get byte array from all pages on which FSI is found.
-	unsigned char* fsibytes = new unsigned char[pages.size()*BM_CONS::pageSize];
-	unsigned char* it = fsibytes;
-	for (uint64_t& page : pages)
+
+// _____________________________________________________________________________
+void SegmentFSI::grow(Extent e)
+{
+	LayoutGuard guard(this, true);
+
+	// The pages of e follow the pages counted so far, the first of them takes
+	// the surplus marker iff there is one
+	uint64_t numPages = e.end - e.start;
+	entries = (counted + numPages + 1) / 2;
+	vector<unsigned char> values(numPages, freeBytes.size()-1);
+
+	// Absorb the first pages of e until the FSI pages can hold the inventory
+	uint64_t fsiPages = 0;
+	for (Extent& x : extents) fsiPages += x.end - x.start;
+	uint64_t absorbed = 0;
+	while (fsiPages * BM_CONS::pageSize < invOffset + entries)
 	{
-		BufferFrame& bf = bm->fixPage(page, false);
-		memcpy(it, bf.getData(), BM_CONS::pageSize);
-		bm->unfixPage(bf, false);
-		it = it + BM_CONS::pageSize;
+		if (absorbed == numPages) { SM_EXC::FsiOverflowException e; throw e; }
+		addPage(e.start + absorbed);
+		values[absorbed++] = 15;
+		fsiPages++;
 	}
+	writeValues(counted, values);
+	writeHeader();
+}
 
-	// take only inventory body bytes, deserialize completely
-	vector<unsigned char> invVec(fsibytes+3*sizeof(uint64_t) +
-		                         extentsSize*sizeof(Extent), fsibytes+fsiSize);
-	auto deserializedInv = reinterpret_cast<FreeSpaceEntry*>(invVec.data());
-	for (unsigned int i = 0; i < inventorySize; i++)
+// _____________________________________________________________________________
+void SegmentFSI::shrink(uint64_t numPages)
+{
+	lock_guard<recursive_mutex> guard(claimLock);
+	LayoutGuard layout(this, true);
+
+	// Subtract the dropped page markers from the summary
+	vector<unsigned char> values;
+	readValues(numPages, counted, values);
+	for (uint64_t k = 0; k < values.size(); k++)
+		summary[(numPages + k) / SMConst::fsiBlockPages][values[k]]--;
+	uint64_t blockPages = SMConst::fsiBlockPages;
+	summary.resize((numPages + blockPages - 1) / blockPages);
+
+	// Keep a surplus marker iff the number of pages is uneven (see grow)
+	counted = numPages;
+	entries = (numPages + 1) / 2;
+	writeHeader();
+	for (auto it = claims.begin(); it != claims.end(); )
 	{
-		FreeSpaceEntry e = deserializedInv[i];
-		this->inv.push_back(e);
+		if (it->second.page >= numPages) it = claims.erase(it);
+		else ++it;
 	}
-}
\ No newline at end of file
+}
+
+
+// _____________________________________________________________________________
+bool SegmentFSI::holdsRecords(uint64_t page)
+{
+	LayoutGuard guard(this, false);
+	if (page >= counted) return false;
+	return value(page) < freeBytes.size()-1;
+}
+
+
+// _____________________________________________________________________________
+bool SegmentFSI::isEmpty(uint64_t page)
+{
+	lock_guard<recursive_mutex> guard(claimLock);
+	LayoutGuard layout(this, false);
+	if (page >= counted) return false;
+	for (auto& claim : claims) if (claim.second.page == page) return false;
+	return value(page) == freeBytes.size()-1;
+}
+
+
+// _____________________________________________________________________________
+void SegmentFSI::markLargeRecordPage(uint64_t page, bool used)
+{
+	lock_guard<recursive_mutex> guard(claimLock);
+	LayoutGuard layout(this, false);
+	unsigned char value = used ? 14 : freeBytes.size()-1;
+	setValue(page, value);
+	if (!used) dropClaims(page);
+}
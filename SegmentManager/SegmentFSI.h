@@ -12,14 +12,12 @@
 #include "SMConst.h"
 #include <gtest/gtest.h>
 #include <stdint.h>
-
-
-// An entry in the SegmentFSI, marking 16 discrete fullness values for a pair
-// of pages.
-struct FreeSpaceEntry {
-   unsigned int page1 : 4;
-   unsigned int page2 : 4;
-};
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+#include <unordered_map>
 
 
 // The free space management entity for specialized segments (inherit from 
@@ -30,12 +28,19 @@ struct FreeSpaceEntry {
 // the initial FSI fits on the first page of the segment.
 //
 // The FSI encodes the following information:
-// | FSI size | Extents size | Inventory Size | Extents | Inventory |
+// | Pages | Extents size | Inventory Size | Schema | Zones | Extents |
+// | Inventory |
 //
-// It is assumed that the FSI extent entries and all size markers fit on the 
-// first page of the segment. All size markers are 8 byte integers.
-// Any given inventory entry uses 4 bit pairs to encode a degree of fullness
-// according to the following linear / logarithmic scale:
+// Pages is the number of pages of the segment the inventory has entries for.
+// Schema and Zones reference the large records holding the schema and the
+// zone maps of the segment's records (see SPSegment), 0 iff there are none.
+// The extents are the pages over which the FSI is spread, in the order in
+// which the FSI is laid out on them. Room for SMConst::maxFSIExtents extents
+// is reserved on the first page, so that the inventory never moves. All size
+// markers are 8 byte integers.
+// Any given inventory entry is a byte, whose low and high 4 bits encode the
+// degree of fullness of a pair of pages according to the following 
+// linear / logarithmic scale:
 //
 // Value -> At least N remaining bytes:
 // 0 -> 0
@@ -51,34 +56,35 @@ struct FreeSpaceEntry {
 // 10 -> 3072
 // 11 -> 4096
 //
-// A value of 15 for a page entry in a FreeSpaceEntry marks the given page
-// as being used by the SegmentFSI
+// A value of 15 for a page in an inventory entry marks the given page
+// as being used by the SegmentFSI, a value of 14 marks it as being used by
+// a large record (see SPSegment).
+//
+// The inventory is not copied to main memory: entries are read and updated
+// in place on the FSI pages through the buffer manager. In memory, the FSI
+// only counts the pages of every value per block of SMConst::fsiBlockPages
+// pages, so that getPage only scans blocks holding a page which fits.
+//
+// The FSI is thread safe. Every inserting thread claims its own target page
+// (see getPage), so that concurrent inserts do not compete for the same page.
+// Entries are updated through an atomic compare and swap on their byte, with
+// the FSI page fixed in shared mode, so that updates do not serialize.
 class SegmentFSI
 {
 	friend class SPSegment;
+	FRIEND_TEST(SegmentManagerTest, targetPageClaims);
 	
 public:
 
 	// Constructor. Takes the size of the segment in pages, and the page on
-	// which the segment containing this FSI starts. 
+	// which the segment containing this FSI starts. Materializes the FSI of
+	// the new segment on that page.
 	SegmentFSI(BufferManager* bm, uint64_t pages, uint64_t pageStart);
-	~SegmentFSI() { }
-
-	// Serializes this SegmentFSI object. Returns byte array and its length.
-	// This object does not take responsiblity for freeing the allocated
-	// memory
-	std::pair<unsigned char*, uint64_t> serialize();
 
-	// De-serializes this SegmentFSI object, re-writes data structures.
-	// Assumes bytes contains the FSI header, that is, 
-	// | FSI size | Extents size | Inventory Size | Extents | Inventory
-	// After extracting the FSI's extents, looks up all pages on which FSI
-	// is found and then deserializes the FSI completely.
-	void deserialize(unsigned char* bytes);
-
-	// Returns the runtime size of this SegmentFSI in bytes: size of 
-	// extents + size of inv
-	uint64_t getRuntimeSize();
+	// Constructor. Reads the FSI of a segment recovered from file, found on
+	// the segment's first page pageStart, and counts its page markers.
+	SegmentFSI(BufferManager* bm, uint64_t pageStart);
+	~SegmentFSI() { pthread_rwlock_destroy(&layoutLock); }
 
 	// Updates the inventory by performing a discretization of the new
 	// available free space, and updating the appropriate page entry.
@@ -90,38 +96,150 @@ public:
 	// SM_EXC::SegmentFullException when this is true for no page, i.e.
 	// the segment must be grown. Second value in pair is true iff the returned
 	// page is empty.
+	//
+	// The returned page becomes the calling thread's target page: it is 
+	// returned again as long as it has enough space, and it is not handed
+	// out to other threads, unless no other page fits. Empty target pages 
+	// are never handed out to other threads, so an empty page must be
+	// initialized by the thread it is returned to, or released through
+	// releaseClaim. A thread's target page is dropped once it does not fit,
+	// or when it is marked empty again. A non empty target page which its
+	// thread has not used for SMConst::claimTimeout milliseconds is stale,
+	// e.g. since the thread has exited, and is taken over by other threads.
 	std::pair<uint64_t, bool> getPage(unsigned requiredSize, bool lastValid);
 
-	// Adds #numPages page makers to the inventory. Starts with last entry
-	// in current inventory iff useLast == true
-	void grow(Extent e, bool useLast);
+	// Drops the calling thread's target page, if any.
+	void releaseClaim();
+
+	// Adds page markers for the pages of the extent e, which has been 
+	// appended to the segment. Starts with the surplus marker of the last
+	// entry iff the segment had an uneven number of pages. If the FSI pages 
+	// cannot hold the new markers, the first pages of e are added to the FSI.
+	// Throws SM_EXC::FsiOverflowException iff this is not possible.
+	void grow(Extent e);
 
-	// Instructs the FSI to look for an empty page in the segment, and to use
-	// this page as part of the FSI. #surplus dictates whether the FSI currently
-	// holds an extra page marker or not (see FreeSpaceEntry)
-	void absorbPage(bool surplus);
+	// Drops the page markers of all but the first #numPages pages, and the
+	// claims on the dropped pages. The FSI must not use any of them.
+	void shrink(uint64_t numPages);
 
+	// Returns true iff the page with the given relative index may hold 
+	// records, i.e. it is neither empty nor used by the FSI itself.
+	bool holdsRecords(uint64_t page);
+
+	// Returns true iff the page with the given relative index is empty, i.e.
+	// has never been initialized, and is not any thread's target page.
+	bool isEmpty(uint64_t page);
+
+	// Marks the page with the given relative index as being used by a large
+	// record (used == true), or as being empty again (used == false).
+	void markLargeRecordPage(uint64_t page, bool used);
 
 
 private:
 
+	// Returns the fullness value of the page with the given relative index.
+	unsigned int value(uint64_t page);
+
+	// Copies the fullness values of the pages [first, last) to values.
+	void readValues(uint64_t first, uint64_t last, 
+	                std::vector<unsigned char>& values);
+
+	// Sets the fullness values of the pages starting at first, fixing every
+	// FSI page once, and updates the summary. Only FSI pages whose entries
+	// change are written back. The old values of pages which have not been
+	// counted yet are not subtracted from the summary. Requires layoutLock
+	// to be held exclusively.
+	void writeValues(uint64_t first, const std::vector<unsigned char>& values);
+
+	// Sets the fullness value of the given counted page through a compare 
+	// and swap on its entry, with its FSI page fixed in shared mode, and 
+	// updates the summary. Requires layoutLock to be held.
+	void setValue(uint64_t page, unsigned char value);
+
+	// Returns the id of the FSI page holding the given inventory entry, and
+	// the entry's offset on that page.
+	std::pair<uint64_t, uint64_t> locate(uint64_t entry);
+
+	// Adds the given page of the segment to the pages of the FSI.
+	void addPage(uint64_t pageId);
+
+	// Writes the size markers, references and extents to the first page of
+	// the FSI.
+	void writeHeader();
+
+	// Returns true iff the page with the given relative index is the target
+	// page of a thread other than the given one. Stale claims (see getPage)
+	// only count iff the page is empty.
+	bool claimedByOther(uint64_t page, std::thread::id self, bool empty);
+
+	// Drops the claims of all threads on the page with the given relative
+	// index.
+	void dropClaims(uint64_t page);
+
+	// Holds layoutLock for its lifetime, shared or exclusively.
+	struct LayoutGuard
+	{
+		LayoutGuard(SegmentFSI* fsi, bool exclusive) : lock(&fsi->layoutLock)
+		{
+			if (exclusive) pthread_rwlock_wrlock(lock);
+			else pthread_rwlock_rdlock(lock);
+		}
+		~LayoutGuard() { pthread_rwlock_unlock(lock); }
+		pthread_rwlock_t* lock;
+	};
+
 	// BufferManager handler
 	BufferManager* bm;
 
+	// Guards the layout of the inventory, i.e. entries, counted, the 
+	// references, the extents and the size of summary. Held in shared mode
+	// while entries are read or updated, and exclusively while the layout 
+	// changes, or the header is written.
+	pthread_rwlock_t layoutLock;
+
+	// Guards claims. Recursive, so that the SPSegment can hold it while it
+	// reserves empty pages, which must not be claimed meanwhile. Taken 
+	// before layoutLock.
+	std::recursive_mutex claimLock;
+
+	// The target page (relative index) of each inserting thread, along with
+	// the time it has been returned last. Every page is the target page of
+	// at most one thread, so that stale claims are dropped as soon as their
+	// pages are taken over.
+	struct Claim
+	{
+		uint64_t page;
+		std::chrono::steady_clock::time_point lastUse;
+	};
+	std::unordered_map<std::thread::id, Claim> claims;
+
 	// The free space mapping discretization (see above), maps integer keys 
 	// (index) to integer values representing free bytes (see above). 
 	// Constraint: last entry contains number of bytes in an empty page.
 	std::vector<int> freeBytes;
 
-	// Free space information for pairs of pages. Note: may contain a surplus
-	// page entry if the size of the segment is uneven.
-	std::vector<FreeSpaceEntry> inv;
+	// The number of entries in the inventory. Note: the last entry may 
+	// contain a surplus page marker if the size of the segment is uneven.
+	uint64_t entries;
+
+	// The number of pages of the segment, i.e. of page markers counted in 
+	// summary
+	uint64_t counted;
+
+	// The header pages of the large records holding the schema and the zone
+	// maps of the segment (see above), 0 iff none
+	uint64_t schemaPage;
+	uint64_t zonesPage;
+
+	// The number of pages of each fullness value, per block of 
+	// SMConst::fsiBlockPages pages. Counts are changed atomically.
+	std::vector<std::array<uint32_t, 16>> summary;
 
-	// The set of pages over which this SegmentFSI is spread. Assumed to fit
-	// on the first page at all times.
+	// The set of pages over which this SegmentFSI is spread, in layout order.
+	// Assumed to fit on the first page at all times.
 	std::vector<Extent> extents;
 
 
 };
 
-#endif  // SEGMENTFSI_H
\ No newline at end of file
+#endif  // SEGMENTFSI_H
@@ -7,14 +7,21 @@
 #include "SegmentInventory.h"
 #include "FreeSpaceInventory.h"
 #include "RegularSegment.h"
+#include "SPSegment.h"
+#include "PAXSegment.h"
 #include <queue>
 #include <fcntl.h>
 #include <iostream>
 #include <algorithm>
 #include <unordered_set>
+#include <math.h>
 
 using namespace std;
 
+// The segment type is kept in the top bits of the ids recorded in the SI
+const unsigned typeShift = 56;
+const uint64_t idMask = (1ull << typeShift) - 1;
+
 // _____________________________________________________________________________
 SegmentInventory::SegmentInventory(BufferManager* bm, bool visible, uint64_t id, 
                                    Extent* ex) : Segment(true, visible, id, ex)
@@ -22,13 +29,27 @@ SegmentInventory::SegmentInventory(BufferManager* bm, bool visible, uint64_t id,
 	this->bm = bm;
 	this->nextId = 1;	
 	maxEntries = (BM_CONS::pageSize-sizeof(uint64_t)) / (3*sizeof(uint64_t));
+	maxLogRecords = (BM_CONS::pageSize-2*sizeof(uint64_t)) / sizeof(LogRecord);
+	logStart = 0;
+	logGeneration = 0;
+	logRecords = 0;
+	unlogged = false;
+	loading = true;
 	initializeFromFile();
+	loading = false;
 }
 
 // _____________________________________________________________________________
 SegmentInventory::~SegmentInventory()
 {	
-	writeToFile();
+	// Logged changes are replayed on startup, so only unlogged ones require
+	// a snapshot
+	if (unlogged) compact(false);
+	for (auto it=segments.begin(); it!=segments.end(); ++it)
+	{
+		auto seg = dynamic_cast<RegularSegment*>(it->second);
+		if (seg != nullptr) seg->flush();
+	}
 	for (auto it=segments.begin(); it!=segments.end(); ++it)
 		if (it->first > 1 && it->second != nullptr) delete it->second;
 }
@@ -37,8 +58,28 @@ SegmentInventory::~SegmentInventory()
 Segment* SegmentInventory::getSegment(uint64_t id)
 {
 	auto seg = segments.find(id);
-	if (seg == segments.end()) return nullptr;
-	return seg->second;
+	if (seg != segments.end()) return seg->second;
+
+	// Materialize a recovered segment
+	auto desc = descriptors.find(id);
+	if (desc == descriptors.end()) return nullptr;
+	vector<Extent>& exts = desc->second.extents;
+	RegularSegment* newSeg;
+	if (desc->second.type == SP_SGM) 
+		newSeg = new SPSegment(bm, true, id, &exts[0], nullptr, true);
+	else if (desc->second.type == PAX_SGM || desc->second.type == CPAX_SGM)
+		newSeg = new PAXSegment(bm, true, id, &exts[0]);
+	else newSeg = new RegularSegment(true, id, &exts[0], true);
+	newSeg->extents.insert(newSeg->extents.end(), exts.begin()+1, exts.end());
+	descriptors.erase(desc);
+	segments.insert(pair<uint64_t, Segment*>(id, newSeg));
+	return newSeg;
+}
+
+//______________________________________________________________________________
+uint64_t SegmentInventory::entryKey(Segment* seg)
+{
+	return seg->id | ((uint64_t)seg->getType() << typeShift);
 }
 
 //______________________________________________________________________________
@@ -57,6 +98,7 @@ bool SegmentInventory::unregisterSegment(Segment* seg)
 	if (segments.find(seg->id) == segments.end()) return false;
 	segments.erase(seg->id);
 	numEntries=numEntries-seg->extents.size();
+	logChange(LOG_DROP_SEGMENT, entryKey(seg), 0, 0);
 	return true;
 }
 
@@ -86,6 +128,26 @@ void SegmentInventory::notifySegGrowth(uint64_t id, uint64_t growth)
 	// If max entries per page * num pages is not enough to hold the growth
 	while (maxEntries * getSize() <= (numEntries+growth)) grow();	
 	numEntries=numEntries+growth;
+
+	// The segment's last #growth extents are new
+	vector<Extent>& exts = segments[id]->extents;
+	for (size_t i = exts.size() - growth; i < exts.size(); i++)
+		logChange(LOG_ADD_EXTENT, entryKey(segments[id]), exts[i].start, 
+		          exts[i].end);
+}
+
+
+//______________________________________________________________________________
+void SegmentInventory::notifySegShrink(uint64_t id, Extent e)
+{
+	if (segments.find(id) == segments.end())
+	{
+		cout << "Shrinkage reported for non existent segment with id " << id
+		     << endl;
+		exit(1);
+	}
+	numEntries--;
+	logChange(LOG_REMOVE_EXTENT, entryKey(segments[id]), e.start, e.end);
 }
 
 
@@ -102,11 +164,12 @@ void SegmentInventory::grow()
 	// Grow segment according to dynamic extent mapping.
 	// See SegmentManager::growSegment
 	float numExtents = extents.size();
-	uint64_t newExtentSize = ceil(pow(2, 
-	                         	  pow(params.extentIncrease, numExtents)));
+	uint64_t newExtentSize = min<double>(params.maxExtentSize,
+		ceil(pow(2, pow(params.extentIncrease, numExtents))));
 	
-	// Request an extent with required capacity   	
-	Extent e = fsi->getExtent(newExtentSize);
+	// Request an extent with required capacity, preferably right behind the
+	// last extent
+	Extent e = fsi->getExtent(newExtentSize, extents.back().end);
 	
 	// If no such extent found, then the size of the database file must be
 	// increased to accomodate space for the new extent
@@ -115,11 +178,130 @@ void SegmentInventory::grow()
 		pair<uint64_t, uint64_t> growth = bm->growDB(newExtentSize);
 		Extent grownExtent(growth.first, growth.second);
 		fsi->registerExtent(grownExtent);
-		e = fsi->getExtent(newExtentSize);
+		e = fsi->getExtent(newExtentSize, extents.back().end);
 	}
 	
 	// e has already been unregistered from the FSI in getExtent
 	extents.push_back(e);
+	logChange(LOG_ADD_EXTENT, 0, e.start, e.end);
+}
+
+
+//______________________________________________________________________________
+void SegmentInventory::logChange(logRecordTypes type, uint64_t segId,
+                                 uint64_t start, uint64_t end)
+{
+	if (loading) return;
+	if (logStart == 0 || logRecords == SMConst::logPages * maxLogRecords)
+	{
+		unlogged = true;
+		return;
+	}
+
+	// Append the record to the last log page, and update the page's header.
+	// A page which is started anew may still hold an older generation.
+	LogRecord record = { (uint64_t)type, segId, start, end };
+	uint64_t slot = logRecords % maxLogRecords;
+	BufferFrame& bf = bm->fixPage(logStart + logRecords / maxLogRecords, true);
+	uint64_t* data = reinterpret_cast<uint64_t*>(bf.getData());
+	data[0] = logGeneration;
+	data[1] = slot + 1;
+	memcpy(data + 2 + slot * 4, &record, sizeof(LogRecord));
+	bm->unfixPage(bf, true);
+	logRecords++;
+}
+
+
+//______________________________________________________________________________
+void SegmentInventory::checkpoint()
+{
+	if (unlogged || 2 * logRecords >= SMConst::logPages * maxLogRecords) 
+		compact(true);
+}
+
+
+//______________________________________________________________________________
+void SegmentInventory::compact(bool create)
+{
+	auto fsi = (FreeSpaceInventory*)getSegment(1);
+	if (fsi == nullptr)
+	{
+		cout << "Error: SI cannot find FSI " << endl;
+		exit(1);
+	}
+
+	// The log pages are taken from the end of the file, and are neither
+	// part of a segment nor free space. They are referenced by page 0.
+	if (logStart == 0 && create)
+	{
+		logStart = bm->growDB(SMConst::logPages).first;
+		BufferFrame& bf = bm->fixPage(0, true);
+		reinterpret_cast<uint64_t*>(bf.getData())[BM_CONS::pageSize / 
+		                                          sizeof(uint64_t) - 1] = logStart;
+		bm->unfixPage(bf, true);
+	}
+
+	// Write the snapshots before emptying the log, replaying the old log
+	// onto the new snapshots is harmless (see replayLog)
+	writeToFile();
+	fsi->writeToFile();
+	if (logStart != 0)
+	{
+		logGeneration++;
+		BufferFrame& bf = bm->fixPage(logStart, true);
+		uint64_t* data = reinterpret_cast<uint64_t*>(bf.getData());
+		data[0] = logGeneration;
+		data[1] = 0;
+		bm->unfixPage(bf, true);
+	}
+	logRecords = 0;
+	unlogged = false;
+}
+
+
+//______________________________________________________________________________
+vector<LogRecord> SegmentInventory::readLog()
+{
+	vector<LogRecord> log;
+	for (uint64_t page = 0; page < SMConst::logPages; page++)
+	{
+		BufferFrame& bf = bm->fixPage(logStart + page, false);
+		uint64_t* data = reinterpret_cast<uint64_t*>(bf.getData());
+		if (page == 0) logGeneration = data[0];
+		uint64_t count = data[0] == logGeneration ? data[1] : 0;
+		LogRecord* records = reinterpret_cast<LogRecord*>(data + 2);
+		log.insert(log.end(), records, records + count);
+		bm->unfixPage(bf, false);
+		if (count < maxLogRecords) break;
+	}
+	logRecords = log.size();
+	return log;
+}
+
+
+//______________________________________________________________________________
+void SegmentInventory::replayLog(const vector<LogRecord>& log, 
+                                 multimap<uint64_t, Extent, comp>& mapping)
+{
+	for (const LogRecord& r : log)
+	{
+		if (r.type == LOG_DROP_SEGMENT) mapping.erase(r.segId);
+		if (r.type != LOG_ADD_EXTENT && r.type != LOG_REMOVE_EXTENT) continue;
+
+		// Look for the extent among the segment's extents
+		auto range = mapping.equal_range(r.segId);
+		auto it = range.first;
+		while (it != range.second && 
+		       (it->second.start != r.start || it->second.end != r.end)) ++it;
+
+		if (r.type == LOG_REMOVE_EXTENT && it != range.second) mapping.erase(it);
+		if (r.type == LOG_ADD_EXTENT && it == range.second)
+		{
+			mapping.insert(pair<uint64_t, Extent>(r.segId, 
+			                                      Extent(r.start, r.end)));
+			if ((r.segId & idMask) >= nextId) nextId = (r.segId & idMask)+1;
+		}
+	}
 }
 
 
@@ -141,7 +323,7 @@ void SegmentInventory::parseSIExtents(multimap<uint64_t, Extent, comp>& mapping,
 		mapping.insert(pair<uint64_t, Extent>(id, ext));
 		
 		if (id == 0) exts.push_back(ext);
-		if (id >= nextId) nextId = id+1; 
+		if ((id & idMask) >= nextId) nextId = (id & idMask)+1; 
 	}
 	
 	bm->unfixPage(frame, false);
@@ -165,7 +347,9 @@ void SegmentInventory::initializeFromFile()
 {	
 	// Read in information available starting in frame #0
 	BufferFrame& bootFrame = bm->fixPage(0, true);	
-	numEntries = reinterpret_cast<uint64_t*>(bootFrame.getData())[0];
+	uint64_t* bootData = reinterpret_cast<uint64_t*>(bootFrame.getData());
+	numEntries = bootData[0];
+	logStart = bootData[BM_CONS::pageSize / sizeof(uint64_t) - 1];
 	
 	// File is yet to be initialized and contains no information
 	if (numEntries == 0)
@@ -190,14 +374,27 @@ void SegmentInventory::initializeFromFile()
 	uint64_t entryCounter = numEntries;
 	multimap<uint64_t, Extent, comp> mapping;
 	parseSIExtents(mapping, bootFrame, entryCounter);
+
+	// Apply the changes logged since the snapshot has been written
+	vector<LogRecord> log;
+	if (logStart != 0) log = readLog();
+	replayLog(log, mapping);
+	numEntries = mapping.size();
 	
 	// Now that the mapping of segment ids to extents is complete, create and 
-	// store the actual segments   
+	// store the SI and FSI, and record all other segments
     for (auto it = mapping.begin(); it != mapping.end(); ++it)
 	{
 		// probe segment id, add extent if segment already stored, otherwise
 		// create new segment and store extent.
-		uint64_t segId = it->first;		
+		uint64_t segId = it->first & idMask;
+		if (segId > 1)
+		{
+			SegmentDescriptor& desc = descriptors[segId];
+			desc.type = (segTypes)(it->first >> typeShift);
+			desc.extents.push_back(it->second);
+			continue;
+		}
 		auto segIt = segments.find(segId);
 		if (segIt != segments.end()) 
 			segIt->second->extents.push_back(it->second);
@@ -211,16 +408,17 @@ void SegmentInventory::initializeFromFile()
 				segments.insert(pair<uint64_t, Segment*>(segId, this));
 			}
 				
-			else if (segId == 1) 
-				 newSeg = new FreeSpaceInventory(this, bm, false, segId, 
-				                                 &(it->second));
-
-			else newSeg = new RegularSegment(true, segId, &(it->second), true);
+			else newSeg = new FreeSpaceInventory(this, bm, false, segId, 
+			                                     &(it->second));
 			
 			if (newSeg != NULL) 
 				segments.insert(pair<uint64_t, Segment*>(segId, newSeg));
 		}
 	}
+
+	auto fsi = (FreeSpaceInventory*)getSegment(1);
+	if (fsi != nullptr) 
+		for (const LogRecord& r : log) fsi->replayChange(r);
 }
 
 // _____________________________________________________________________________
@@ -243,49 +441,53 @@ void SegmentInventory::writeToFile()
 	// the next page given by the queue
 	vector<uint64_t> buffer;
 	
-	// Every page in the SI carries this header
-	buffer.push_back(numEntries);
+	// Collect the entries of both materialized and recorded segments
+	vector<pair<uint64_t, Extent>> entries;
+	for (auto it=segments.begin(); it!=segments.end(); ++it)
+		for (Extent& e : it->second->extents)
+			entries.push_back(make_pair(entryKey(it->second), e));
+	for (auto it=descriptors.begin(); it!=descriptors.end(); ++it)
+	{
+		uint64_t key = it->first | ((uint64_t)it->second.type << typeShift);
+		for (Extent& e : it->second.extents)
+			entries.push_back(make_pair(key, e));
+	}
+
+	// Every page in the SI carries this header, the number of entries
+	buffer.push_back(entries.size());
 	
 	// The number of entries that may still be written to page,
 	// controls overflow
 	uint64_t entryCounter = maxEntries;
 			
 	// Loop through all data to be written to file
-	for (auto it=segments.begin(); it!=segments.end(); ++it)
+	for (size_t i = 0; i < entries.size(); i++)
 	{
-		Segment* seg = it->second;
-		vector<Extent>& exts = seg->extents;
+		// SegId | StartPageNo | EndPageNo
+		buffer.push_back(entries[i].first);
+		buffer.push_back(entries[i].second.start);
+		buffer.push_back(entries[i].second.end);
+		
+		entryCounter--;
 		
-		// Current segment's extents
-		for (size_t j = 0; j < exts.size(); j++)
+		// If no more tuples fit on page or this is the final iteration,
+		// flush the buffer
+		if (entryCounter == 0 || i == entries.size()-1)
 		{
-			// SegId | StartPageNo | EndPageNo
-			buffer.push_back(it->first);
-			buffer.push_back(exts[j].start);
-			buffer.push_back(exts[j].end);
-			
-			entryCounter--;
-			
-			// If no more tuples fit on page or this is the final iteration
-			// on both loops, flush the buffer
-			if (entryCounter == 0 || (it == (--segments.end()) && 
-			                           j == exts.size()-1))
-			{
-				// Get the next available frame for the SI
-				uint64_t page = frames.top();
-				frames.pop();
-
-				// write to file				
-				BufferFrame& bf = bm->fixPage(page, true);
-				writeToArray(buffer.data(), bf.getData(), buffer.size(), 0);
-				bm->unfixPage(bf, true);
-
-				// reset buffer
-				buffer.clear();
-				buffer.push_back(numEntries);
-			
-				entryCounter = maxEntries;
-			}			
-		}
+			// Get the next available frame for the SI
+			uint64_t page = frames.top();
+			frames.pop();
+
+			// write to file				
+			BufferFrame& bf = bm->fixPage(page, true);
+			writeToArray(buffer.data(), bf.getData(), buffer.size(), 0);
+			bm->unfixPage(bf, true);
+
+			// reset buffer
+			buffer.clear();
+			buffer.push_back(entries.size());
+		
+			entryCounter = maxEntries;
+		}			
 	}
 }
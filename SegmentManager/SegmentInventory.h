@@ -25,9 +25,45 @@ struct comp {
 };
 
 
+// The types of the change records in the metadata log: an extent added to or
+// removed from a segment, a dropped segment, and a free extent added to or
+// removed from the FreeSpaceInventory.
+enum logRecordTypes { LOG_ADD_EXTENT = 1, LOG_REMOVE_EXTENT, LOG_DROP_SEGMENT,
+                      LOG_ADD_FREE, LOG_REMOVE_FREE };
+
+// A change record in the metadata log. segId is 1 for LOG_ADD_FREE and
+// LOG_REMOVE_FREE, and the extent is empty for LOG_DROP_SEGMENT.
+struct LogRecord
+{
+	uint64_t type;
+	uint64_t segId;
+	uint64_t start;
+	uint64_t end;
+};
+
+
+// A segment recorded in the SI which has not been materialized yet (see 
+// SegmentInventory::getSegment)
+struct SegmentDescriptor
+{
+	segTypes type;
+	std::vector<Extent> extents;
+};
+
+
 // A SegmentInventory is a special segment in the DBMS. Internally, it manages
 // the storage of segments and has the ability to materialize its state onto
 // a segment in the database, as well as initialize its state from that segment.
+//
+// The SI and the FreeSpaceInventory are persisted incrementally: their full
+// state (snapshot) is only written from time to time (see checkpoint), and
+// every change in between is appended as a LogRecord to the metadata log,
+// a fixed extent of SMConst::logPages pages at the end of the database file,
+// which is referenced by the last 8 bytes of page 0. Each log page is 
+// formatted as follows:
+// generation | numberOfRecords | record1 | record2 | ...
+// where only the pages carrying the generation of the first log page belong
+// to the log. On startup, the snapshot is read and the log replayed.
 class SegmentInventory : public Segment
 {
 	friend class SegmentManager;
@@ -71,7 +107,9 @@ public:
 	bool unregisterSegment(Segment* seg);
 	
 	// Returns the segment with the given id. If no such segment is found,
-	// nullptr is returned.
+	// nullptr is returned. Segments recovered from file are only created 
+	// here, on first access: as SPSegment or PAXSegment iff they have been
+	// created as such, otherwise as RegularSegment.
 	//
 	// FRIEND_TEST(SegmentManagerTest, initializeWithFile);
 	Segment* getSegment(uint64_t id);
@@ -82,12 +120,29 @@ public:
 	//
 	// FRIEND_TEST(SegmentManagerTest, createGrowDropSegment);
 	void notifySegGrowth(uint64_t id, uint64_t offset);
+
+	// Notifies the SI that the extent e has been removed from the given
+	// segment. The SI itself is not shrunk.
+	void notifySegShrink(uint64_t id, Extent e);
 	
 	// Returns the next free segment id, updates the current id to the next
 	// available one.
 	//
 	// FRIEND_TEST(SegmentManagerTest, initializeWithFile);
 	uint64_t setNextId();
+
+	// Appends a change record to the metadata log, one page write. If the
+	// log is full or has not been created yet, the change is only recorded
+	// by the next snapshot instead. Changes applied while the SI is being
+	// initialized are not logged.
+	void logChange(logRecordTypes type, uint64_t segId, uint64_t start,
+	               uint64_t end);
+
+	// Writes new snapshots of the SI and the FSI and empties the log iff 
+	// there are changes which have not been logged, or the log is half 
+	// full. Creates the log if necessary. Called by the SegmentManager
+	// after every change.
+	void checkpoint();
 	
 private:
 
@@ -96,6 +151,12 @@ private:
 	// Each page on an SI extent is formatted as follows:
 	// totalNumberOfEntries | segmentId | pageNoStart | pageNoEnd |
 	// nextSegmentId | nextPageNoStart | nextPageNoEnd | ....
+	// where the top 8 bits of a segment id hold the segment's type (see
+	// entryKey).
+	//
+	// Only the SI and FSI are created, all other segments are merely 
+	// recorded as descriptors, so that opening the database does not depend
+	// on the number of segments beyond reading the SI.
 	//
 	// If there is no meaningful data on file (e.g. first int = 0), 
 	// an extent is created and recorded for the segment inventory.
@@ -125,10 +186,29 @@ private:
 	void parseSIExtents(std::multimap<uint64_t, Extent, comp>& mapping, 
 	                    BufferFrame& frame, uint64_t& counter);
 	
+	// Returns the id of the given segment as recorded in the SI and the log,
+	// i.e. tagged with the segment's type.
+	static uint64_t entryKey(Segment* seg);
+
 	// Adds an extent to the SI. Whereas regular segments are grown on demand
 	// (see SegmentManager::growSegment), the SI grows automatically.    
 	void grow();
 
+	// Writes snapshots of the SI and the FSI and starts a new generation of
+	// the log. Creates the log first iff it does not exist and create ==
+	// true.
+	void compact(bool create);
+
+	// Returns the records of the current generation of the log, in the
+	// order they were appended.
+	std::vector<LogRecord> readLog();
+
+	// Applies the SI records of the log to the mapping of segment ids to
+	// extents read from the snapshot. Replaying is idempotent, so that a
+	// log which has not been emptied after a snapshot does no harm.
+	void replayLog(const std::vector<LogRecord>& log, 
+	               std::multimap<uint64_t, Extent, comp>& mapping);
+
 	// Handler to the buffer manager	
 	BufferManager* bm;
 	
@@ -137,6 +217,9 @@ private:
 	
 	// Data structure mapping a segment id to a segment
 	std::map<uint64_t, Segment*> segments;
+
+	// The segments recovered from file which have not been accessed yet
+	std::map<uint64_t, SegmentDescriptor> descriptors;
 	
 	// The SegmentInventory keeps track of the ids that have been assigned to
 	// existing segments, and thus knows the next available id.
@@ -147,6 +230,23 @@ private:
 	
 	// Max SI entries per page
 	uint64_t maxEntries;
+
+	// The first page of the metadata log, 0 iff there is none yet
+	uint64_t logStart;
+
+	// The generation of the log, and the number of records in it
+	uint64_t logGeneration;
+	uint64_t logRecords;
+
+	// Max log records per page
+	uint64_t maxLogRecords;
+
+	// true iff there are changes which have neither been logged nor 
+	// written to a snapshot
+	bool unlogged;
+
+	// true while the SI is being initialized
+	bool loading;
 };
 
 
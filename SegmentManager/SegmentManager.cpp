@@ -6,11 +6,12 @@
 #include "SegmentManager.h"
 #include "RegularSegment.h"
 #include "SPSegment.h"
+#include "PAXSegment.h"
 
+#include <algorithm>
 #include <fcntl.h>
 #include <iostream>
 #include <vector>
-#include <math.h>
 
 using namespace std;
 
@@ -29,12 +30,25 @@ SegmentManager::SegmentManager(const string& filename)
 		spaceInv = new FreeSpaceInventory(segInv, bm, false, 1);
 		segInv->registerSegment(spaceInv);
 	}
+
+	growthPolicy = new CappedGrowthPolicy(new DynamicGrowthPolicy(
+		params.baseExtentSize, params.extentIncrease), params.maxExtentSize);
+	stopping = false;
+	preallocator = thread(&SegmentManager::preallocationWorker, this);
 }
 
 
 // _____________________________________________________________________________
 SegmentManager::~SegmentManager()
 {
+	// Pending preallocations are abandoned
+	{
+		lock_guard<mutex> guard(preallocationLock);
+		stopping = true;
+	}
+	preallocationChanged.notify_all();
+	preallocator.join();
+
 	// Drop non permanent segments
 	for (auto it=segInv->segments.begin(); it!=segInv->segments.end(); ++it)
 		if (!(it->second)->permanent) dropSegment(it->first);
@@ -43,11 +57,13 @@ SegmentManager::~SegmentManager()
 	if (segInv != nullptr) delete segInv;	
 	if (spaceInv != nullptr) delete spaceInv;
 	if (bm != nullptr) delete bm;
+	delete growthPolicy;
 }
 
 // _____________________________________________________________________________
 Segment* SegmentManager::retrieveSegmentById(uint64_t segId)
 {
+	lock_guard<recursive_mutex> guard(lock);
 	return segInv->getSegment(segId);
 }
 
@@ -60,51 +76,73 @@ BufferManager& SegmentManager::getBufferManager()
 
 
 // _____________________________________________________________________________
-uint64_t SegmentManager::createSegment(segTypes type, bool visible)
+uint64_t SegmentManager::createSegment(segTypes type, bool visible,
+                                       const Schema* schema)
 {	
-	// See if there is a free extent available with sufficient pages
-	uint64_t base = params.baseExtentSize;
-	Extent e = spaceInv->getExtent(base);
-	
-	// If no such extent found, then the size of the database file must be
-	// increased to accomodate space for the new segment
-	if (e.start == e.end)
+	if ((type == PAX_SGM || type == CPAX_SGM) && schema == nullptr)
 	{
-		pair<uint64_t, uint64_t> growth = bm->growDB(base);
-		Extent grownExtent(growth.first, growth.second);
-		spaceInv->registerExtent(grownExtent);
-		return createSegment(type, visible);
+		cout << "Error creating segment: PAX segments require a schema" << endl;
+		exit(1);
 	}
-	
+	lock_guard<recursive_mutex> guard(lock);
+
 	// e has already been unregistered from the FSI
-	else
+	Extent e = allocateExtent(params.baseExtentSize, 0);
+	uint64_t newId = segInv->setNextId();
+	Segment* newSeg = nullptr;
+	switch(type)
 	{
-		uint64_t newId = segInv->setNextId();
-		Segment* newSeg = nullptr;
-		switch(type)
-		{
-			case RG_SGM:
-				newSeg = new RegularSegment(visible, newId, &e);
-				break;
-				
-			case SP_SGM:
-				newSeg = new SPSegment(bm, visible, newId, &e);
-				break;
-
-			default:
-				cout << "Segment type not recognized" << endl;
-				exit(1);
-		}		
-		
-		bool found = segInv->registerSegment(newSeg);
-		if (found)
-		{
-			cout << "Error creating segment: id already taken" << endl;
+		case RG_SGM:
+			newSeg = new RegularSegment(visible, newId, &e);
+			break;
+			
+		case SP_SGM:
+			newSeg = new SPSegment(bm, visible, newId, &e, schema);
+			break;
+
+		case PAX_SGM:
+			newSeg = new PAXSegment(bm, visible, newId, &e, *schema);
+			break;
+
+		case CPAX_SGM:
+			newSeg = new PAXSegment(bm, visible, newId, &e, *schema, true);
+			break;
+
+		default:
+			cout << "Segment type not recognized" << endl;
 			exit(1);
-		}
-		return newId;
+	}		
+	
+	bool found = segInv->registerSegment(newSeg);
+	if (found)
+	{
+		cout << "Error creating segment: id already taken" << endl;
+		exit(1);
 	}
-	return 0;
+	segInv->checkpoint();
+	return newId;
+}
+
+// _____________________________________________________________________________
+Extent SegmentManager::allocateExtent(uint64_t numPages, uint64_t after)
+{
+	if (numPages == 0)
+	{
+		cout << "Error allocating extent: extents cannot be empty" << endl;
+		exit(1);
+	}
+
+	// If no such extent found, then the size of the database file must be
+	// increased to accomodate space for the new extent
+	Extent e = spaceInv->getExtent(numPages, after);
+	while (e.start == e.end)
+	{
+		pair<uint64_t, uint64_t> growth = bm->growDB(numPages);
+		Extent grownExtent(growth.first, growth.second);
+		spaceInv->registerExtent(grownExtent);
+		e = spaceInv->getExtent(numPages, after);
+	}
+	return e;
 }
 
 // _____________________________________________________________________________
@@ -126,45 +164,131 @@ uint64_t SegmentManager::growSegment(uint64_t segId)
 		exit(1);
 	}
 	
-	// Grow segment according to dynamic extent mapping.
-	// Let the base size of an extent be b. If the segment has n > 0 extents,
-	// Then the ith extent has size b^(k^(i-1)), where k is the exponential
-	// growth constant. Therefore, the extent that will be added now will have
-	// size b^(k^(n))
-	float numExtents = toGrow->extents.size();
-	uint64_t newExtentSize = ceil(pow(params.baseExtentSize, 
-	                              pow(params.extentIncrease,numExtents)));
-	
-	// Request an extent with required capacity   	
-	Extent e = spaceInv->getExtent(newExtentSize);
+	// Request an extent with the size given by the growth policy, preferably
+	// right behind the segment's last extent
+	lock_guard<recursive_mutex> guard(lock);
+	uint64_t newExtentSize = growthPolicy->extentSize(segId, 
+	                         toGrow->extents.size(), toGrow->getSize());
+	Extent e = allocateExtent(newExtentSize, toGrow->extents.back().end);
+
+	// e has already been unregistered from the FSI
+	toGrow->extents.push_back(e);
 	
-	// If no such extent found, then the size of the database file must be
-	// increased to accomodate space for the new extent
-	if (e.start == e.end)
+	// Notify the SI as well as the respective segment that it has grown
+	segInv->notifySegGrowth(toGrow->id, 1);
+	toGrow->notifySegGrowth(e);
+	growthPolicy->notifyGrowth(segId);
+	segInv->checkpoint();
+	if (params.preallocate) preallocate(segId);
+	return e.start;
+}
+
+// _____________________________________________________________________________
+uint64_t SegmentManager::shrinkSegment(uint64_t segId)
+{
+	auto toShrink = dynamic_cast<RegularSegment*>(retrieveSegmentById(segId));
+	if (segId < 2 || toShrink == nullptr)
 	{
-		pair<uint64_t, uint64_t> growth = bm->growDB(newExtentSize);
-		Extent grownExtent(growth.first, growth.second);
-		spaceInv->registerExtent(grownExtent);
-		growSegment(segId);
+		cout << "Error shrinking segment: no regular segment with id " << segId
+			 << " was found" << endl;
+		exit(1);
 	}
-	
-	else
+
+	// Release the extent holding the last pages of the segment as long as it
+	// is unused
+	lock_guard<recursive_mutex> guard(lock);
+	uint64_t released = 0;
+	vector<Extent>& extents = toShrink->extents;
+	while (extents.size() > 1)
 	{
-		// e has already been unregistered from the FSI
-		toGrow->extents.push_back(e);
-		
-		// Notify the SI as well as the respective segment that it has grown
-		segInv->notifySegGrowth(toGrow->id, 1);
-		toGrow->notifySegGrowth(e);
-		return e.start;
+		auto last = max_element(extents.begin(), extents.end(), 
+			[](const Extent& l, const Extent& r) { return l.start < r.start; });
+		Extent e = *last;
+		if (!toShrink->canRelease(e)) break;
+
+		extents.erase(last);
+		segInv->notifySegShrink(segId, e);
+		toShrink->notifySegShrink(e);
+		spaceInv->registerExtent(e);
+		released += e.end - e.start;
+	}
+	segInv->checkpoint();
+	return released;
+}
+
+// _____________________________________________________________________________
+void SegmentManager::setGrowthPolicy(ExtentGrowthPolicy* policy)
+{
+	lock_guard<recursive_mutex> guard(lock);
+	delete growthPolicy;
+	growthPolicy = policy;
+}
+
+// _____________________________________________________________________________
+void SegmentManager::preallocate(uint64_t segId)
+{
+	auto seg = dynamic_cast<RegularSegment*>(retrieveSegmentById(segId));
+	if (seg == nullptr) return;
+
+	uint64_t size;
+	{
+		lock_guard<recursive_mutex> guard(lock);
+		size = growthPolicy->extentSize(segId, seg->extents.size(), 
+		                                seg->getSize());
+	}
+	if (size == 0) return;
+	{
+		lock_guard<mutex> guard(preallocationLock);
+		preallocations.push_back(size);
+	}
+	preallocationChanged.notify_all();
+}
+
+// _____________________________________________________________________________
+void SegmentManager::waitForPreallocation()
+{
+	unique_lock<mutex> guard(preallocationLock);
+	preallocationChanged.wait(guard, 
+		[this]() { return preallocations.empty() || stopping; });
+}
+
+// _____________________________________________________________________________
+void SegmentManager::preallocationWorker()
+{
+	unique_lock<mutex> queueGuard(preallocationLock);
+	while (true)
+	{
+		preallocationChanged.wait(queueGuard, 
+			[this]() { return !preallocations.empty() || stopping; });
+		if (stopping) return;
+		uint64_t size = preallocations.front();
+		queueGuard.unlock();
+
+		// The file is grown without holding the inventories, so that 
+		// concurrent segment operations only wait for the registration
+		bool needed;
+		{
+			lock_guard<recursive_mutex> guard(lock);
+			needed = !spaceInv->hasExtent(size);
+		}
+		if (needed)
+		{
+			pair<uint64_t, uint64_t> growth = bm->growDB(size);
+			lock_guard<recursive_mutex> guard(lock);
+			spaceInv->registerExtent(Extent(growth.first, growth.second));
+			segInv->checkpoint();
+		}
+
+		queueGuard.lock();
+		preallocations.pop_front();
+		preallocationChanged.notify_all();
 	}
-	
-	return 0;
 }
 
 // _____________________________________________________________________________
 void SegmentManager::dropSegment(uint64_t segId)
 {
+	lock_guard<recursive_mutex> guard(lock);
 	Segment* toDrop = retrieveSegmentById(segId);
 	if (toDrop == nullptr)
 	{
@@ -183,4 +307,5 @@ void SegmentManager::dropSegment(uint64_t segId)
 	
 	// Clean memory
 	delete toDrop;
+	segInv->checkpoint();
 }
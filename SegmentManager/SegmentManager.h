@@ -10,14 +10,21 @@
 #include "../BufferManager/BufferManager.h"
 #include "SegmentInventory.h"
 #include "FreeSpaceInventory.h"
+#include "ExtentGrowthPolicy.h"
+#include "Schema.h"
 #include "SMConst.h"
 
 #include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
 
 
 // Provides basic functions operating on segments, such as create, drop, grow
-// or retrieve by id. See constructor for further details.
+// or retrieve by id. See constructor for further details. All methods may be
+// called concurrently.
 class SegmentManager
 {
 
@@ -35,9 +42,12 @@ public:
 	~SegmentManager();
 	
 	// Creates a new segment of the given type with one initial extent, 
-	// and returns its id
+	// and returns its id. Segments of type PAX_SGM and CPAX_SGM
+	// (compressed PAX) require a schema, SP_SGM segments keep zone maps iff
+	// one is given.
 	FRIEND_TEST(SegmentManagerTest, createGrowDropSegment);
-	uint64_t createSegment(segTypes type, bool visible);
+	uint64_t createSegment(segTypes type, bool visible, 
+	                       const Schema* schema = nullptr);
 	
 	// Drops the segment with the given id. The results in a change in the FSI,
 	// where the pages of the dropped segment are now recorded as being free.
@@ -46,11 +56,36 @@ public:
 	// FRIEND_TEST(SegmentManagerTest, createGrowDropSegment);
 	void dropSegment(uint64_t segId);
 	
-	// Adds an additional extent to the segment with the given id.
-	// Method returns the page number of the first page of the new extent.
+	// Adds an additional extent to the segment with the given id, sized
+	// according to the extent growth policy. Method returns the page number
+	// of the first page of the new extent. Unless the extent has been 
+	// preallocated (see preallocate), the database file is grown if no free
+	// extent is large enough.
 	//
 	// FRIEND_TEST(SegmentManagerTest, createGrowDropSegment);
 	uint64_t growSegment(uint64_t segId);
+
+	// Removes the trailing extents of the segment with the given id which
+	// hold no data, as far as the segment can tell (see 
+	// RegularSegment::canRelease), and records their pages as being free in
+	// the FSI. The first extent is always kept. Returns the number of pages
+	// released. Like growing, shrinking requires exclusive access to the 
+	// segment. See SPSegment::compact for emptying the pages of a segment.
+	uint64_t shrinkSegment(uint64_t segId);
+
+	// Replaces the policy which determines the size of the extents added by
+	// growSegment. Takes ownership of policy. The default policy is the 
+	// dynamic extent mapping, capped at SMConst::maxExtentSize pages.
+	void setGrowthPolicy(ExtentGrowthPolicy* policy);
+
+	// Makes sure that the next extent of the segment with the given id can
+	// be taken from the free space, by growing the database file in the 
+	// background if necessary, so that growing the segment does not stall 
+	// on file growth. Called by growSegment iff SMConst::preallocate.
+	void preallocate(uint64_t segId);
+
+	// Blocks until all preallocations requested so far are done.
+	void waitForPreallocation();
 	
 	// Returns a pointer to the segment with the given id	
 	// If no such segment exists, a nullptr is returned. Use dynamic cast
@@ -65,6 +100,16 @@ public:
 
 private:
 
+	// Returns an extent with #numPages taken from the free space, preferably
+	// starting at #after (see FreeSpaceInventory::getExtent). Grows the
+	// database file iff no free extent is large enough. Empty extents are
+	// rejected.
+	Extent allocateExtent(uint64_t numPages, uint64_t after);
+
+	// Grows the database file for the requested preallocations, one at a
+	// time, until the SegmentManager is destroyed.
+	void preallocationWorker();
+
 	// BufferManager handler
 	BufferManager* bm;
 
@@ -77,6 +122,20 @@ private:
 	
 	// Segment manager parameters
 	SMConst params;
+
+	// Determines the size of the extents added by growSegment
+	ExtentGrowthPolicy* growthPolicy;
+
+	// Guards the inventories and the growth policy
+	std::recursive_mutex lock;
+
+	// The sizes of the extents requested to be preallocated, guarded by
+	// preallocationLock. stopping is set on destruction.
+	std::deque<uint64_t> preallocations;
+	std::mutex preallocationLock;
+	std::condition_variable preallocationChanged;
+	bool stopping;
+	std::thread preallocator;
 };
 
 
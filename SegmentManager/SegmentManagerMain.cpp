@@ -164,10 +164,18 @@ int main(int argc, char** argv) {
       uint64_t r = rnd.next()%testData.size();
       const string s = testData[r];
 
-      // Replace old with new value if successful (current implementation
-      // does not support indirection to another page)
-      if (sp->update(tid, Record(s.size(), s.c_str())))
-         values[tid.intRepresentation]=r;
+      // Replace old with new value. Records which no longer fit on their
+      // page are moved to another page, so an update only fails if the
+      // segment is full.
+      bool updated;
+      try { updated = sp->update(tid, Record(s.size(), s.c_str())); }
+      catch (SM_EXC::SPSegmentFullException& e)
+      {
+         sm.growSegment(spId);
+         updated = sp->update(tid, Record(s.size(), s.c_str()));
+      }
+      assert(updated);
+      values[tid.intRepresentation]=r;
    }
    cout << "done." << endl;
 
@@ -4,8 +4,15 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "SegmentManager.h"
+#include "SPSegment.h"
+#include "PAXSegment.h"
 #include "SMConst.h"
+#include <algorithm>
+#include <atomic>
+#include <map>
 #include <math.h>
+#include <mutex>
+#include <set>
 
 using namespace std;
 
@@ -191,8 +198,9 @@ TEST(SegmentManagerTest, initializeWithFile)
 	ASSERT_EQ(si->extents[0].start, 0);
 	ASSERT_EQ(si->extents[0].end, 1);
 	
-	// Check segment mapping
-	ASSERT_EQ(si->segments.size(), 5);
+	// Check segment mapping, segments are created on first access
+	ASSERT_EQ(si->segments.size(), 2);
+	ASSERT_EQ(si->descriptors.size(), 3);
 	ASSERT_NE(si->getSegment(0), nullptr);
 	ASSERT_NE(si->getSegment(1), nullptr);
 	ASSERT_NE(si->getSegment(2), nullptr);
@@ -468,6 +476,1091 @@ TEST(SegmentManagerTest, createGrowDropSegment)
 }
 
 
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, parallelScan)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_NE(sp, nullptr);
+
+	// Fill the segment across several extents with records of varying size
+	map<uint64_t, string> inserted;
+	for (unsigned i = 0; i < 3000; i++)
+	{
+		string s = to_string(i) + string(i % 200, 'x');
+		TID tid;
+		try { tid = sp->insert(Record(s.size(), s.c_str())); }
+		catch (SM_EXC::SPSegmentFullException& e)
+		{
+			sm->growSegment(spId);
+			tid = sp->insert(Record(s.size(), s.c_str()));
+		}
+		inserted[tid.intRepresentation] = s;
+	}
+	ASSERT_GT(sp->getSize(), (uint64_t)SMConst::baseExtentSize);
+
+	// Every record must be produced exactly once, independently of the
+	// number of workers
+	for (unsigned threads : { 1, 4 })
+	{
+		map<uint64_t, string> scanned;
+		mutex scannedLock;
+		sp->parallelScan([&](RecordBatch& batch)
+		{
+			lock_guard<mutex> guard(scannedLock);
+			for (auto& entry : batch)
+			{
+				string s(entry.second->getData(), entry.second->getLen());
+				ASSERT_TRUE(scanned.insert(make_pair(
+				            entry.first.intRepresentation, s)).second);
+			}
+		}, threads);
+		ASSERT_EQ(scanned, inserted);
+	}
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, recordForwarding)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_NE(sp, nullptr);
+
+	// Fill the first page with small records
+	vector<TID> tids;
+	string small(100, 'a');
+	do tids.push_back(sp->insert(Record(small.size(), small.c_str())));
+	while (tids.back().pageId == tids.front().pageId);
+	tids.pop_back();
+	TID tid = tids[0];
+
+	// Growing a record beyond its page's capacity moves it, but keeps its TID
+	string large(1000, 'b');
+	ASSERT_TRUE(sp->update(tid, Record(large.size(), large.c_str())));
+	auto record = sp->lookup(tid);
+	ASSERT_NE(record, nullptr);
+	ASSERT_EQ(string(record->getData(), record->getLen()), large);
+
+	// The moved record is reported exactly once, under its home TID
+	unsigned found = 0;
+	sp->parallelScan([&](RecordBatch& batch)
+	{
+		for (auto& entry : batch)
+			if (entry.first.intRepresentation == tid.intRepresentation)
+			{
+				found++;
+				ASSERT_EQ(string(entry.second->getData(),
+				                 entry.second->getLen()), large);
+			}
+	}, 1);
+	ASSERT_EQ(found, 1u);
+
+	// The moved record is only removed on behalf of its home slot
+	BufferFrame& bf = sp->bm->fixPage(tid.pageId, false);
+	SlottedPage* page = reinterpret_cast<SlottedPage*>(bf.getData());
+	TID target;
+	memcpy(&target, page->getData() + page->getSlot(tid.slotId)->offset, 
+	       sizeof(TID));
+	sp->bm->unfixPage(bf, false);
+	ASSERT_FALSE(sp->removeMoved(target, tids[1]));
+	record = sp->lookup(tid);
+	ASSERT_NE(record, nullptr);
+	ASSERT_EQ(string(record->getData(), record->getLen()), large);
+
+	// Once there is room on the home page, the redirect can be collapsed
+	for (unsigned i = 1; i < tids.size(); i++) ASSERT_TRUE(sp->remove(tids[i]));
+	ASSERT_GE(sp->collapseRedirects(), 1u);
+	record = sp->lookup(tid);
+	ASSERT_EQ(string(record->getData(), record->getLen()), large);
+
+	// Removing through the home TID removes the record
+	ASSERT_TRUE(sp->remove(tid));
+	ASSERT_EQ(sp->lookup(tid), nullptr);
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, largeRecords)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_NE(sp, nullptr);
+
+	// A record spanning several pages
+	string large;
+	for (unsigned i = 0; large.size() < 50000; i++) large += to_string(i);
+	TID tid = sp->insert(Record(large.size(), large.c_str()));
+	TID small = sp->insert(Record(5, "small"));
+	ASSERT_EQ(sp->getLength(tid), large.size());
+	auto record = sp->lookup(tid);
+	ASSERT_EQ(string(record->getData(), record->getLen()), large);
+
+	// Partial reads across page boundaries, and beyond the end
+	char buffer[5000];
+	ASSERT_EQ(sp->read(tid, 4000, 5000, buffer), 5000u);
+	ASSERT_EQ(string(buffer, 5000), large.substr(4000, 5000));
+	ASSERT_EQ(sp->read(tid, large.size()-10, 5000, buffer), 10u);
+	ASSERT_EQ(sp->read(tid, large.size(), 5000, buffer), 0u);
+	ASSERT_EQ(sp->read(small, 1, 5000, buffer), 4u);
+	ASSERT_EQ(string(buffer, 4), "mall");
+
+	// Updates between large and small values keep the TID
+	string larger = large + large;
+	bool updated;
+	try { updated = sp->update(tid, Record(larger.size(), larger.c_str())); }
+	catch (SM_EXC::SPSegmentFullException& e)
+	{
+		sm->growSegment(spId);
+		updated = sp->update(tid, Record(larger.size(), larger.c_str()));
+	}
+	ASSERT_TRUE(updated);
+	record = sp->lookup(tid);
+	ASSERT_EQ(string(record->getData(), record->getLen()), larger);
+	ASSERT_TRUE(sp->update(tid, Record(5, "tiny!")));
+	ASSERT_EQ(sp->getLength(tid), 5u);
+
+	// Scans materialize large records, removing them frees their pages
+	ASSERT_TRUE(sp->update(tid, Record(large.size(), large.c_str())));
+	unsigned found = 0;
+	sp->parallelScan([&](RecordBatch& batch)
+	{
+		for (auto& entry : batch)
+			if (entry.first.intRepresentation == tid.intRepresentation)
+				found += entry.second->getLen() == large.size();
+	}, 2);
+	ASSERT_EQ(found, 1u);
+	uint64_t size = sp->getSize();
+	ASSERT_TRUE(sp->remove(tid));
+	ASSERT_EQ(sp->lookup(tid), nullptr);
+	for (unsigned i = 0; i < 3; i++)
+	{
+		tid = sp->insert(Record(larger.size(), larger.c_str()));
+		ASSERT_TRUE(sp->remove(tid));
+	}
+	ASSERT_EQ(sp->getSize(), size);
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, denseSlots)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_NE(sp, nullptr);
+
+	// A page must be able to hold more than 256 narrow records
+	vector<TID> tids;
+	for (unsigned i = 0; tids.empty() || 
+	     tids.back().pageId == tids.front().pageId; i++)
+		tids.push_back(sp->insert(Record(sizeof(unsigned), (char*)&i)));
+	tids.pop_back();
+	ASSERT_GT(tids.size(), 256u);
+	ASSERT_LE(tids.size(), (size_t)TID_CONS::maxSlots);
+
+	for (unsigned i = 0; i < tids.size(); i++)
+	{
+		ASSERT_EQ(tids[i].slotId, i);
+		auto record = sp->lookup(tids[i]);
+		ASSERT_EQ(*reinterpret_cast<const unsigned*>(record->getData()), i);
+	}
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, compactionAndSlotReuse)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_NE(sp, nullptr);
+
+	// Fill a page, then punch holes into it
+	map<uint64_t, string> records;
+	vector<TID> tids;
+	for (unsigned i = 0; tids.empty() || 
+	     tids.back().pageId == tids.front().pageId; i++)
+	{
+		string s = to_string(i) + string(i % 50, 'x');
+		tids.push_back(sp->insert(Record(s.size(), s.c_str())));
+		records[tids.back().intRepresentation] = s;
+	}
+	uint64_t page = tids.front().pageId;
+	for (unsigned i = 0; i < tids.size(); i += 2)
+	{
+		ASSERT_TRUE(sp->remove(tids[i]));
+		records.erase(tids[i].intRepresentation);
+	}
+
+	// Freed slots are reused, and growing records force the page to be 
+	// compacted without losing any of the remaining records. Inserts run on
+	// a new thread, which has no target page yet and picks the fullest page.
+	set<uint64_t> reused;
+	thread([&]()
+	{
+		for (unsigned i = 1; i + 1 < tids.size(); i += 4)
+		{
+			string s(60, 'y');
+			if (!sp->update(tids[i], Record(s.size(), s.c_str()))) return;
+			records[tids[i].intRepresentation] = s;
+			TID tid = sp->insert(Record(3, "new"));
+			if (tid.pageId == page) reused.insert(tid.slotId);
+			records[tid.intRepresentation] = "new";
+		}
+	}).join();
+	ASSERT_FALSE(reused.empty());
+	for (uint64_t slot : reused) ASSERT_EQ(slot % 2, 0u);
+	for (auto& entry : records)
+	{
+		TID tid;
+		tid.intRepresentation = entry.first;
+		auto record = sp->lookup(tid);
+		ASSERT_NE(record, nullptr);
+		ASSERT_EQ(string(record->getData(), record->getLen()), entry.second);
+	}
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, concurrentInserts)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_NE(sp, nullptr);
+	while (sp->getSize() < 300) sm->growSegment(spId);
+
+	// Every thread inserts into its own target page
+	const unsigned numThreads = 4, perThread = 2000;
+	vector<vector<TID>> tids(numThreads);
+	vector<thread> threads;
+	for (unsigned t = 0; t < numThreads; t++)
+	{
+		threads.push_back(thread([&, t]()
+		{
+			for (unsigned i = 0; i < perThread; i++)
+			{
+				string s = to_string(t) + ":" + to_string(i);
+				tids[t].push_back(sp->insert(Record(s.size(), s.c_str())));
+			}
+		}));
+	}
+	for (thread& t : threads) t.join();
+
+	set<uint64_t> seen;
+	map<uint64_t, set<unsigned>> pageOwners;
+	for (unsigned t = 0; t < numThreads; t++)
+	{
+		for (unsigned i = 0; i < perThread; i++)
+		{
+			ASSERT_TRUE(seen.insert(tids[t][i].intRepresentation).second);
+			pageOwners[tids[t][i].pageId].insert(t);
+			auto record = sp->lookup(tids[t][i]);
+			ASSERT_NE(record, nullptr);
+			ASSERT_EQ(string(record->getData(), record->getLen()),
+			          to_string(t) + ":" + to_string(i));
+		}
+	}
+	for (auto& owners : pageOwners) ASSERT_EQ(owners.second.size(), 1u);
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, targetPageClaims)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_NE(sp, nullptr);
+	while (sp->getSize() < 300) sm->growSegment(spId);
+	SegmentFSI* fsi = sp->getFSI();
+	string s(100, 'x');
+	Record r(s.size(), s.c_str());
+
+	// A page emptied by compaction is empty again, even though it is still
+	// the target page of a thread which has exited
+	TID tid;
+	thread([&]() { tid = sp->insert(r); }).join();
+	uint64_t page = sp->pageIndex(tid.pageId);
+	ASSERT_FALSE(fsi->isEmpty(page));
+	ASSERT_TRUE(sp->remove(tid));
+	sp->compact();
+	ASSERT_TRUE(fsi->isEmpty(page));
+
+	// The target pages of threads which have exited are taken over once
+	// they are stale. The threads of a wave are alive at the same time, so
+	// that they have distinct ids.
+	const unsigned numThreads = 10;
+	set<uint64_t> pages;
+	mutex pagesLock;
+	auto wave = [&]()
+	{
+		atomic<unsigned> inserted(0);
+		vector<thread> threads;
+		for (unsigned t = 0; t < numThreads; t++)
+		{
+			threads.push_back(thread([&]()
+			{
+				TID tid = sp->insert(r);
+				{
+					lock_guard<mutex> guard(pagesLock);
+					pages.insert(tid.pageId);
+				}
+				inserted++;
+				while (inserted < numThreads) this_thread::yield();
+			}));
+		}
+		for (thread& t : threads) t.join();
+	};
+	wave();
+	ASSERT_EQ(pages.size(), numThreads);
+	this_thread::sleep_for(chrono::milliseconds(SMConst::claimTimeout + 100));
+	wave();
+	ASSERT_EQ(pages.size(), numThreads);
+	ASSERT_EQ(fsi->claims.size(), numThreads);
+
+	// Entries are updated without a lock, but concurrent updates of the two
+	// pages of an entry are not lost, and the summary stays exact
+	vector<thread> updaters;
+	for (unsigned t = 0; t < 4; t++)
+	{
+		updaters.push_back(thread([&, t]()
+		{
+			for (unsigned i = 0; i < 1000; i++)
+				fsi->update(200 + t, i % 2 == 0 ? 0 : 8 << t);
+		}));
+	}
+	for (thread& t : updaters) t.join();
+	for (unsigned t = 0; t < 4; t++) ASSERT_EQ(fsi->value(200 + t), t + 1);
+	vector<unsigned char> values;
+	uint64_t blockPages = SMConst::fsiBlockPages;
+	fsi->readValues(0, min(fsi->counted, blockPages), values);
+	for (unsigned v = 0; v < 16; v++)
+		ASSERT_EQ(fsi->summary[0][v], 
+		          (uint32_t)count(values.begin(), values.end(), v));
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, paxSegment)
+{
+	Schema schema;
+	schema.addAttribute("id", INTEGER);
+	schema.addAttribute("name", CHAR, 20);
+	schema.addAttribute("value", INTEGER);
+	ASSERT_EQ(schema.getRecordLength(), 36u);
+
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t paxId = sm->createSegment(segTypes::PAX_SGM, true, &schema);
+	PAXSegment* pax =dynamic_cast<PAXSegment*>(sm->retrieveSegmentById(paxId));
+	ASSERT_NE(pax, nullptr);
+	ASSERT_GT(pax->getCapacity(), 0);
+
+	// Records are laid out according to the schema
+	auto makeRecord = [](int64_t id, int64_t value)
+	{
+		char data[36] = { 0 };
+		memcpy(data, &id, 8);
+		snprintf(data + 8, 20, "name%ld", (long)id);
+		memcpy(data + 28, &value, 8);
+		return string(data, 36);
+	};
+	vector<TID> tids;
+	for (int64_t i = 0; i < 2000; i++)
+	{
+		string r = makeRecord(i, i % 100);
+		try { tids.push_back(pax->insert(Record(r.size(), r.c_str()))); }
+		catch (SM_EXC::PAXSegmentFullException& e)
+		{
+			sm->growSegment(paxId);
+			tids.push_back(pax->insert(Record(r.size(), r.c_str())));
+		}
+	}
+	ASSERT_THROW(pax->insert(Record(3, "abc")), SM_EXC::SchemaMismatchException);
+
+	auto record = pax->lookup(tids[1234]);
+	ASSERT_EQ(string(record->getData(), record->getLen()), makeRecord(1234, 34));
+	string r = makeRecord(1234, 1000);
+	ASSERT_TRUE(pax->update(tids[1234], Record(r.size(), r.c_str())));
+	ASSERT_TRUE(pax->remove(tids[5]));
+	ASSERT_FALSE(pax->remove(tids[5]));
+	ASSERT_EQ(pax->lookup(tids[5]), nullptr);
+
+	// Column scans only see the requested, aligned minipages
+	int64_t sum = 0;
+	unsigned rows = 0;
+	pax->scan({ 2 }, [&](const ColumnBatch& batch)
+	{
+		ASSERT_EQ(batch.columns.size(), 1u);
+		ASSERT_EQ((uintptr_t)batch.columns[0] % PAX_ALIGNMENT, 0u);
+		auto values = reinterpret_cast<const int64_t*>(batch.columns[0]);
+		for (unsigned i = 0; i < batch.count; i++)
+			if (batch.valid[i/8] & (1 << i%8)) { sum += values[i]; rows++; }
+	});
+	ASSERT_EQ(rows, 1999u);
+	ASSERT_EQ(sum, 20*4950 - 5 - 34 + 1000);
+
+	// Range selection on an integer column
+	auto selected = pax->selectRange(2, 99, 1000);
+	ASSERT_EQ(selected.size(), 21u);
+	ASSERT_THROW(pax->selectRange(1, 0, 0), SM_EXC::SchemaMismatchException);
+	ASSERT_THROW(pax->selectRange(3, 0, 0), SM_EXC::SchemaMismatchException);
+	for (TID tid : selected)
+	{
+		record = pax->lookup(tid);
+		int64_t value;
+		memcpy(&value, record->getData() + 28, 8);
+		ASSERT_TRUE(value == 99 || value == 1000);
+	}
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, compressedPaxSegment)
+{
+	Schema schema;
+	schema.addAttribute("id", INTEGER);
+	schema.addAttribute("name", CHAR, 20);
+	schema.addAttribute("value", INTEGER);
+
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t paxId = sm->createSegment(segTypes::PAX_SGM, true, &schema);
+	uint64_t cpaxId = sm->createSegment(segTypes::CPAX_SGM, true, &schema);
+	PAXSegment* pax =dynamic_cast<PAXSegment*>(sm->retrieveSegmentById(paxId));
+	PAXSegment* cpax=dynamic_cast<PAXSegment*>(sm->retrieveSegmentById(cpaxId));
+	ASSERT_TRUE(cpax->isCompressed());
+
+	// Sequential ids (FOR), few distinct names (DICT), sorted runs (RLE)
+	auto makeRecord = [](int64_t id, int64_t value)
+	{
+		char data[36] = { 0 };
+		memcpy(data, &id, 8);
+		snprintf(data + 8, 20, "name%ld", (long)(id % 4));
+		memcpy(data + 28, &value, 8);
+		return string(data, 36);
+	};
+	auto insert = [sm](uint64_t segId, PAXSegment* seg, const string& r)
+	{
+		try { return seg->insert(Record(r.size(), r.c_str())); }
+		catch (SM_EXC::PAXSegmentFullException& e)
+		{
+			sm->growSegment(segId);
+			return seg->insert(Record(r.size(), r.c_str()));
+		}
+	};
+	vector<TID> tids, ctids;
+	for (int64_t i = 0; i < 3000; i++)
+	{
+		string r = makeRecord(i, i / 100);
+		tids.push_back(insert(paxId, pax, r));
+		ctids.push_back(insert(cpaxId, cpax, r));
+	}
+
+	// Compressed pages hold several times more rows
+	auto countPages = [](PAXSegment* seg)
+	{
+		unsigned pages = 0;
+		seg->scan({ }, [&](const ColumnBatch& batch) { pages++; });
+		return pages;
+	};
+	ASSERT_LT(3 * countPages(cpax), countPages(pax));
+
+	// Both segments return the same records
+	string r = makeRecord(77, -5);
+	ASSERT_TRUE(pax->update(tids[77], Record(r.size(), r.c_str())));
+	ASSERT_TRUE(cpax->update(ctids[77], Record(r.size(), r.c_str())));
+	ASSERT_TRUE(pax->remove(tids[2999]));
+	ASSERT_TRUE(cpax->remove(ctids[2999]));
+	for (int64_t i = 0; i < 3000; i++)
+	{
+		auto record = pax->lookup(tids[i]);
+		auto crecord = cpax->lookup(ctids[i]);
+		ASSERT_EQ(record == nullptr, crecord == nullptr);
+		if (record == nullptr) continue;
+		ASSERT_EQ(string(crecord->getData(), crecord->getLen()),
+		          string(record->getData(), record->getLen()));
+	}
+
+	// Scans see the decoded, aligned columns
+	int64_t sum = 0;
+	cpax->scan({ 0, 2 }, [&](const ColumnBatch& batch)
+	{
+		ASSERT_EQ((uintptr_t)batch.columns[1] % PAX_ALIGNMENT, 0u);
+		auto values = reinterpret_cast<const int64_t*>(batch.columns[1]);
+		for (unsigned i = 0; i < batch.count; i++)
+			if (batch.valid[i/8] & (1 << i%8)) sum += values[i];
+	});
+	ASSERT_EQ(sum, 100 * (29 * 30 / 2) - 29 - 0 - 5);
+	ASSERT_EQ(cpax->selectRange(0, 100, 2500).size(),
+	          pax->selectRange(0, 100, 2500).size());
+	ASSERT_EQ(cpax->selectRange(2, -5, 3).size(), 400u);
+
+	// Updates fail iff the page cannot hold the re-encoded values. The rows
+	// of the insert page are updated where they are staged.
+	r = makeRecord(INT64_MAX, 0);
+	ASSERT_THROW(cpax->update(ctids[1], Record(r.size(), r.c_str())),
+	             SM_EXC::PAXPageOverflowException);
+	ASSERT_EQ(cpax->lookup(ctids[1])->getData()[0], 1);
+	ASSERT_FALSE(cpax->update(ctids[2999], Record(r.size(), r.c_str())));
+	ASSERT_TRUE(cpax->update(ctids[2998], Record(r.size(), r.c_str())));
+	auto record = cpax->lookup(ctids[2998]);
+	ASSERT_EQ(string(record->getData(), record->getLen()), r);
+	ASSERT_EQ(cpax->selectRange(0, INT64_MAX, INT64_MAX).size(), 1u);
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, paxSegmentRecovery)
+{
+	Schema schema;
+	schema.addAttribute("id", INTEGER);
+	schema.addAttribute("name", CHAR, 20);
+
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t paxId = sm->createSegment(segTypes::PAX_SGM, true, &schema);
+	uint64_t cpaxId = sm->createSegment(segTypes::CPAX_SGM, true, &schema);
+	auto makeRecord = [](int64_t id)
+	{
+		char data[28] = { 0 };
+		memcpy(data, &id, 8);
+		snprintf(data + 8, 20, "name%ld", (long)(id % 7));
+		return string(data, 28);
+	};
+	auto insert = [&sm](uint64_t segId, const string& r)
+	{
+		auto seg = dynamic_cast<PAXSegment*>(sm->retrieveSegmentById(segId));
+		try { return seg->insert(Record(r.size(), r.c_str())); }
+		catch (SM_EXC::PAXSegmentFullException& e)
+		{
+			sm->growSegment(segId);
+			return seg->insert(Record(r.size(), r.c_str()));
+		}
+	};
+	vector<TID> tids, ctids;
+	for (int64_t i = 0; i < 3000; i++)
+	{
+		tids.push_back(insert(paxId, makeRecord(i)));
+		ctids.push_back(insert(cpaxId, makeRecord(i)));
+	}
+	PAXSegment* pax =dynamic_cast<PAXSegment*>(sm->retrieveSegmentById(paxId));
+	PAXSegment* cpax=dynamic_cast<PAXSegment*>(sm->retrieveSegmentById(cpaxId));
+	ASSERT_TRUE(pax->remove(tids[10]));
+	ASSERT_TRUE(cpax->remove(ctids[10]));
+	delete sm;
+
+	// Reopened segments keep their schema and records, and inserts continue
+	// on the last insert page
+	sm = new SegmentManager("database");
+	pax = dynamic_cast<PAXSegment*>(sm->retrieveSegmentById(paxId));
+	cpax = dynamic_cast<PAXSegment*>(sm->retrieveSegmentById(cpaxId));
+	ASSERT_NE(pax, nullptr);
+	ASSERT_NE(cpax, nullptr);
+	ASSERT_EQ(pax->getType(), PAX_SGM);
+	ASSERT_EQ(cpax->getType(), CPAX_SGM);
+	ASSERT_EQ(cpax->getSchema().getAttributes()[1].name, "name");
+	ASSERT_EQ(cpax->getSchema().getRecordLength(), 28u);
+	for (int64_t i = 3000; i < 4000; i++)
+	{
+		tids.push_back(insert(paxId, makeRecord(i)));
+		ctids.push_back(insert(cpaxId, makeRecord(i)));
+	}
+	ASSERT_EQ(tids[3000].pageId, tids[2999].pageId);
+	for (int64_t i = 0; i < 4000; i++)
+	{
+		auto record = pax->lookup(tids[i]);
+		auto crecord = cpax->lookup(ctids[i]);
+		ASSERT_EQ(record == nullptr, i == 10);
+		ASSERT_EQ(crecord == nullptr, i == 10);
+		if (i == 10) continue;
+		ASSERT_EQ(string(record->getData(), record->getLen()), makeRecord(i));
+		ASSERT_EQ(string(crecord->getData(), crecord->getLen()),
+		          makeRecord(i));
+	}
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, zoneMaps)
+{
+	Schema schema;
+	schema.addAttribute("ts", INTEGER);
+	schema.addAttribute("value", INTEGER);
+
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true, &schema);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_NE(sp->getZoneMap(), nullptr);
+
+	// A clustered time series, every 10th record lacks its value (NULL)
+	vector<TID> tids;
+	for (int64_t i = 0; i < 4000; i++)
+	{
+		int64_t data[2] = { i, i % 7 };
+		Record r(i % 10 == 0 ? 8 : 16, (char*)data);
+		try { tids.push_back(sp->insert(r)); }
+		catch (SM_EXC::SPSegmentFullException& e)
+		{
+			sm->growSegment(spId);
+			tids.push_back(sp->insert(r));
+		}
+	}
+
+	auto count = [sp](const RangePredicate& p, uint64_t& skipped)
+	{
+		mutex m;
+		unsigned found = 0;
+		skipped = sp->parallelScan([&](RecordBatch& batch)
+		{
+			lock_guard<mutex> guard(m);
+			found += batch.size();
+		}, 2, p);
+		return found;
+	};
+	uint64_t skipped;
+	RangePredicate p = { 0, 1000, 1099 };
+	ASSERT_EQ(count(p, skipped), 100u);
+	ASSERT_GT(skipped, 10u);
+
+	// Zones are widened by updates and stay conservative on removes
+	int64_t data[2] = { 1050, 0 };
+	ASSERT_TRUE(sp->update(tids[15], Record(16, (char*)data)));
+	ASSERT_TRUE(sp->remove(tids[1000]));
+	ASSERT_EQ(count(p, skipped), 100u);
+
+	// The scan recomputed the zones of the pages read
+	Zone zone = sp->getZoneMap()->getZone(sp->pageIndex(tids[0].pageId), 1);
+	ASSERT_GT(zone.nulls, 0u);
+	ASSERT_EQ(zone.min, 0);
+	ASSERT_EQ(zone.max, 6);
+
+	// NULL values never match
+	RangePredicate q = { 1, 0, 0 };
+	ASSERT_EQ(count(q, skipped), 572u - 58u + 1u);
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, zoneMapRecovery)
+{
+	Schema schema;
+	schema.addAttribute("ts", INTEGER);
+	schema.addAttribute("value", INTEGER);
+
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true, &schema);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	vector<TID> tids;
+	for (int64_t i = 0; i < 4000; i++)
+	{
+		int64_t data[2] = { i, i % 7 };
+		Record r(16, (char*)data);
+		try { tids.push_back(sp->insert(r)); }
+		catch (SM_EXC::SPSegmentFullException& e)
+		{
+			sm->growSegment(spId);
+			tids.push_back(sp->insert(r));
+		}
+	}
+
+	auto count = [&sp](const RangePredicate& p, uint64_t& skipped)
+	{
+		mutex m;
+		unsigned found = 0;
+		skipped = sp->parallelScan([&](RecordBatch& batch)
+		{
+			lock_guard<mutex> guard(m);
+			found += batch.size();
+		}, 2, p);
+		return found;
+	};
+	uint64_t skipped, skippedBefore;
+	RangePredicate p = { 0, 1000, 1099 };
+	ASSERT_EQ(count(p, skippedBefore), 100u);
+	ASSERT_GT(skippedBefore, 10u);
+	delete sm;
+
+	// The reopened segment keeps its schema and zones
+	sm = new SegmentManager("database");
+	sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_NE(sp->getZoneMap(), nullptr);
+	ASSERT_EQ(sp->getZoneMap()->getSchema().getAttributes()[1].name, "value");
+	ASSERT_EQ(count(p, skipped), 100u);
+	ASSERT_EQ(skipped, skippedBefore);
+
+	// Changes after recovery are covered, also after reopening again
+	int64_t data[2] = { 1050, 0 };
+	ASSERT_TRUE(sp->update(tids[15], Record(16, (char*)data)));
+	ASSERT_EQ(count(p, skipped), 101u);
+	delete sm;
+	sm = new SegmentManager("database");
+	sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_EQ(count(p, skipped), 101u);
+	ASSERT_EQ(skipped, skippedBefore - 1);
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, bestFitExtents)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	vector<uint64_t> ids;
+	for (int i = 0; i < 6; i++)
+		ids.push_back(sm->createSegment(segTypes::RG_SGM, true));
+	auto firstPage = [sm](uint64_t id)
+		{ return sm->retrieveSegmentById(id)->firstPage(); };
+	uint64_t d = firstPage(ids[3]);
+
+	// The smallest free extent which is large enough is taken, rather than
+	// the first one
+	sm->dropSegment(ids[0]);
+	sm->dropSegment(ids[1]);
+	sm->dropSegment(ids[3]);
+	uint64_t x = sm->createSegment(segTypes::RG_SGM, true);
+	ASSERT_EQ(firstPage(x), d);
+
+	// A free extent right behind a segment is preferred when growing it,
+	// even if another one fits better
+	sm->dropSegment(ids[4]);
+	sm->dropSegment(ids[5]);
+	ASSERT_EQ(sm->growSegment(x), d + SMConst::baseExtentSize);
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, extentGrowthPolicies)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t id = sm->createSegment(segTypes::RG_SGM, true);
+	Segment* seg = sm->retrieveSegmentById(id);
+
+	// The default policy follows the dynamic extent mapping
+	sm->growSegment(id);
+	ASSERT_EQ(seg->getSize(), 30u + 60u);
+
+	sm->setGrowthPolicy(new LinearGrowthPolicy(10));
+	sm->growSegment(id);
+	ASSERT_EQ(seg->getSize(), 100u);
+	sm->setGrowthPolicy(new GeometricGrowthPolicy(10, 2));
+	sm->growSegment(id);
+	ASSERT_EQ(seg->getSize(), 200u);
+	sm->setGrowthPolicy(new CappedGrowthPolicy(
+		new GeometricGrowthPolicy(10, 2), 50));
+	sm->growSegment(id);
+	ASSERT_EQ(seg->getSize(), 250u);
+
+	// Extents double while the segment keeps growing quickly
+	sm->setGrowthPolicy(new AdaptiveGrowthPolicy(10, 40, chrono::hours(1)));
+	vector<uint64_t> sizes = { 260, 270, 290, 330, 370 };
+	for (uint64_t size : sizes)
+	{
+		sm->growSegment(id);
+		ASSERT_EQ(seg->getSize(), size);
+	}
+
+	// Once preallocated, the next extent is taken from the free space
+	sm->setGrowthPolicy(new LinearGrowthPolicy(500));
+	sm->growSegment(id);
+	sm->waitForPreallocation();
+	uint64_t pages = sm->getBufferManager().getNumPages();
+	ASSERT_LE(sm->growSegment(id) + 500, pages);
+
+	// Dynamic extents soon exceed the range of 64 bit page numbers, but are
+	// still capped
+	DynamicGrowthPolicy dynamic(30, 1.2f);
+	ASSERT_GE(dynamic.extentSize(id, 100, 0), 1ul << 62);
+	sm->setGrowthPolicy(new CappedGrowthPolicy(
+		new DynamicGrowthPolicy(30, 1.2f), 100));
+	for (uint64_t i = 0; i < 20; i++)
+	{
+		uint64_t size = seg->getSize();
+		sm->growSegment(id);
+		ASSERT_LE(seg->getSize(), size + 100);
+	}
+	uint64_t size = seg->getSize();
+	sm->growSegment(id);
+	ASSERT_EQ(seg->getSize(), size + 100);
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, segmentCompaction)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_NE(sp, nullptr);
+	sm->growSegment(spId);
+	ASSERT_EQ(sp->getSize(), 90u);
+
+	// Fill most of the segment, then move some records off the first page
+	vector<TID> tids;
+	string small(100, 'a');
+	for (unsigned i = 0; i < 2500; i++)
+		tids.push_back(sp->insert(Record(small.size(), small.c_str())));
+	ASSERT_GE(tids.back().pageId, sp->firstPage() + 30);
+	string large(300, 'b');
+	for (unsigned i = 5; i < 15; i++)
+		ASSERT_TRUE(sp->update(tids[i], Record(large.size(), large.c_str())));
+
+	// Keep few records, spread over the first extent, and the first page 
+	// full, so that the moved records stay where they are when updated
+	map<uint64_t, string> kept;
+	for (unsigned i = 0; i < tids.size(); i++)
+	{
+		bool home = tids[i].pageId == tids[5].pageId;
+		if (i >= 5 && i < 15) kept[tids[i].intRepresentation] = large;
+		else if (home || (i < 1000 && i % 50 == 0)) 
+			kept[tids[i].intRepresentation] = small;
+		else ASSERT_TRUE(sp->remove(tids[i]));
+	}
+
+	// Compaction empties the pages of the second extent, so it can be 
+	// released, while all TIDs stay valid. The moved records can be updated
+	// and looked up meanwhile, and no update is lost.
+	uint64_t emptied = 0;
+	atomic<bool> done(false);
+	thread compaction([&]() { emptied = sp->compact(0); done = true; });
+	for (unsigned round = 0; !done; round++)
+	{
+		large.assign(300, 'b' + round % 20);
+		for (unsigned i = 5; i < 15; i++)
+			ASSERT_TRUE(sp->update(tids[i], 
+			                       Record(large.size(), large.c_str())));
+		for (unsigned i = 5; i < 15; i++)
+		{
+			auto record = sp->lookup(tids[i]);
+			ASSERT_NE(record, nullptr);
+			ASSERT_EQ(string(record->getData(), record->getLen()), large);
+		}
+	}
+	compaction.join();
+	for (unsigned i = 5; i < 15; i++) kept[tids[i].intRepresentation] = large;
+	ASSERT_GE(emptied, 30u);
+	ASSERT_EQ(sm->shrinkSegment(spId), 60u);
+	ASSERT_EQ(sp->getSize(), 30u);
+	ASSERT_EQ(sm->shrinkSegment(spId), 0u);
+	for (auto& entry : kept)
+	{
+		TID tid;
+		tid.intRepresentation = entry.first;
+		auto record = sp->lookup(tid);
+		ASSERT_NE(record, nullptr);
+		ASSERT_EQ(string(record->getData(), record->getLen()), entry.second);
+	}
+
+	// The segment can be filled and grown again
+	for (unsigned i = 0; i < 2500; i++)
+	{
+		try { tids[i] = sp->insert(Record(small.size(), small.c_str())); }
+		catch (SM_EXC::SPSegmentFullException& e) 
+			{ sm->growSegment(spId); i--; }
+	}
+	ASSERT_GT(sp->getSize(), 30u);
+	auto record = sp->lookup(tids[2499]);
+	ASSERT_EQ(string(record->getData(), record->getLen()), small);
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, metadataLog)
+{
+	// Changes are logged as they happen, so a copy of the database file 
+	// taken at any time, i.e. without shutting down, recovers them
+	SegmentManager* sm = new SegmentManager("database");
+	uint64_t a = sm->createSegment(segTypes::RG_SGM, true);
+	uint64_t b = sm->createSegment(segTypes::RG_SGM, true);
+	sm->growSegment(a);
+	sm->dropSegment(b);
+
+	// Enough changes to compact the log several times
+	for (unsigned i = 0; i < 500; i++)
+		sm->dropSegment(sm->createSegment(segTypes::RG_SGM, true));
+	uint64_t c = sm->createSegment(segTypes::SP_SGM, true);
+	sm->growSegment(c);
+	sm->waitForPreallocation();
+	if (system("cp database crashed") < 0) 
+		cout << "Error copying database" << endl;
+
+	SegmentManager* recovered = new SegmentManager("crashed");
+	vector<uint64_t> ids = { a, c };
+	for (uint64_t id : ids)
+	{
+		Segment* original = sm->retrieveSegmentById(id);
+		Segment* seg = recovered->retrieveSegmentById(id);
+		ASSERT_NE(seg, nullptr);
+		ASSERT_EQ(seg->getSize(), original->getSize());
+		ASSERT_EQ(seg->firstPage(), original->firstPage());
+	}
+	ASSERT_EQ(recovered->retrieveSegmentById(b), nullptr);
+
+	// Both continue with the same ids and free space
+	uint64_t d = sm->createSegment(segTypes::RG_SGM, true);
+	ASSERT_EQ(recovered->createSegment(segTypes::RG_SGM, true), d);
+	ASSERT_EQ(recovered->retrieveSegmentById(d)->firstPage(),
+	          sm->retrieveSegmentById(d)->firstPage());
+
+	// Cleanup
+	delete recovered;
+	delete sm;
+	if (system("rm database crashed") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+// _____________________________________________________________________________
+TEST(SegmentManagerTest, lazySegmentRecovery)
+{
+	SegmentManager* sm = new SegmentManager("database");
+	for (unsigned i = 0; i < 100; i++) sm->createSegment(segTypes::RG_SGM, true);
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	vector<TID> tids;
+	for (unsigned i = 0; i < 2000; i++)
+	{
+		string data = to_string(i);
+		try { tids.push_back(sp->insert(Record(data.size(), data.c_str()))); }
+		catch (SM_EXC::SPSegmentFullException& e) 
+			{ sm->growSegment(spId); i--; }
+	}
+	uint64_t size = sp->getSize();
+	delete sm;
+
+	// Recovered segments keep their type, and the FSI of an SP segment
+	// continues where it left off
+	sm = new SegmentManager("database");
+	ASSERT_EQ(dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId - 1)), 
+	          nullptr);
+	sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	ASSERT_NE(sp, nullptr);
+	ASSERT_EQ(sp->getSize(), size);
+	for (unsigned i = 0; i < 1000; i++)
+	{
+		string data = "new";
+		try { sp->insert(Record(data.size(), data.c_str())); }
+		catch (SM_EXC::SPSegmentFullException& e) 
+			{ sm->growSegment(spId); i--; }
+	}
+	for (unsigned i = 0; i < tids.size(); i++)
+	{
+		auto record = sp->lookup(tids[i]);
+		ASSERT_NE(record, nullptr);
+		ASSERT_EQ(string(record->getData(), record->getLen()), to_string(i));
+	}
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
+TEST(SegmentManagerTest, multiPageSegmentFSI)
+{
+	// Every record fills a page, so that the FSI of the segment has to spread
+	// over more than the first page
+	SegmentManager* sm = new SegmentManager("database");
+	sm->setGrowthPolicy(new LinearGrowthPolicy(4000));
+	uint64_t spId = sm->createSegment(segTypes::SP_SGM, true);
+	SPSegment* sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	vector<TID> tids;
+	for (unsigned i = 0; i < 7000; i++)
+	{
+		string data = to_string(i) + string(3000, 'x');
+		try { tids.push_back(sp->insert(Record(data.size(), data.c_str()))); }
+		catch (SM_EXC::SPSegmentFullException& e) 
+			{ sm->growSegment(spId); i--; }
+	}
+	ASSERT_GT(sp->getSize(), 6096);
+	delete sm;
+
+	// The inventory is recovered from its pages, and new records do not
+	// overwrite old ones
+	sm = new SegmentManager("database");
+	sp = dynamic_cast<SPSegment*>(sm->retrieveSegmentById(spId));
+	for (unsigned i = 0; i < 500; i++)
+	{
+		string data = string(3000, 'y');
+		try { sp->insert(Record(data.size(), data.c_str())); }
+		catch (SM_EXC::SPSegmentFullException& e) 
+			{ sm->growSegment(spId); i--; }
+	}
+	for (unsigned i = 0; i < tids.size(); i++)
+	{
+		auto record = sp->lookup(tids[i]);
+		ASSERT_NE(record, nullptr);
+		ASSERT_EQ(string(record->getData(), record->getLen()), 
+		          to_string(i) + string(3000, 'x'));
+	}
+
+	// Cleanup
+	delete sm;
+	if (system("rm database") < 0) 
+  		cout << "Error removing database" << endl;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 int main(int argc, char **argv)
 {
@@ -10,226 +10,126 @@
 
 using namespace std;
 
-// Returns true iff rhs is smaller than lhs
-bool firstElemComp(pair<uint16_t, uint16_t> lhs, pair<uint16_t, uint16_t> rhs)
-{ return rhs.first<lhs.first; }
-
 // _____________________________________________________________________________
 void SlottedPage::compactify() 
 { 
 	auto dataSize = BM_CONS::pageSize - sizeof(SlottedPageHeader);
-	vector<pair<uint16_t,uint16_t>> freeSpace;
-	vector<SlottedPageSlot> nonFreeSlots;
 	auto slots = reinterpret_cast<SlottedPageSlot*>(data);
 
-	// Get non free slots in their offset order
-	for (auto i = 0; i < header.slotCount; i++)
-	{
-		SlottedPageSlot& slot = slots[i];
-		if (slot.offset != 0 || slot.length != 0) nonFreeSlots.push_back(slot);
-	}
-
-	// slot vector -> offset, slot id
-	vector<pair<uint16_t, uint16_t>> slotVec;
-	for (uint16_t i = 0; i < nonFreeSlots.size(); i++)
-		slotVec.push_back(pair<uint16_t, uint16_t>
-			((uint16_t)nonFreeSlots[i].offset, i));
-		
-	sort(slotVec.begin(), slotVec.end(), firstElemComp);
-
-
-	uint16_t upperBound = dataSize;
-	for (unsigned i = 0; i < slotVec.size(); i++)
+	// Ids of all non free slots, ordered by descending offset
+	uint16_t order[TID_CONS::maxSlots];
+	uint16_t n = 0;
+	for (uint16_t i = 0; i < header.slotCount; i++)
+		if (slots[i].offset != 0) order[n++] = i;
+	sort(order, order+n, [slots](uint16_t lhs, uint16_t rhs)
+		{ return slots[lhs].offset > slots[rhs].offset; });
+
+	// Starting with the data item closest to the end of the page, move every
+	// run of adjacent items right so that it immediately precedes the run
+	// moved before it.
+	unsigned upperBound = dataSize;
+	for (uint16_t i = 0, j; i < n; i = j)
 	{
-		auto orderedSlot = slotVec[i];
-		SlottedPageSlot& slot = nonFreeSlots[orderedSlot.second];
-		memcpy(data+upperBound-slot.length, data+orderedSlot.first, slot.length);
-		
-		slot.offset += (upperBound-slot.length - orderedSlot.first);
-		upperBound -= slot.length;
-	}
-	header.dataStart = slotVec[slotVec.size()-1].first;
-
-	/*
-	// Get free space between non empty slots according to the ordering above
-	for (unsigned i = 0; i < slotVec.size(); i++)
-	{
-		auto slot = slotVec[i];
-
-		// Last slot -> get space between end of data and end of page.
-		if (i == 0) 
-			freeSpace.push_back(pair<uint16_t,uint16_t>
-				(slot.first+nonFreeSlots[slot.second].length, dataSize));
-
-		else
+		unsigned runStart = slots[order[i]].offset;
+		unsigned runEnd = runStart + footprint(slots[order[i]].length);
+		for (j = i+1; j < n; j++)
 		{
-			uint16_t lastOffset = slotVec[i-1].first;
-			freeSpace.push_back(pair<uint16_t,uint16_t>
-				(slot.first+nonFreeSlots[slot.second].length, lastOffset));
+			SlottedPageSlot& slot = slots[order[j]];
+			if (slot.offset + footprint(slot.length) != runStart) break;
+			runStart = slot.offset;
 		}
-	}
 
-	// Starting at the end of file, "swap" the data item with the empty space
-	// that immediately follows it, add the current item's free space to the
-	// next data item's free space and repeat until all data items have been
-	// processed.
-	for (size_t i = 0; i < freeSpace.size(); i++)
-	{
-		// If there is no space between the two data blocks, move to next
-		// pair of data blocks.
-		auto space = freeSpace[i];
-		if (space.first == space.second) continue;
-
-		// Otherwise move preceding data block right
-		auto orderedSlot = slotVec[i];
-		SlottedPageSlot& slot = nonFreeSlots[orderedSlot.second];
-		for (auto j = 1; j <= slot.length; j++)
-			data[space.second-j] = data[orderedSlot.first+slot.length-j];
-
-		// Update slot info
-		auto spaceAmount = space.second - space.first;
-		slot.offset += spaceAmount;
-
-		// Update empty space following the next data block
-		if (i+1 < freeSpace.size()) freeSpace[i+1].second += spaceAmount;	
+		unsigned shift = upperBound - runEnd;
+		if (shift > 0)
+		{
+			memmove(data+runStart+shift, data+runStart, runEnd-runStart);
+			for (uint16_t k = i; k < j; k++) slots[order[k]].offset += shift;
+		}
+		upperBound = runStart + shift;
 	}
-
-	// Now that defragmentation of the data blocks is done, update the page
-	// header, and write the updated slots (in reverse order)
-	
-	//header.slotCount = nonFreeSlots.size();
-	//header.firstFreeSlot = nonFreeSlots.size();
-	header.dataStart = slotVec[slotVec.size()-1].first;
-
-	//for (size_t i = 0; i < nonFreeSlots.size(); i++)
-	//{
-		//auto nonFreeSlot = nonFreeSlots[nonFreeSlots.size()-1-i]; 
-		//slots[i].offset = nonFreeSlot.offset;
-		//slots[i].length = nonFreeSlot.length;
-	//}*/
+	header.dataStart = upperBound;
 }
 
 
 
 // _____________________________________________________________________________
-shared_ptr<pair<uint8_t, uint32_t>> SlottedPage::insert(const Record& r,bool in) 
+shared_ptr<pair<uint16_t, uint32_t>> SlottedPage::insert(const Record& r,bool in,
+                                                        unsigned type) 
 { 
 	auto dataSize = BM_CONS::pageSize - sizeof(SlottedPageHeader);
 	auto slotSize = sizeof(SlottedPageSlot);
 	auto rLength = r.getLen();
+	auto rSpace = footprint(rLength);
+	auto slots = reinterpret_cast<SlottedPageSlot*>(data);
 
-	// Header not initialized -> initialize header properties, add data
-	// at the very end of the page, and a slot right after the header
+	// Header not initialized -> initialize header properties of an empty page
 	if (!in)
 	{
-		//cout << "sp page not initialized" << endl;
 		header.lsn = 0;
-		header.slotCount = 1;
-		header.firstFreeSlot = 1;
-		header.dataStart = dataSize-rLength;
-		header.freeSpace = dataSize-slotSize-rLength;
-
-		SlottedPageSlot s = { header.dataStart, rLength };
-
-		// Write info
-		memcpy(data, &s, slotSize);
-		//reinterpret_cast<SlottedPageSlot*>(data)[0] = s;
-		memcpy(data+header.dataStart, r.getData(), rLength);
-		auto returnPair = shared_ptr<pair<uint8_t, uint32_t>>
-			 (new pair<uint8_t, uint32_t>(0, header.freeSpace));
-		return returnPair;	
+		header.slotCount = 0;
+		header.firstFreeSlot = SP_NO_FREE_SLOT;
+		header.dataStart = dataSize;
+		header.freeSpace = dataSize;
 	}
 
-	// Otherwise perform a standard insert procedure:
-	// 1. See if there is an available free slot with enough length to store r
-	// 2. If no, check if the page can still fit the record plus a new slot
-	// 3. If no, return nullptr to signal caller that insert was unsuccessful.
-	else
-	{
-		// Case 1: first free slot is an index to an existing slot
-		auto firstFreeSlot = header.firstFreeSlot;
-		if (firstFreeSlot < header.slotCount)
-		{
-			auto slots = reinterpret_cast<SlottedPageSlot*>(data);
-			auto& slot = slots[firstFreeSlot];
-
-			// The length of the record must be at most as large as the
-			// piece of memory pointed to by the slot.
-			if (rLength <= slot.length)
-			{
-				// update slot and header
-				auto freed = slot.length - rLength;
-				slot.length = rLength;
-				header.freeSpace += freed;
-				
-				// update the next free slot
-				bool nextFreeSlotFound = false;
-				for (auto i = firstFreeSlot+1; i < header.slotCount; i++)
-				{
-					auto slot = slots[i];
-					if (slot.offset == 0 && slot.length == 0) 
-					{ 
-						nextFreeSlotFound = true; 
-						header.firstFreeSlot = i;
-						break;
-					}
-				}
-				if (!nextFreeSlotFound) header.firstFreeSlot = header.slotCount;
-
-				memcpy(data+slot.offset, r.getData(), slot.length);
-				return shared_ptr<pair<uint8_t,uint32_t>>
-					   (new pair<uint8_t,uint32_t>( firstFreeSlot, 
-					   	                            header.freeSpace));
-			}
-		}
-
-		// Case 2: Check if record can be added normally (update dataStart)
-		else if (header.freeSpace >= rLength + slotSize)
-		{
-			// compactification may be required
-			if ((header.dataStart-slotSize*header.slotCount)<(rLength+slotSize))
-				this->compactify();
-
-			header.slotCount++;
-			header.dataStart = header.dataStart-rLength;
-			header.freeSpace = header.freeSpace-slotSize-rLength;
-			if (header.firstFreeSlot==header.slotCount-1)header.firstFreeSlot++;
-
-			SlottedPageSlot s = { header.dataStart, rLength };
-
-			// Write info
-			memcpy(data+(header.slotCount-1)*slotSize, &s, slotSize);
-			//reinterpret_cast<SlottedPageSlot*>(data)[header.slotCount-1] = s;
-			memcpy(data+header.dataStart, r.getData(), rLength);
-			auto returnPair = shared_ptr<pair<uint8_t, uint32_t>>
-			 	(new pair<uint8_t, uint32_t>(header.slotCount-1, 
-			 		                         header.freeSpace));
-			return returnPair;	
-		}
-
-		// Case 3
-		else return nullptr;
-	}
-	return nullptr;
+	// Standard insert procedure:
+	// 1. If there is a free slot, reuse it, only space for r is required.
+	// 2. Otherwise, space for r and a new slot is required.
+	// 3. If the page (after compactification) cannot provide this space, 
+	//    return nullptr to signal caller that insert was unsuccessful.
+	// 4. Slot ids must be addressable by a TID.
+	bool reuseSlot = header.firstFreeSlot != SP_NO_FREE_SLOT;
+	if (!reuseSlot && header.slotCount >= TID_CONS::maxSlots) return nullptr;
+	unsigned requiredSpace = reuseSlot ? rSpace : rSpace + slotSize;
+	if (header.freeSpace < requiredSpace) return nullptr;
+
+	unsigned slotsEnd = header.slotCount * slotSize;
+	if (!reuseSlot) slotsEnd += slotSize;
+	if (header.dataStart < slotsEnd + rSpace) this->compactify();
+
+	// Take the first free slot off the chain, or append a new slot
+	uint16_t slotId = reuseSlot ? header.firstFreeSlot : header.slotCount++;
+	if (reuseSlot) header.firstFreeSlot = slots[slotId].length;
+	header.dataStart -= rSpace;
+	header.freeSpace -= requiredSpace;
+
+	SlottedPageSlot s = { header.dataStart, rLength, type };
+	slots[slotId] = s;
+	memcpy(data+header.dataStart, r.getData(), rLength);
+
+	return shared_ptr<pair<uint16_t,uint32_t>>
+		   (new pair<uint16_t,uint32_t>(slotId, header.freeSpace));
 }
 
 
 // _____________________________________________________________________________
-bool SlottedPage::remove(uint8_t slotId)
+bool SlottedPage::remove(uint16_t slotId)
 {
-	 if (slotId >= header.slotCount) return false;
-	 reinterpret_cast<SlottedPageSlot*>(data)[slotId].length = 0;
-	 reinterpret_cast<SlottedPageSlot*>(data)[slotId].offset = 0;
-	 if (header.firstFreeSlot > slotId) header.firstFreeSlot = slotId;
+	 SlottedPageSlot* slot = getSlot(slotId);
+	 if (slot == nullptr) return false;
+	 header.freeSpace += footprint(slot->length);
+	 slot->offset = 0;
+	 slot->length = header.firstFreeSlot;
+	 slot->type = SP_RECORD;
+	 header.firstFreeSlot = slotId;
 	 return true;
 }
 
 // _____________________________________________________________________________
-shared_ptr<Record> SlottedPage::lookup(uint8_t slotId)
+SlottedPageSlot* SlottedPage::getSlot(uint16_t slotId)
+{
+	 if (slotId >= header.slotCount) return nullptr;
+	 auto slot = reinterpret_cast<SlottedPageSlot*>(data) + slotId;
+	 if (slot->offset == 0) return nullptr;
+	 return slot;
+}
+
+// _____________________________________________________________________________
+shared_ptr<Record> SlottedPage::lookup(uint16_t slotId)
 {
 	 if (slotId >= header.slotCount) return nullptr;
 	 auto slot = reinterpret_cast<SlottedPageSlot*>(data)[slotId];
-	 if (slot.length == 0 && slot.offset == 0) return nullptr;
+	 if (slot.offset == 0) return nullptr;
 
 	 // Extract record from file
 	 auto ptrData = (const char*)data+slot.offset;
@@ -238,18 +138,19 @@ shared_ptr<Record> SlottedPage::lookup(uint8_t slotId)
 }
 
 // _____________________________________________________________________________
-bool SlottedPage::update(uint8_t slotId, const Record& r)
+bool SlottedPage::update(uint16_t slotId, const Record& r, unsigned type)
 {
-	if (slotId >= header.slotCount) return false;
-
-	SlottedPageSlot& slot = reinterpret_cast<SlottedPageSlot*>(data)[slotId];
-	if (slot.length == 0 && slot.offset == 0) return false;
+	SlottedPageSlot* slotPtr = getSlot(slotId);
+	if (slotPtr == nullptr) return false;
+	SlottedPageSlot& slot = *slotPtr;
 
 	// Check difference between the allotted slot length and the size of the
 	// record. If it fits, then insert directly, otherwise check space right
 	// before dataStart, if it fits there, change the offset, otherwise
-	// compactify and check again. If still not possible, return false.
-	int spaceDiff = (uint16_t)slot.length - (uint16_t)r.getLen();
+	// drop the old item, compactify and write r right before dataStart. 
+	// If the page has not enough free space for this, return false.
+	unsigned rSpace = footprint(r.getLen());
+	int spaceDiff = footprint(slot.length) - rSpace;
 
 	// Case 1
 	if (spaceDiff >= 0)
@@ -257,39 +158,27 @@ bool SlottedPage::update(uint8_t slotId, const Record& r)
 		// Update header and record on file
 		header.freeSpace += spaceDiff;
 		slot.length = r.getLen();
+		slot.type = type;
 		memcpy(data + slot.offset, r.getData(), r.getLen());
 		return true;
 	}
 
-	else
+	// Case 3
+	int preStartSpace = header.dataStart - 
+	                    header.slotCount * sizeof(SlottedPageSlot);
+	if (preStartSpace < (int)rSpace)
 	{
-		bool secondRun = false;
-		while(true)
-		{
-			auto slotsSize = header.slotCount * sizeof(SlottedPageSlot);
-			int preStartSpace = header.dataStart - slotsSize;
-			if (preStartSpace < 0) return false;
-
-			// Case 2
-			if ((uint16_t)preStartSpace >= r.getLen())
-			{
-				// spaceDiff is negative
-				header.freeSpace += spaceDiff;
-				slot.offset = header.dataStart - r.getLen();
-				slot.length = r.getLen();
-				header.dataStart = slot.offset;
-				memcpy(data + slot.offset, r.getData(), r.getLen());
-				return true;
-			}
-
-			// Case 3
-			else
-			{
-				if (secondRun) return false;
-				compactify();
-				secondRun = true;
-			}	
-		}
-		return false;
+		if (header.freeSpace + spaceDiff < 0) return false;
+		slot.offset = 0;
+		compactify();
 	}
-}
\ No newline at end of file
+
+	// Case 2 (spaceDiff is negative)
+	header.freeSpace += spaceDiff;
+	header.dataStart -= rSpace;
+	slot.offset = header.dataStart;
+	slot.length = r.getLen();
+	slot.type = type;
+	memcpy(data + slot.offset, r.getData(), r.getLen());
+	return true;
+}
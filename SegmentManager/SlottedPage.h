@@ -12,28 +12,43 @@
 #include <vector>
 #include <memory>
 #include "Record.h"
+#include "TID.h"
 #include "../BufferManager/BMConst.h"
 
 
 // A slotted page header -------------------------------------------------------
 struct SlottedPageHeader
 {
-	// recovery component, number of used slots, id of first free slot to
-	// speed up locating free slots, lower end of data, and the space that would
-	// be available in this slotted page after compactification (in bytes)
-	// Latter 3 refer to offsets wrt data pointer.
+	// recovery component, number of used slots, id of the first slot in the
+	// chain of free slots (SP_NO_FREE_SLOT iff there is none), lower end of 
+	// data, and the space that would be available in this slotted page after
+	// compactification (in bytes). Latter 2 refer to offsets wrt data pointer.
 	uint16_t lsn, slotCount, firstFreeSlot, dataStart, freeSpace;
 };
 
+// Marks the end of the chain of free slots, the largest value the length of
+// a slot can hold (see SlottedPageSlot)
+const uint16_t SP_NO_FREE_SLOT = 
+	(1 << TID_CONS::bitsFor(BM_CONS::pageSize)) - 1;
+
+
+// Slot types ------------------------------------------------------------------
+//
+// SP_RECORD: the data item is a regular record.
+// SP_REDIRECT: the record has been moved to another page. The data item is 
+// the TID of the moved record.
+// SP_MOVED: the data item is a record which has been moved here from another
+// page. It is prefixed by the TID of its home slot, which holds the redirect.
+// SP_BLOB: the record is too large for a page and is stored on pages of its
+// own (see SPSegment). The data item is the id of its header page.
+enum slotTypes { SP_RECORD, SP_REDIRECT, SP_MOVED, SP_BLOB };
 
-// A slotted page slot ---------------------------------------------------------
-struct SlottedPageSlot
-{
-	// offset and length of corresponding data item. Slot is free iff
-	// offset == 0 == length
-	unsigned int offset: 16;
-	unsigned int length: 16;
-};
+
+// A slotted page slot is declared in TID.h ---------------------------------
+static_assert(BM_CONS::pageSize <= (1 << 16), 
+              "Slotted page headers cannot address pages of this size");
+static_assert(TID_CONS::maxSlots < SP_NO_FREE_SLOT, 
+              "Free slot chain cannot address all slots");
 
 // Priority queue comparison ---------------------------------------------------
 class pqcomp
@@ -58,33 +73,45 @@ public:
 	SlottedPageHeader& getHeader() { return header; }
 	unsigned char* getData() { return data; }
 
-	// Creates a header for this page if necessary, and inserts r along 
-	// with its slot as the first entry in an empty page. 
-	// This method does not check whether
-	// space requirements are fulfilled. Returns the respective slot id and
-	// the new exact free space available.
+	// Returns the slot with the given id, nullptr iff slot invalid or free.
+	SlottedPageSlot* getSlot(uint16_t slotId);
+
+	// The number of bytes a data item of the given length occupies on the 
+	// page. Every item reserves at least sizeof(TID) bytes, so that any
+	// record can be replaced in place by a redirect.
+	static unsigned footprint(unsigned length) 
+	{ return length < sizeof(TID) ? sizeof(TID) : length; }
+
+	// Creates a header for this page if necessary (in == false), and inserts
+	// r as a data item of the given type. A free slot is reused if available,
+	// otherwise a new slot is added. Returns the respective slot id and the
+	// new exact free space available.
 	//
-	// If no free slot big enough is found, and inserting the record plus a
-	// new slot is not possible, returns nullptr.
-	std::shared_ptr<std::pair<uint8_t,uint32_t>>insert(const Record& r,bool in);
+	// If the page cannot hold the record (and a new slot, if required) even 
+	// after compactification, returns nullptr.
+	std::shared_ptr<std::pair<uint16_t,uint32_t>>insert(const Record& r,bool in,
+	                                               unsigned type = SP_RECORD);
 
-	// Mark the given slot as empty, update firstFreeSlot in header.
+	// Mark the given slot as empty, prepend it to the chain of free slots.
 	// Returns true iff slot is valid.
-	bool remove(uint8_t slotId);
+	bool remove(uint16_t slotId);
 
-	// Returns the record under the given slot. Returns nullptr iff slot invalid
-	std::shared_ptr<Record> lookup(uint8_t slotId);
+	// Returns the data item under the given slot, regardless of its type. 
+	// Returns nullptr iff slot invalid.
+	std::shared_ptr<Record> lookup(uint16_t slotId);
 
-	// Updates the record at the given slot with r. If r takes up more space than
-	// the currently stated by the given slot, then check if there is enough
-	// space right before dataStart and update the offset. Otherwise, compactify
-	// the page and check again. If this is still not the case, return false
-	// (no indirection implemented) -> must remove then newly insert the record.
-	bool update(uint8_t slotId, const Record& r);
+	// Updates the data item at the given slot with r, and sets its type. If r
+	// takes up more space than the currently stated by the given slot, then 
+	// check if there is enough space right before dataStart and update the 
+	// offset. Otherwise, drop the old item, compactify the page and write r 
+	// right before dataStart. Returns false iff the page does not have enough
+	// free space for r (see SPSegment::update for forwarding).
+	bool update(uint16_t slotId, const Record& r, unsigned type = SP_RECORD);
 
 	// Rearranges/ Presses data blocks together to make space for more incoming 
-	// data. Updates header and the corresponding slots (cleans out slots
-	// so that only non empty slots are stored)
+	// data. Updates header and the corresponding slots. Works in place: the
+	// slot ids are sorted by offset on the stack, and data items which are 
+	// already adjacent are moved together.
 	void compactify();
 
 	
@@ -7,27 +7,70 @@
 #ifndef TID_H
 #define TID_H
 
+#include <stdint.h>
+#include "../BufferManager/BMConst.h"
+
+
+namespace TID_CONS
+{
+	// Returns the number of bits required to address n different values,
+	// i.e. ceil(log2(n)).
+	constexpr unsigned bitsFor(uint64_t n) 
+	{ return n <= 1 ? 0 : 1 + bitsFor((n+1)/2); }
+}
+
+
+// A slotted page slot ---------------------------------------------------------
+// Declared along with the TID, since its size bounds the number of slots on a
+// page, and thus the slot id bits (see SlottedPage).
+struct SlottedPageSlot
+{
+	// offset and length of corresponding data item, wide enough for any byte
+	// of a page. Slot is free iff offset == 0, length then holds the id of 
+	// the next free slot (free slots are chained, see SlottedPageHeader). 
+	// type is one of slotTypes.
+	unsigned int offset: TID_CONS::bitsFor(BM_CONS::pageSize);
+	unsigned int length: TID_CONS::bitsFor(BM_CONS::pageSize);
+	unsigned int type: 2;
+};
+
+
+namespace TID_CONS
+{
+	// Upper bound for the number of slots on a page: every slot takes up
+	// sizeof(SlottedPageSlot) bytes, and every data item at least a TID, 
+	// i.e. 8 bytes (see SlottedPage).
+	const uint64_t maxSlots = BM_CONS::pageSize / 
+	                          (sizeof(SlottedPageSlot) + sizeof(uint64_t));
+
+	// Number of bits of a TID used for the slot id / page id
+	const unsigned slotBits = bitsFor(maxSlots);
+	const unsigned pageBits = 64 - slotBits;
+}
+
 
 // An object representing a tupel identifier. 
 // Marks the pageNo and the internal (slot) tid using a a single 8 byte int
 // value. The TID is divided as follows:
-// | 56 Bit = pageId | 8 bit = slot id |
+// | 64 - slotBits = pageId | slotBits = slot id |
 //
-// Reason: 8 bits for the slot id make it possible to address 256 different
-// slots. This indicates that a page can hold 256 record entries, averaging
-// out to a size per entry of 16 bytes. Addressing any more slots would
-// necessarily reduce this entry size. Addressing any less slots would allow
-// too few records to be addressed.
+// Reason: the slot id is sized from the page size, so that every slot a page
+// can possibly hold is addressable (9 bits for 4 KB pages). A fixed width
+// would either cap the number of narrow records per page, or waste page id
+// bits on larger page sizes.
 //
-// 56 Bits for the pageId makes it possible to address more than enough pages
-// Choosing a total of 64 bits allows a TID to be naturally byte aligned.
+// The remaining bits for the pageId make it possible to address more than
+// enough pages. Choosing a total of 64 bits allows a TID to be naturally byte
+// aligned.
 typedef union {
 
 	struct {
-		uint64_t pageId:56;
-  		uint8_t slotId:8;		
+		uint64_t pageId:TID_CONS::pageBits;
+  		uint64_t slotId:TID_CONS::slotBits;
 	};
   	uint64_t intRepresentation;
 } TID;
 
-#endif  // TID_H
\ No newline at end of file
+static_assert(sizeof(TID) == 8, "TIDs must fit into 8 bytes");
+
+#endif  // TID_H
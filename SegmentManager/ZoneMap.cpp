@@ -0,0 +1,168 @@
+
+///////////////////////////////////////////////////////////////////////////////
+// ZoneMap.cpp
+///////////////////////////////////////////////////////////////////////////////
+
+#include "ZoneMap.h"
+#include <limits>
+#include <string.h>
+
+using namespace std;
+
+// _____________________________________________________________________________
+ZoneMap::ZoneMap(const Schema& schema, uint64_t pages) : schema(schema)
+{
+	grow(pages);
+}
+
+// _____________________________________________________________________________
+void ZoneMap::grow(uint64_t pages)
+{
+	lock_guard<mutex> guard(lock);
+	zones.resize(zones.size() + pages, emptyZones());
+}
+
+// _____________________________________________________________________________
+void ZoneMap::shrink(uint64_t pages)
+{
+	lock_guard<mutex> guard(lock);
+	zones.resize(zones.size() - pages);
+}
+
+// _____________________________________________________________________________
+void ZoneMap::add(uint64_t page, const Record& r)
+{
+	lock_guard<mutex> guard(lock);
+	widen(zones[page], r);
+}
+
+// _____________________________________________________________________________
+void ZoneMap::set(uint64_t page, const vector<Zone>& zones)
+{
+	lock_guard<mutex> guard(lock);
+	this->zones[page] = zones;
+}
+
+// _____________________________________________________________________________
+bool ZoneMap::mayMatch(uint64_t page, const RangePredicate& p)
+{
+	if (schema.getAttributes()[p.attr].type != INTEGER) return true;
+	lock_guard<mutex> guard(lock);
+	const Zone& zone = zones[page][p.attr];
+	return zone.min <= p.hi && zone.max >= p.lo && zone.min <= zone.max;
+}
+
+// _____________________________________________________________________________
+Zone ZoneMap::getZone(uint64_t page, unsigned attr)
+{
+	lock_guard<mutex> guard(lock);
+	return zones[page][attr];
+}
+
+// _____________________________________________________________________________
+vector<Zone> ZoneMap::emptyZones() const
+{
+	Zone empty = { numeric_limits<int64_t>::max(),
+	               numeric_limits<int64_t>::min(), 0 };
+	return vector<Zone>(schema.getAttributes().size(), empty);
+}
+
+// _____________________________________________________________________________
+void ZoneMap::widen(vector<Zone>& zones, const Record& r) const
+{
+	auto& attributes = schema.getAttributes();
+	for (size_t i = 0; i < attributes.size(); i++)
+	{
+		if (attributes[i].type != INTEGER) continue;
+		if (r.getLen() < attributes[i].offset + sizeof(int64_t))
+			{ zones[i].nulls++; continue; }
+
+		int64_t value;
+		memcpy(&value, r.getData() + attributes[i].offset, sizeof(int64_t));
+		zones[i].min = min(zones[i].min, value);
+		zones[i].max = max(zones[i].max, value);
+	}
+}
+
+// _____________________________________________________________________________
+bool ZoneMap::matches(const Record& r, const RangePredicate& p) const
+{
+	const Attribute& a = schema.getAttributes()[p.attr];
+	if (r.getLen() < a.offset + sizeof(int64_t)) return false;
+
+	int64_t value;
+	memcpy(&value, r.getData() + a.offset, sizeof(int64_t));
+	return p.lo <= value && value <= p.hi;
+}
+
+// _____________________________________________________________________________
+void ZoneMap::forget()
+{
+	Zone any = { numeric_limits<int64_t>::min(), 
+	             numeric_limits<int64_t>::max(), 0 };
+	lock_guard<mutex> guard(lock);
+	for (vector<Zone>& page : zones) 
+		for (Zone& zone : page) zone = any;
+}
+
+// _____________________________________________________________________________
+void ZoneMap::writeZones(vector<char>& bytes)
+{
+	// | numPages | numAttributes | zones of page 0 | zones of page 1 | ...
+	lock_guard<mutex> guard(lock);
+	uint64_t sizes[2] = { zones.size(), schema.getAttributes().size() };
+	bytes.insert(bytes.end(), (char*)sizes, (char*)(sizes + 2));
+	for (vector<Zone>& page : zones)
+		bytes.insert(bytes.end(), (char*)page.data(), 
+		             (char*)(page.data() + page.size()));
+}
+
+// _____________________________________________________________________________
+void ZoneMap::readZones(const char* data)
+{
+	// See writeZones
+	lock_guard<mutex> guard(lock);
+	uint64_t sizes[2];
+	memcpy(sizes, data, sizeof(sizes));
+	data += sizeof(sizes);
+	for (uint64_t page = 0; page < min<uint64_t>(sizes[0], zones.size()); 
+	     page++)
+		memcpy(zones[page].data(), data + page*sizes[1]*sizeof(Zone), 
+		       sizes[1]*sizeof(Zone));
+}
+
+// _____________________________________________________________________________
+void ZoneMap::writeSchema(const Schema& schema, vector<char>& bytes)
+{
+	// | numAttributes | type | length | nameLength | name | ...
+	auto append = [&bytes](const void* data, size_t length)
+		{ bytes.insert(bytes.end(), (char*)data, (char*)data + length); };
+	uint64_t numAttributes = schema.getAttributes().size();
+	append(&numAttributes, sizeof(uint64_t));
+	for (const Attribute& a : schema.getAttributes())
+	{
+		uint32_t fields[3] = { a.type, a.length, (uint32_t)a.name.size() };
+		append(fields, sizeof(fields));
+		append(a.name.data(), a.name.size());
+	}
+}
+
+// _____________________________________________________________________________
+Schema ZoneMap::readSchema(const char* data)
+{
+	// See writeSchema
+	Schema schema;
+	uint64_t numAttributes;
+	memcpy(&numAttributes, data, sizeof(uint64_t));
+	data += sizeof(uint64_t);
+	for (uint64_t i = 0; i < numAttributes; i++)
+	{
+		uint32_t fields[3];
+		memcpy(fields, data, sizeof(fields));
+		data += sizeof(fields);
+		schema.addAttribute(string(data, fields[2]), (attrTypes)fields[0], 
+		                    fields[1]);
+		data += fields[2];
+	}
+	return schema;
+}
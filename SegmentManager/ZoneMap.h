@@ -0,0 +1,117 @@
+
+///////////////////////////////////////////////////////////////////////////////
+// ZoneMap.h
+//////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef ZONEMAP_H
+#define ZONEMAP_H
+
+#include "Schema.h"
+#include "Record.h"
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+
+// A range predicate lo <= value <= hi on the INTEGER attribute attr (schema
+// index) of a record.
+struct RangePredicate
+{
+	unsigned attr;
+	int64_t lo;
+	int64_t hi;
+};
+
+// The summary of the values of an INTEGER attribute on a page. Every value
+// lies in [min, max], min > max iff there is none. nulls is the number of
+// records which are too short to hold the attribute (NULL values).
+struct Zone
+{
+	int64_t min;
+	int64_t max;
+	uint64_t nulls;
+};
+
+
+// Per page min / max summaries (zone maps) of the INTEGER attributes of the
+// records of a segment, indexed by the relative index of the page inside
+// the segment, as the SegmentFSI. Used to skip pages during predicate scans.
+//
+// Zones are conservative: they are widened on every insert and update, but
+// never narrowed when a record is removed or changed, unless the owner of
+// the page recomputes the zone (see set). A zone thus always covers the
+// values on its page, while it may be wider than necessary.
+//
+// The ZoneMap is thread safe.
+class ZoneMap
+{
+public:
+
+	// Constructor. Takes the schema of the records and the number of pages.
+	ZoneMap(const Schema& schema, uint64_t pages);
+	~ZoneMap() { }
+
+	// Adds zones for #pages more (empty) pages.
+	void grow(uint64_t pages);
+
+	// Drops the zones of the last #pages pages.
+	void shrink(uint64_t pages);
+
+	// Widens the zones of the given page to cover the values of r.
+	void add(uint64_t page, const Record& r);
+
+	// Replaces the zones of the given page, e.g. with exact zones computed
+	// by a scan of the page. zones must have been created by emptyZones.
+	void set(uint64_t page, const std::vector<Zone>& zones);
+
+	// Returns true iff a record on the given page may match p.
+	bool mayMatch(uint64_t page, const RangePredicate& p);
+
+	// Returns the zone of the INTEGER attribute attr of the given page.
+	Zone getZone(uint64_t page, unsigned attr);
+
+	// Returns empty zones for all attributes of a page.
+	std::vector<Zone> emptyZones() const;
+
+	// Widens zones to cover the values of r.
+	void widen(std::vector<Zone>& zones, const Record& r) const;
+
+	// Returns true iff r matches p. NULL values never match.
+	bool matches(const Record& r, const RangePredicate& p) const;
+
+	// Widens the zones of all pages to cover any value, e.g. since they have
+	// been lost. They are narrowed again as pages are scanned (see set).
+	void forget();
+
+	// Appends the zones of all pages to bytes.
+	void writeZones(std::vector<char>& bytes);
+
+	// Replaces the zones of the first pages with the ones written by
+	// writeZones, for a schema with the same attributes. Zones of pages 
+	// which do not exist anymore are ignored.
+	void readZones(const char* data);
+
+	// Appends the given schema to bytes.
+	static void writeSchema(const Schema& schema, std::vector<char>& bytes);
+
+	// Returns the schema written by writeSchema.
+	static Schema readSchema(const char* data);
+
+	// Getter methods
+	const Schema& getSchema() { return schema; }
+
+private:
+
+	// The schema of the records
+	Schema schema;
+
+	// Guards zones
+	std::mutex lock;
+
+	// The zones of every attribute of every page. Only the zones of INTEGER
+	// attributes are maintained.
+	std::vector<std::vector<Zone>> zones;
+};
+
+#endif  // ZONEMAP_H